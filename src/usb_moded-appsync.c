@@ -42,6 +42,9 @@
 #include "usb_moded-modesetting.h"
 #include "usb_moded-log.h"
 #include "usb_moded-systemd.h"
+#include "usb_moded-snapshot.h"
+#include "usb_moded-trace.h"
+#include "usb_moded-root.h"
 
 static struct list_elem *read_file(const gchar *filename, int diag);
 static void enumerate_usb(void);
@@ -94,22 +97,20 @@ static gint list_sort_func(gconstpointer a, gconstpointer b)
 void readlist(int diag)
 {
   GDir *confdir = 0;
+  gchar *confpath = 0;
 
   const gchar *dirname;
   struct list_elem *list_item;
 
   free_appsync_list();
 
-  if(diag)
-  {
-    if( !(confdir = g_dir_open(CONF_DIR_DIAG_PATH, 0, NULL)) )
-	goto cleanup;
-  }
-  else
-  {
-    if( !(confdir = g_dir_open(CONF_DIR_PATH, 0, NULL)) )
-	goto cleanup;
-  }
+  /* use startup snapshot if there is a valid one */
+  if( usb_moded_snapshot_get_appsync(&sync_list) )
+    goto cleanup;
+
+  confpath = usb_moded_root_path(diag ? CONF_DIR_DIAG_PATH : CONF_DIR_PATH);
+  if( !(confdir = g_dir_open(confpath, 0, NULL)) )
+    goto cleanup;
 
   while( (dirname = g_dir_read_name(confdir)) )
   {
@@ -120,10 +121,12 @@ void readlist(int diag)
 
 cleanup:
   if( confdir ) g_dir_close(confdir);
+  g_free(confpath);
 
   /* sort list alphabetically so services for a mode
      can be run in a certain order */
   sync_list=g_list_sort(sync_list, list_sort_func);
+  usb_moded_snapshot_add_appsync(sync_list);
 
   /* set up session bus connection if app sync in use
    * so we do not need to make the time consuming connect
@@ -141,19 +144,13 @@ cleanup:
 static struct list_elem *read_file(const gchar *filename, int diag)
 {
   gchar *full_filename = NULL;
+  gchar *confpath = NULL;
   GKeyFile *settingsfile = NULL;
   struct list_elem *list_item = NULL;
 
-  if(diag)
-  {
-    if( !(full_filename = g_strconcat(CONF_DIR_DIAG_PATH, "/", filename, NULL)) )
-	goto cleanup;
-  }
-  else
-  {
-    if( !(full_filename = g_strconcat(CONF_DIR_PATH, "/", filename, NULL)) )
-	goto cleanup;
-  }
+  confpath = usb_moded_root_path(diag ? CONF_DIR_DIAG_PATH : CONF_DIR_PATH);
+  if( !(full_filename = g_strconcat(confpath, "/", filename, NULL)) )
+    goto cleanup;
 
   if( !(settingsfile = g_key_file_new()) )
     goto cleanup;
@@ -180,6 +177,7 @@ cleanup:
   if(settingsfile) 
 	g_key_file_free(settingsfile);
   g_free(full_filename);
+  g_free(confpath);
 
   /* if a minimum set of required elements is not filled in we discard the list_item */
   if( list_item && !(list_item->name && list_item->mode) )
@@ -218,12 +216,21 @@ int activate_sync(const char *mode)
 
     if(!strcmp(data->mode, mode))
     {
+      /* left running by appsync_stop_except() */
+      if(data->keep)
+      {
+        log_debug("%s already running", data->name);
+        data->keep = 0;
+        data->state = APP_STATE_ACTIVE;
+        continue;
+      }
       ++count;
       data->state = APP_STATE_INACTIVE;
     }
     else
     {
       data->state = APP_STATE_DONTCARE;
+      data->keep = 0;
     }
   }
 
@@ -258,6 +265,11 @@ int activate_sync(const char *mode)
       {
 	continue;
       }
+      /* do not launch items that are already running */
+      if(data->state == APP_STATE_ACTIVE)
+      {
+	continue;
+      }
       log_debug("launching pre-enum-app %s\n", data->name);
       if(data->systemd)
       {
@@ -317,7 +329,7 @@ int activate_sync_post(const char *mode)
     if(!strcmp(mode, data->mode))
     {
       /* launch only items marked as post, others are already running */
-      if(!data->post)
+      if(!data->post || data->state == APP_STATE_ACTIVE)
 	continue;
       log_debug("launching post-enum-app %s\n", data->name);
       if(data->systemd)
@@ -426,6 +438,7 @@ static void enumerate_usb(void)
   gettimeofday(&tv, 0);
   timersub(&tv, &sync_tv, &tv);
   log_debug("sync to enum: %.3f seconds", tv.tv_sec + tv.tv_usec * 1e-6);
+  usb_moded_trace_mark(TRACE_APPSYNC_PRE, "pre-enum apps ready");
 
 #ifdef APP_SYNC_DBUS
   /* remove dbus service */
@@ -464,6 +477,7 @@ int appsync_stop(gboolean force)
     {
       struct list_elem *data = iter->data;
       data->state = APP_STATE_ACTIVE;
+      data->keep = 0;
     }
   }
 
@@ -477,3 +491,46 @@ int appsync_stop(gboolean force)
   cancel_enumerate_usb_timer();
   return(0);
 }
+
+/** Stop applications, except the ones also used by another mode
+ *
+ * Used when switching directly from one mode to another. Applications
+ * left running are not launched again by activate_sync().
+ *
+ * @param mode The mode that is going to be activated
+ * @return 0
+ */
+int appsync_stop_except(const char *mode)
+{
+  GList *iter, *iter2;
+
+  for( iter = sync_list; iter; iter = g_list_next(iter) )
+  {
+    struct list_elem *data = iter->data;
+    data->keep = 0;
+  }
+
+  for( iter = sync_list; iter; iter = g_list_next(iter) )
+  {
+    struct list_elem *data = iter->data;
+
+    if(!data->systemd || data->state != APP_STATE_ACTIVE)
+      continue;
+
+    for( iter2 = sync_list; iter2; iter2 = g_list_next(iter2) )
+    {
+      struct list_elem *next = iter2->data;
+
+      if(next->systemd && !strcmp(next->mode, mode) && !strcmp(next->name, data->name))
+      {
+        log_debug("keeping %s-enum-app %s", data->post ? "post" : "pre", data->name);
+        next->keep = 1;
+        /* not to be stopped below */
+        data->state = APP_STATE_DONTCARE;
+        break;
+      }
+    }
+  }
+
+  return appsync_stop(FALSE);
+}
@@ -53,6 +53,7 @@ typedef struct list_elem
   app_state_t state;	/* marker to check if the app has started sucessfully */
   int systemd;		/* marker to know if we start it with systemd or not */
   int post;		/* marker to indicate when to start the app */
+  int keep;		/* marker to leave the app running on a mode switch */
   /*@}*/
 }list_elem;
 
@@ -61,5 +62,6 @@ int activate_sync(const char *mode);
 int activate_sync_post(const char *mode);
 int mark_active(const gchar *name, int post);
 int appsync_stop(gboolean force);
+int appsync_stop_except(const char *mode);
 void free_appsync_list(void);
 void usb_moded_appsync_cleanup(void);
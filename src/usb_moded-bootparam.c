@@ -0,0 +1,171 @@
+/**
+  @file usb_moded-bootparam.c
+
+  Copyright (C) 2016 Jolla. All rights reserved.
+
+  @author: Philippe De Swert <philippe.deswert@jollamobile.com>
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the Lesser GNU General Public License 
+  version 2 as published by the Free Software Foundation. 
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  General Public License for more details.
+ 
+  You should have received a copy of the Lesser GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+  02110-1301 USA
+*/
+
+/*
+ * Parses /proc/cmdline once and keeps the values usb-moded cares about
+ */
+
+#include <string.h>
+
+#include <glib.h>
+
+#include "usb_moded-bootparam.h"
+#include "usb_moded-log.h"
+#include "usb_moded-root.h"
+
+#define BOOTPARAM_CMDLINE_PATH		"/proc/cmdline"
+#define BOOTPARAM_NETWORK_KEY		"usb_moded_ip"
+#define BOOTPARAM_MODE_KEY		"usb_moded_mode"
+#define BOOTPARAM_ANDROID_SERIAL_KEY	"androidboot.serialno"
+
+/** Parsed values, indexed by bootparam_t */
+static gchar *bootparam_table[BOOTPARAM_COUNT];
+
+/** Set once the command line has been parsed */
+static gboolean bootparam_parsed = FALSE;
+
+static void bootparam_set(bootparam_t id, const char *val)
+{
+  g_free(bootparam_table[id]);
+  bootparam_table[id] = g_strdup(val);
+}
+
+/** Handle usb_moded_ip=ip::gateway:netmask::interface:...
+ *
+ * Only used when the interface refers to the usb/rndis interface.
+ */
+static void bootparam_parse_network(const char *val)
+{
+  gchar **tok = g_strsplit(val, ":", 7);
+
+  if(g_strv_length(tok) < 6)
+    goto EXIT;
+
+  if(!g_strrstr(tok[5], "usb") && !g_strrstr(tok[5], "rndis"))
+    goto EXIT;
+
+  bootparam_set(BOOTPARAM_NETWORK_IP, tok[0]);
+  /* gateway might be empty, so we do not want to store an empty string */
+  if(strlen(tok[2]) > 2)
+    bootparam_set(BOOTPARAM_NETWORK_GATEWAY, tok[2]);
+  bootparam_set(BOOTPARAM_NETWORK_NETMASK, tok[3]);
+
+EXIT:
+  g_strfreev(tok);
+}
+
+static void bootparam_parse(void)
+{
+  gchar  *data = 0;
+  gint    argc = 0;
+  gchar **argv = 0;
+  GError *err  = 0;
+  gchar  *path = usb_moded_root_path(BOOTPARAM_CMDLINE_PATH);
+
+  bootparam_parsed = TRUE;
+
+  if(!g_file_get_contents(path, &data, 0, &err))
+  {
+    log_debug("could not read %s: %s", BOOTPARAM_CMDLINE_PATH, err->message);
+    goto EXIT;
+  }
+
+  if(!g_shell_parse_argv(data, &argc, &argv, 0))
+  {
+    log_debug("kernel command line could not be parsed");
+    goto EXIT;
+  }
+
+  for(int i = 0; i < argc; i++)
+  {
+    char *val = strchr(argv[i], '=');
+
+    if(!val)
+      continue;
+    *val++ = 0;
+
+    if(!g_ascii_strcasecmp(argv[i], BOOTPARAM_NETWORK_KEY))
+    {
+      bootparam_parse_network(val);
+    }
+    else if(!strcmp(argv[i], BOOTPARAM_MODE_KEY))
+    {
+      if(*val)
+	bootparam_set(BOOTPARAM_MODE, val);
+    }
+    else if(!strcmp(argv[i], BOOTPARAM_ANDROID_SERIAL_KEY))
+    {
+      /* the serial ends at the first comma, if any */
+      val[strcspn(val, ",")] = 0;
+      if(*val)
+	bootparam_set(BOOTPARAM_ANDROID_SERIAL, val);
+    }
+  }
+
+  for(int i = 0; i < BOOTPARAM_COUNT; i++)
+  {
+    if(bootparam_table[i])
+      log_debug("boot parameter %d = %s", i, bootparam_table[i]);
+  }
+
+EXIT:
+  g_free(path);
+  g_clear_error(&err);
+  g_strfreev(argv);
+  g_free(data);
+}
+
+/** Parse the kernel command line
+ *
+ * Calling this is optional, the first lookup parses the command line
+ * if that has not been done yet.
+ */
+void usb_moded_bootparam_init(void)
+{
+  if(!bootparam_parsed)
+    bootparam_parse();
+}
+
+/** Release the parsed values
+ */
+void usb_moded_bootparam_quit(void)
+{
+  for(int i = 0; i < BOOTPARAM_COUNT; i++)
+    g_free(bootparam_table[i]), bootparam_table[i] = 0;
+  bootparam_parsed = FALSE;
+}
+
+/** Get value given on the kernel command line
+ *
+ * @param id which value to look up
+ *
+ * @return value owned by the table, or NULL if it was not set
+ */
+const char *usb_moded_bootparam_get(bootparam_t id)
+{
+  if(id < 0 || id >= BOOTPARAM_COUNT)
+    return NULL;
+
+  usb_moded_bootparam_init();
+
+  return bootparam_table[id];
+}
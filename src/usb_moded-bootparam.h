@@ -0,0 +1,42 @@
+/**
+  @file usb_moded-bootparam.h
+
+  Copyright (C) 2016 Jolla. All rights reserved.
+
+  @author: Philippe De Swert <philippe.deswert@jollamobile.com>
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the Lesser GNU General Public License 
+  version 2 as published by the Free Software Foundation. 
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  General Public License for more details.
+ 
+  You should have received a copy of the Lesser GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+  02110-1301 USA
+*/
+
+/** Values usb-moded picks up from the kernel command line */
+typedef enum bootparam_t
+{
+	/** usb_moded_ip=<ip>::<gw>:<netmask>::<usb*|rndis*>:... */
+	BOOTPARAM_NETWORK_IP,
+	BOOTPARAM_NETWORK_GATEWAY,
+	BOOTPARAM_NETWORK_NETMASK,
+
+	/** usb_moded_mode=<mode> */
+	BOOTPARAM_MODE,
+
+	/** androidboot.serialno=<serial> */
+	BOOTPARAM_ANDROID_SERIAL,
+
+	BOOTPARAM_COUNT
+} bootparam_t;
+
+void usb_moded_bootparam_init(void);
+void usb_moded_bootparam_quit(void);
+const char *usb_moded_bootparam_get(bootparam_t id);
@@ -34,3 +34,7 @@ char * get_mode_whitelist(void);
 set_config_result_t set_mode_whitelist(const  char *whitelist);
 set_config_result_t set_mode_in_whitelist(const char *mode, int allowed);
 
+void usb_moded_config_init(void);
+void usb_moded_config_quit(void);
+gboolean usb_moded_config_sync(void);
+
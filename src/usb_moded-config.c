@@ -26,9 +26,11 @@
 #include <string.h>
 #include <stdio.h>
 #include <fcntl.h>
+#include <errno.h>
 
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/inotify.h>
 
 #include <glib.h>
 #include <glob.h>
@@ -41,8 +43,12 @@
 #include "usb_moded-config-private.h"
 #include "usb_moded-log.h"
 #include "usb_moded-modes.h"
+#include "usb_moded-modeid.h"
 #include "usb_moded-modesetting.h"
 #include "usb_moded-dbus-private.h"
+#include "usb_moded-bootparam.h"
+#include "usb_moded-snapshot.h"
+#include "usb_moded-root.h"
 
 #ifdef USE_MER_SSU
 # include "usb_moded-ssu.h"
@@ -50,7 +56,6 @@
 
 static int get_conf_int(const gchar *entry, const gchar *key);
 static char * get_conf_string(const gchar *entry, const gchar *key);
-static char * get_kcmdline_string(const char *entry);
 
 static int validate_ip(const char *ipadd)
 {
@@ -130,10 +135,10 @@ char * get_trigger_value(void)
 
 static char * get_network_ip(void)
 {
-  char * ip = get_kcmdline_string(NETWORK_IP_KEY);
+  const char * ip = usb_moded_bootparam_get(BOOTPARAM_NETWORK_IP);
   if (ip != NULL)
     if(!validate_ip(ip))
-	return(ip);
+	return(g_strdup(ip));
 
   return(get_conf_string(NETWORK_ENTRY, NETWORK_IP_KEY));
 }
@@ -145,18 +150,18 @@ static char * get_network_interface(void)
 
 static char * get_network_gateway(void)
 {
-  char * gw = get_kcmdline_string(NETWORK_GATEWAY_KEY);
+  const char * gw = usb_moded_bootparam_get(BOOTPARAM_NETWORK_GATEWAY);
   if (gw != NULL)
-    return(gw);
+    return(g_strdup(gw));
 
   return(get_conf_string(NETWORK_ENTRY, NETWORK_GATEWAY_KEY));
 }
 
 static char * get_network_netmask(void)
 {
-  char * netmask = get_kcmdline_string(NETWORK_NETMASK_KEY);
+  const char * netmask = usb_moded_bootparam_get(BOOTPARAM_NETWORK_NETMASK);
   if (netmask != NULL)
-    return(netmask);
+    return(g_strdup(netmask));
 
   return(get_conf_string(NETWORK_ENTRY, NETWORK_NETMASK_KEY));
 }
@@ -173,181 +178,414 @@ static void create_conf_file(void)
   gchar *keyfile;
   int dir = 1;
   struct stat dir_stat;
+  gchar *path;
 
   /* since this function can also be called when the dir exists we only create
      it if it is missing */
-  if(stat(CONFIG_FILE_DIR, &dir_stat))
+  path = usb_moded_root_path(CONFIG_FILE_DIR);
+  if(stat(path, &dir_stat))
   {
-	dir = mkdir(CONFIG_FILE_DIR, 0755);
+	dir = mkdir(path, 0755);
 	if(dir < 0)
 	{
 		log_warning("Could not create confdir, continuing without configuration!\n");
 		/* no point in trying to generate the config file if the dir cannot be created */
+		g_free(path);
 		return;
 	}
   }
+  g_free(path);
 
   settingsfile = g_key_file_new();
 
   g_key_file_set_string(settingsfile, MODE_SETTING_ENTRY, MODE_SETTING_KEY, MODE_DEVELOPER );
   keyfile = g_key_file_to_data (settingsfile, NULL, NULL);
-  if(g_file_set_contents(FS_MOUNT_CONFIG_FILE, keyfile, -1, NULL) == 0)
+  path = usb_moded_root_path(FS_MOUNT_CONFIG_FILE);
+  if(g_file_set_contents(path, keyfile, -1, NULL) == 0)
 	log_debug("Conffile creation failed. Continuing without configuration!\n");
+  g_free(path);
   free(keyfile);
   g_key_file_free(settingsfile);
 }
 
-static int get_conf_int(const gchar *entry, const gchar *key)
+/* ========================================================================= *
+ * Cached configuration
+ *
+ * FS_MOUNT_CONFIG_FILE is parsed once and kept in memory. Setters update
+ * the cached keyfile in place and the file is written after a short idle
+ * period, external modifications are picked up via inotify watch on
+ * CONFIG_FILE_DIR.
+ * ========================================================================= */
+
+/** Parsed FS_MOUNT_CONFIG_FILE content */
+static GKeyFile *config_cache = 0;
+
+/** Set when the cache needs to be reloaded before the next lookup */
+static gboolean config_cache_stale = TRUE;
+
+/** Number of lookups served from the cache */
+static unsigned config_cache_hits = 0;
+
+/** Number of times the config file has been (re)loaded */
+static unsigned config_cache_reloads = 0;
+
+/** File identity after the last load/write done by usb-moded itself */
+static struct stat config_cache_written;
+
+/** Set when the cache has changes that are not yet written to file */
+static gboolean config_cache_dirty = FALSE;
+
+/** Timer id for delayed writing of changes, or 0 */
+static guint config_flush_id = 0;
+
+/** Delay between the last change and writing it to file [ms] */
+#define CONFIG_FLUSH_DELAY_MS 1000
+
+/** Upper limit for the retry delay after failed writes [ms] */
+#define CONFIG_FLUSH_RETRY_MAX_MS 60000
+
+/** Delay before retrying a failed write, doubled on each failure [ms] */
+static guint config_flush_retry_ms = CONFIG_FLUSH_DELAY_MS;
+
+/** Inotify file descriptor, or -1 */
+static int config_watch_fd = -1;
+
+/** I/O watch id for config_watch_fd, or 0 */
+static guint config_watch_id = 0;
+
+/** Check whether the config file is as usb-moded last loaded/wrote it
+ *
+ * Used for ignoring inotify events caused by our own writes.
+ */
+static gboolean config_cache_is_own_write(void)
 {
-  GKeyFile *settingsfile;
-  gboolean test = FALSE;
-  gchar **keys, **origkeys;
-  int ret = 0;
+  struct stat st;
+  gchar *path = usb_moded_root_path(FS_MOUNT_CONFIG_FILE);
+  int rc = stat(path, &st);
+
+  g_free(path);
+  if(rc == -1)
+    return FALSE;
+
+  return (st.st_dev == config_cache_written.st_dev &&
+	  st.st_ino == config_cache_written.st_ino &&
+	  st.st_size == config_cache_written.st_size &&
+	  st.st_mtim.tv_sec == config_cache_written.st_mtim.tv_sec &&
+	  st.st_mtim.tv_nsec == config_cache_written.st_mtim.tv_nsec);
+}
 
-  settingsfile = g_key_file_new();
-  test = g_key_file_load_from_file(settingsfile, FS_MOUNT_CONFIG_FILE, G_KEY_FILE_NONE, NULL);
-  if(!test)
+/** Mark cached configuration as outdated
+ */
+static void config_cache_invalidate(void)
+{
+  /* pending changes take precedence over what is on disk */
+  if(config_cache_dirty)
   {
-      log_debug("no conffile, Creating\n");
-      create_conf_file();
+    log_warning("%s: modified while changes are pending; overriding",
+		FS_MOUNT_CONFIG_FILE);
+    return;
   }
-  keys = g_key_file_get_keys (settingsfile, entry, NULL, NULL);
-  if(keys == NULL)
-        return ret;
-  origkeys = keys;
-  while (*keys != NULL)
-  {
-        if(!strcmp(*keys, key))
-        {
-                ret = g_key_file_get_integer(settingsfile, entry, *keys, NULL);
-                log_debug("%s key value  = %d\n", key, ret);
-        }
-        keys++;
-  }
-  g_strfreev(origkeys);
-  g_key_file_free(settingsfile);
-  return(ret);
 
+  if(!config_cache_stale)
+    log_debug("config cache invalidated");
+  config_cache_stale = TRUE;
+
+  /* hidden modes and whitelist might have changed too */
+  mode_lists_invalidate();
 }
 
-static char * get_conf_string(const gchar *entry, const gchar *key)
+/** Get cached configuration, (re)loading it from file when needed
+ *
+ * @return keyfile object owned by the cache
+ */
+static GKeyFile *config_cache_get(void)
 {
-  GKeyFile *settingsfile;
-  gboolean test = FALSE;
-  gchar **keys, **origkeys, *tmp_char = NULL;
-  settingsfile = g_key_file_new();
-  test = g_key_file_load_from_file(settingsfile, FS_MOUNT_CONFIG_FILE, G_KEY_FILE_NONE, NULL);
-  if(!test)
+  gchar *path;
+
+  if(config_cache && !config_cache_stale)
+  {
+    config_cache_hits++;
+    return config_cache;
+  }
+
+  if(config_cache)
+    g_key_file_free(config_cache);
+  config_cache = g_key_file_new();
+  path = usb_moded_root_path(FS_MOUNT_CONFIG_FILE);
+
+  if(usb_moded_snapshot_get_settings(config_cache))
+  {
+    log_debug("config loaded from snapshot");
+  }
+  else
   {
+    if(!g_key_file_load_from_file(config_cache, path, G_KEY_FILE_NONE, NULL))
+    {
       log_debug("No conffile. Creating\n");
       create_conf_file();
       /* should succeed now */
-      g_key_file_load_from_file(settingsfile, FS_MOUNT_CONFIG_FILE, G_KEY_FILE_NONE, NULL);
+      g_key_file_load_from_file(config_cache, path, G_KEY_FILE_NONE, NULL);
+    }
+    usb_moded_snapshot_add_settings(config_cache);
   }
-  keys = g_key_file_get_keys (settingsfile, entry, NULL, NULL);
-  if(keys == NULL)
-        goto end;
-  origkeys = keys;
-  while (*keys != NULL)
+
+  /* remember what was loaded so that events for it can be ignored */
+  if(stat(path, &config_cache_written) == -1)
+    memset(&config_cache_written, 0, sizeof config_cache_written);
+  g_free(path);
+
+  config_cache_stale = FALSE;
+  config_cache_reloads++;
+  log_debug("config cache loaded: %u hits, %u reloads",
+	    config_cache_hits, config_cache_reloads);
+
+  return config_cache;
+}
+
+/** Write cached configuration to FS_MOUNT_CONFIG_FILE
+ *
+ * @return TRUE on success, FALSE otherwise
+ */
+static gboolean config_cache_write(void)
+{
+  gboolean ack = FALSE;
+  gchar *keyfile;
+  gchar *path = usb_moded_root_path(FS_MOUNT_CONFIG_FILE);
+
+  keyfile = g_key_file_to_data(config_cache, NULL, NULL);
+  if(keyfile && g_file_set_contents(path, keyfile, -1, NULL))
   {
-        if(!strcmp(*keys, key))
-        {
-                tmp_char = g_key_file_get_string(settingsfile, entry, *keys, NULL);
-                if(tmp_char)
-                {
-                        log_debug("key %s value  = %s\n", key, tmp_char);
-                }
-        }
-        keys++;
-  }
-  g_strfreev(origkeys);
-end:
-  g_key_file_free(settingsfile);
-  return(tmp_char);
+    ack = TRUE;
+    if(stat(path, &config_cache_written) == -1)
+      memset(&config_cache_written, 0, sizeof config_cache_written);
+  }
+  g_free(keyfile);
+  g_free(path);
 
+  return ack;
 }
 
-static char * get_kcmdline_string(const char *entry)
+/** Timer callback for writing out pending config changes
+ */
+static gboolean config_flush_cb(gpointer aptr)
 {
-  int fd;
-  char cmdLine[1024];
-  char *ret = NULL;
-  int len;
-  gint argc = 0;
-  gchar **argv = NULL;
-  gchar **arg_tokens = NULL, **network_tokens = NULL;
-  GError *optErr = NULL;
-  int i;
+  (void)aptr;
+
+  config_flush_id = 0;
+
+  if(usb_moded_config_sync())
+  {
+    config_flush_retry_ms = CONFIG_FLUSH_DELAY_MS;
+  }
+  else
+  {
+    /* keep the changes pending and try again later */
+    config_flush_retry_ms = MIN(config_flush_retry_ms * 2,
+				CONFIG_FLUSH_RETRY_MAX_MS);
+    log_warning("%s: retrying in %u ms", FS_MOUNT_CONFIG_FILE,
+		config_flush_retry_ms);
+    config_flush_id = g_timeout_add(config_flush_retry_ms, config_flush_cb, 0);
+  }
+
+  return FALSE;
+}
+
+/** Schedule writing of cached configuration to FS_MOUNT_CONFIG_FILE
+ *
+ * Changes made in quick succession are written out in one go after
+ * CONFIG_FLUSH_DELAY_MS of inactivity, on shutdown, or when
+ * usb_moded_config_sync() is called.
+ *
+ * @return TRUE
+ */
+static gboolean config_cache_store(void)
+{
+  config_cache_dirty = TRUE;
+
+  if(config_flush_id)
+    g_source_remove(config_flush_id);
+  config_flush_id = g_timeout_add(CONFIG_FLUSH_DELAY_MS, config_flush_cb, 0);
+
+  return TRUE;
+}
+
+/** Write pending config changes to FS_MOUNT_CONFIG_FILE immediately
+ *
+ * @return TRUE if there is nothing left to write, FALSE on failure
+ */
+gboolean usb_moded_config_sync(void)
+{
+  if(config_flush_id)
+    g_source_remove(config_flush_id), config_flush_id = 0;
+
+  if(!config_cache_dirty)
+    return TRUE;
 
-  if ((fd = open("/proc/cmdline", O_RDONLY)) < 0)
+  if(!config_cache || !config_cache_write())
   {
-    log_debug("could not read /proc/cmdline");
-    return(ret);
+    log_warning("%s: could not write pending changes", FS_MOUNT_CONFIG_FILE);
+    return FALSE;
   }
 
-  len = read(fd, cmdLine, sizeof(cmdLine) - 1);
-  close(fd);
+  config_cache_dirty = FALSE;
+  log_debug("%s: pending changes written", FS_MOUNT_CONFIG_FILE);
+  return TRUE;
+}
+
+/** Handle inotify events for CONFIG_FILE_DIR
+ */
+static gboolean config_watch_cb(GIOChannel *channel, GIOCondition condition,
+				gpointer data)
+{
+  const char *name = strrchr(FS_MOUNT_CONFIG_FILE, '/') + 1;
+  gboolean keep_watch = FALSE;
+  char buf[sizeof(struct inotify_event) + 256]
+    __attribute__((aligned(__alignof__(struct inotify_event))));
+  gboolean changed = FALSE;
+  int fd, rc;
+
+  (void)data;
+
+  if(condition & (G_IO_ERR | G_IO_HUP | G_IO_NVAL))
+    goto EXIT;
+
+  if((fd = g_io_channel_unix_get_fd(channel)) == -1)
+    goto EXIT;
+
+  rc = read(fd, buf, sizeof buf);
+  if(rc == -1)
+  {
+    if(errno == EINTR || errno == EAGAIN)
+      keep_watch = TRUE;
+    else
+      log_warning("config watch: read: %m");
+    goto EXIT;
+  }
 
-  if (len <= 0)
+  for(int pos = 0; pos + (int)sizeof(struct inotify_event) <= rc; )
   {
-    log_debug("kernel command line was empty");
-    return(ret);
+    struct inotify_event *eve = (struct inotify_event *)(buf + pos);
+
+    if(eve->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED | IN_Q_OVERFLOW))
+      changed = TRUE;
+    else if(eve->len > 0 && !strcmp(eve->name, name))
+      changed = TRUE;
+
+    pos += sizeof *eve + eve->len;
   }
 
-  cmdLine[len] = '\0';
+  if(changed && !config_cache_is_own_write())
+    config_cache_invalidate();
 
-  /* we're looking for a piece of the kernel command line matching this:
-    ip=192.168.3.100::192.168.3.1:255.255.255.0::usb0:on */
-  if (!g_shell_parse_argv(cmdLine, &argc, &argv, &optErr)) 
+  keep_watch = TRUE;
+
+EXIT:
+  if(!keep_watch)
   {
-    g_error_free(optErr);
-    return(ret);
+    log_warning("config watch disabled; config cache will not be reloaded");
+    config_watch_id = 0;
   }
+  return keep_watch;
+}
+
+/** Start tracking changes to FS_MOUNT_CONFIG_FILE
+ */
+void usb_moded_config_init(void)
+{
+  GIOChannel *chn = 0;
+  gchar *path = 0;
+
+  if(config_watch_fd != -1)
+    goto EXIT;
 
-  /* find the ip token */
-  for (i=0; i < argc; i++) 
+  if((config_watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) == -1)
   {
-    arg_tokens = g_strsplit(argv[i], "=", 2);
-    if (!g_ascii_strcasecmp(arg_tokens[0], "usb_moded_ip"))
-    {
-      network_tokens = g_strsplit(arg_tokens[1], ":", 7);
-      /* check if it is for the usb or rndis interface */
-      if(g_strrstr(network_tokens[5], "usb")|| (g_strrstr(network_tokens[5], "rndis")))
-      {
-	if(!strcmp(entry, NETWORK_IP_KEY))
-	{
-		g_free(ret), ret = g_strdup(network_tokens[0]);
-		log_debug("Command line ip = %s\n", ret);
-	}
-	if(!strcmp(entry, NETWORK_GATEWAY_KEY))
-	{
-		/* gateway might be empty, so we do not want to return an empty string */
-		if(strlen(network_tokens[2]) > 2)
-		{
-		  g_free(ret), ret = g_strdup(network_tokens[2]);
-		  log_debug("Command line gateway = %s\n", ret);
-		}
-	}
-	if(!strcmp(entry, NETWORK_NETMASK_KEY))
-	{
-		g_free(ret), ret = g_strdup(network_tokens[3]);
-		log_debug("Command line netmask = %s\n", ret);
-	}
-      } 
-    }
-    g_strfreev(arg_tokens);
+    log_warning("config watch: inotify_init: %m");
+    goto EXIT;
+  }
+
+  /* Watching the directory covers both in-place modifications and
+   * atomic replacement via rename, as g_file_set_contents() does. */
+  path = usb_moded_root_path(CONFIG_FILE_DIR);
+  if(inotify_add_watch(config_watch_fd, path,
+		       IN_CLOSE_WRITE | IN_MODIFY | IN_CREATE | IN_DELETE |
+		       IN_MOVED_FROM | IN_MOVED_TO |
+		       IN_DELETE_SELF | IN_MOVE_SELF) == -1)
+  {
+    log_warning("config watch: %s: %m", CONFIG_FILE_DIR);
+    goto EXIT;
+  }
+
+  if((chn = g_io_channel_unix_new(config_watch_fd)) == 0)
+    goto EXIT;
+
+  config_watch_id = g_io_add_watch(chn, G_IO_IN | G_IO_ERR | G_IO_HUP | G_IO_NVAL,
+				   config_watch_cb, 0);
+
+EXIT:
+  g_free(path);
+  if(chn)
+    g_io_channel_unref(chn);
+
+  if(!config_watch_id && config_watch_fd != -1)
+    close(config_watch_fd), config_watch_fd = -1;
+
+  /* whatever happened before init is not trusted */
+  config_cache_invalidate();
+}
+
+/** Stop tracking config file changes and release the cached data
+ */
+void usb_moded_config_quit(void)
+{
+  /* do not lose changes that are still pending */
+  usb_moded_config_sync();
+
+  if(config_watch_id)
+    g_source_remove(config_watch_id), config_watch_id = 0;
+
+  if(config_watch_fd != -1)
+    close(config_watch_fd), config_watch_fd = -1;
+
+  if(config_cache)
+  {
+    log_debug("config cache: %u hits, %u reloads",
+	      config_cache_hits, config_cache_reloads);
+    g_key_file_free(config_cache), config_cache = 0;
   }
-  g_strfreev(argv);
-  g_strfreev(network_tokens);
+  config_cache_stale = TRUE;
+}
+
+static int get_conf_int(const gchar *entry, const gchar *key)
+{
+  GKeyFile *settingsfile = config_cache_get();
+  int ret = 0;
 
+  if(g_key_file_has_key(settingsfile, entry, key, NULL))
+  {
+    ret = g_key_file_get_integer(settingsfile, entry, key, NULL);
+    log_debug("%s key value  = %d\n", key, ret);
+  }
   return(ret);
 }
 
+static char * get_conf_string(const gchar *entry, const gchar *key)
+{
+  GKeyFile *settingsfile = config_cache_get();
+  gchar *tmp_char = g_key_file_get_string(settingsfile, entry, key, NULL);
+
+  if(tmp_char)
+  {
+    log_debug("key %s value  = %s\n", key, tmp_char);
+  }
+  return(tmp_char);
+}
+
 char * get_mode_setting(void)
 {
-  char * mode = get_kcmdline_string(MODE_SETTING_KEY);
+  const char * mode = usb_moded_bootparam_get(BOOTPARAM_MODE);
   if (mode != NULL)
-    return(mode);
+    return(g_strdup(mode));
 
   return(get_conf_string(MODE_SETTING_ENTRY, MODE_SETTING_KEY));
 }
@@ -369,43 +607,24 @@ int config_value_changed(GKeyFile *settingsfile, const char *entry, const char *
 
 set_config_result_t set_config_setting(const char *entry, const char *key, const char *value)
 {
-  GKeyFile *settingsfile;
-  gboolean test = FALSE;
+  GKeyFile *settingsfile = config_cache_get();
   set_config_result_t ret = SET_CONFIG_ERROR;
-  gchar *keyfile;
 
-  settingsfile = g_key_file_new();
-  test = g_key_file_load_from_file(settingsfile, FS_MOUNT_CONFIG_FILE, G_KEY_FILE_NONE, NULL);
-  if(test)
-  {
-      if(!config_value_changed(settingsfile, entry, key, value))
-      {
-              g_key_file_free(settingsfile);
-              return SET_CONFIG_UNCHANGED;
-      }
-  }
-  else
-  {
-      log_debug("No conffile. Creating.\n");
-      create_conf_file();
-  }
+  if(!config_value_changed(settingsfile, entry, key, value))
+      return SET_CONFIG_UNCHANGED;
 
   g_key_file_set_string(settingsfile, entry, key, value);
-  keyfile = g_key_file_to_data (settingsfile, NULL, NULL); 
-  /* free the settingsfile before writing things out to be sure 
-     the contents will be correctly written to file afterwards.
-     Just a precaution. */
-  g_key_file_free(settingsfile);
-  if (g_file_set_contents(FS_MOUNT_CONFIG_FILE, keyfile, -1, NULL))
+  if (config_cache_store())
       ret = SET_CONFIG_UPDATED;
-  g_free(keyfile);
-  
+
   return (ret);
 }
 
 set_config_result_t set_mode_setting(const char *mode)
 {
-  if (strcmp(mode, MODE_ASK) && valid_mode(mode))
+  mode_id_t id = mode_registry_lookup(mode);
+
+  if (id != MODE_ID_ASK && valid_mode_id(id))
     return SET_CONFIG_ERROR;
   return (set_config_setting(MODE_SETTING_ENTRY, MODE_SETTING_KEY, mode));
 }
@@ -482,6 +701,7 @@ set_config_result_t set_hide_mode_setting(const char *mode)
   }
 
   if(ret == SET_CONFIG_UPDATED) {
+      mode_lists_set_hidden(mode, TRUE);
       send_hidden_modes_signal();
       send_supported_modes_signal();
       send_available_modes_signal();
@@ -503,6 +723,7 @@ set_config_result_t set_unhide_mode_setting(const char *mode)
   }
 
   if(ret == SET_CONFIG_UPDATED) {
+      mode_lists_set_hidden(mode, FALSE);
       send_hidden_modes_signal();
       send_supported_modes_signal();
       send_available_modes_signal();
@@ -519,17 +740,19 @@ set_config_result_t set_mode_whitelist(const char *whitelist)
 
   if(ret == SET_CONFIG_UPDATED) {
     char *mode_setting;
-    const char *current_mode;
+    mode_id_t current_mode;
+
+    mode_lists_set_whitelist(whitelist);
 
     mode_setting = get_mode_setting();
     if (strcmp(mode_setting, MODE_ASK) && valid_mode(mode_setting))
       set_mode_setting(MODE_ASK);
     g_free(mode_setting);
 
-    current_mode = get_usb_mode();
-    if (strcmp(current_mode, MODE_CHARGING_FALLBACK) && strcmp(current_mode, MODE_ASK) && valid_mode(current_mode)) {
+    current_mode = get_usb_mode_id();
+    if (current_mode != MODE_ID_CHARGING_FALLBACK && current_mode != MODE_ID_ASK && valid_mode_id(current_mode)) {
       usb_moded_mode_cleanup(get_usb_module());
-      set_usb_mode(MODE_CHARGING_FALLBACK);
+      set_usb_mode_id(MODE_ID_CHARGING_FALLBACK);
     }
 
     usb_moded_send_whitelisted_modes_signal(whitelist);
@@ -560,50 +783,14 @@ set_config_result_t set_mode_in_whitelist(const char *mode, int allowed)
  */
 set_config_result_t set_network_setting(const char *config, const char *setting)
 {
-  GKeyFile *settingsfile;
-  gboolean test = FALSE;
-  gchar *keyfile;
-
   if(!strcmp(config, NETWORK_IP_KEY) || !strcmp(config, NETWORK_GATEWAY_KEY))
 	if(validate_ip(setting) != 0)
 		return SET_CONFIG_ERROR;
 
-  settingsfile = g_key_file_new();
-  test = g_key_file_load_from_file(settingsfile, FS_MOUNT_CONFIG_FILE, G_KEY_FILE_NONE, NULL);
-
   if(!strcmp(config, NETWORK_IP_KEY) || !strcmp(config, NETWORK_INTERFACE_KEY) || !strcmp(config, NETWORK_GATEWAY_KEY))
-  {
-	set_config_result_t ret = SET_CONFIG_ERROR;
-	if (test)
-	{
-		if(!config_value_changed(settingsfile, NETWORK_ENTRY, config, setting))
-		{
-			g_key_file_free(settingsfile);
-			return SET_CONFIG_UNCHANGED;
-		}
-	}
-	else
-	{
-		log_debug("No conffile. Creating.\n");
-		create_conf_file();
-	}
+	return set_config_setting(NETWORK_ENTRY, config, setting);
 
-	g_key_file_set_string(settingsfile, NETWORK_ENTRY, config, setting);
-  	keyfile = g_key_file_to_data (settingsfile, NULL, NULL); 
-  	/* free the settingsfile before writing things out to be sure 
-     	the contents will be correctly written to file afterwards.
-     	Just a precaution. */
-  	g_key_file_free(settingsfile);
-	if (g_file_set_contents(FS_MOUNT_CONFIG_FILE, keyfile, -1, NULL))
-		ret = SET_CONFIG_UPDATED;
-	free(keyfile);
-	return ret;
-  }
-  else
-  {
-	g_key_file_free(settingsfile);
-	return SET_CONFIG_ERROR;
-  }
+  return SET_CONFIG_ERROR;
 }
 
 char * get_network_setting(const char *config)
@@ -727,21 +914,95 @@ static int glob_error_cb(const char *path, int err)
 }
 
 /**
- * Read *.ini files on CONFIG_FILE_DIR in the order of [0-9][A-Z][a-z]
+ * Get fingerprint line for a config fragment
  *
- * @return the in memory value-pair file.
+ * The fingerprint consists of path, device, inode, size and mtime.
+ *
+ * @param path file to check
+ *
+ * @return fingerprint string, or NULL if the file can't be stat'ed
+ */
+static gchar *merge_fingerprint(const char *path)
+{
+	struct stat st;
+
+	if( stat(path, &st) == -1 )
+		return NULL;
+
+	return g_strdup_printf("%s %lu %lu %lld %ld.%09ld\n", path,
+			       (unsigned long)st.st_dev,
+			       (unsigned long)st.st_ino,
+			       (long long)st.st_size,
+			       (long)st.st_mtim.tv_sec,
+			       (long)st.st_mtim.tv_nsec);
+}
+
+/**
+ * Glob *.ini files on CONFIG_FILE_DIR in the order of [0-9][A-Z][a-z]
+ *
+ * @param gb glob buffer to fill, must be released with globfree()
+ *
+ * @return 0 on success, -1 if there are no ini-files
  */
-static GKeyFile *read_ini_files(void)
+static int glob_ini_files(glob_t *gb)
 {
 	static const char pattern[] = CONFIG_FILE_DIR"/*.ini";
+	gchar *path = usb_moded_root_path(pattern);
+	int rc = 0;
 
-	GKeyFile *ini = g_key_file_new();
+	memset(gb, 0, sizeof *gb);
+
+	if( glob(path, 0, glob_error_cb, gb) != 0 ) {
+		log_debug("no configuration ini-files found");
+		rc = -1;
+	}
+	g_free(path);
+	return rc;
+}
+
+/**
+ * Build combined fingerprint of all *.ini files on CONFIG_FILE_DIR
+ *
+ * @return fingerprint text, or NULL if there are no ini-files
+ */
+static gchar *merge_stamp(void)
+{
+	GString *stamp = NULL;
 	glob_t gb;
 
-	memset(&gb, 0, sizeof gb);
+	if( glob_ini_files(&gb) == -1 )
+		goto exit;
 
-	if( glob(pattern, 0, glob_error_cb, &gb) != 0 ) {
-		log_debug("no configuration ini-files found");
+	stamp = g_string_new(NULL);
+	for( size_t i = 0; i < gb.gl_pathc; ++i ) {
+		gchar *fp = merge_fingerprint(gb.gl_pathv[i]);
+		if( fp )
+			g_string_append(stamp, fp);
+		g_free(fp);
+	}
+exit:
+	globfree(&gb);
+	return stamp ? g_string_free(stamp, FALSE) : NULL;
+}
+
+/**
+ * Read *.ini files on CONFIG_FILE_DIR in the order of [0-9][A-Z][a-z]
+ *
+ * Fragments whose fingerprint matches the one stored in the merge
+ * cache are taken from the cache instead of parsing the file again.
+ *
+ * @param cache_old merge cache from previous run, or NULL
+ * @param cache_new merge cache to fill with current fragments
+ *
+ * @return the in memory value-pair file.
+ */
+static GKeyFile *read_ini_files(GKeyFile *cache_old, GKeyFile *cache_new)
+{
+	GKeyFile *ini = g_key_file_new();
+	glob_t gb;
+	int reused = 0;
+
+	if( glob_ini_files(&gb) == -1 ) {
 		g_key_file_free(ini);
 		ini = NULL;
 		goto exit;
@@ -751,16 +1012,43 @@ static GKeyFile *read_ini_files(void)
 		const char *path = gb.gl_pathv[i];
 		GError *err	= 0;
 		GKeyFile *tmp = g_key_file_new();
+		gchar *fp = merge_fingerprint(path);
+		gchar *old_fp = 0, *data = 0;
+		gboolean ok = FALSE;
+
+		if( cache_old && fp ) {
+			old_fp = g_key_file_get_string(cache_old, path, MERGE_CACHE_FINGERPRINT_KEY, 0);
+			if( !g_strcmp0(fp, old_fp) )
+				data = g_key_file_get_string(cache_old, path, MERGE_CACHE_DATA_KEY, 0);
+		}
 
-		if( !g_key_file_load_from_file(tmp, path, 0, &err) ) {
+		if( data && g_key_file_load_from_data(tmp, data, strlen(data), 0, 0) ) {
+			log_debug("reusing cached %s ...", path);
+			ok = TRUE;
+			reused++;
+		} else if( !g_key_file_load_from_file(tmp, path, 0, &err) ) {
 			log_debug("%s: can't load: %s", path, err->message);
 		} else {
 			log_debug("processing %s ...", path);
+			ok = TRUE;
+		}
+
+		if( ok ) {
 			merge_file(ini, tmp);
+			if( fp ) {
+				gchar *text = g_key_file_to_data(tmp, 0, 0);
+				g_key_file_set_string(cache_new, path, MERGE_CACHE_FINGERPRINT_KEY, fp);
+				g_key_file_set_string(cache_new, path, MERGE_CACHE_DATA_KEY, text);
+				g_free(text);
+			}
 		}
 		g_clear_error(&err);
 		g_key_file_free(tmp);
+		g_free(data);
+		g_free(old_fp);
+		g_free(fp);
 	}
+	log_debug("%d of %zu ini-files reused from merge cache", reused, gb.gl_pathc);
 exit:
 	globfree(&gb);
 	return ini;
@@ -770,44 +1058,114 @@ exit:
  * Read the *.ini files and create/overwrite FS_MOUNT_CONFIG_FILE with
  * the merged data.
  *
+ * If none of the ini-files have changed since the previous merge, as
+ * recorded in MERGE_STAMP_FILE, the files are not parsed at all.
+ *
  * @return 0 on failure
  */
 int conf_file_merge(void)
 {
-  GString *keyfile_string = NULL;
   GKeyFile *settingsfile,*tempfile;
+  GKeyFile *cache_old = 0, *cache_new = 0;
+  gchar *stamp_old = 0, *stamp_new = 0;
+  gchar *merged = 0, *current = 0;
+  gint64 started = g_get_monotonic_time();
+  gint64 merge_usec = 0;
   int ret = 0;
+  gchar *conf_path  = usb_moded_root_path(FS_MOUNT_CONFIG_FILE);
+  gchar *cache_path = usb_moded_root_path(MERGE_CACHE_FILE);
+  gchar *stamp_path = usb_moded_root_path(MERGE_STAMP_FILE);
+
+	/* Fast path: nothing changed since the previous merge */
+	stamp_new = merge_stamp();
+	if (stamp_new &&
+	    g_file_get_contents(stamp_path, &stamp_old, 0, 0) &&
+	    !strcmp(stamp_old, stamp_new)) {
+		cache_old = g_key_file_new();
+		if (g_key_file_load_from_file(cache_old, cache_path, G_KEY_FILE_NONE, NULL))
+			merge_usec = g_key_file_get_int64(cache_old, MERGE_CACHE_GROUP,
+							  MERGE_CACHE_USEC_KEY, 0);
+		log_debug("Configuration unchanged, merge skipped in %lld us"
+			  " (saved ~%lld us)",
+			  (long long)(g_get_monotonic_time() - started),
+			  (long long)merge_usec);
+		goto out_nomerge;
+	}
+
+	cache_old = g_key_file_new();
+	if (!g_key_file_load_from_file(cache_old, cache_path, G_KEY_FILE_NONE, NULL)) {
+		g_key_file_free(cache_old);
+		cache_old = 0;
+	}
+	cache_new = g_key_file_new();
 
-	settingsfile = read_ini_files();
+	settingsfile = read_ini_files(cache_old, cache_new);
 	if (!settingsfile)
 	{
 		log_debug("No configuration. Creating defaults.");
 		create_conf_file();
 		/* There was no configuration so no info to be merged */
-		return ret;
+		goto out_nomerge;
 	}
 
+	merged = g_key_file_to_data(settingsfile, NULL, NULL);
+
 	tempfile = g_key_file_new();
-	if (g_key_file_load_from_file(tempfile, FS_MOUNT_CONFIG_FILE,
+	if (g_key_file_load_from_file(tempfile, conf_path,
 				G_KEY_FILE_NONE,NULL)) {
-		if (!g_strcmp0(g_key_file_to_data(settingsfile, NULL, NULL),
-				g_key_file_to_data(tempfile, NULL, NULL)))
+		current = g_key_file_to_data(tempfile, NULL, NULL);
+		if (!g_strcmp0(merged, current))
 			goto out;
 	}
 
 	log_debug("Merging configuration");
-	keyfile_string = g_string_new(NULL);
-	keyfile_string = g_string_append(keyfile_string,
-					g_key_file_to_data(settingsfile,
-							NULL, NULL));
-	if (keyfile_string) {
-		ret = !g_file_set_contents(FS_MOUNT_CONFIG_FILE,
-						keyfile_string->str,-1, NULL);
-		g_string_free(keyfile_string, TRUE);
+	ret = !g_file_set_contents(conf_path, merged, -1, NULL);
+	config_cache_invalidate();
+
+	/* The merged file is also one of the inputs, update its cache entry */
+	if (!ret) {
+		gchar *fp = merge_fingerprint(conf_path);
+		if (fp) {
+			g_key_file_set_string(cache_new, conf_path,
+					      MERGE_CACHE_FINGERPRINT_KEY, fp);
+			g_key_file_set_string(cache_new, conf_path,
+					      MERGE_CACHE_DATA_KEY, merged);
+		}
+		g_free(fp);
 	}
 out:
 	g_key_file_free(tempfile);
 	g_key_file_free(settingsfile);
+
+	/* Record what the merge was based on and what it cost */
+	if (!ret) {
+		gchar *text;
+
+		merge_usec = g_get_monotonic_time() - started;
+		g_key_file_set_int64(cache_new, MERGE_CACHE_GROUP,
+				     MERGE_CACHE_USEC_KEY, merge_usec);
+		text = g_key_file_to_data(cache_new, NULL, NULL);
+		g_free(stamp_new), stamp_new = merge_stamp();
+		if (!text || !stamp_new ||
+		    !g_file_set_contents(cache_path, text, -1, NULL) ||
+		    !g_file_set_contents(stamp_path, stamp_new, -1, NULL))
+			log_debug("could not update merge cache");
+		g_free(text);
+		log_debug("Configuration merged in %lld us", (long long)merge_usec);
+	}
+
+out_nomerge:
+	if (cache_old)
+		g_key_file_free(cache_old);
+	if (cache_new)
+		g_key_file_free(cache_new);
+	g_free(current);
+	g_free(merged);
+	g_free(stamp_old);
+	g_free(stamp_new);
+	g_free(stamp_path);
+	g_free(cache_path);
+	g_free(conf_path);
 	return ret;
 }
 
@@ -851,6 +1209,21 @@ char * get_android_product_id(void)
   return(get_conf_string(ANDROID_ENTRY, ANDROID_PRODUCT_ID_KEY));
 }
 
+int get_module_unload_timeout(void)
+{
+  return(get_conf_int(MODULE_ENTRY, MODULE_UNLOAD_TIMEOUT_KEY));
+}
+
+char * get_configfs_gadget(void)
+{
+  return(get_conf_string(CONFIGFS_ENTRY, CONFIGFS_GADGET_KEY));
+}
+
+char * get_configfs_udc(void)
+{
+  return(get_conf_string(CONFIGFS_ENTRY, CONFIGFS_UDC_KEY));
+}
+
 char * get_hidden_modes(void)
 {
   return(get_conf_string(MODE_SETTING_ENTRY, MODE_HIDE_KEY));
@@ -862,32 +1235,15 @@ char * get_mode_whitelist(void)
 
 int check_android_section(void)
 {
-  GKeyFile *settingsfile;
-  gboolean test = FALSE;
-  gchar **keys;
-  int ret = 1;
-
-  settingsfile = g_key_file_new();
-  test = g_key_file_load_from_file(settingsfile, FS_MOUNT_CONFIG_FILE, G_KEY_FILE_NONE, NULL);
-  if(!test)
-  {
-	ret = 0;
-	goto cleanup;
-  }
-  keys = g_key_file_get_keys (settingsfile, ANDROID_ENTRY, NULL, NULL);
-  if(keys == NULL)
-  {  
-        ret =  0;
-	goto cleanup;
-  }
-
-  g_strfreev(keys);
-cleanup:
-  g_key_file_free(settingsfile);
-  return(ret);
+  return(g_key_file_has_group(config_cache_get(), ANDROID_ENTRY) ? 1 : 0);
 }
 
 int is_roaming_not_allowed(void)
 {
   return(get_conf_int(NETWORK_ENTRY, NO_ROAMING_KEY));
 }
+
+int use_builtin_dhcp_server(void)
+{
+  return(get_conf_int(NETWORK_ENTRY, NETWORK_BUILTIN_DHCP_KEY));
+}
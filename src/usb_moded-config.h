@@ -23,6 +23,13 @@
 
 #define CONFIG_FILE_DIR			"/etc/usb-moded"
 #define FS_MOUNT_CONFIG_FILE		CONFIG_FILE_DIR"/usb-moded.ini"
+#define MERGE_CACHE_FILE		CONFIG_FILE_DIR"/usb-moded.ini.cache"
+#define MERGE_STAMP_FILE		CONFIG_FILE_DIR"/usb-moded.ini.stamp"
+
+#define MERGE_CACHE_GROUP		"merge"
+#define MERGE_CACHE_USEC_KEY		"usec"
+#define MERGE_CACHE_FINGERPRINT_KEY	"fingerprint"
+#define MERGE_CACHE_DATA_KEY		"data"
 
 #define MODE_SETTING_ENTRY		"usbmode"
 #define MODE_SETTING_KEY		"mode"
@@ -52,11 +59,17 @@
 #define NETWORK_NAT_INTERFACE_KEY	"nat_interface"
 #define NETWORK_NETMASK_KEY		"netmask"
 #define NO_ROAMING_KEY			"noroaming"
+#define NETWORK_BUILTIN_DHCP_KEY	"builtin_dhcp"
 #define ANDROID_ENTRY			"android"
 #define ANDROID_MANUFACTURER_KEY	"iManufacturer"
 #define ANDROID_VENDOR_ID_KEY		"idVendor"
 #define ANDROID_PRODUCT_KEY		"iProduct"
 #define ANDROID_PRODUCT_ID_KEY		"idProduct"
+#define MODULE_ENTRY			"modules"
+#define MODULE_UNLOAD_TIMEOUT_KEY	"unload_timeout"
+#define CONFIGFS_ENTRY			"configfs"
+#define CONFIGFS_GADGET_KEY		"gadget"
+#define CONFIGFS_UDC_KEY		"udc"
 #define MODE_HIDE_KEY			"hide"
 #define MODE_WHITELIST_KEY		"whitelist"
 
@@ -80,12 +93,18 @@ char * get_android_vendor_id(void);
 char * get_android_product(void);
 char * get_android_product_id(void);
 
+int get_module_unload_timeout(void);
+
+char * get_configfs_gadget(void);
+char * get_configfs_udc(void);
+
 char * get_hidden_modes(void);
 char * get_mode_whitelist(void);
 
 int check_android_section(void);
 
 int is_roaming_not_allowed(void);
+int use_builtin_dhcp_server(void);
 
 typedef enum set_config_result_t {
 	SET_CONFIG_ERROR = -1,
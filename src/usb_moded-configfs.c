@@ -0,0 +1,457 @@
+/**
+  @file usb_moded-configfs.c
+
+  Copyright (C) 2016 Jolla. All rights reserved.
+
+  @author: Philippe De Swert <philippe.deswert@jollamobile.com>
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the Lesser GNU General Public License
+  version 2 as published by the Free Software Foundation.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  General Public License for more details.
+
+  You should have received a copy of the Lesser GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+  02110-1301 USA
+*/
+
+/*
+ * ConfigFS gadget backend
+ *
+ * Instead of loading a gadget module per mode, or toggling the
+ * android_usb gadget, a single gadget is composed under
+ * /sys/kernel/config/usb_gadget. The function instances used by the
+ * dynamic modes are created once at startup and kept around; a mode
+ * change only relinks the functions of the configuration and rebinds
+ * the gadget to the udc.
+ *
+ * Gadget layout:
+ *
+ *   <gadget>/functions/<type>.<instance>    created at startup
+ *   <gadget>/configs/c.1/<type>.<instance>  links to the active functions
+ *   <gadget>/UDC                            udc name when bound
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include <glib.h>
+
+#include "usb_moded-configfs.h"
+#include "usb_moded-dyn-config.h"
+#include "usb_moded-config.h"
+#include "usb_moded-bootparam.h"
+#include "usb_moded-mac.h"
+#include "usb_moded-log.h"
+#include "usb_moded-root.h"
+
+/* ========================================================================= *
+ * State data
+ * ========================================================================= */
+
+#define CONFIGFS_GADGET_ROOT    "/sys/kernel/config/usb_gadget"
+#define CONFIGFS_GADGET_DEFAULT CONFIGFS_GADGET_ROOT "/g1"
+#define CONFIGFS_CONFIG         "configs/c.1"
+#define CONFIGFS_STRINGS        "strings/0x409"
+#define CONFIGFS_UDC_CLASS      "/sys/class/udc"
+
+/** Gadget directory, or NULL if the backend is not available */
+static gchar *configfs_gadget = 0;
+
+/** Name of the udc the gadget was last bound to */
+static gchar *configfs_udc = 0;
+
+/* ========================================================================= *
+ * Internal helpers
+ * ========================================================================= */
+
+static gchar *configfs_path(const char *sub)
+{
+    return g_strconcat(configfs_gadget, "/", sub, NULL);
+}
+
+static int configfs_write(const char *sub, const char *text)
+{
+    int    ret  = -1;
+    gchar *path = configfs_path(sub);
+    gchar *real = usb_moded_root_path(path);
+    int    fd   = open(real, O_WRONLY | O_TRUNC);
+    size_t len  = strlen(text);
+
+    if( fd == -1 ) {
+        log_warning("%s: open: %m", path);
+        goto EXIT;
+    }
+
+    if( write(fd, text, len) != (ssize_t)len ) {
+        log_warning("%s: write '%s': %m", path, text);
+        goto EXIT;
+    }
+
+    log_debug("%s <- '%s'", path, text);
+    ret = 0;
+
+EXIT:
+    if( fd != -1 )
+        close(fd);
+    g_free(real);
+    g_free(path);
+    return ret;
+}
+
+static gchar *configfs_read(const char *sub)
+{
+    gchar *path = configfs_path(sub);
+    gchar *real = usb_moded_root_path(path);
+    gchar *text = 0;
+
+    if( g_file_get_contents(real, &text, 0, 0) )
+        g_strstrip(text);
+
+    g_free(real);
+    g_free(path);
+    return text;
+}
+
+static bool configfs_mkdir(const char *sub)
+{
+    bool   ok   = true;
+    gchar *path = configfs_path(sub);
+    gchar *real = usb_moded_root_path(path);
+
+    if( mkdir(real, 0755) == -1 && errno != EEXIST ) {
+        log_warning("%s: mkdir: %m", path);
+        ok = false;
+    }
+
+    g_free(real);
+    g_free(path);
+    return ok;
+}
+
+/** Write value from config, if it is configured */
+static void configfs_write_config(const char *sub, char *text)
+{
+    if( text )
+        configfs_write(sub, text);
+    g_free(text);
+}
+
+/** Create function instance, network functions get the configured mac */
+static bool configfs_create_function(const char *function)
+{
+    gchar *sub = g_strconcat("functions/", function, NULL);
+    gchar *mac = 0;
+    bool   ok  = configfs_mkdir(sub);
+
+    if( ok && (g_str_has_prefix(function, "rndis.") ||
+               g_str_has_prefix(function, "ecm.") ||
+               g_str_has_prefix(function, "ncm.")) ) {
+        if( (mac = read_mac()) ) {
+            gchar *attr = g_strconcat(sub, "/dev_addr", NULL);
+            configfs_write(attr, mac);
+            g_free(attr);
+        }
+    }
+
+    g_free(mac);
+    g_free(sub);
+    return ok;
+}
+
+static gchar *configfs_find_udc(void)
+{
+    gchar         *udc = get_configfs_udc();
+    gchar         *real = 0;
+    DIR           *dir = 0;
+    struct dirent *de;
+
+    if( udc )
+        goto EXIT;
+
+    real = usb_moded_root_path(CONFIGFS_UDC_CLASS);
+    if( !(dir = opendir(real)) ) {
+        log_warning("%s: opendir: %m", CONFIGFS_UDC_CLASS);
+        goto EXIT;
+    }
+
+    while( !udc && (de = readdir(dir)) ) {
+        if( de->d_name[0] != '.' )
+            udc = g_strdup(de->d_name);
+    }
+
+    closedir(dir);
+
+EXIT:
+    g_free(real);
+    return udc;
+}
+
+static int configfs_unbind(void)
+{
+    int    ret = 0;
+    gchar *udc = configfs_read("UDC");
+
+    if( udc && *udc )
+        ret = configfs_write("UDC", "\n");
+
+    g_free(udc);
+    return ret;
+}
+
+static int configfs_bind(void)
+{
+    /* the udc can come and go with its driver, look it up on every
+     * bind instead of relying on what was there at startup */
+    g_free(configfs_udc), configfs_udc = configfs_find_udc();
+
+    if( !configfs_udc ) {
+        log_warning("configfs: no udc to bind to");
+        return -1;
+    }
+    return configfs_write("UDC", configfs_udc);
+}
+
+/** Remove all function links from the configuration */
+static void configfs_unlink_functions(void)
+{
+    gchar         *cfg = configfs_path(CONFIGFS_CONFIG);
+    gchar         *real = usb_moded_root_path(cfg);
+    DIR           *dir = opendir(real);
+    struct dirent *de;
+    gchar         *link;
+
+    if( !dir ) {
+        log_warning("%s: opendir: %m", cfg);
+        goto EXIT;
+    }
+
+    while( (de = readdir(dir)) ) {
+        if( de->d_type != DT_LNK )
+            continue;
+
+        link = g_strconcat(real, "/", de->d_name, NULL);
+        if( unlink(link) == -1 )
+            log_warning("%s: unlink: %m", link);
+        g_free(link);
+    }
+
+    closedir(dir);
+EXIT:
+    g_free(real);
+    g_free(cfg);
+}
+
+/** Link function into the configuration, creating it if needed */
+static int configfs_link_function(const char *function)
+{
+    int    ret    = -1;
+    gchar *target = 0;
+    gchar *link   = 0;
+    gchar *rtarget = 0;
+    gchar *rlink  = 0;
+
+    if( !configfs_create_function(function) )
+        goto EXIT;
+
+    target = g_strconcat(configfs_gadget, "/functions/", function, NULL);
+    link   = g_strconcat(configfs_gadget, "/" CONFIGFS_CONFIG "/", function, NULL);
+
+    rtarget = usb_moded_root_path(target);
+    rlink   = usb_moded_root_path(link);
+    if( symlink(rtarget, rlink) == -1 ) {
+        log_warning("%s: symlink: %m", link);
+        goto EXIT;
+    }
+
+    ret = 0;
+
+EXIT:
+    g_free(rlink);
+    g_free(rtarget);
+    g_free(link);
+    g_free(target);
+    return ret;
+}
+
+/* ========================================================================= *
+ * External API
+ * ========================================================================= */
+
+/** Set up the configfs gadget, if the kernel supports it
+ *
+ * Creates the gadget, its configuration and all function instances
+ * used by the dynamic modes, and writes the device identity from the
+ * [android] config section.
+ *
+ * @param modelist list of dynamic modes
+ */
+void usb_moded_configfs_init(GList *modelist)
+{
+    bool        used = false;
+    const char *serial;
+    gchar      *real = 0;
+
+    for( GList *iter = modelist; iter; iter = iter->next ) {
+        struct mode_list_elem *data = iter->data;
+        if( data->configfs_functions )
+            used = true;
+    }
+
+    if( !used )
+        goto EXIT;
+
+    real = usb_moded_root_path(CONFIGFS_GADGET_ROOT);
+    if( access(real, F_OK) == -1 ) {
+        log_warning("%s: not available, configfs modes will not work",
+                    CONFIGFS_GADGET_ROOT);
+        goto EXIT;
+    }
+
+    if( !(configfs_gadget = get_configfs_gadget()) )
+        configfs_gadget = g_strdup(CONFIGFS_GADGET_DEFAULT);
+
+    g_free(real), real = usb_moded_root_path(configfs_gadget);
+    if( mkdir(real, 0755) == -1 && errno != EEXIST ) {
+        log_warning("%s: mkdir: %m", configfs_gadget);
+        g_free(configfs_gadget), configfs_gadget = 0;
+        goto EXIT;
+    }
+
+    configfs_mkdir(CONFIGFS_STRINGS);
+    configfs_mkdir(CONFIGFS_CONFIG);
+    configfs_mkdir(CONFIGFS_CONFIG "/" CONFIGFS_STRINGS);
+
+    /* identity can only be changed while not bound */
+    configfs_unbind();
+
+    configfs_write_config("idVendor", get_android_vendor_id());
+    configfs_write_config("idProduct", get_android_product_id());
+    configfs_write_config(CONFIGFS_STRINGS "/manufacturer",
+                          get_android_manufacturer());
+    configfs_write_config(CONFIGFS_STRINGS "/product", get_android_product());
+    if( (serial = usb_moded_bootparam_get(BOOTPARAM_ANDROID_SERIAL)) )
+        configfs_write(CONFIGFS_STRINGS "/serialnumber", serial);
+
+    /* function instances are kept for the lifetime of the daemon */
+    for( GList *iter = modelist; iter; iter = iter->next ) {
+        struct mode_list_elem *data = iter->data;
+        gchar **vec;
+
+        if( !data->configfs_functions )
+            continue;
+
+        vec = g_strsplit(data->configfs_functions, ",", 0);
+        for( int i = 0; vec[i]; ++i )
+            configfs_create_function(g_strstrip(vec[i]));
+        g_strfreev(vec);
+    }
+
+    configfs_udc = configfs_find_udc();
+
+    log_debug("configfs: gadget %s, udc %s", configfs_gadget,
+              configfs_udc ?: "none");
+
+EXIT:
+    g_free(real);
+}
+
+/** Release configfs backend state
+ *
+ * The gadget itself is left as it is.
+ */
+void usb_moded_configfs_quit(void)
+{
+    g_free(configfs_gadget), configfs_gadget = 0;
+    g_free(configfs_udc), configfs_udc = 0;
+}
+
+/** Check if the configfs gadget can be used
+ *
+ * @return TRUE if the gadget was set up, FALSE otherwise
+ */
+gboolean usb_moded_configfs_available(void)
+{
+    return configfs_gadget != 0;
+}
+
+/** Activate a set of functions
+ *
+ * Unbinds the gadget, relinks the configuration with the given
+ * functions in order and binds the gadget again.
+ *
+ * @param functions  comma separated function instances
+ * @param product_id product id to use, or NULL for the configured one
+ * @param vendor_id  vendor id to use, or NULL for the configured one
+ *
+ * @return 0 on success, -1 on failure
+ */
+int usb_moded_configfs_set_functions(const char *functions,
+                                     const char *product_id,
+                                     const char *vendor_id)
+{
+    int     ret = -1;
+    gchar **vec = 0;
+
+    if( !configfs_gadget ) {
+        log_warning("configfs: gadget not available");
+        goto EXIT;
+    }
+
+    configfs_unbind();
+    configfs_unlink_functions();
+
+    if( product_id )
+        configfs_write("idProduct", product_id);
+    else
+        configfs_write_config("idProduct", get_android_product_id());
+
+    if( vendor_id )
+        configfs_write("idVendor", vendor_id);
+    else
+        configfs_write_config("idVendor", get_android_vendor_id());
+
+    ret = 0;
+    vec = g_strsplit(functions, ",", 0);
+    for( int i = 0; vec[i]; ++i ) {
+        if( configfs_link_function(g_strstrip(vec[i])) == -1 )
+            ret = -1;
+    }
+
+    if( configfs_bind() == -1 )
+        ret = -1;
+
+EXIT:
+    g_strfreev(vec);
+    return ret;
+}
+
+/** Unbind the gadget and drop all functions from the configuration
+ *
+ * @return 0 on success, -1 on failure
+ */
+int usb_moded_configfs_disable(void)
+{
+    int ret = -1;
+
+    if( !configfs_gadget )
+        goto EXIT;
+
+    ret = configfs_unbind();
+    configfs_unlink_functions();
+
+EXIT:
+    return ret;
+}
@@ -0,0 +1,37 @@
+/**
+  @file usb_moded-configfs.h
+
+  Copyright (C) 2016 Jolla. All rights reserved.
+
+  @author: Philippe De Swert <philippe.deswert@jollamobile.com>
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the Lesser GNU General Public License 
+  version 2 as published by the Free Software Foundation. 
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  General Public License for more details.
+ 
+  You should have received a copy of the Lesser GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+  02110-1301 USA
+*/
+
+#ifndef USB_MODED_CONFIGFS_H_
+#define USB_MODED_CONFIGFS_H_
+
+#include <glib.h>
+
+void     usb_moded_configfs_init(GList *modelist);
+void     usb_moded_configfs_quit(void);
+gboolean usb_moded_configfs_available(void);
+
+int      usb_moded_configfs_set_functions(const char *functions,
+                                          const char *product_id,
+                                          const char *vendor_id);
+int      usb_moded_configfs_disable(void);
+
+#endif /* USB_MODED_CONFIGFS_H_ */
@@ -0,0 +1,1061 @@
+/**
+  @file usb_moded-connman.c
+
+  Copyright (C) 2016 Jolla. All rights reserved.
+
+  @author: Philippe De Swert <philippe.deswert@jollamobile.com>
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the Lesser GNU General Public License
+  version 2 as published by the Free Software Foundation.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  General Public License for more details.
+
+  You should have received a copy of the Lesser GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+  02110-1301 USA
+*/
+
+/*
+ * ConnMan client
+ *
+ * Services and technologies, together with the properties usb-moded
+ * cares about, are cached from the initial GetServices / GetTechnologies
+ * replies and kept up to date from the ServicesChanged, TechnologyAdded,
+ * TechnologyRemoved and PropertyChanged signals. Questions about the
+ * cellular data connection are answered from the cache, and all method
+ * calls made to ConnMan are asynchronous.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include <glib.h>
+
+#include "usb_moded-connman.h"
+#include "usb_moded-log.h"
+#include "usb_moded-dbus-private.h"
+
+/* ========================================================================= *
+ * Constants
+ * ========================================================================= */
+
+#define CONNMAN_SERVICE                "net.connman"
+#define CONNMAN_MANAGER_PATH           "/"
+#define CONNMAN_MANAGER_INTERFACE      CONNMAN_SERVICE ".Manager"
+#define CONNMAN_SERVICE_INTERFACE      CONNMAN_SERVICE ".Service"
+#define CONNMAN_TECH_INTERFACE         CONNMAN_SERVICE ".Technology"
+#define CONNMAN_ERROR_INTERFACE        CONNMAN_SERVICE ".Error"
+#define CONNMAN_ERROR_ALREADY_ENABLED  CONNMAN_ERROR_INTERFACE ".AlreadyEnabled"
+#define CONNMAN_ERROR_ALREADY_DISABLED CONNMAN_ERROR_INTERFACE ".AlreadyDisabled"
+
+#define CONNMAN_GET_SERVICES_REQ       "GetServices"
+#define CONNMAN_GET_TECHNOLOGIES_REQ   "GetTechnologies"
+#define CONNMAN_SET_PROPERTY_REQ       "SetProperty"
+#define CONNMAN_CONNECT_REQ            "Connect"
+#define CONNMAN_DISCONNECT_REQ         "Disconnect"
+
+#define CONNMAN_SERVICES_CHANGED_SIG   "ServicesChanged"
+#define CONNMAN_TECH_ADDED_SIG         "TechnologyAdded"
+#define CONNMAN_TECH_REMOVED_SIG       "TechnologyRemoved"
+#define CONNMAN_PROPERTY_CHANGED_SIG   "PropertyChanged"
+
+#define CONNMAN_WIFI_TECHNOLOGY        "/net/connman/technology/wifi"
+
+#define CONNMAN_MANAGER_MATCH\
+     "type='signal'"\
+     ",sender='"CONNMAN_SERVICE"'"\
+     ",interface='"CONNMAN_MANAGER_INTERFACE"'"
+
+#define CONNMAN_SERVICE_MATCH\
+     "type='signal'"\
+     ",sender='"CONNMAN_SERVICE"'"\
+     ",interface='"CONNMAN_SERVICE_INTERFACE"'"\
+     ",member='"CONNMAN_PROPERTY_CHANGED_SIG"'"
+
+#define CONNMAN_TECH_MATCH\
+     "type='signal'"\
+     ",sender='"CONNMAN_SERVICE"'"\
+     ",interface='"CONNMAN_TECH_INTERFACE"'"\
+     ",member='"CONNMAN_PROPERTY_CHANGED_SIG"'"
+
+#define CONNMAN_NAME_OWNER_CHANGED_MATCH\
+     "type='signal'"\
+     ",interface='"DBUS_INTERFACE_DBUS"'"\
+     ",member='"DBUS_NAME_OWNER_CHANGED_SIG"'"\
+     ",arg0='"CONNMAN_SERVICE"'"
+
+/** How many times setting tethering is tried */
+#define CONNMAN_TETHERING_TRIES        10
+
+/** Delay between tethering attempts [ms] */
+#define CONNMAN_TETHERING_RETRY_MS     200
+
+/* ========================================================================= *
+ * Types
+ * ========================================================================= */
+
+/** Cached properties of a connman service */
+typedef struct connman_service_t
+{
+    char  *path;
+    char  *type;
+    char  *state;
+    char **nameservers;
+    char  *interface;
+} connman_service_t;
+
+/** Cached properties of a connman technology */
+typedef struct connman_technology_t
+{
+    char     *path;
+    char     *type;
+    gboolean  powered;
+} connman_technology_t;
+
+/** Tethering change in progress */
+typedef struct connman_tethering_t
+{
+    char            *path;
+    gboolean         on;
+    int              tries;
+    guint            retry_id;
+    DBusPendingCall *pc;
+} connman_tethering_t;
+
+/** Function for storing a property of a cached object */
+typedef void (*connman_property_fn)(gpointer obj, const char *key,
+                                    DBusMessageIter *var);
+
+/** Function for updating a cached object from its properties */
+typedef void (*connman_object_fn)(const char *path, DBusMessageIter *props);
+
+/* ========================================================================= *
+ * State data
+ * ========================================================================= */
+
+/** SystemBus connection ref used for connman ipc */
+static DBusConnection *connman_con = 0;
+
+/** Flag for: connman is available on system bus */
+static gboolean connman_is_available = FALSE;
+
+/** Object path -> connman_service_t */
+static GHashTable *connman_services = 0;
+
+/** Object path -> connman_technology_t */
+static GHashTable *connman_technologies = 0;
+
+static DBusPendingCall *connman_available_pc    = 0;
+static DBusPendingCall *connman_services_pc     = 0;
+static DBusPendingCall *connman_technologies_pc = 0;
+
+/** Functions to call once cellular data is usable, as connman_online_fn */
+static GSList *connman_online_waiters = 0;
+
+/** Flag for: wifi was powered off by usb-moded */
+static gboolean connman_wifi_restore = FALSE;
+
+/** Tethering change in progress, or NULL */
+static connman_tethering_t *connman_tethering = 0;
+
+/* ========================================================================= *
+ * Property parsing
+ * ========================================================================= */
+
+/** Replace a cached string with a string / object path from a variant */
+static void connman_iter_string(DBusMessageIter *var, char **pstr)
+{
+    const char *str = 0;
+    int         type = dbus_message_iter_get_arg_type(var);
+
+    if( type != DBUS_TYPE_STRING && type != DBUS_TYPE_OBJECT_PATH )
+        return;
+
+    dbus_message_iter_get_basic(var, &str);
+    g_free(*pstr), *pstr = g_strdup(str);
+}
+
+/** Call set_cb for each entry of an a{sv} property dictionary */
+static void connman_parse_properties(DBusMessageIter *iter,
+                                     connman_property_fn set_cb,
+                                     gpointer obj)
+{
+    DBusMessageIter arr, ent, var;
+    const char     *key = 0;
+
+    if( dbus_message_iter_get_arg_type(iter) != DBUS_TYPE_ARRAY )
+        return;
+
+    dbus_message_iter_recurse(iter, &arr);
+    while( dbus_message_iter_get_arg_type(&arr) == DBUS_TYPE_DICT_ENTRY ) {
+        dbus_message_iter_recurse(&arr, &ent);
+        if( dbus_message_iter_get_arg_type(&ent) == DBUS_TYPE_STRING ) {
+            dbus_message_iter_get_basic(&ent, &key);
+            dbus_message_iter_next(&ent);
+            if( dbus_message_iter_get_arg_type(&ent) == DBUS_TYPE_VARIANT ) {
+                dbus_message_iter_recurse(&ent, &var);
+                set_cb(obj, key, &var);
+            }
+        }
+        dbus_message_iter_next(&arr);
+    }
+}
+
+/** Call update_cb for each entry of an a(oa{sv}) object list */
+static void connman_parse_objects(DBusMessageIter *iter,
+                                  connman_object_fn update_cb)
+{
+    DBusMessageIter arr, obj;
+    const char     *path = 0;
+
+    if( dbus_message_iter_get_arg_type(iter) != DBUS_TYPE_ARRAY )
+        return;
+
+    dbus_message_iter_recurse(iter, &arr);
+    while( dbus_message_iter_get_arg_type(&arr) == DBUS_TYPE_STRUCT ) {
+        dbus_message_iter_recurse(&arr, &obj);
+        if( dbus_message_iter_get_arg_type(&obj) == DBUS_TYPE_OBJECT_PATH ) {
+            dbus_message_iter_get_basic(&obj, &path);
+            dbus_message_iter_next(&obj);
+            update_cb(path, &obj);
+        }
+        dbus_message_iter_next(&arr);
+    }
+}
+
+/* ========================================================================= *
+ * Services
+ * ========================================================================= */
+
+static void connman_service_free(gpointer aptr)
+{
+    connman_service_t *self = aptr;
+
+    g_free(self->path);
+    g_free(self->type);
+    g_free(self->state);
+    g_strfreev(self->nameservers);
+    g_free(self->interface);
+    g_free(self);
+}
+
+static connman_service_t *connman_service_get(const char *path)
+{
+    connman_service_t *self = g_hash_table_lookup(connman_services, path);
+
+    if( !self ) {
+        self = g_new0(connman_service_t, 1);
+        self->path = g_strdup(path);
+        g_hash_table_replace(connman_services, self->path, self);
+    }
+    return self;
+}
+
+/** Service is connected and has name servers to hand out */
+static gboolean connman_service_is_online(const connman_service_t *self)
+{
+    return (!g_strcmp0(self->state, "online") ||
+            !g_strcmp0(self->state, "ready")) &&
+        self->nameservers && self->nameservers[0];
+}
+
+/** Find a service of the given type, preferring one that is online */
+static connman_service_t *connman_service_find(const char *type)
+{
+    connman_service_t *found = 0;
+    GHashTableIter     iter;
+    gpointer           val;
+
+    g_hash_table_iter_init(&iter, connman_services);
+    while( g_hash_table_iter_next(&iter, 0, &val) ) {
+        connman_service_t *self = val;
+
+        if( g_strcmp0(self->type, type) )
+            continue;
+        if( !found || connman_service_is_online(self) )
+            found = self;
+        if( connman_service_is_online(found) )
+            break;
+    }
+    return found;
+}
+
+static void connman_service_set_property(gpointer obj, const char *key,
+                                         DBusMessageIter *var)
+{
+    connman_service_t *self = obj;
+    DBusMessageIter    arr;
+
+    if( !strcmp(key, "Type") ) {
+        connman_iter_string(var, &self->type);
+    }
+    else if( !strcmp(key, "State") ) {
+        connman_iter_string(var, &self->state);
+        log_debug("connman: %s state = %s", self->path, self->state);
+    }
+    else if( !strcmp(key, "Nameservers") ) {
+        GPtrArray *vec = g_ptr_array_new();
+
+        if( dbus_message_iter_get_arg_type(var) == DBUS_TYPE_ARRAY ) {
+            const char *str = 0;
+
+            dbus_message_iter_recurse(var, &arr);
+            while( dbus_message_iter_get_arg_type(&arr) == DBUS_TYPE_STRING ) {
+                dbus_message_iter_get_basic(&arr, &str);
+                g_ptr_array_add(vec, g_strdup(str));
+                dbus_message_iter_next(&arr);
+            }
+        }
+        g_ptr_array_add(vec, 0);
+        g_strfreev(self->nameservers);
+        self->nameservers = (char **)g_ptr_array_free(vec, FALSE);
+    }
+    else if( !strcmp(key, "Ethernet") ) {
+        connman_parse_properties(var, connman_service_set_property, self);
+    }
+    else if( !strcmp(key, "Interface") ) {
+        /* from within the Ethernet dictionary */
+        connman_iter_string(var, &self->interface);
+    }
+}
+
+/** Notify the waiters once cellular data is usable */
+static void connman_online_check(void)
+{
+    connman_service_t *service;
+    GSList            *waiters = connman_online_waiters;
+
+    if( !waiters || !connman_services )
+        return;
+
+    service = connman_service_find("cellular");
+    if( !service || !connman_service_is_online(service) )
+        return;
+
+    log_debug("connman: cellular data is online");
+
+    /* waiters can start waiting again from the callback */
+    connman_online_waiters = 0;
+    for( GSList *item = waiters; item; item = item->next ) {
+        connman_online_fn online_cb = item->data;
+        online_cb();
+    }
+    g_slist_free(waiters);
+}
+
+static void connman_service_update(const char *path, DBusMessageIter *props)
+{
+    connman_service_t *self = connman_service_get(path);
+
+    connman_parse_properties(props, connman_service_set_property, self);
+}
+
+/* ========================================================================= *
+ * Technologies
+ * ========================================================================= */
+
+static void connman_technology_free(gpointer aptr)
+{
+    connman_technology_t *self = aptr;
+
+    g_free(self->path);
+    g_free(self->type);
+    g_free(self);
+}
+
+static void connman_technology_set_property(gpointer obj, const char *key,
+                                            DBusMessageIter *var)
+{
+    connman_technology_t *self = obj;
+
+    if( !strcmp(key, "Type") ) {
+        connman_iter_string(var, &self->type);
+    }
+    else if( !strcmp(key, "Powered") ) {
+        dbus_bool_t powered = FALSE;
+
+        if( dbus_message_iter_get_arg_type(var) == DBUS_TYPE_BOOLEAN )
+            dbus_message_iter_get_basic(var, &powered);
+        self->powered = powered;
+        log_debug("connman: %s powered = %d", self->path, self->powered);
+    }
+}
+
+static void connman_tethering_kick(const char *path);
+
+static void connman_technology_update(const char *path, DBusMessageIter *props)
+{
+    connman_technology_t *self = g_hash_table_lookup(connman_technologies, path);
+
+    if( !self ) {
+        self = g_new0(connman_technology_t, 1);
+        self->path = g_strdup(path);
+        g_hash_table_replace(connman_technologies, self->path, self);
+        connman_tethering_kick(path);
+    }
+    connman_parse_properties(props, connman_technology_set_property, self);
+}
+
+/* ========================================================================= *
+ * Method calls
+ * ========================================================================= */
+
+/** Construct a SetProperty request with a boolean value */
+static DBusMessage *connman_set_property_req(const char *path,
+                                             const char *interface,
+                                             const char *key,
+                                             gboolean on)
+{
+    DBusMessage     *req = 0;
+    DBusMessageIter  iter, var;
+    dbus_bool_t      val = (on != FALSE);
+
+    req = dbus_message_new_method_call(CONNMAN_SERVICE, path, interface,
+                                       CONNMAN_SET_PROPERTY_REQ);
+    if( !req )
+        goto EXIT;
+
+    dbus_message_iter_init_append(req, &iter);
+    dbus_message_iter_append_basic(&iter, DBUS_TYPE_STRING, &key);
+    dbus_message_iter_open_container(&iter, DBUS_TYPE_VARIANT,
+                                     DBUS_TYPE_BOOLEAN_AS_STRING, &var);
+    dbus_message_iter_append_basic(&var, DBUS_TYPE_BOOLEAN, &val);
+    dbus_message_iter_close_container(&iter, &var);
+
+EXIT:
+    return req;
+}
+
+/** Send a request whose reply is of no interest, takes ownership of req */
+static void connman_send(DBusMessage *req)
+{
+    if( !req )
+        return;
+
+    if( connman_con ) {
+        dbus_message_set_no_reply(req, TRUE);
+        if( !dbus_connection_send(connman_con, req, 0) )
+            log_err("connman: failed to send %s", dbus_message_get_member(req));
+    }
+    dbus_message_unref(req);
+}
+
+/** Send a method call without arguments to a service */
+static void connman_service_call(const char *path, const char *member)
+{
+    log_debug("connman: %s.%s", path, member);
+    connman_send(dbus_message_new_method_call(CONNMAN_SERVICE, path,
+                                              CONNMAN_SERVICE_INTERFACE,
+                                              member));
+}
+
+/** Send an asynchronous manager query */
+static gboolean connman_manager_query(const char *member,
+                                      DBusPendingCallNotifyFunction notify,
+                                      DBusPendingCall **ppc)
+{
+    gboolean         ack = FALSE;
+    DBusMessage     *req = 0;
+    DBusPendingCall *pc  = 0;
+
+    if( !connman_con )
+        goto EXIT;
+
+    req = dbus_message_new_method_call(CONNMAN_SERVICE, CONNMAN_MANAGER_PATH,
+                                       CONNMAN_MANAGER_INTERFACE, member);
+    if( !req ) {
+        log_err("%s.%s: failed to construct request",
+                CONNMAN_MANAGER_INTERFACE, member);
+        goto EXIT;
+    }
+
+    if( !dbus_connection_send_with_reply(connman_con, req, &pc, -1) )
+        goto EXIT;
+
+    if( !pc )
+        goto EXIT;
+
+    if( !dbus_pending_call_set_notify(pc, notify, 0, 0) )
+        goto EXIT;
+
+    ack = TRUE;
+    *ppc = pc, pc = 0;
+
+EXIT:
+    if( pc  ) dbus_pending_call_unref(pc);
+    if( req ) dbus_message_unref(req);
+
+    return ack;
+}
+
+/** Get the object list out of a manager query reply */
+static DBusMessage *connman_manager_reply(DBusPendingCall *pc,
+                                          const char *member,
+                                          DBusMessageIter *iter)
+{
+    DBusMessage *rsp = 0;
+    DBusError    err = DBUS_ERROR_INIT;
+
+    if( !(rsp = dbus_pending_call_steal_reply(pc)) ) {
+        log_err("%s.%s: no reply", CONNMAN_MANAGER_INTERFACE, member);
+        goto EXIT;
+    }
+
+    if( dbus_set_error_from_message(&err, rsp) ) {
+        log_err("%s.%s: error reply: %s: %s", CONNMAN_MANAGER_INTERFACE,
+                member, err.name, err.message);
+        dbus_message_unref(rsp), rsp = 0;
+        goto EXIT;
+    }
+
+    dbus_message_iter_init(rsp, iter);
+
+EXIT:
+    dbus_error_free(&err);
+    return rsp;
+}
+
+static void connman_services_query_cb(DBusPendingCall *pc, void *aptr)
+{
+    DBusMessage     *rsp;
+    DBusMessageIter  iter;
+
+    (void)aptr;
+
+    if( (rsp = connman_manager_reply(pc, CONNMAN_GET_SERVICES_REQ, &iter)) ) {
+        connman_parse_objects(&iter, connman_service_update);
+        dbus_message_unref(rsp);
+        connman_online_check();
+    }
+
+    dbus_pending_call_unref(connman_services_pc),
+        connman_services_pc = 0;
+}
+
+static void connman_technologies_query_cb(DBusPendingCall *pc, void *aptr)
+{
+    DBusMessage     *rsp;
+    DBusMessageIter  iter;
+
+    (void)aptr;
+
+    if( (rsp = connman_manager_reply(pc, CONNMAN_GET_TECHNOLOGIES_REQ, &iter)) ) {
+        connman_parse_objects(&iter, connman_technology_update);
+        dbus_message_unref(rsp);
+    }
+
+    dbus_pending_call_unref(connman_technologies_pc),
+        connman_technologies_pc = 0;
+}
+
+static void connman_pending_cancel(DBusPendingCall **ppc)
+{
+    if( *ppc ) {
+        dbus_pending_call_cancel(*ppc);
+        dbus_pending_call_unref(*ppc), *ppc = 0;
+    }
+}
+
+/* ========================================================================= *
+ * Tethering
+ * ========================================================================= */
+
+static void connman_tethering_cancel(void)
+{
+    connman_tethering_t *self = connman_tethering;
+
+    if( !self )
+        return;
+
+    connman_tethering = 0;
+    connman_pending_cancel(&self->pc);
+    if( self->retry_id )
+        g_source_remove(self->retry_id);
+    g_free(self->path);
+    g_free(self);
+}
+
+static void connman_tethering_try(void);
+
+static gboolean connman_tethering_retry_cb(gpointer aptr)
+{
+    (void)aptr;
+
+    if( connman_tethering ) {
+        connman_tethering->retry_id = 0;
+        connman_tethering_try();
+    }
+    return FALSE;
+}
+
+static void connman_tethering_reply_cb(DBusPendingCall *pc, void *aptr)
+{
+    connman_tethering_t *self = connman_tethering;
+    DBusMessage         *rsp  = 0;
+    DBusError            err  = DBUS_ERROR_INIT;
+    gboolean             done = TRUE;
+
+    (void)aptr;
+
+    dbus_pending_call_unref(self->pc), self->pc = 0;
+
+    if( !(rsp = dbus_pending_call_steal_reply(pc)) ) {
+        done = FALSE;
+    }
+    else if( !dbus_set_error_from_message(&err, rsp) ) {
+        log_debug("%s tethering %s", self->path, self->on ? "on" : "off");
+    }
+    else if( (self->on && !strcmp(err.name, CONNMAN_ERROR_ALREADY_ENABLED)) ||
+             (!self->on && (!strcmp(err.name, CONNMAN_ERROR_ALREADY_DISABLED) ||
+                            !strcmp(err.name, DBUS_ERROR_UNKNOWN_OBJECT))) ) {
+        log_debug("%s tethering already %s", self->path, self->on ? "on" : "off");
+    }
+    else if( self->tries < CONNMAN_TETHERING_TRIES ) {
+        log_debug("%s tethering: %s; retrying", self->path, err.message);
+        done = FALSE;
+    }
+    else {
+        log_err("%s\n", err.message);
+    }
+
+    if( !done && self->tries < CONNMAN_TETHERING_TRIES )
+        self->retry_id = g_timeout_add(CONNMAN_TETHERING_RETRY_MS,
+                                       connman_tethering_retry_cb, 0);
+    else
+        connman_tethering_cancel();
+
+    if( rsp ) dbus_message_unref(rsp);
+    dbus_error_free(&err);
+}
+
+static void connman_tethering_try(void)
+{
+    connman_tethering_t *self = connman_tethering;
+    DBusMessage         *req  = 0;
+
+    self->tries++;
+
+    req = connman_set_property_req(self->path, CONNMAN_TECH_INTERFACE,
+                                   "Tethering", self->on);
+    if( !req || !connman_con ||
+        !dbus_connection_send_with_reply(connman_con, req, &self->pc, -1) ||
+        !self->pc ||
+        !dbus_pending_call_set_notify(self->pc, connman_tethering_reply_cb, 0, 0) ) {
+        log_err("%s: failed to set tethering", self->path);
+        connman_tethering_cancel();
+    }
+
+    if( req ) dbus_message_unref(req);
+}
+
+/** Retry right away when the technology waited for shows up */
+static void connman_tethering_kick(const char *path)
+{
+    connman_tethering_t *self = connman_tethering;
+
+    if( !self || !self->retry_id || strcmp(self->path, path) )
+        return;
+
+    g_source_remove(self->retry_id), self->retry_id = 0;
+    connman_tethering_try();
+}
+
+/* ========================================================================= *
+ * Signal handling
+ * ========================================================================= */
+
+static void connman_services_changed_signal(DBusMessage *msg)
+{
+    DBusMessageIter iter, arr;
+    const char     *path = 0;
+
+    dbus_message_iter_init(msg, &iter);
+    connman_parse_objects(&iter, connman_service_update);
+
+    dbus_message_iter_next(&iter);
+    if( dbus_message_iter_get_arg_type(&iter) == DBUS_TYPE_ARRAY ) {
+        dbus_message_iter_recurse(&iter, &arr);
+        while( dbus_message_iter_get_arg_type(&arr) == DBUS_TYPE_OBJECT_PATH ) {
+            dbus_message_iter_get_basic(&arr, &path);
+            g_hash_table_remove(connman_services, path);
+            dbus_message_iter_next(&arr);
+        }
+    }
+
+    connman_online_check();
+}
+
+static void connman_technology_added_signal(DBusMessage *msg)
+{
+    DBusMessageIter iter;
+    const char     *path = 0;
+
+    dbus_message_iter_init(msg, &iter);
+    if( dbus_message_iter_get_arg_type(&iter) != DBUS_TYPE_OBJECT_PATH )
+        return;
+
+    dbus_message_iter_get_basic(&iter, &path);
+    dbus_message_iter_next(&iter);
+    connman_technology_update(path, &iter);
+}
+
+static void connman_technology_removed_signal(DBusMessage *msg)
+{
+    const char *path = 0;
+
+    if( dbus_message_get_args(msg, 0, DBUS_TYPE_OBJECT_PATH, &path,
+                              DBUS_TYPE_INVALID) )
+        g_hash_table_remove(connman_technologies, path);
+}
+
+static void connman_property_changed_signal(DBusMessage *msg, GHashTable *objects,
+                                            connman_property_fn set_cb)
+{
+    DBusMessageIter iter, var;
+    const char     *key  = 0;
+    const char     *path = dbus_message_get_path(msg);
+    gpointer        obj  = path ? g_hash_table_lookup(objects, path) : 0;
+
+    if( !obj )
+        return;
+
+    dbus_message_iter_init(msg, &iter);
+    if( dbus_message_iter_get_arg_type(&iter) != DBUS_TYPE_STRING )
+        return;
+
+    dbus_message_iter_get_basic(&iter, &key);
+    dbus_message_iter_next(&iter);
+    if( dbus_message_iter_get_arg_type(&iter) != DBUS_TYPE_VARIANT )
+        return;
+
+    dbus_message_iter_recurse(&iter, &var);
+    set_cb(obj, key, &var);
+}
+
+/* ========================================================================= *
+ * Name owner tracking
+ * ========================================================================= */
+
+static void connman_available_changed(const char *owner)
+{
+    gboolean is_available = (owner && *owner);
+
+    if( connman_is_available == is_available )
+        return;
+
+    connman_is_available = is_available;
+    log_debug("connman is %s", connman_is_available ? "running" : "stopped");
+
+    /* Forget cached state */
+    connman_pending_cancel(&connman_services_pc);
+    connman_pending_cancel(&connman_technologies_pc);
+    g_hash_table_remove_all(connman_services);
+    g_hash_table_remove_all(connman_technologies);
+    connman_wifi_restore = FALSE;
+
+    /* Query current state on connman startup */
+    if( connman_is_available ) {
+        connman_manager_query(CONNMAN_GET_SERVICES_REQ,
+                              connman_services_query_cb,
+                              &connman_services_pc);
+        connman_manager_query(CONNMAN_GET_TECHNOLOGIES_REQ,
+                              connman_technologies_query_cb,
+                              &connman_technologies_pc);
+    }
+}
+
+static void connman_available_cb(const char *owner)
+{
+    connman_available_changed(owner);
+
+    dbus_pending_call_unref(connman_available_pc),
+        connman_available_pc = 0;
+}
+
+static void connman_name_owner_signal(DBusMessage *msg)
+{
+    DBusError   err  = DBUS_ERROR_INIT;
+    const char *name = 0;
+    const char *prev = 0;
+    const char *curr = 0;
+
+    if( !dbus_message_get_args(msg, &err,
+                               DBUS_TYPE_STRING, &name,
+                               DBUS_TYPE_STRING, &prev,
+                               DBUS_TYPE_STRING, &curr,
+                               DBUS_TYPE_INVALID) )
+    {
+        log_err("failed to parse signal: %s: %s",
+                err.name, err.message);
+    }
+    else if( !strcmp(name, CONNMAN_SERVICE) )
+    {
+        connman_available_changed(curr);
+    }
+    dbus_error_free(&err);
+}
+
+/* ========================================================================= *
+ * dbus message filter
+ * ========================================================================= */
+
+static DBusHandlerResult
+connman_dbus_filter_cb(DBusConnection *con, DBusMessage *msg, void *aptr)
+{
+    (void)con;
+    (void)aptr;
+
+    if( dbus_message_get_type(msg) != DBUS_MESSAGE_TYPE_SIGNAL )
+        goto EXIT;
+
+    if( dbus_message_is_signal(msg, CONNMAN_MANAGER_INTERFACE,
+                               CONNMAN_SERVICES_CHANGED_SIG) )
+        connman_services_changed_signal(msg);
+    else if( dbus_message_is_signal(msg, CONNMAN_MANAGER_INTERFACE,
+                                    CONNMAN_TECH_ADDED_SIG) )
+        connman_technology_added_signal(msg);
+    else if( dbus_message_is_signal(msg, CONNMAN_MANAGER_INTERFACE,
+                                    CONNMAN_TECH_REMOVED_SIG) )
+        connman_technology_removed_signal(msg);
+    else if( dbus_message_is_signal(msg, CONNMAN_SERVICE_INTERFACE,
+                                    CONNMAN_PROPERTY_CHANGED_SIG) ) {
+        connman_property_changed_signal(msg, connman_services,
+                                        connman_service_set_property);
+        connman_online_check();
+    }
+    else if( dbus_message_is_signal(msg, CONNMAN_TECH_INTERFACE,
+                                    CONNMAN_PROPERTY_CHANGED_SIG) )
+        connman_property_changed_signal(msg, connman_technologies,
+                                        connman_technology_set_property);
+    else if( dbus_message_is_signal(msg, DBUS_INTERFACE_DBUS,
+                                    DBUS_NAME_OWNER_CHANGED_SIG) )
+        connman_name_owner_signal(msg);
+
+EXIT:
+    return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+}
+
+/* ========================================================================= *
+ * External API
+ * ========================================================================= */
+
+/** Get the cellular data connection for nat, bringing it up if needed
+ *
+ * Wifi is powered off first, as cellular data does not always come
+ * up otherwise. It is powered back on by usb_moded_connman_reset_state().
+ *
+ * @param dns1          where to store the primary name server
+ * @param dns2          where to store the secondary name server
+ * @param nat_interface where to store the cellular network interface
+ *
+ * @return CONNMAN_CELLULAR_ONLINE when the values were filled in,
+ *         CONNMAN_CELLULAR_CONNECTING if a connection was requested,
+ *         or CONNMAN_CELLULAR_UNAVAILABLE
+ */
+int usb_moded_connman_cellular_data(char **dns1, char **dns2, char **nat_interface)
+{
+    connman_technology_t *wifi;
+    connman_service_t    *service;
+    GHashTableIter        iter;
+    gpointer              val;
+
+    if( !connman_is_available || !connman_services ) {
+        log_debug("connman is not available");
+        return CONNMAN_CELLULAR_UNAVAILABLE;
+    }
+
+    /* turn off wifi in preparation for cellular connection if needed */
+    wifi = g_hash_table_lookup(connman_technologies, CONNMAN_WIFI_TECHNOLOGY);
+    if( wifi && wifi->powered ) {
+        log_debug("connman: powering off wifi");
+        connman_send(connman_set_property_req(CONNMAN_WIFI_TECHNOLOGY,
+                                              CONNMAN_TECH_INTERFACE,
+                                              "Powered", FALSE));
+        connman_wifi_restore = TRUE;
+    }
+
+    if( !(service = connman_service_find("cellular")) ) {
+        log_debug("connman: no cellular service");
+        return CONNMAN_CELLULAR_UNAVAILABLE;
+    }
+
+    if( connman_service_is_online(service) ) {
+        /* use the same dns for dns2 when there is no secondary */
+        *dns1 = strdup(service->nameservers[0]);
+        *dns2 = strdup(service->nameservers[1] ?: service->nameservers[0]);
+        *nat_interface = service->interface ? strdup(service->interface) : 0;
+        log_debug("connman: %s online, dns = %s %s, interface = %s",
+                  service->path, *dns1, *dns2, service->interface ?: "NULL");
+        return CONNMAN_CELLULAR_ONLINE;
+    }
+
+    /* make sure that wifi is disconnected as sometimes cellular will
+     * not come up otherwise */
+    g_hash_table_iter_init(&iter, connman_services);
+    while( g_hash_table_iter_next(&iter, 0, &val) ) {
+        connman_service_t *other = val;
+
+        if( !g_strcmp0(other->type, "wifi") &&
+            (!g_strcmp0(other->state, "ready") ||
+             !g_strcmp0(other->state, "online")) )
+            connman_service_call(other->path, CONNMAN_DISCONNECT_REQ);
+    }
+
+    log_debug("Not online. Turning on cellular data connection.\n");
+    connman_service_call(service->path, CONNMAN_CONNECT_REQ);
+    return CONNMAN_CELLULAR_CONNECTING;
+}
+
+/** Get notified once the cellular data connection is usable
+ *
+ * Each caller waits with a function of its own, and waiting again
+ * with the same function has no further effect.
+ *
+ * @param online_cb function to call once
+ */
+void usb_moded_connman_wait_online(connman_online_fn online_cb)
+{
+    if( !g_slist_find(connman_online_waiters, online_cb) )
+        connman_online_waiters = g_slist_append(connman_online_waiters,
+                                                online_cb);
+}
+
+/** Stop waiting for the cellular data connection
+ *
+ * @param online_cb function given to usb_moded_connman_wait_online()
+ */
+void usb_moded_connman_wait_online_cancel(connman_online_fn online_cb)
+{
+    connman_online_waiters = g_slist_remove(connman_online_waiters,
+                                            online_cb);
+}
+
+/** Restore wifi if it was powered off for cellular data
+ */
+void usb_moded_connman_reset_state(void)
+{
+    if( !connman_wifi_restore )
+        return;
+
+    /* make sure connman turns wifi back on when we disconnect */
+    log_debug("Turning wifi back on\n");
+    connman_wifi_restore = FALSE;
+    connman_send(connman_set_property_req(CONNMAN_WIFI_TECHNOLOGY,
+                                          CONNMAN_TECH_INTERFACE,
+                                          "Powered", TRUE));
+}
+
+/** Configure tethering for a connman technology
+ *
+ * Setting is retried for a while, as the technology might not exist
+ * yet right after the usb network interface has been brought up.
+ *
+ * @param path technology object path
+ * @param on   TRUE to enable tethering, FALSE to disable
+ *
+ * @return TRUE if the request was sent, FALSE otherwise
+ */
+gboolean usb_moded_connman_set_tethering(const char *path, gboolean on)
+{
+    connman_tethering_cancel();
+
+    if( !connman_con || !path )
+        return FALSE;
+
+    connman_tethering = g_new0(connman_tethering_t, 1);
+    connman_tethering->path = g_strdup(path);
+    connman_tethering->on   = on;
+    connman_tethering_try();
+
+    return connman_tethering != 0;
+}
+
+/** Start tracking connman state
+ *
+ * @return TRUE on success, FALSE otherwise
+ */
+gboolean usb_moded_connman_start(void)
+{
+    gboolean ack = FALSE;
+
+    log_debug("starting connman tracking");
+
+    connman_services = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                             0, connman_service_free);
+    connman_technologies = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                                 0, connman_technology_free);
+
+    /* Get connection ref */
+    if( (connman_con = usb_moded_dbus_get_connection()) == 0 )
+    {
+        log_err("Could not connect to dbus for connman\n");
+        goto EXIT;
+    }
+
+    /* Add filter callback */
+    if( !dbus_connection_add_filter(connman_con,
+                                    connman_dbus_filter_cb, 0, 0) )
+    {
+        log_err("adding system dbus filter for connman failed");
+        goto EXIT;
+    }
+
+    /* Add match without blocking / error checking */
+    dbus_bus_add_match(connman_con, CONNMAN_MANAGER_MATCH, 0);
+    dbus_bus_add_match(connman_con, CONNMAN_SERVICE_MATCH, 0);
+    dbus_bus_add_match(connman_con, CONNMAN_TECH_MATCH, 0);
+    dbus_bus_add_match(connman_con, CONNMAN_NAME_OWNER_CHANGED_MATCH, 0);
+
+    /* Initiate async connman name owner query */
+    usb_moded_get_name_owner_async(CONNMAN_SERVICE, connman_available_cb,
+                                   &connman_available_pc);
+
+    ack = TRUE;
+
+EXIT:
+    return ack;
+}
+
+/** Stop tracking connman state
+ */
+void usb_moded_connman_stop(void)
+{
+    log_debug("stopping connman tracking");
+
+    /* Do note leave pending queries behind */
+    g_slist_free(connman_online_waiters), connman_online_waiters = 0;
+    connman_tethering_cancel();
+    connman_pending_cancel(&connman_available_pc);
+    connman_pending_cancel(&connman_services_pc);
+    connman_pending_cancel(&connman_technologies_pc);
+
+    if( connman_con )
+    {
+        /* Remove filter callback */
+        dbus_connection_remove_filter(connman_con, connman_dbus_filter_cb, 0);
+
+        if( dbus_connection_get_is_connected(connman_con) ) {
+            /* Remove match without blocking / error checking */
+            dbus_bus_remove_match(connman_con, CONNMAN_MANAGER_MATCH, 0);
+            dbus_bus_remove_match(connman_con, CONNMAN_SERVICE_MATCH, 0);
+            dbus_bus_remove_match(connman_con, CONNMAN_TECH_MATCH, 0);
+            dbus_bus_remove_match(connman_con, CONNMAN_NAME_OWNER_CHANGED_MATCH, 0);
+        }
+
+        /* Let go of connection ref */
+        dbus_connection_unref(connman_con),
+            connman_con = 0;
+    }
+
+    if( connman_services )
+        g_hash_table_destroy(connman_services), connman_services = 0;
+    if( connman_technologies )
+        g_hash_table_destroy(connman_technologies), connman_technologies = 0;
+    connman_is_available = FALSE;
+}
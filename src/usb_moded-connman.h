@@ -0,0 +1,46 @@
+/**
+  @file usb_moded-connman.h
+
+  Copyright (C) 2016 Jolla. All rights reserved.
+
+  @author: Philippe De Swert <philippe.deswert@jollamobile.com>
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the Lesser GNU General Public License 
+  version 2 as published by the Free Software Foundation. 
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  General Public License for more details.
+ 
+  You should have received a copy of the Lesser GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+  02110-1301 USA
+*/
+
+#ifndef USB_MODED_CONNMAN_H_
+#define USB_MODED_CONNMAN_H_
+
+#include <glib.h>
+
+/** Results of usb_moded_connman_cellular_data() */
+#define CONNMAN_CELLULAR_ONLINE      0
+#define CONNMAN_CELLULAR_UNAVAILABLE 1
+#define CONNMAN_CELLULAR_CONNECTING  2
+
+/** Called once the cellular data connection is usable */
+typedef void (*connman_online_fn)(void);
+
+gboolean usb_moded_connman_start(void);
+void     usb_moded_connman_stop(void);
+
+int      usb_moded_connman_cellular_data(char **dns1, char **dns2, char **nat_interface);
+void     usb_moded_connman_wait_online(connman_online_fn online_cb);
+void     usb_moded_connman_wait_online_cancel(connman_online_fn online_cb);
+void     usb_moded_connman_reset_state(void);
+
+gboolean usb_moded_connman_set_tethering(const char *path, gboolean on);
+
+#endif /* USB_MODED_CONNMAN_H_ */
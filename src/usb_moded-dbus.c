@@ -34,11 +34,13 @@
 #include "usb_moded-dbus-private.h"
 #include "usb_moded.h"
 #include "usb_moded-modes.h"
+#include "usb_moded-modeid.h"
 #include "usb_moded-modesetting.h"
 #include "usb_moded-config.h"
 #include "usb_moded-config-private.h"
 #include "usb_moded-network.h"
 #include "usb_moded-log.h"
+#include "usb_moded-trace.h"
 
 #define INIT_DONE_INTERFACE "com.nokia.startup.signal"
 #define INIT_DONE_SIGNAL    "init_done"
@@ -158,6 +160,10 @@ static const char introspect_usb_moded[] =
 "      <arg name=\"whitelisted\" type=\"b\" direction=\"in\"/>"
 "     </method>"
 "    <method name=\"" USB_MODE_RESCUE_OFF "\"/>\n"
+"    <method name=\"" USB_MODE_CONFIG_SYNC "\"/>\n"
+"    <method name=\"" USB_MODE_TRANSITION_TRACE "\">\n"
+"      <arg name=\"trace\" type=\"s\" direction=\"out\"/>\n"
+"    </method>\n"
 "    <signal name=\"" USB_MODE_SIGNAL_NAME "\">\n"
 "      <arg name=\"mode\" type=\"s\"/>\n"
 "    </signal>\n"
@@ -212,23 +218,27 @@ static DBusHandlerResult msg_handler(DBusConnection *const connection, DBusMessa
 
 	if(!strcmp(member, USB_MODE_STATE_REQUEST))
 	{
-		const char *mode = get_usb_mode();
+		mode_id_t id = get_usb_mode_id();
+		const char *mode;
 
 		/* To the outside we want to keep CHARGING and CHARGING_FALLBACK the same */
-		if(!strcmp(MODE_CHARGING_FALLBACK, mode))
-			mode = MODE_CHARGING;
+		if(id == MODE_ID_CHARGING_FALLBACK)
+			id = MODE_ID_CHARGING;
+		mode = mode_registry_name(id);
 		if((reply = dbus_message_new_method_return(msg)))
 			dbus_message_append_args (reply, DBUS_TYPE_STRING, &mode, DBUS_TYPE_INVALID);
 	}
 	else if(!strcmp(member, USB_MODE_STATE_SET))
 	{
 		char *use = 0;
+		mode_id_t id;
 		DBusError   err = DBUS_ERROR_INIT;
 
 		if(!dbus_message_get_args(msg, &err, DBUS_TYPE_STRING, &use, DBUS_TYPE_INVALID))
 			reply = dbus_message_new_error(msg, DBUS_ERROR_INVALID_ARGS, member);
 		else
 		{
+				id = mode_registry_lookup(use);
 				/* check if usb is connected, since it makes no sense to change mode if it isn't */
 				if(!get_usb_connection_state())
 				{
@@ -236,13 +246,13 @@ static DBusHandlerResult msg_handler(DBusConnection *const connection, DBusMessa
 					goto error_reply;
 				}
 				/* check if the mode exists */
-				if(valid_mode(use))
+				if(valid_mode_id(id))
 					goto error_reply;
 				/* do not change mode if the mode requested is the one already set */
-				if(strcmp(use, get_usb_mode()) != 0)
+				if(id != get_usb_mode_id())
 				{
-					usb_moded_mode_cleanup(get_usb_module());
-					set_usb_mode(use);
+					usb_moded_trace_begin("dbus set_mode");
+					switch_usb_mode_id(id);
 				}
 				if((reply = dbus_message_new_method_return(msg)))
 					dbus_message_append_args (reply, DBUS_TYPE_STRING, &use, DBUS_TYPE_INVALID);
@@ -414,6 +424,21 @@ error_reply:
 		log_debug("Rescue mode off\n ");
 		reply = dbus_message_new_method_return(msg);
 	}
+	else if(!strcmp(member, USB_MODE_CONFIG_SYNC))
+	{
+		if(usb_moded_config_sync())
+			reply = dbus_message_new_method_return(msg);
+		else
+			reply = dbus_message_new_error(msg, DBUS_ERROR_FAILED, member);
+	}
+	else if(!strcmp(member, USB_MODE_TRANSITION_TRACE))
+	{
+		gchar *trace = usb_moded_trace_report();
+
+		if((reply = dbus_message_new_method_return(msg)))
+			dbus_message_append_args (reply, DBUS_TYPE_STRING, (const char *) &trace, DBUS_TYPE_INVALID);
+		g_free(trace);
+	}
 	else if(!strcmp(member, USB_MODE_WHITELISTED_MODES_GET))
 	{
 		gchar *mode_list = get_mode_whitelist();
@@ -57,6 +57,8 @@
 #define USB_MODE_WHITELISTED_MODES_SET "set_whitelisted_modes" /* set the list of whitelisted modes */
 #define USB_MODE_WHITELISTED_SET "set_whitelisted" /* sets whether an specific mode is in the whitelist */
 #define USB_MODE_AVAILABLE_MODES_GET "get_available_modes" /* returns a comma separated list of modes which are currently available for selection */
+#define USB_MODE_CONFIG_SYNC	"sync_config"	/* write pending configuration changes to disk */
+#define USB_MODE_TRANSITION_TRACE "get_transition_trace" /* return timing breakdown of the last mode transition */
 
 /**
  * (Transient) states reported by "sig_usb_state_ind" that are not modes.
@@ -72,6 +74,8 @@
 #define CHARGER_CONNECTED		"charger_connected"
 #define CHARGER_DISCONNECTED		"charger_disconnected"
 #define MODE_SETTING_FAILED		"mode_setting_failed"
+#define MODULE_UNLOAD_FAILED		"module_unload_failed"
+#define CONNECTION_SHARING_STOPPED	"connection_sharing_stopped"
 
 /* errors */
 #define UMOUNT_ERROR			"Unmounting filesystem failed. Exporting impossible"
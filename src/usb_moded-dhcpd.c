@@ -0,0 +1,571 @@
+/**
+  @file usb_moded-dhcpd.c
+
+  Copyright (C) 2016 Jolla. All rights reserved.
+
+  @author: Philippe De Swert <philippe.deswert@jollamobile.com>
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the Lesser GNU General Public License
+  version 2 as published by the Free Software Foundation.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  General Public License for more details.
+
+  You should have received a copy of the Lesser GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+  02110-1301 USA
+*/
+
+/*
+ * Built-in DHCPv4 server for the usb network interface
+ *
+ * A minimal server running from the mainloop, as an alternative to
+ * writing udhcpd.conf and having udhcpd started. It hands out the
+ * same pool udhcpd would get (.1 - .15 in the network of the device
+ * address, skipping the device itself) to the host on the other end
+ * of the cable.
+ *
+ * Replies are broadcast on the usb interface, which works for clients
+ * that do not have an address yet without needing raw sockets.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <glib.h>
+
+#include "usb_moded-dhcpd.h"
+#include "usb_moded-log.h"
+#include "usb_moded-root.h"
+#include "usb_moded-trace.h"
+
+/* ========================================================================= *
+ * Protocol
+ * ========================================================================= */
+
+#define DHCPD_SERVER_PORT   67
+#define DHCPD_CLIENT_PORT   68
+#define DHCPD_MAGIC         0x63825363
+#define DHCPD_MSG_MIN       300     /* minimum BOOTP message size */
+#define DHCPD_LEASE_TIME    3600
+#define DHCPD_POOL_FIRST    1
+#define DHCPD_POOL_LAST     15
+#define DHCPD_POOL_SIZE     (DHCPD_POOL_LAST - DHCPD_POOL_FIRST + 1)
+
+enum
+{
+    DHCP_OPT_PAD        = 0,
+    DHCP_OPT_SUBNET     = 1,
+    DHCP_OPT_ROUTER     = 3,
+    DHCP_OPT_DNS        = 6,
+    DHCP_OPT_REQUESTED  = 50,
+    DHCP_OPT_LEASE_TIME = 51,
+    DHCP_OPT_MSG_TYPE   = 53,
+    DHCP_OPT_SERVER_ID  = 54,
+    DHCP_OPT_END        = 255,
+};
+
+enum
+{
+    DHCP_DISCOVER = 1,
+    DHCP_OFFER    = 2,
+    DHCP_REQUEST  = 3,
+    DHCP_DECLINE  = 4,
+    DHCP_ACK      = 5,
+    DHCP_NAK      = 6,
+    DHCP_RELEASE  = 7,
+    DHCP_INFORM   = 8,
+};
+
+/** BOOTP message, options follow the magic cookie */
+typedef struct dhcp_msg_t
+{
+    uint8_t  op;
+    uint8_t  htype;
+    uint8_t  hlen;
+    uint8_t  hops;
+    uint32_t xid;
+    uint16_t secs;
+    uint16_t flags;
+    uint32_t ciaddr;
+    uint32_t yiaddr;
+    uint32_t siaddr;
+    uint32_t giaddr;
+    uint8_t  chaddr[16];
+    uint8_t  sname[64];
+    uint8_t  file[128];
+    uint32_t magic;
+    uint8_t  options[312];
+} __attribute__((packed)) dhcp_msg_t;
+
+/* ========================================================================= *
+ * State data
+ * ========================================================================= */
+
+typedef struct dhcpd_lease_t
+{
+    uint8_t mac[6];
+    bool    used;
+    gint64  expires;    /* monotonic time, usec */
+} dhcpd_lease_t;
+
+typedef struct dhcpd_t
+{
+    int            fd;
+    guint          watch_id;
+    char          *interface;
+    struct in_addr server;
+    struct in_addr netmask;
+    struct in_addr router;      /* INADDR_ANY if none */
+    struct in_addr dns[2];      /* INADDR_ANY if none */
+    uint32_t       pool_base;   /* host order network part of the pool */
+    dhcpd_lease_t  leases[DHCPD_POOL_SIZE];
+    gint64         started;
+    bool           leased;      /* first lease has been handed out */
+} dhcpd_t;
+
+static dhcpd_t *dhcpd = 0;
+
+/* ========================================================================= *
+ * Leases
+ * ========================================================================= */
+
+static struct in_addr dhcpd_lease_addr(const dhcpd_t *self, int slot)
+{
+    struct in_addr addr = {
+        .s_addr = htonl(self->pool_base + DHCPD_POOL_FIRST + slot)
+    };
+    return addr;
+}
+
+static int dhcpd_lease_slot(const dhcpd_t *self, struct in_addr addr)
+{
+    uint32_t host = ntohl(addr.s_addr);
+
+    if( host < self->pool_base + DHCPD_POOL_FIRST ||
+        host > self->pool_base + DHCPD_POOL_LAST ||
+        addr.s_addr == self->server.s_addr )
+        return -1;
+
+    return host - self->pool_base - DHCPD_POOL_FIRST;
+}
+
+/** Find lease for a client, or a free slot for it
+ *
+ * @param want preferred address, or INADDR_ANY
+ *
+ * @return slot index, or -1 if the pool is exhausted
+ */
+static int dhcpd_lease_find(dhcpd_t *self, const uint8_t *mac,
+                            struct in_addr want)
+{
+    gint64 now  = g_get_monotonic_time();
+    int    slot = -1;
+
+    for( int i = 0; i < DHCPD_POOL_SIZE; ++i ) {
+        if( self->leases[i].used && !memcmp(self->leases[i].mac, mac, 6) )
+            return i;
+    }
+
+    slot = dhcpd_lease_slot(self, want);
+    if( slot != -1 && self->leases[slot].used &&
+        self->leases[slot].expires > now )
+        slot = -1;
+
+    for( int i = 0; slot == -1 && i < DHCPD_POOL_SIZE; ++i ) {
+        if( dhcpd_lease_addr(self, i).s_addr == self->server.s_addr )
+            continue;
+        if( !self->leases[i].used || self->leases[i].expires <= now )
+            slot = i;
+    }
+
+    return slot;
+}
+
+/* ========================================================================= *
+ * Messages
+ * ========================================================================= */
+
+/** Look up option from a received message
+ *
+ * @return pointer to option data, or NULL if not present
+ */
+static const uint8_t *dhcpd_option(const dhcp_msg_t *msg, size_t len,
+                                   int code, int *size)
+{
+    const uint8_t *pos = msg->options;
+    const uint8_t *end = (const uint8_t *)msg + len;
+
+    while( pos < end && *pos != DHCP_OPT_END ) {
+        if( *pos == DHCP_OPT_PAD ) {
+            ++pos;
+            continue;
+        }
+        if( pos + 2 > end || pos + 2 + pos[1] > end )
+            break;
+        if( pos[0] == code ) {
+            *size = pos[1];
+            return pos + 2;
+        }
+        pos += 2 + pos[1];
+    }
+    return 0;
+}
+
+static uint8_t *dhcpd_put_option(uint8_t *pos, int code, const void *data,
+                                 int size)
+{
+    *pos++ = code;
+    *pos++ = size;
+    memcpy(pos, data, size);
+    return pos + size;
+}
+
+static void dhcpd_reply(dhcpd_t *self, const dhcp_msg_t *req, int type,
+                        struct in_addr yiaddr)
+{
+    dhcp_msg_t         rsp;
+    uint8_t           *pos = rsp.options;
+    uint8_t            val = type;
+    uint32_t           lease = htonl(DHCPD_LEASE_TIME);
+    size_t             len;
+    struct sockaddr_in dst = {
+        .sin_family      = AF_INET,
+        .sin_port        = htons(DHCPD_CLIENT_PORT),
+        .sin_addr.s_addr = htonl(INADDR_BROADCAST),
+    };
+
+    memset(&rsp, 0, sizeof rsp);
+    rsp.op     = 2;
+    rsp.htype  = req->htype;
+    rsp.hlen   = req->hlen;
+    rsp.xid    = req->xid;
+    rsp.flags  = req->flags;
+    rsp.ciaddr = req->ciaddr;
+    rsp.yiaddr = (type == DHCP_NAK) ? 0 : yiaddr.s_addr;
+    rsp.siaddr = self->server.s_addr;
+    rsp.giaddr = req->giaddr;
+    rsp.magic  = htonl(DHCPD_MAGIC);
+    memcpy(rsp.chaddr, req->chaddr, sizeof rsp.chaddr);
+
+    pos = dhcpd_put_option(pos, DHCP_OPT_MSG_TYPE, &val, 1);
+    pos = dhcpd_put_option(pos, DHCP_OPT_SERVER_ID, &self->server, 4);
+
+    if( type != DHCP_NAK ) {
+        pos = dhcpd_put_option(pos, DHCP_OPT_LEASE_TIME, &lease, 4);
+        pos = dhcpd_put_option(pos, DHCP_OPT_SUBNET, &self->netmask, 4);
+        if( self->router.s_addr != INADDR_ANY )
+            pos = dhcpd_put_option(pos, DHCP_OPT_ROUTER, &self->router, 4);
+        if( self->dns[1].s_addr != INADDR_ANY )
+            pos = dhcpd_put_option(pos, DHCP_OPT_DNS, self->dns, 8);
+        else if( self->dns[0].s_addr != INADDR_ANY )
+            pos = dhcpd_put_option(pos, DHCP_OPT_DNS, self->dns, 4);
+    }
+    *pos++ = DHCP_OPT_END;
+
+    /* some clients drop replies shorter than a BOOTP message, the
+     * options are padded with DHCP_OPT_PAD by the memset above */
+    len = pos - (uint8_t *)&rsp;
+    if( len < DHCPD_MSG_MIN )
+        len = DHCPD_MSG_MIN;
+
+    if( sendto(self->fd, &rsp, len, 0,
+               (struct sockaddr *)&dst, sizeof dst) == -1 )
+        log_warning("dhcpd: send: %m");
+}
+
+static void dhcpd_handle(dhcpd_t *self, const dhcp_msg_t *req, size_t len)
+{
+    const uint8_t *opt;
+    int            size = 0;
+    int            type;
+    int            slot;
+    struct in_addr want = { .s_addr = INADDR_ANY };
+    char           addr[INET_ADDRSTRLEN];
+
+    if( len < offsetof(dhcp_msg_t, options) || req->op != 1 ||
+        req->hlen != 6 || ntohl(req->magic) != DHCPD_MAGIC )
+        return;
+
+    if( !(opt = dhcpd_option(req, len, DHCP_OPT_MSG_TYPE, &size)) || size != 1 )
+        return;
+    type = opt[0];
+
+    /* requests for another server are not for us */
+    opt = dhcpd_option(req, len, DHCP_OPT_SERVER_ID, &size);
+    if( opt && size == 4 && memcmp(opt, &self->server, 4) )
+        return;
+
+    if( (opt = dhcpd_option(req, len, DHCP_OPT_REQUESTED, &size)) && size == 4 )
+        memcpy(&want, opt, 4);
+    else if( req->ciaddr )
+        want.s_addr = req->ciaddr;
+
+    switch( type ) {
+    case DHCP_DISCOVER:
+        if( (slot = dhcpd_lease_find(self, req->chaddr, want)) == -1 ) {
+            log_warning("dhcpd: address pool exhausted");
+            break;
+        }
+        dhcpd_reply(self, req, DHCP_OFFER, dhcpd_lease_addr(self, slot));
+        break;
+
+    case DHCP_REQUEST:
+        slot = dhcpd_lease_find(self, req->chaddr, want);
+        if( slot == -1 || dhcpd_lease_addr(self, slot).s_addr != want.s_addr ) {
+            dhcpd_reply(self, req, DHCP_NAK, want);
+            break;
+        }
+        memcpy(self->leases[slot].mac, req->chaddr, 6);
+        self->leases[slot].used    = true;
+        self->leases[slot].expires = g_get_monotonic_time() +
+            (gint64)DHCPD_LEASE_TIME * 1000000;
+        dhcpd_reply(self, req, DHCP_ACK, want);
+
+        inet_ntop(AF_INET, &want, addr, sizeof addr);
+        if( !self->leased ) {
+            self->leased = true;
+            usb_moded_trace_span(TRACE_DHCPD, self->started, "lease %s", addr);
+            log_debug("dhcpd: first lease %s after %" G_GINT64_FORMAT " ms",
+                      addr, (g_get_monotonic_time() - self->started) / 1000);
+        }
+        else {
+            log_debug("dhcpd: lease %s", addr);
+        }
+        break;
+
+    case DHCP_RELEASE:
+    case DHCP_DECLINE:
+        for( int i = 0; i < DHCPD_POOL_SIZE; ++i ) {
+            if( self->leases[i].used &&
+                !memcmp(self->leases[i].mac, req->chaddr, 6) )
+                self->leases[i].used = false;
+        }
+        break;
+
+    default:
+        break;
+    }
+}
+
+static gboolean dhcpd_io_cb(GIOChannel *channel, GIOCondition condition,
+                            gpointer aptr)
+{
+    dhcpd_t    *self = aptr;
+    dhcp_msg_t  req;
+    ssize_t     len;
+
+    (void)channel;
+
+    if( condition & ~G_IO_IN ) {
+        log_err("dhcpd: socket error, stopping");
+        self->watch_id = 0;
+        return FALSE;
+    }
+
+    if( (len = recv(self->fd, &req, sizeof req, 0)) == -1 ) {
+        if( errno != EINTR && errno != EAGAIN )
+            log_warning("dhcpd: recv: %m");
+        return TRUE;
+    }
+
+    dhcpd_handle(self, &req, len);
+    return TRUE;
+}
+
+/** Parse the addresses to serve and hand out
+ *
+ * @return true on success, false if ip or netmask is not valid
+ */
+static bool dhcpd_configure(dhcpd_t *self, const char *ip,
+                            const char *netmask, const char *router,
+                            const char *dns1, const char *dns2)
+{
+    struct in_addr server = { .s_addr = INADDR_ANY };
+    struct in_addr mask   = { .s_addr = INADDR_ANY };
+
+    if( !ip || inet_pton(AF_INET, ip, &server) != 1 ||
+        !netmask || inet_pton(AF_INET, netmask, &mask) != 1 ) {
+        log_err("dhcpd: invalid address %s / %s", ip ?: "-", netmask ?: "-");
+        return false;
+    }
+
+    self->server  = server;
+    self->netmask = mask;
+    self->router.s_addr = INADDR_ANY;
+    self->dns[0].s_addr = INADDR_ANY;
+    self->dns[1].s_addr = INADDR_ANY;
+
+    if( router )
+        inet_pton(AF_INET, router, &self->router);
+    if( dns1 )
+        inet_pton(AF_INET, dns1, &self->dns[0]);
+    if( dns2 )
+        inet_pton(AF_INET, dns2, &self->dns[1]);
+    if( self->dns[0].s_addr == INADDR_ANY )
+        self->dns[0] = self->dns[1], self->dns[1].s_addr = INADDR_ANY;
+
+    self->pool_base = ntohl(self->server.s_addr) & 0xffffff00;
+    return true;
+}
+
+/* ========================================================================= *
+ * External API
+ * ========================================================================= */
+
+/** Start serving addresses on the usb network interface
+ *
+ * A server that is already running is replaced.
+ *
+ * @param interface usb network interface
+ * @param ip        address of the device
+ * @param netmask   netmask to hand out
+ * @param router    router to hand out, or NULL
+ * @param dns1      primary dns to hand out, or NULL
+ * @param dns2      secondary dns to hand out, or NULL
+ *
+ * @return 0 on success, 1 on failure
+ */
+int usb_moded_dhcpd_start(const char *interface, const char *ip,
+                          const char *netmask, const char *router,
+                          const char *dns1, const char *dns2)
+{
+    dhcpd_t    *self = 0;
+    GIOChannel *chn  = 0;
+    int         one  = 1;
+    struct sockaddr_in sa = {
+        .sin_family      = AF_INET,
+        .sin_port        = htons(DHCPD_SERVER_PORT),
+        .sin_addr.s_addr = htonl(INADDR_ANY),
+    };
+
+    usb_moded_dhcpd_stop();
+
+    self = g_malloc0(sizeof *self);
+    self->fd = -1;
+    self->started = g_get_monotonic_time();
+    self->interface = g_strdup(interface);
+
+    if( !dhcpd_configure(self, ip, netmask, router, dns1, dns2) )
+        goto FAIL;
+
+    log_debug("dhcpd: serving %s on %s", ip, interface);
+
+    /* off-device only interfaces that really exist are served, for
+     * example a veth pair set up for benchmarking */
+    if( usb_moded_root_stubbed() && !if_nametoindex(interface) )
+        goto DONE;
+
+    self->fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    if( self->fd == -1 ) {
+        log_err("dhcpd: socket: %m");
+        goto FAIL;
+    }
+
+    if( setsockopt(self->fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one) == -1 ||
+        setsockopt(self->fd, SOL_SOCKET, SO_BROADCAST, &one, sizeof one) == -1 ||
+        setsockopt(self->fd, SOL_SOCKET, SO_BINDTODEVICE, interface,
+                   strlen(interface) + 1) == -1 ) {
+        log_err("dhcpd: setsockopt: %m");
+        goto FAIL;
+    }
+
+    if( bind(self->fd, (struct sockaddr *)&sa, sizeof sa) == -1 ) {
+        log_err("dhcpd: bind: %m");
+        goto FAIL;
+    }
+
+    if( !(chn = g_io_channel_unix_new(self->fd)) )
+        goto FAIL;
+    self->watch_id = g_io_add_watch(chn, G_IO_IN | G_IO_ERR | G_IO_HUP | G_IO_NVAL,
+                                    dhcpd_io_cb, self);
+    g_io_channel_unref(chn);
+    if( !self->watch_id )
+        goto FAIL;
+
+DONE:
+    dhcpd = self;
+    return 0;
+
+FAIL:
+    if( self->fd != -1 )
+        close(self->fd);
+    g_free(self->interface);
+    g_free(self);
+    return 1;
+}
+
+/** Update what the running server hands out
+ *
+ * Leases are kept as long as the address pool stays the same, so that
+ * clients can renew them. If no server is running on the interface,
+ * one is started.
+ *
+ * @param interface usb network interface
+ * @param ip        address of the device
+ * @param netmask   netmask to hand out
+ * @param router    router to hand out, or NULL
+ * @param dns1      primary dns to hand out, or NULL
+ * @param dns2      secondary dns to hand out, or NULL
+ *
+ * @return 0 on success, 1 on failure
+ */
+int usb_moded_dhcpd_update(const char *interface, const char *ip,
+                           const char *netmask, const char *router,
+                           const char *dns1, const char *dns2)
+{
+    dhcpd_t  *self = dhcpd;
+    uint32_t  pool_base;
+
+    if( !self || g_strcmp0(self->interface, interface) )
+        return usb_moded_dhcpd_start(interface, ip, netmask, router,
+                                     dns1, dns2);
+
+    pool_base = self->pool_base;
+    if( !dhcpd_configure(self, ip, netmask, router, dns1, dns2) ) {
+        usb_moded_dhcpd_stop();
+        return 1;
+    }
+
+    if( self->pool_base != pool_base ) {
+        log_debug("dhcpd: address pool moved, dropping leases");
+        memset(self->leases, 0, sizeof self->leases);
+    }
+
+    log_debug("dhcpd: now serving %s on %s", ip, interface);
+    return 0;
+}
+
+/** Stop the built-in dhcp server, if running
+ */
+void usb_moded_dhcpd_stop(void)
+{
+    dhcpd_t *self = dhcpd;
+
+    if( !self )
+        return;
+    dhcpd = 0;
+
+    log_debug("dhcpd: stopped on %s", self->interface);
+
+    if( self->watch_id )
+        g_source_remove(self->watch_id);
+    if( self->fd != -1 )
+        close(self->fd);
+    g_free(self->interface);
+    g_free(self);
+}
@@ -0,0 +1,34 @@
+/**
+  @file usb_moded-dhcpd.h
+
+  Copyright (C) 2016 Jolla. All rights reserved.
+
+  @author: Philippe De Swert <philippe.deswert@jollamobile.com>
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the Lesser GNU General Public License 
+  version 2 as published by the Free Software Foundation. 
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  General Public License for more details.
+ 
+  You should have received a copy of the Lesser GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+  02110-1301 USA
+*/
+
+#ifndef USB_MODED_DHCPD_H_
+#define USB_MODED_DHCPD_H_
+
+int  usb_moded_dhcpd_start(const char *interface, const char *ip,
+                           const char *netmask, const char *router,
+                           const char *dns1, const char *dns2);
+int  usb_moded_dhcpd_update(const char *interface, const char *ip,
+                            const char *netmask, const char *router,
+                            const char *dns1, const char *dns2);
+void usb_moded_dhcpd_stop(void);
+
+#endif /* USB_MODED_DHCPD_H_ */
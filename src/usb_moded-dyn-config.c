@@ -32,8 +32,11 @@
 
 #include "usb_moded-dyn-config.h"
 #include "usb_moded-log.h"
+#include "usb_moded-snapshot.h"
+#include "usb_moded-root.h"
 
 static struct mode_list_elem *read_mode_file(const gchar *filename);
+static gchar *list_normalize(gchar *list);
 
 void list_item_free(mode_list_elem *list_item)
 {
@@ -46,6 +49,7 @@ void list_item_free(mode_list_elem *list_item)
   free(list_item->softconnect);
   free(list_item->softconnect_disconnect);
   free(list_item->softconnect_path);
+  free(list_item->sysfs_always_write);
   free(list_item->android_extra_sysfs_path);
   free(list_item->android_extra_sysfs_value);
   free(list_item->android_extra_sysfs_path2);
@@ -56,6 +60,7 @@ void list_item_free(mode_list_elem *list_item)
   free(list_item->android_extra_sysfs_value4);
   free(list_item->idProduct);
   free(list_item->idVendorOverride);
+  free(list_item->configfs_functions);
 #ifdef CONNMAN
   free(list_item->connman_tethering);
 #endif
@@ -87,20 +92,20 @@ GList *read_mode_list(int diag)
   const gchar *dirname;
   struct mode_list_elem *list_item;
   gchar *full_filename = NULL;
+  gchar *confpath;
 
-  if(diag)
-	confdir = g_dir_open(DIAG_DIR_PATH, 0, NULL);
-  else
-	confdir = g_dir_open(MODE_DIR_PATH, 0, NULL);
+  /* use startup snapshot if there is a valid one */
+  if(usb_moded_snapshot_get_modes(&modelist))
+	return(modelist);
+
+  confpath = usb_moded_root_path(diag ? DIAG_DIR_PATH : MODE_DIR_PATH);
+  confdir = g_dir_open(confpath, 0, NULL);
   if(confdir)
   {
     while((dirname = g_dir_read_name(confdir)) != NULL)
 	{
 		log_debug("Read file %s\n", dirname);
-		if(diag)
-			full_filename = g_strconcat(DIAG_DIR_PATH, "/", dirname, NULL);
-		else
-			full_filename = g_strconcat(MODE_DIR_PATH, "/", dirname, NULL);
+		full_filename = g_strconcat(confpath, "/", dirname, NULL);
 		list_item = read_mode_file(full_filename);
 		/* free full_filename immediately as we do not use it anymore */
 		free(full_filename);
@@ -111,11 +116,39 @@ GList *read_mode_list(int diag)
   }
   else
 	  log_debug("Mode confdir open failed or file is incomplete/invalid.\n");
+  g_free(confpath);
 
   modelist = g_list_sort (modelist, compare_modes);
+  usb_moded_snapshot_add_modes(modelist);
   return(modelist);
 }
 
+/* strip whitespace around comma separated entries, dropping empty ones */
+static gchar *list_normalize(gchar *list)
+{
+  gchar **vec;
+  GString *str;
+
+  if(!list)
+	return NULL;
+
+  vec = g_strsplit(list, ",", 0);
+  str = g_string_new(NULL);
+  for(int i = 0; vec[i]; i++)
+  {
+	g_strstrip(vec[i]);
+	if(!*vec[i])
+		continue;
+	if(str->len)
+		g_string_append_c(str, ',');
+	g_string_append(str, vec[i]);
+  }
+  g_strfreev(vec);
+  g_free(list);
+
+  return g_string_free(str, FALSE);
+}
+
 static struct mode_list_elem *read_mode_file(const gchar *filename)
 {
   GKeyFile *settingsfile;
@@ -145,6 +178,7 @@ static struct mode_list_elem *read_mode_file(const gchar *filename)
   list_item->softconnect = g_key_file_get_string(settingsfile, MODE_OPTIONS_ENTRY, MODE_SOFTCONNECT, NULL);
   list_item->softconnect_disconnect = g_key_file_get_string(settingsfile, MODE_OPTIONS_ENTRY, MODE_SOFTCONNECT_DISCONNECT, NULL);
   list_item->softconnect_path = g_key_file_get_string(settingsfile, MODE_OPTIONS_ENTRY, MODE_SOFTCONNECT_PATH, NULL);
+  list_item->sysfs_always_write = list_normalize(g_key_file_get_string(settingsfile, MODE_OPTIONS_ENTRY, MODE_SYSFS_ALWAYS_WRITE, NULL));
   list_item->android_extra_sysfs_path = g_key_file_get_string(settingsfile, MODE_OPTIONS_ENTRY, MODE_ANDROID_EXTRA_SYSFS_PATH, NULL);
   list_item->android_extra_sysfs_path2 = g_key_file_get_string(settingsfile, MODE_OPTIONS_ENTRY, MODE_ANDROID_EXTRA_SYSFS_PATH2, NULL);
   list_item->android_extra_sysfs_path3 = g_key_file_get_string(settingsfile, MODE_OPTIONS_ENTRY, MODE_ANDROID_EXTRA_SYSFS_PATH3, NULL);
@@ -159,6 +193,7 @@ static struct mode_list_elem *read_mode_file(const gchar *filename)
   list_item->idVendorOverride = g_key_file_get_string(settingsfile, MODE_OPTIONS_ENTRY, MODE_IDVENDOROVERRIDE, NULL);
   list_item->nat = g_key_file_get_integer(settingsfile, MODE_OPTIONS_ENTRY, MODE_HAS_NAT, NULL);
   list_item->dhcp_server = g_key_file_get_integer(settingsfile, MODE_OPTIONS_ENTRY, MODE_HAS_DHCP_SERVER, NULL);
+  list_item->configfs_functions = g_key_file_get_string(settingsfile, MODE_CONFIGFS_ENTRY, MODE_CONFIGFS_FUNCTIONS, NULL);
 #ifdef CONNMAN
   list_item->connman_tethering = g_key_file_get_string(settingsfile, MODE_OPTIONS_ENTRY, MODE_CONNMAN_TETHERING, NULL);
 #endif
@@ -40,6 +40,8 @@
 #define MODE_SOFTCONNECT		"softconnect"
 #define MODE_SOFTCONNECT_DISCONNECT	"softconnect_disconnect"
 #define MODE_SOFTCONNECT_PATH		"softconnect_path"
+/* sysfs paths that must be written even when the value does not change */
+#define MODE_SYSFS_ALWAYS_WRITE		"sysfs_always_write"
 /* Instead of hard-coding values that never change or have only one option, 
 android engineers prefered to have sysfs entries... go figure... */
 #define MODE_ANDROID_EXTRA_SYSFS_PATH	"android_extra_sysfs_path"
@@ -56,6 +58,9 @@ android engineers prefered to have sysfs entries... go figure... */
 #define MODE_IDVENDOROVERRIDE		"idVendorOverride"
 #define MODE_HAS_NAT			"nat"
 #define MODE_HAS_DHCP_SERVER		"dhcp_server"
+/* functions linked into the configfs gadget, instead of loading a module */
+#define MODE_CONFIGFS_ENTRY		"configfs"
+#define MODE_CONFIGFS_FUNCTIONS		"functions"
 #ifdef CONNMAN
 #define MODE_CONNMAN_TETHERING		"connman_tethering"
 #endif
@@ -78,6 +83,7 @@ typedef struct mode_list_elem
   char *softconnect;			/* value to be written to softconnect interface */
   char *softconnect_disconnect;		/* value to set on the softconnect interface to disable after disconnect */
   char *softconnect_path;		/* path for the softconnect */
+  char *sysfs_always_write;		/* comma separated sysfs paths that are never skipped as unchanged */
   char *android_extra_sysfs_path;	/* path for static value that never changes that needs to be set by sysfs :( */
   char *android_extra_sysfs_value;	/* static value that never changes that needs to be set by sysfs :( */
   char *android_extra_sysfs_path2;	/* path for static value that never changes that needs to be set by sysfs :( */
@@ -90,9 +96,11 @@ typedef struct mode_list_elem
   char *idVendorOverride;		/* Temporary vendor override for special modes used by odms in testing/manufacturing */
   int nat;				/* If NAT should be set up in this mode or not */
   int dhcp_server;			/* if a DHCP server needs to be configured and started or not */
+  char *configfs_functions;		/* comma separated configfs function instances, like rndis.usb0 */
 #ifdef CONNMAN
   char* connman_tethering;		/* connman's tethering technology path */
 #endif
+  int mode_id;				/* mode registry id, assigned when the mode list is loaded */
  /*@} */
 }mode_list_elem;
 
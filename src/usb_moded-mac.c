@@ -23,6 +23,7 @@
 #include <stdio.h>
 #include "usb_moded-mac.h"
 #include "usb_moded-log.h"
+#include "usb_moded-root.h"
 
 static void random_ether_addr(unsigned char *addr)
 {
@@ -47,11 +48,14 @@ void generate_random_mac (void)
   unsigned char addr[6];
   int i;
   FILE *g_ether;
+  gchar *path;
 
   log_debug("Getting random usb ethernet mac\n");
   random_ether_addr(addr);
   
-  g_ether = fopen("/etc/modprobe.d/g_ether.conf", "w");
+  path = usb_moded_root_path("/etc/modprobe.d/g_ether.conf");
+  g_ether = fopen(path, "w");
+  g_free(path);
   if(!g_ether)	
   {
 	log_warning("Failed to write mac address to /etc/modprobe.d/g_ether.conf\n");
@@ -73,8 +77,11 @@ char * read_mac(void)
   char *mac = NULL, *ret = NULL;
   size_t read = 0;
   int test = 0;
+  gchar *path;
 
-  g_ether = fopen("/etc/modprobe.d/g_ether.conf", "r");
+  path = usb_moded_root_path("/etc/modprobe.d/g_ether.conf");
+  g_ether = fopen(path, "r");
+  g_free(path);
   if(!g_ether)
   {
 	log_warning("Failed to read mac address from /etc/modprobe.d/g_ether.conf\n");
@@ -0,0 +1,268 @@
+/**
+  @file usb_moded-modeid.c
+
+  Copyright (C) 2016 Jolla. All rights reserved.
+
+  @author: Philippe De Swert <philippe.deswert@jollamobile.com>
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the Lesser GNU General Public License 
+  version 2 as published by the Free Software Foundation. 
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  General Public License for more details.
+ 
+  You should have received a copy of the Lesser GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+  02110-1301 USA
+*/
+
+/*
+ * Mode registry: maps mode names to small integer ids and back
+ *
+ * Mode names are only needed at the D-Bus and configuration boundary,
+ * internally modes are identified by mode_id_t.
+ */
+
+#include <glib.h>
+
+#include "usb_moded-modeid.h"
+#include "usb_moded-modes.h"
+#include "usb_moded-log.h"
+
+/* ========================================================================= *
+ * State data
+ * ========================================================================= */
+
+/** Names of built-in modes, indexed by mode id */
+static const char * const mode_registry_builtin[MODE_ID_BUILTIN_COUNT] =
+{
+    [MODE_ID_UNDEFINED]          = MODE_UNDEFINED,
+    [MODE_ID_ASK]                = MODE_ASK,
+    [MODE_ID_MASS_STORAGE]       = MODE_MASS_STORAGE,
+    [MODE_ID_DEVELOPER]          = MODE_DEVELOPER,
+    [MODE_ID_MTP]                = MODE_MTP,
+    [MODE_ID_HOST]               = MODE_HOST,
+    [MODE_ID_CONNECTION_SHARING] = MODE_CONNECTION_SHARING,
+    [MODE_ID_DIAG]               = MODE_DIAG,
+    [MODE_ID_ADB]                = MODE_ADB,
+    [MODE_ID_PC_SUITE]           = MODE_PC_SUITE,
+    [MODE_ID_CHARGING]           = MODE_CHARGING,
+    [MODE_ID_CHARGING_FALLBACK]  = MODE_CHARGING_FALLBACK,
+    [MODE_ID_CHARGER]            = MODE_CHARGER,
+};
+
+/** Mode name -> mode id + 1 */
+static GHashTable *mode_registry_ids = 0;
+
+/** Mode id -> mode name */
+static GPtrArray *mode_registry_names = 0;
+
+/** Mode id -> dynamic mode data, or NULL */
+static GPtrArray *mode_registry_elems = 0;
+
+/** Mode id -> MODE_FLAG_xxx bits */
+static GArray *mode_registry_flags = 0;
+
+/* ========================================================================= *
+ * Internal helpers
+ * ========================================================================= */
+
+static mode_id_t mode_registry_add(const char *name)
+{
+    mode_id_t id = mode_registry_names->len;
+    gchar *copy = g_strdup(name);
+
+    g_ptr_array_add(mode_registry_names, copy);
+    g_ptr_array_add(mode_registry_elems, 0);
+    g_array_set_size(mode_registry_flags, id + 1);
+    g_hash_table_insert(mode_registry_ids, copy, GINT_TO_POINTER(id + 1));
+
+    if( id >= MODE_ID_BUILTIN_COUNT )
+        log_debug("mode %s registered as %d", name, id);
+
+    return id;
+}
+
+/* ========================================================================= *
+ * External API
+ * ========================================================================= */
+
+/** Create registry and add built-in modes to it
+ */
+void mode_registry_init(void)
+{
+    if( mode_registry_ids )
+        return;
+
+    mode_registry_ids   = g_hash_table_new(g_str_hash, g_str_equal);
+    mode_registry_names = g_ptr_array_new_with_free_func(g_free);
+    mode_registry_elems = g_ptr_array_new();
+    mode_registry_flags = g_array_new(FALSE, TRUE, sizeof(unsigned));
+
+    for( mode_id_t id = 0; id < MODE_ID_BUILTIN_COUNT; ++id )
+        mode_registry_add(mode_registry_builtin[id]);
+}
+
+/** Release all registry data
+ */
+void mode_registry_quit(void)
+{
+    if( mode_registry_ids )
+        g_hash_table_unref(mode_registry_ids), mode_registry_ids = 0;
+
+    if( mode_registry_names )
+        g_ptr_array_unref(mode_registry_names), mode_registry_names = 0;
+
+    if( mode_registry_elems )
+        g_ptr_array_unref(mode_registry_elems), mode_registry_elems = 0;
+
+    if( mode_registry_flags )
+        g_array_unref(mode_registry_flags), mode_registry_flags = 0;
+}
+
+/** Get id of a mode
+ *
+ * @param name mode name
+ *
+ * @return mode id, or MODE_ID_INVALID if the mode is not known
+ */
+mode_id_t mode_registry_lookup(const char *name)
+{
+    gpointer val;
+
+    if( !name )
+        return MODE_ID_INVALID;
+
+    mode_registry_init();
+
+    val = g_hash_table_lookup(mode_registry_ids, name);
+    return val ? GPOINTER_TO_INT(val) - 1 : MODE_ID_INVALID;
+}
+
+/** Get name of a mode
+ *
+ * @param id mode id
+ *
+ * @return mode name, MODE_UNDEFINED for invalid ids
+ */
+const char *mode_registry_name(mode_id_t id)
+{
+    mode_registry_init();
+
+    if( id < 0 || id >= (mode_id_t)mode_registry_names->len )
+        return MODE_UNDEFINED;
+
+    return g_ptr_array_index(mode_registry_names, id);
+}
+
+/** Get number of registered modes
+ *
+ * @return one past the largest valid mode id
+ */
+mode_id_t mode_registry_count(void)
+{
+    mode_registry_init();
+
+    return mode_registry_names->len;
+}
+
+/** Register modes from a dynamic mode list
+ *
+ * Assigns mode_id for each list element and makes the element
+ * available via mode_registry_data().
+ *
+ * @param modelist list of mode_list_elem
+ */
+void mode_registry_add_modelist(GList *modelist)
+{
+    mode_registry_init();
+
+    for( GList *iter = modelist; iter; iter = g_list_next(iter) ) {
+        struct mode_list_elem *data = iter->data;
+        mode_id_t id = mode_registry_lookup(data->mode_name);
+
+        if( id == MODE_ID_INVALID )
+            id = mode_registry_add(data->mode_name);
+
+        data->mode_id = id;
+        g_ptr_array_index(mode_registry_elems, id) = data;
+    }
+}
+
+/** Forget dynamic mode data before the mode list is released
+ *
+ * Mode ids remain valid.
+ */
+void mode_registry_forget_modelist(void)
+{
+    if( !mode_registry_elems )
+        return;
+
+    for( guint i = 0; i < mode_registry_elems->len; ++i )
+        g_ptr_array_index(mode_registry_elems, i) = 0;
+}
+
+/** Get dynamic mode data for a mode
+ *
+ * @param id mode id
+ *
+ * @return mode data, or NULL if there is no such dynamic mode
+ */
+struct mode_list_elem *mode_registry_data(mode_id_t id)
+{
+    if( !mode_registry_elems || id < 0 ||
+        id >= (mode_id_t)mode_registry_elems->len )
+        return 0;
+
+    return g_ptr_array_index(mode_registry_elems, id);
+}
+
+/** Get flag bits of a mode
+ *
+ * @param id mode id
+ *
+ * @return MODE_FLAG_xxx bits, zero for invalid ids
+ */
+unsigned mode_registry_get_flags(mode_id_t id)
+{
+    if( !mode_registry_flags || id < 0 ||
+        id >= (mode_id_t)mode_registry_flags->len )
+        return 0;
+
+    return g_array_index(mode_registry_flags, unsigned, id);
+}
+
+/** Set or clear flag bits of a mode
+ *
+ * @param id   mode id
+ * @param mask MODE_FLAG_xxx bits to change
+ * @param set  TRUE to set the bits, FALSE to clear them
+ */
+void mode_registry_set_flags(mode_id_t id, unsigned mask, gboolean set)
+{
+    if( !mode_registry_flags || id < 0 ||
+        id >= (mode_id_t)mode_registry_flags->len )
+        return;
+
+    if( set )
+        g_array_index(mode_registry_flags, unsigned, id) |= mask;
+    else
+        g_array_index(mode_registry_flags, unsigned, id) &= ~mask;
+}
+
+/** Clear flag bits from all modes
+ *
+ * @param mask MODE_FLAG_xxx bits to clear
+ */
+void mode_registry_clear_flags(unsigned mask)
+{
+    if( !mode_registry_flags )
+        return;
+
+    for( guint i = 0; i < mode_registry_flags->len; ++i )
+        g_array_index(mode_registry_flags, unsigned, i) &= ~mask;
+}
@@ -0,0 +1,81 @@
+/**
+  @file usb_moded-modeid.h
+
+  Copyright (C) 2016 Jolla. All rights reserved.
+
+  @author: Philippe De Swert <philippe.deswert@jollamobile.com>
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the Lesser GNU General Public License 
+  version 2 as published by the Free Software Foundation. 
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  General Public License for more details.
+ 
+  You should have received a copy of the Lesser GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+  02110-1301 USA
+*/
+
+#ifndef USB_MODED_MODEID_H_
+#define USB_MODED_MODEID_H_
+
+#include <glib.h>
+
+#include "usb_moded-dyn-config.h"
+
+/** Small integer identifying a mode name within usb-moded
+ *
+ * Built-in modes have fixed ids, dynamic modes get ids allocated
+ * when the mode list is loaded. Ids stay valid until exit, also over
+ * mode list reloads.
+ */
+typedef int mode_id_t;
+
+enum
+{
+    MODE_ID_INVALID = -1,
+
+    /* Built-in modes, see usb_moded-modes.h */
+    MODE_ID_UNDEFINED,
+    MODE_ID_ASK,
+    MODE_ID_MASS_STORAGE,
+    MODE_ID_DEVELOPER,
+    MODE_ID_MTP,
+    MODE_ID_HOST,
+    MODE_ID_CONNECTION_SHARING,
+    MODE_ID_DIAG,
+    MODE_ID_ADB,
+    MODE_ID_PC_SUITE,
+    MODE_ID_CHARGING,
+    MODE_ID_CHARGING_FALLBACK,
+    MODE_ID_CHARGER,
+
+    /* Ids from here on are allocated for dynamic modes */
+    MODE_ID_BUILTIN_COUNT
+};
+
+/** Mode is listed in the hidden modes setting */
+#define MODE_FLAG_HIDDEN      (1u<<0)
+/** Mode is listed in the mode whitelist setting */
+#define MODE_FLAG_WHITELISTED (1u<<1)
+
+void mode_registry_init(void);
+void mode_registry_quit(void);
+
+mode_id_t mode_registry_lookup(const char *name);
+const char *mode_registry_name(mode_id_t id);
+mode_id_t mode_registry_count(void);
+
+void mode_registry_add_modelist(GList *modelist);
+void mode_registry_forget_modelist(void);
+struct mode_list_elem *mode_registry_data(mode_id_t id);
+
+unsigned mode_registry_get_flags(mode_id_t id);
+void mode_registry_set_flags(mode_id_t id, unsigned mask, gboolean set);
+void mode_registry_clear_flags(unsigned mask);
+
+#endif /* USB_MODED_MODEID_H_ */
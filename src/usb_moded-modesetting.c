@@ -32,6 +32,7 @@
 #include <stdio.h>
 #include <stdbool.h>
 #include <sys/stat.h>
+#include <sys/inotify.h>
 #include <limits.h>
 
 #include <glib.h>
@@ -39,6 +40,7 @@
 #include "usb_moded.h"
 #include "usb_moded-modules.h"
 #include "usb_moded-modes.h"
+#include "usb_moded-modeid.h"
 #include "usb_moded-log.h"
 #include "usb_moded-dbus.h"
 #include "usb_moded-dbus-private.h"
@@ -46,62 +48,581 @@
 #include "usb_moded-config.h"
 #include "usb_moded-modesetting.h"
 #include "usb_moded-network.h"
+#include "usb_moded-netlink.h"
 #include "usb_moded-android.h"
+#include "usb_moded-transition.h"
+#include "usb_moded-trace.h"
+#include "usb_moded-root.h"
+#include "usb_moded-mount.h"
+#include "usb_moded-configfs.h"
+#ifdef CONNMAN
+#include "usb_moded-connman.h"
+#endif
 
 
 static char *read_from_file(const char *path, size_t maxsize);
 
 static GHashTable *tracked_values = 0;
 
+/* paths whose content was found to differ from tracked_values */
+static GHashTable *drifted_values = 0;
+
+/* change notification set up for a tracked path */
+typedef struct sysfs_watch_t
+{
+    gchar *path;    /* tracked path */
+    int    wd;      /* inotify watch descriptor, or -1 */
+    int    fd;      /* read only fd for POLLPRI notifications, or -1 */
+    guint  pri_id;  /* io watch for POLLPRI notifications */
+    bool   notify;  /* sysfs_notify() has been seen for the path */
+    bool   written; /* IN_MODIFY from our own write is still due */
+} sysfs_watch_t;
+
+/* tracked path -> sysfs_watch_t, for paths that have change notification */
+static GHashTable *sysfs_watches = 0;
+
+/* inotify instance shared by all watched paths */
+static int   sysfs_inotify_fd = -1;
+static guint sysfs_inotify_id = 0;
+
+/* paths not known to signal kernel side changes are rescanned at most
+ * this often */
+#define SYSFS_RESCAN_INTERVAL (30 * G_USEC_PER_SEC)
+static gint64 sysfs_rescan_time = 0;
+
+/* drift detection statistics */
+static unsigned sysfs_stat_events  = 0; /* change notifications handled */
+static unsigned sysfs_stat_rescans = 0; /* paths checked by rescan */
+
+/* open attribute file kept for repeated writes */
+typedef struct sysfs_handle_t
+{
+    int    fd;          /* write only fd, or -1 */
+    gchar *value;       /* last value known to be in the file, or NULL */
+    bool   unreadable;  /* reading previous value is known to fail */
+} sysfs_handle_t;
+
+/* attribute path -> sysfs_handle_t */
+static GHashTable *sysfs_handles = 0;
+
+/* upper limit for fds kept open by the handle cache */
+#define SYSFS_HANDLES_MAX 32
+
+/* mass storage blockers already reported during the current activation,
+ * as "<name> <pid>" strings */
+static GHashTable *reported_holders = 0;
+
+/* handle cache statistics */
+static unsigned sysfs_stat_writes   = 0; /* write_to_file() calls */
+static unsigned sysfs_stat_hits     = 0; /* handle found in cache */
+static unsigned sysfs_stat_misses   = 0; /* handle not in cache */
+static unsigned sysfs_stat_opens    = 0; /* open() calls made */
+static unsigned sysfs_stat_reopens  = 0; /* reopens after ENODEV/ESTALE */
+static unsigned sysfs_stat_reads    = 0; /* previous value read from file */
+static unsigned sysfs_stat_uncached = 0; /* writes with cache full */
+static unsigned sysfs_stat_elided   = 0; /* writes skipped as unchanged */
+
+static void sysfs_handle_free(gpointer aptr)
+{
+    sysfs_handle_t *handle = aptr;
+
+    if( handle->fd != -1 )
+        close(handle->fd);
+    g_free(handle->value);
+    g_free(handle);
+}
+
+static void sysfs_handle_set_value(sysfs_handle_t *handle, const char *text)
+{
+    gchar *prev = handle->value;
+
+    handle->value = g_strdup(text);
+    g_free(prev);
+}
+
+static bool sysfs_handle_open(sysfs_handle_t *handle, const char *path)
+{
+    gchar *real = usb_moded_root_path(path);
+
+    if( handle->fd != -1 )
+        close(handle->fd);
+
+    ++sysfs_stat_opens;
+
+    /* no O_CREAT -> writes only to already existing files */
+    handle->fd = TEMP_FAILURE_RETRY(open(real, O_WRONLY | O_CLOEXEC));
+    if( handle->fd == -1 )
+        log_warning("open(%s): %m", path);
+    g_free(real);
+
+    return handle->fd != -1;
+}
+
+/* get cached handle for path, or a temporary one if the cache is full */
+static sysfs_handle_t *sysfs_handle_get(const char *path, bool *cached)
+{
+    sysfs_handle_t *handle = 0;
+
+    *cached = false;
+
+    if( sysfs_handles && (handle = g_hash_table_lookup(sysfs_handles, path)) )
+    {
+        ++sysfs_stat_hits;
+        *cached = true;
+        return handle;
+    }
+
+    ++sysfs_stat_misses;
+    handle = g_malloc0(sizeof *handle);
+    handle->fd = -1;
+
+    if( sysfs_handles && g_hash_table_size(sysfs_handles) < SYSFS_HANDLES_MAX )
+    {
+        g_hash_table_replace(sysfs_handles, g_strdup(path), handle);
+        *cached = true;
+    }
+    else
+    {
+        ++sysfs_stat_uncached;
+    }
+
+    return handle;
+}
+
+/* update last known value after it has been read from the file */
+static void sysfs_handle_note_value(const char *path, const char *text)
+{
+    sysfs_handle_t *handle;
+
+    if( sysfs_handles && (handle = g_hash_table_lookup(sysfs_handles, path)) )
+        sysfs_handle_set_value(handle, text);
+}
+
+/** Log sysfs handle cache statistics
+ *
+ * The totals are logged, and what changed since the previous call is
+ * added to the transition trace.
+ */
+void usb_moded_mode_sysfs_stats(void)
+{
+    static unsigned prev_hits, prev_misses, prev_uncached, prev_elided;
+    static unsigned prev_opens;
+
+    usb_moded_trace_mark(TRACE_SYSFS_STATS,
+                         "%u hits, %u misses, %u uncached, %u elided,"
+                         " %u opens, %u handles",
+                         sysfs_stat_hits - prev_hits,
+                         sysfs_stat_misses - prev_misses,
+                         sysfs_stat_uncached - prev_uncached,
+                         sysfs_stat_elided - prev_elided,
+                         sysfs_stat_opens - prev_opens,
+                         sysfs_handles ? g_hash_table_size(sysfs_handles) : 0);
+    prev_hits     = sysfs_stat_hits;
+    prev_misses   = sysfs_stat_misses;
+    prev_uncached = sysfs_stat_uncached;
+    prev_elided   = sysfs_stat_elided;
+    prev_opens    = sysfs_stat_opens;
+
+    log_debug("sysfs cache: %u writes, %u hits, %u misses, %u elided,"
+              " %u opens (%u reopens), %u reads, %u uncached, %u handles",
+              sysfs_stat_writes, sysfs_stat_hits, sysfs_stat_misses,
+              sysfs_stat_elided, sysfs_stat_opens,
+              sysfs_stat_reopens, sysfs_stat_reads, sysfs_stat_uncached,
+              sysfs_handles ? g_hash_table_size(sysfs_handles) : 0);
+    log_debug("sysfs drift: %u events, %u rescanned, %u watched of %u tracked",
+              sysfs_stat_events, sysfs_stat_rescans,
+              sysfs_watches ? g_hash_table_size(sysfs_watches) : 0,
+              tracked_values ? g_hash_table_size(tracked_values) : 0);
+}
+
+static void sysfs_mark_drifted(const char *path, bool drifted)
+{
+    if( !drifted_values )
+        return;
+
+    if( drifted )
+        g_hash_table_replace(drifted_values, g_strdup(path), GINT_TO_POINTER(1));
+    else
+        g_hash_table_remove(drifted_values, path);
+}
+
+/** Forget assumptions about sysfs content
+ *
+ * Called when something outside usb_moded's control, like a gadget
+ * module getting loaded or unloaded, might have reset sysfs values.
+ * The next write to each tracked path is then done unconditionally.
+ */
+void usb_moded_mode_values_drifted(void)
+{
+    GHashTableIter iter;
+    gpointer key;
+
+    if( !tracked_values )
+        return;
+
+    g_hash_table_iter_init(&iter, tracked_values);
+    while( g_hash_table_iter_next(&iter, &key, 0) )
+        sysfs_mark_drifted(key, true);
+}
+
+/* check if path is on the always write list of a mode
+ *
+ * The list has been stripped of whitespace when the mode was loaded.
+ */
+static bool sysfs_always_write(const struct mode_list_elem *data,
+                               const char *path)
+{
+    const char *list = data ? data->sysfs_always_write : 0;
+    size_t len = strlen(path);
+
+    while( list && *list )
+    {
+        const char *end = strchrnul(list, ',');
+
+        if( (size_t)(end - list) == len && !strncmp(list, path, len) )
+            return true;
+        list = *end ? end + 1 : end;
+    }
+    return false;
+}
+
+/* check if writing text to path would not change anything */
+static bool sysfs_write_redundant(const char *path, const char *text)
+{
+    const char *curr;
+
+    if( !tracked_values || !(curr = g_hash_table_lookup(tracked_values, path)) )
+        return false;
+
+    if( strcmp(curr, text) )
+        return false;
+
+    if( drifted_values && g_hash_table_lookup(drifted_values, path) )
+        return false;
+
+    return !sysfs_always_write(get_usb_mode_data(), path);
+}
+
+static void sysfs_watch_remove(const char *path);
+static void sysfs_watch_add(const char *path);
+
 static void usb_moded_mode_track_value(const char *path, const char *text)
 {
     if( !tracked_values || !path )
         goto EXIT;
 
-    if( text )
+    if( text ) {
         g_hash_table_replace(tracked_values, g_strdup(path), g_strdup(text));
-    else
+        sysfs_watch_add(path);
+    }
+    else {
         g_hash_table_remove(tracked_values, path);
+        sysfs_watch_remove(path);
+    }
 
 EXIT:
     return;
 }
 
+/* check if two values are the same hexadecimal number written in
+ * different case, like 0A02 in a config file and 0a02 from the kernel */
+static bool sysfs_hex_case_equal(const char *a, const char *b)
+{
+    if( !a || !b || !*a || g_ascii_strcasecmp(a, b) )
+        return false;
+
+    if( !g_ascii_strncasecmp(a, "0x", 2) )
+        a += 2;
+    for( ; *a; ++a ) {
+        if( !g_ascii_isxdigit(*a) )
+            return false;
+    }
+    return true;
+}
+
+/* compare tracked value against file content, raise drift if they differ */
+static void sysfs_verify_path(const char *path)
+{
+    const char *text;
+    char *curr;
+
+    if( !tracked_values || !(text = g_hash_table_lookup(tracked_values, path)) )
+        return;
+
+    curr = read_from_file(path, 0x1000);
+
+    /* There might be case mismatch between hexadecimal
+     * values used in configuration files vs what we get
+     * back when reading from kernel interfaces. That is
+     * not a change, and keeping the configured value
+     * lets the next write of it be skipped. */
+    if( g_strcmp0(text, curr) && sysfs_hex_case_equal(text, curr) ) {
+        log_debug("'%s' : '%s' reads back as '%s' (case diff only)", path,
+                  text, curr);
+    }
+    else if( g_strcmp0(text, curr) ) {
+        log_warning("unexpected change '%s' : '%s' -> '%s'", path,
+                    text, curr ?: "???");
+        sysfs_handle_note_value(path, curr);
+        sysfs_mark_drifted(path, true);
+        /* note: invalidates text */
+        usb_moded_mode_track_value(path, curr);
+    }
+
+    free(curr);
+}
+
+static void sysfs_watch_free(gpointer aptr)
+{
+    sysfs_watch_t *watch = aptr;
+
+    if( watch->wd != -1 && sysfs_inotify_fd != -1 )
+        inotify_rm_watch(sysfs_inotify_fd, watch->wd);
+    if( watch->pri_id )
+        g_source_remove(watch->pri_id);
+    if( watch->fd != -1 )
+        close(watch->fd);
+    g_free(watch->path);
+    g_free(watch);
+}
+
+/* read attribute to (re)arm POLLPRI notification */
+static bool sysfs_watch_arm(sysfs_watch_t *watch)
+{
+    char buf[256];
+
+    if( lseek(watch->fd, 0, SEEK_SET) == -1 )
+        return false;
+
+    return TEMP_FAILURE_RETRY(read(watch->fd, buf, sizeof buf)) != -1;
+}
+
+/* attribute signalled change via sysfs_notify() */
+static gboolean sysfs_watch_pri_cb(GIOChannel *channel, GIOCondition condition,
+                                   gpointer aptr)
+{
+    sysfs_watch_t *watch = aptr;
+    gchar *path = g_strdup(watch->path);
+    gboolean keep_watch = TRUE;
+
+    (void)channel;
+    (void)condition;
+
+    /* POLLERR is reported together with POLLPRI, a read failure
+     * tells apart the attribute going away */
+    if( !sysfs_watch_arm(watch) ) {
+        watch->pri_id = 0;
+        watch->notify = false;
+        close(watch->fd), watch->fd = -1;
+        keep_watch = FALSE;
+        /* note: invalidates watch */
+        if( watch->wd == -1 )
+            sysfs_watch_remove(path);
+    }
+    else {
+        /* only the kernel raises POLLPRI, so changes it makes
+         * to this attribute do not need rescanning */
+        watch->notify = true;
+    }
+
+    ++sysfs_stat_events;
+    sysfs_verify_path(path);
+    g_free(path);
+
+    return keep_watch;
+}
+
+/* set up change notification for a tracked path */
+static void sysfs_watch_add(const char *path)
+{
+    gchar *real = 0;
+    sysfs_watch_t *watch;
+    GIOChannel *chn;
+
+    if( !sysfs_watches || g_hash_table_lookup(sysfs_watches, path) )
+        return;
+
+    real = usb_moded_root_path(path);
+
+    watch = g_malloc0(sizeof *watch);
+    watch->path = g_strdup(path);
+    watch->wd = -1;
+    watch->fd = -1;
+
+    /* catches writes made by other processes, and on newer kernels
+     * also sysfs_notify() */
+    if( sysfs_inotify_fd != -1 )
+        watch->wd = inotify_add_watch(sysfs_inotify_fd, real, IN_MODIFY);
+
+    /* catches sysfs_notify() on kernels where inotify does not */
+    if( g_str_has_prefix(path, "/sys/") &&
+        (watch->fd = open(real, O_RDONLY | O_CLOEXEC)) != -1 ) {
+        if( sysfs_watch_arm(watch) && (chn = g_io_channel_unix_new(watch->fd)) ) {
+            watch->pri_id = g_io_add_watch(chn, G_IO_PRI | G_IO_ERR,
+                                           sysfs_watch_pri_cb, watch);
+            g_io_channel_unref(chn);
+        }
+        if( !watch->pri_id )
+            close(watch->fd), watch->fd = -1;
+    }
+
+    if( watch->wd == -1 && !watch->pri_id ) {
+        /* left for rescan */
+        log_debug("%s: no change notification", path);
+        sysfs_watch_free(watch);
+        goto EXIT;
+    }
+
+    g_hash_table_replace(sysfs_watches, watch->path, watch);
+
+EXIT:
+    g_free(real);
+}
+
+static void sysfs_watch_remove(const char *path)
+{
+    if( sysfs_watches )
+        g_hash_table_remove(sysfs_watches, path);
+}
+
+/* find path watched with inotify watch descriptor */
+static gchar *sysfs_watch_path(int wd)
+{
+    GHashTableIter iter;
+    gpointer value;
+
+    g_hash_table_iter_init(&iter, sysfs_watches);
+    while( g_hash_table_iter_next(&iter, 0, &value) ) {
+        sysfs_watch_t *watch = value;
+        if( watch->wd == wd )
+            return g_strdup(watch->path);
+    }
+    return 0;
+}
+
+/* note that we wrote to a watched path
+ *
+ * Identical queued inotify events get merged, so one note covers any
+ * number of writes made before the event is read.
+ */
+static void sysfs_watch_mark_written(const char *path)
+{
+    sysfs_watch_t *watch;
+
+    if( sysfs_watches && (watch = g_hash_table_lookup(sysfs_watches, path)) )
+        watch->written = (watch->wd != -1);
+}
+
+/* check if IN_MODIFY was caused by our own write, consuming the note */
+static bool sysfs_watch_own_write(const char *path)
+{
+    sysfs_watch_t *watch;
+    bool written;
+
+    if( !sysfs_watches || !(watch = g_hash_table_lookup(sysfs_watches, path)) )
+        return false;
+
+    written = watch->written;
+    watch->written = false;
+    return written;
+}
+
+/* handle inotify events for tracked paths */
+static gboolean sysfs_inotify_cb(GIOChannel *channel, GIOCondition condition,
+                                 gpointer aptr)
+{
+    char buf[sizeof(struct inotify_event) + 256]
+        __attribute__((aligned(__alignof__(struct inotify_event))));
+    gboolean keep_watch = FALSE;
+    int rc;
+
+    (void)channel;
+    (void)aptr;
+
+    if( condition & (G_IO_ERR | G_IO_HUP | G_IO_NVAL) )
+        goto EXIT;
+
+    if( (rc = read(sysfs_inotify_fd, buf, sizeof buf)) == -1 ) {
+        if( errno == EINTR || errno == EAGAIN )
+            keep_watch = TRUE;
+        else
+            log_warning("sysfs watch: read: %m");
+        goto EXIT;
+    }
+
+    for( int pos = 0; pos + (int)sizeof(struct inotify_event) <= rc; ) {
+        struct inotify_event *eve = (struct inotify_event *)(buf + pos);
+        gchar *path = sysfs_watch_path(eve->wd);
+
+        pos += sizeof *eve + eve->len;
+
+        if( !path )
+            continue;
+
+        if( eve->mask & IN_IGNORED ) {
+            /* attribute is gone, and with it the watch */
+            sysfs_watch_t *watch = g_hash_table_lookup(sysfs_watches, path);
+            watch->wd = -1;
+            if( !watch->pri_id )
+                sysfs_watch_remove(path);
+        }
+        else if( sysfs_watch_own_write(path) ) {
+            g_free(path);
+            continue;
+        }
+
+        ++sysfs_stat_events;
+        sysfs_verify_path(path);
+        g_free(path);
+    }
+
+    keep_watch = TRUE;
+
+EXIT:
+    if( !keep_watch ) {
+        log_warning("sysfs watch disabled; changes found by rescan only");
+        sysfs_inotify_id = 0;
+    }
+    return keep_watch;
+}
+
+/** Look for tracked sysfs values that have changed
+ *
+ * Paths with change notification are verified as soon as the change
+ * is signalled. But IN_MODIFY only covers writes from user space, and
+ * an armed POLLPRI watch does not prove the driver ever calls
+ * sysfs_notify(). So everything is rescanned except paths that have
+ * been seen to raise POLLPRI. This is rate limited as it is called
+ * from the dsme heartbeat.
+ */
 void usb_moded_mode_verify_values(void)
 {
     GHashTableIter iter;
-    gpointer key, value;
+    gpointer key;
+    GSList *todo = 0;
+    gint64 now = g_get_monotonic_time();
 
-    if( !tracked_values )
+    if( !tracked_values || now < sysfs_rescan_time )
         goto EXIT;
 
+    sysfs_rescan_time = now + SYSFS_RESCAN_INTERVAL;
+
+    /* verifying can modify tracked_values, collect paths first */
     g_hash_table_iter_init(&iter, tracked_values);
-    while( g_hash_table_iter_next(&iter, &key, &value) )
-    {
-        const char *path = key;
-        const char *text = value;
-
-        char *curr = read_from_file(path, 0x1000);
-
-        if( g_strcmp0(text, curr) ) {
-            /* There might be case mismatch between hexadecimal
-             * values used in configuration files vs what we get
-             * back when reading from kernel interfaces. */
-            if( text && curr && !g_ascii_strcasecmp(text, curr) ) {
-                log_debug("unexpected change '%s' : '%s' -> '%s' (case diff only)", path,
-                          text ?: "???",
-                          curr ?: "???");
-            }
-            else {
-                log_warning("unexpected change '%s' : '%s' -> '%s'", path,
-                            text ?: "???",
-                            curr ?: "???");
-            }
-            usb_moded_mode_track_value(path, curr);
-        }
+    while( g_hash_table_iter_next(&iter, &key, 0) ) {
+        sysfs_watch_t *watch = 0;
+
+        if( sysfs_watches )
+            watch = g_hash_table_lookup(sysfs_watches, key);
+        if( !watch || !watch->notify )
+            todo = g_slist_prepend(todo, g_strdup(key));
+    }
 
-        free(curr);
+    for( GSList *item = todo; item; item = item->next ) {
+        ++sysfs_stat_rescans;
+        sysfs_verify_path(item->data);
     }
+    g_slist_free_full(todo, g_free);
 
 EXIT:
     return;
@@ -109,6 +630,9 @@ EXIT:
 
 static void report_mass_storage_blocker(const char *mountpoint, int try);
 static guint delayed_network = 0;
+/* mode waiting for its network interface to appear, and since when */
+static struct mode_list_elem *network_wait_data = 0;
+static gint64 network_wait_started = 0;
 
 static char *strip(char *str)
 {
@@ -134,8 +658,9 @@ static char *read_from_file(const char *path, size_t maxsize)
   ssize_t  done = 0;
   char    *data = 0;
   char    *text = 0;
+  gchar   *real = usb_moded_root_path(path);
 
-  if((fd = open(path, O_RDONLY)) == -1)
+  if((fd = open(real, O_RDONLY)) == -1)
   {
     /* Silently ignore things that could result
      * from missing / read-only files */
@@ -158,6 +683,7 @@ static char *read_from_file(const char *path, size_t maxsize)
   strip(text);
 
 cleanup:
+  g_free(real);
   free(data);
   if(fd != -1) close(fd);
   return text;
@@ -167,10 +693,14 @@ int write_to_file_real(const char *file, int line, const char *func,
                        const char *path, const char *text)
 {
   int err = -1;
-  int fd = -1;
   size_t todo = 0;
+  size_t done = 0;
   char *prev = 0;
   bool  clear = false;
+  bool  cached = false;
+  bool  reopened = false;
+  sysfs_handle_t *handle = 0;
+  gint64 start = usb_moded_trace_now();
 
   /* if either path or the text to be written are not there
      we return an error */
@@ -195,9 +725,36 @@ int write_to_file_real(const char *file, int line, const char *func,
     }
   }
 
+  /* Writes that would not change anything are skipped, as some of
+   * them make the gadget re-enumerate. */
+  if( sysfs_write_redundant(path, clear ? "" : text) )
+  {
+    ++sysfs_stat_elided;
+    log_debug("%s:%d: %s(): SKIP '%s' : '%s' (unchanged)",
+              file, line, func, path, text);
+    usb_moded_trace_span(TRACE_SYSFS_WRITE, start, "%s elided", path);
+    return 0;
+  }
+
+  handle = sysfs_handle_get(path, &cached);
+  ++sysfs_stat_writes;
+
+  /* The previous value is read from the file only once, after
+   * that the value we last wrote is assumed to be there. */
+  if( handle->value )
+  {
+    prev = strdup(handle->value);
+  }
+  else if( !handle->unreadable )
+  {
+    ++sysfs_stat_reads;
+    if( !(prev = read_from_file(path, 0x1000)) )
+      handle->unreadable = true;
+  }
+
   /* If the file can be read, it also means we can later check that
    * the file retains the value we are about to write here. */
-  if( (prev = read_from_file(path, 0x1000)) )
+  if( prev )
         usb_moded_mode_track_value(path, clear ? "" : text);
 
   log_debug("%s:%d: %s(): WRITE '%s' : '%s' --> '%s'",
@@ -206,16 +763,23 @@ int write_to_file_real(const char *file, int line, const char *func,
 
   todo  = strlen(text);
 
-  /* no O_CREAT -> writes only to already existing files */
-  if( (fd = TEMP_FAILURE_RETRY(open(path, O_WRONLY))) == -1 )
-  {
-    log_warning("open(%s): %m", path);
+  if( handle->fd == -1 && !sysfs_handle_open(handle, path) )
     goto cleanup;
-  }
 
   while( todo > 0 )
   {
-    ssize_t n = TEMP_FAILURE_RETRY(write(fd, text, todo));
+    ssize_t n = TEMP_FAILURE_RETRY(pwrite(handle->fd, text + done, todo, done));
+    if( n < 0 && (errno == ENODEV || errno == ESTALE) && !reopened )
+    {
+      /* The attribute was removed while we kept it open, e.g.
+       * the gadget was re-created; try once with a fresh fd. */
+      log_debug("write(%s): %m; reopening", path);
+      reopened = true;
+      ++sysfs_stat_reopens;
+      if( !sysfs_handle_open(handle, path) )
+        goto cleanup;
+      continue;
+    }
     if( n < 0 )
     {
         if( clear && errno == EINVAL )
@@ -225,150 +789,269 @@ int write_to_file_real(const char *file, int line, const char *func,
       goto cleanup;
     }
     todo -= n;
-    text += n;
+    done += n;
   }
 
   err = 0;
 
 cleanup:
 
-  if( fd != -1 ) TEMP_FAILURE_RETRY(close(fd));
+  /* a failed write leaves the file in unknown state */
+  sysfs_mark_drifted(path, err && !clear);
+
+  /* the IN_MODIFY our write causes does not need verifying */
+  if( done > 0 )
+    sysfs_watch_mark_written(path);
+
+  /* remember what should be in the file now, if it can be read back */
+  if( handle && !handle->unreadable )
+    sysfs_handle_set_value(handle, clear ? "" : err ? NULL : text);
+
+  if( handle && !cached )
+    sysfs_handle_free(handle);
 
   free(prev);
 
+  usb_moded_trace_span(TRACE_SYSFS_WRITE, start, "%s%s", path,
+                       err ? " failed" : "");
+
   return err;
 }
 
+/* stop waiting for the network interface of the mode */
+static void network_wait_stop(void)
+{
+	usb_moded_netlink_link_watch_stop();
+	if(delayed_network)
+	{
+		g_source_remove(delayed_network);
+		delayed_network = 0;
+	}
+	network_wait_data = 0;
+}
+
+/* the network interface appeared, bring the network up right away */
+static void network_link_cb(const char *ifname, unsigned flags)
+{
+	int ret;
+
+	if(!network_wait_data || !usb_network_is_interface(network_wait_data, ifname))
+		return;
+
+	log_debug("interface %s appeared, flags 0x%x\n", ifname, flags);
+	ret = usb_network_up(network_wait_data);
+	usb_moded_trace_span(TRACE_NETWORK_UP, network_wait_started,
+			     "link %s appeared: %d", ifname, ret);
+
+	/* bringing the link up generates notifications of its own, so
+	   do not retry from here but leave a failure to the timer */
+	usb_moded_netlink_link_watch_stop();
+	if(ret == 0)
+		network_wait_stop();
+}
+
+/* safety net in case the link notification never arrives */
 static gboolean network_retry(gpointer data)
 {
 	delayed_network = 0;
-	usb_network_up(data);
+	network_wait_stop();
+	usb_moded_trace_mark(TRACE_NETWORK_UP, "retry: %d", usb_network_up(data));
 	return(FALSE);
 }
 
+/* state of a mass storage mode activation in progress */
+typedef struct mass_storage_ctx_t
+{
+	struct mode_list_elem *data;	/* mode being activated */
+	char *mount;			/* comma separated list of mountpoints */
+	gchar **mounts;			/* split mountpoint list */
+	int fua;			/* value for nofua */
+	int next;			/* index of the next mountpoint to umount */
+	int try;			/* umount retries done so far */
+} mass_storage_ctx_t;
+
+/* umount retries before giving up, delays double from the first one */
+#define MASS_STORAGE_UMOUNT_TRIES	4
+#define MASS_STORAGE_UMOUNT_DELAY	200
+
+/* activation waiting for an umount retry, if any */
+static mass_storage_ctx_t *mass_storage_waiting = 0;
+
+static void mass_storage_ctx_free(gpointer aptr)
+{
+	mass_storage_ctx_t *ctx = aptr;
+
+	if(mass_storage_waiting == ctx)
+		mass_storage_waiting = 0;
+	usb_moded_mount_watch_stop();
+	g_strfreev(ctx->mounts);
+	g_free(ctx->mount);
+	g_free(ctx);
+}
+
+/* retry umount right away when the mountpoint being waited on goes away,
+   other changes in the mount table do not use up retries */
+static void mass_storage_mounts_changed(void)
+{
+	mass_storage_ctx_t *ctx = mass_storage_waiting;
+
+	if(!ctx || usb_moded_mount_is_mounted(ctx->mounts[ctx->next]))
+		return;
+
+	log_debug("%s got unmounted, continuing\n", ctx->mounts[ctx->next]);
+	usb_moded_transition_flush(TRANSITION_UMOUNT_RETRY);
+}
+
+/* export the mountpoints once umounting is done */
+static void set_mass_storage_export(gpointer aptr)
+{
+	mass_storage_ctx_t *ctx = aptr;
+	char command2[256];
+	int i;
+
+	for(i=0 ; ctx->mounts[i] != NULL; i++)
+	{
+		if(strcmp(ctx->data->mode_module, MODULE_NONE))
+		{
+			sprintf(command2, "echo %i  > /sys/devices/platform/musb_hdrc/gadget/gadget-lun%d/nofua", ctx->fua, i);
+			log_debug("usb lun = %s active\n", command2);
+			usb_moded_system(command2);
+			sprintf(command2, "/sys/devices/platform/musb_hdrc/gadget/gadget-lun%d/file", i);
+			log_debug("usb lun = %s active\n", command2);
+			write_to_file(command2, ctx->mounts[i]);
+		}
+		else
+		{
+			write_to_file("/sys/class/android_usb/android0/enable", "0");
+			write_to_file("/sys/class/android_usb/android0/functions", "mass_storage");
+			//write_to_file("/sys/class/android_usb/f_mass_storage/lun/nofua", fua);
+			write_to_file("/sys/class/android_usb/f_mass_storage/lun/file", ctx->mount);
+			write_to_file("/sys/class/android_usb/android0/enable", "1");
+		}
+	}
+
+	usb_moded_trace_mark(TRACE_ENUMERATION, "luns: %d", i);
+
+	/* only send data in use signal in case we actually succeed */
+	usb_moded_send_signal(DATA_IN_USE);
+
+	mass_storage_ctx_free(ctx);
+}
+
+/* umount the mountpoints, retrying from a transition step on failure */
+static void set_mass_storage_umount(gpointer aptr)
+{
+	mass_storage_ctx_t *ctx = aptr;
+	guint delay;
+
+	mass_storage_waiting = 0;
+
+	for( ; ctx->mounts[ctx->next] != NULL; ctx->next++)
+	{
+		/* no check for / needed as that will fail to umount anyway */
+		if(!usb_moded_mount_is_mounted(ctx->mounts[ctx->next]))
+			continue;
+		if(!usb_moded_mount_umount(ctx->mounts[ctx->next]))
+			continue;
+
+		if(++ctx->try < MASS_STORAGE_UMOUNT_TRIES)
+		{
+			/* back off, but retry as soon as the blocker lets go
+			 * and the mountpoint gets unmounted */
+			delay = MASS_STORAGE_UMOUNT_DELAY << (ctx->try - 1);
+			log_err("Umount failed. Retrying in %u ms\n", delay);
+			report_mass_storage_blocker(ctx->mounts[ctx->next], 1);
+			usb_moded_transition_schedule(TRANSITION_UMOUNT_RETRY, delay,
+						      set_mass_storage_umount, ctx,
+						      mass_storage_ctx_free);
+			mass_storage_waiting = ctx;
+			usb_moded_mount_watch_start(mass_storage_mounts_changed);
+			return;
+		}
+
+		log_err("Unmounting %s failed\n", ctx->mount);
+		report_mass_storage_blocker(ctx->mounts[ctx->next], 2);
+		usb_moded_send_error_signal(UMOUNT_ERROR);
+		mass_storage_ctx_free(ctx);
+		/* the mode has already been reported as set, tear it down
+		   the same way as on disconnect */
+		usb_moded_mode_cleanup(get_usb_module());
+		usb_moded_module_cleanup(get_usb_module());
+		set_usb_mode_id(MODE_ID_UNDEFINED);
+		return;
+	}
+
+	/* activate mounts after waiting 1s to be sure enumeration happened and autoplay will work in windows*/
+	usb_moded_transition_schedule(TRANSITION_LUN_SETTLE, 1000,
+				      set_mass_storage_export, ctx,
+				      mass_storage_ctx_free);
+}
+
+/* start mass storage mode activation
+ *
+ * Umounting and exporting the mountpoints continue asynchronously
+ * from transition steps.
+ */
 static int set_mass_storage_mode(struct mode_list_elem *data)
 {
-        gchar *command;
-        char command2[256], *real_path = NULL, *mountpath;
+        char command2[256];
         char *mount;
-        gchar **mounts;
-        int ret = 0, i = 0, mountpoints = 0, fua = 0, try = 0;
+        mass_storage_ctx_t *ctx;
+        int ret = 0, mountpoints = 0, fua = 0;
 
         /* send unmount signal so applications can release their grasp on the fs, do this here so they have time to act */
         usb_moded_send_signal(USB_PRE_UNMOUNT);
         fua = find_sync();
         mount = find_mounts();
-        if(mount)
+        if(!mount)
         {
-        	mounts = g_strsplit(mount, ",", 0);
-             	/* check amount of mountpoints */
-                for(i=0 ; mounts[i] != NULL; i++)
-                {
-                	mountpoints++;
-                }
+                usb_moded_send_signal(DATA_IN_USE);
+                return(0);
+        }
+
+        /* a new activation reports blockers afresh */
+        if(reported_holders)
+                g_hash_table_remove_all(reported_holders);
+
+        ctx = g_malloc0(sizeof *ctx);
+        ctx->data = data;
+        ctx->fua = fua;
+        ctx->mount = mount;
+        ctx->mounts = g_strsplit(mount, ",", 0);
 
-		if(strcmp(data->mode_module, MODULE_NONE))
+        /* check amount of mountpoints */
+        mountpoints = g_strv_length(ctx->mounts);
+
+	if(strcmp(data->mode_module, MODULE_NONE))
+	{
+		/* check if the file storage module has been loaded with sufficient luns in the parameter,
+		if not, unload and reload or load it. Since  mountpoints start at 0 the amount of them is one more than their id */
+		sprintf(command2, "/sys/devices/platform/musb_hdrc/gadget/gadget-lun%d/file", (mountpoints - 1) );
+		if(access(command2, R_OK) == -1)
 		{
-			/* check if the file storage module has been loaded with sufficient luns in the parameter,
-			if not, unload and reload or load it. Since  mountpoints start at 0 the amount of them is one more than their id */
-			sprintf(command2, "/sys/devices/platform/musb_hdrc/gadget/gadget-lun%d/file", (mountpoints - 1) );
-			if(access(command2, R_OK) == -1)
+			log_debug("%s does not exist, unloading and reloading mass_storage\n", command2);
+			usb_moded_unload_module(MODULE_MASS_STORAGE);
+			sprintf(command2, "modprobe %s luns=%d \n", MODULE_MASS_STORAGE, mountpoints);
+			log_debug("usb-load command = %s \n", command2);
+			ret = usb_moded_system(command2);
+			if(ret)
 			{
-				log_debug("%s does not exist, unloading and reloading mass_storage\n", command2);
-				usb_moded_unload_module(MODULE_MASS_STORAGE);
-				sprintf(command2, "modprobe %s luns=%d \n", MODULE_MASS_STORAGE, mountpoints);
-				log_debug("usb-load command = %s \n", command2);
-				ret = usb_moded_system(command2);
-				if(ret)
-					return(ret);
+				mass_storage_ctx_free(ctx);
+				return(ret);
 			}
 		}
-                /* umount filesystems */
-                for(i=0 ; mounts[i] != NULL; i++)
-                {
-                	/* check if filesystem is mounted or not, if ret = 1 it is already unmounted */
-			real_path = realpath(mounts[i], NULL);
-			if(real_path)
-				mountpath = real_path;
-			else
-				mountpath = mounts[i];
-umount:                 command = g_strconcat("mount | grep ", mountpath, NULL);
-                        ret = usb_moded_system(command);
-                        g_free(command);
-                        if(!ret)
-                        {
-				/* no check for / needed as that will fail to umount anyway */
-				command = g_strconcat("umount ", mountpath, NULL);
-                                log_debug("unmount command = %s\n", command);
-                                ret = usb_moded_system(command);
-                                g_free(command);
-                                if(ret != 0)
-                                {
-					if(try != 3)
-					{
-						try++;
-						usb_moded_sleep(1);
-						log_err("Umount failed. Retrying\n");
-						report_mass_storage_blocker(mount, 1);
-						goto umount;
-					}
-					else
-					{
-                                		log_err("Unmounting %s failed\n", mount);
-						report_mass_storage_blocker(mount, 2);
-                                        	usb_moded_send_error_signal(UMOUNT_ERROR);
-     	                                   	return(ret);
-					}
-                                }
-                         }
-                         else
-                         	/* already unmounted. Set return value to 0 since there is no error */
-                                ret = 0;
-              	}
-		
-	        /* activate mounts after sleeping 1s to be sure enumeration happened and autoplay will work in windows*/
-		usb_moded_sleep(1);
-                for(i=0 ; mounts[i] != NULL; i++)
-                {       
-			
-			if(strcmp(data->mode_module, MODULE_NONE))
-			{
-				sprintf(command2, "echo %i  > /sys/devices/platform/musb_hdrc/gadget/gadget-lun%d/nofua", fua, i);
-				log_debug("usb lun = %s active\n", command2);
-				usb_moded_system(command2);
-				sprintf(command2, "/sys/devices/platform/musb_hdrc/gadget/gadget-lun%d/file", i);
-				log_debug("usb lun = %s active\n", command2);
-				write_to_file(command2, mounts[i]);
-			}
-			else
-			{
-				write_to_file("/sys/class/android_usb/android0/enable", "0");
-				write_to_file("/sys/class/android_usb/android0/functions", "mass_storage");
-				//write_to_file("/sys/class/android_usb/f_mass_storage/lun/nofua", fua);
-				write_to_file("/sys/class/android_usb/f_mass_storage/lun/file", mount);
-				write_to_file("/sys/class/android_usb/android0/enable", "1");
-
-			}
-                }
-                g_strfreev(mounts);
-		g_free(mount);
-		if(real_path)
-			free(real_path);
 	}
 
-	/* only send data in use signal in case we actually succeed */
-        if(!ret)
-                usb_moded_send_signal(DATA_IN_USE);
-	
-	return(ret);
+	/* umount filesystems */
+	set_mass_storage_umount(ctx);
 
+	return(ret);
 }
 
 static int unset_mass_storage_mode(struct mode_list_elem *data)
 {
-        gchar *command;
-        char command2[256], *real_path = NULL, *mountpath;
-        char *mount;
+        char command2[256];
+        char *mount, *alt_mount;
         gchar **mounts;
         int ret = 1, i = 0;
 
@@ -378,40 +1061,23 @@ static int unset_mass_storage_mode(struct mode_list_elem *data)
         	mounts = g_strsplit(mount, ",", 0);
                 for(i=0 ; mounts[i] != NULL; i++)
                 {
-                	/* check if it is still or already mounted, if so (ret==0) skip mounting */
-			real_path = realpath(mounts[i], NULL);
-			if(real_path)
-				mountpath = real_path;
-			else
-				mountpath = mounts[i];
-                	command = g_strconcat("mount | grep ", mountpath, NULL);
-                        ret = usb_moded_system(command);
-                        g_free(command);
-                        if(ret)
+                	/* check if it is still or already mounted, if so skip mounting */
+                        ret = 0;
+                        if(!usb_moded_mount_is_mounted(mounts[i]))
                         {
-                        	command = g_strconcat("mount ", mountpath, NULL);
-				log_debug("mount command = %s\n",command);
-                                ret = usb_moded_system(command);
-                                g_free(command);
-				/* mount returns 0 if success */
-                                if(ret != 0 )
+                                ret = usb_moded_mount_mount(mounts[i]);
+                                if(ret != 0)
                                 {
-                                	log_err("Mounting %s failed\n", mount);
-					if(ret)
+                                	log_err("Mounting %s failed\n", mounts[i]);
+					alt_mount = find_alt_mount();
+					if(alt_mount)
 					{
-						g_free(mount);
-						mount = find_alt_mount();
-						if(mount)
-						{
-                                               		command = g_strconcat("mount -t tmpfs tmpfs -o ro --size=512K ", mount, NULL);
-							log_debug("Total failure, mount ro tmpfs as fallback\n");
-                                                        ret = usb_moded_system(command);
-                                                        g_free(command);
-                                                }
-						usb_moded_send_error_signal(RE_MOUNT_FAILED);
-                                        }
-
-                                  }
+						log_debug("Total failure, mount ro tmpfs as fallback\n");
+						ret = usb_moded_mount_tmpfs(alt_mount);
+						g_free(alt_mount);
+					}
+					usb_moded_send_error_signal(RE_MOUNT_FAILED);
+                                }
                         }
 			if(data != NULL)
 			{
@@ -431,52 +1097,123 @@ static int unset_mass_storage_mode(struct mode_list_elem *data)
                  }
                  g_strfreev(mounts);
 		 g_free(mount);
-		 if(real_path)
-			free(real_path);
         }
 
 	return(ret);
 
 }
 
+/* report each blocking process once per mass storage activation */
+static void report_mass_storage_holder(pid_t pid, const char *comm)
+{
+  gchar *holder = g_strdup_printf("%s %d", comm, (int)pid);
+
+  if(reported_holders && g_hash_table_lookup(reported_holders, holder))
+  {
+	log_debug("Mass storage still blocked by process %s\n", holder);
+	g_free(holder);
+	return;
+  }
+
+  log_err("Mass storage blocked by process %s\n", holder);
+  usb_moded_send_error_signal(holder);
+  if(reported_holders)
+	g_hash_table_insert(reported_holders, holder, GINT_TO_POINTER(1));
+  else
+	g_free(holder);
+}
+
+/* look for processes keeping the mountpoint that failed to umount busy */
 static void report_mass_storage_blocker(const char *mountpoint, int try)
 {
-  FILE *stream = 0;
-  gchar *lsof_command = 0;
-  int count = 0;
+  usb_moded_mount_scan_holders(mountpoint, report_mass_storage_holder);
+
+  if(try == 2)
+	log_err("Setting Mass storage blocked. Giving up.\n");
+}
+
+/* state of a dynamic mode activation in progress */
+typedef struct dynamic_mode_ctx_t
+{
+  struct mode_list_elem *data;	/* mode being activated */
+  int dhcpd;			/* set up dhcp server and nat */
+  int postsync;			/* run post sync when done */
+  int tries;			/* dhcp server set up attempts */
+} dynamic_mode_ctx_t;
+
+/* deadline for cellular data to come online for nat [ms] */
+#define CELLULAR_WAIT_TIMEOUT	10000
+
+/* run post sync once the interfaces have settled */
+static void set_dynamic_mode_postsync(gpointer aptr)
+{
+  struct mode_list_elem *data = aptr;
+
+  activate_sync_post(data->mode_name);
+  usb_moded_trace_mark(TRACE_POSTSYNC, "%s", data->mode_name);
+}
+
+/* set up dhcp server, waiting for cellular data for nat if needed */
+#ifdef CONNMAN
+/* continue right away when cellular data comes online */
+static void set_dynamic_mode_cellular_online(void)
+{
+  usb_moded_transition_flush(TRANSITION_CELLULAR_WAIT);
+}
+#endif
 
-  lsof_command = g_strconcat("lsof ", mountpoint, NULL);
+static void set_dynamic_mode_dhcpd(gpointer aptr)
+{
+  dynamic_mode_ctx_t *ctx = aptr;
+  struct mode_list_elem *data = ctx->data;
+  int postsync = ctx->postsync;
+
+#ifdef CONNMAN
+  usb_moded_connman_wait_online_cancel(set_dynamic_mode_cellular_online);
+#endif
 
-  if( (stream = usb_moded_popen(lsof_command, "r")) )
+  /* Needs to be called before application post synching so
+     that the dhcp server has the right config */
+  if(ctx->dhcpd)
   {
-    char *text = 0;
-    size_t size = 0;
+	int rc = usb_network_set_up_dhcpd(data);
 
-    while( getline(&text, &size, stream) >= 0 )
-    {
-        /* skip the first line as it does not contain process info */
-        if(count != 0)
-        {
-          gchar **split = 0;
-          split = g_strsplit((const gchar*)text, " ", 2);
-          log_err("Mass storage blocked by process %s\n", split[0]);
-          usb_moded_send_error_signal(split[0]);
-          g_strfreev(split);
-        }
-        count++;
-    }
-    pclose(stream);
+	usb_moded_trace_mark(TRACE_DHCPD, "%d", rc);
+	if(rc == NETWORK_PENDING)
+	{
+		if(++ctx->tries < 2)
+		{
+			/* the timeout is only a deadline, waiting ends as
+			   soon as connman reports cellular data online */
+#ifdef CONNMAN
+			usb_moded_connman_wait_online(set_dynamic_mode_cellular_online);
+#endif
+			usb_moded_transition_schedule(TRANSITION_CELLULAR_WAIT,
+						      CELLULAR_WAIT_TIMEOUT,
+						      set_dynamic_mode_dhcpd, ctx, g_free);
+			return;
+		}
+		log_debug("data connection not available!\n");
+	}
   }
-  g_free(lsof_command);
-  if(try == 2)
-	log_err("Setting Mass storage blocked. Giving up.\n");
+  g_free(ctx);
 
+  /* let's wait for a bit (350ms) to allow interfaces to settle before running postsync */
+  if(postsync)
+	usb_moded_transition_schedule(TRANSITION_POSTSYNC_SETTLE, 350,
+				      set_dynamic_mode_postsync, data, NULL);
 }
 
-int set_dynamic_mode(void)
+/** set up the current dynamic mode
+ *
+ * @param plan parts to skip when switching from another mode, or NULL
+ * @return 0 on success, non-zero on failure
+ */
+int set_dynamic_mode(const mode_plan_t *plan)
 {
 
   struct mode_list_elem *data; 
+  dynamic_mode_ctx_t *ctx;
   int ret = 1;
   int network = 1;
 
@@ -497,6 +1234,8 @@ int set_dynamic_mode(void)
 		log_debug("Appsync failure");
 		return(ret);
 	}
+  if(data->appsync)
+	usb_moded_trace_mark(TRACE_APPSYNC_PRE, "started");
 #endif
   /* make sure things are disabled before changing functionality */
   if(data->softconnect_disconnect)
@@ -504,24 +1243,41 @@ int set_dynamic_mode(void)
 	write_to_file(data->softconnect_path, data->softconnect_disconnect);
   }
   /* set functionality first, then enable */
-  if(data->android_extra_sysfs_value && data->android_extra_sysfs_path)
+  if(plan && plan->keep_extra_sysfs)
   {
-	ret = write_to_file(data->android_extra_sysfs_path, data->android_extra_sysfs_value);
+	/* already written by the previous mode */
+	if(data->android_extra_sysfs_value && data->android_extra_sysfs_path)
+		ret = 0;
   }
-  if(data->android_extra_sysfs_value2 && data->android_extra_sysfs_path2)
+  else
   {
-	write_to_file(data->android_extra_sysfs_path2, data->android_extra_sysfs_value2);
+	if(data->android_extra_sysfs_value && data->android_extra_sysfs_path)
+	{
+		ret = write_to_file(data->android_extra_sysfs_path, data->android_extra_sysfs_value);
+	}
+	if(data->android_extra_sysfs_value2 && data->android_extra_sysfs_path2)
+	{
+		write_to_file(data->android_extra_sysfs_path2, data->android_extra_sysfs_value2);
+	}
   }
-  if(data->sysfs_path)
+  if(data->sysfs_path && !(plan && plan->keep_sysfs))
   {
 	write_to_file(data->sysfs_path, data->sysfs_value);
   }
-  if(data->idProduct)
+  if(data->configfs_functions)
+  {
+	/* relink functions and rebind, ids are part of the gadget */
+	ret = usb_moded_configfs_set_functions(data->configfs_functions,
+					       data->idProduct,
+					       data->idVendorOverride);
+	usb_moded_trace_mark(TRACE_ENUMERATION, "configfs: %d", ret);
+  }
+  else if(data->idProduct && !(plan && plan->keep_product))
   {
 	/* only works for android since the idProduct is a module parameter */
 	set_android_productid(data->idProduct);
   }
-  if(data->idVendorOverride)
+  if(data->idVendorOverride && !data->configfs_functions && !(plan && plan->keep_vendor))
   {
 	/* only works for android since the idProduct is a module parameter */
 	set_android_vendorid(data->idVendorOverride);
@@ -531,10 +1287,11 @@ int set_dynamic_mode(void)
   if(data->softconnect)
   {
 	ret = write_to_file(data->softconnect_path, data->softconnect);
+	usb_moded_trace_mark(TRACE_ENUMERATION, "softconnect: %d", ret);
   }
 
   /* functionality should be enabled, so we can enable the network now */
-  if(data->network)
+  if(data->network && !(plan && plan->keep_network))
   {
 #ifdef DEBIAN
   	char command[256];
@@ -545,34 +1302,46 @@ int set_dynamic_mode(void)
 	usb_network_down(data);
 	network = usb_network_up(data);
 #endif /* DEBIAN */
+	usb_moded_trace_mark(TRACE_NETWORK_UP, "%d", network);
   }
 
   /* try a second time to bring up the network if it failed the first time,
-     this can happen with functionfs based gadgets (which is why we sleep for a bit */
-  if(network != 0 && data->network)
+     this can happen with functionfs based gadgets where the interface only
+     shows up later. Retry as soon as it appears, the timer is a safety net */
+  if(network != 0 && data->network && !(plan && plan->keep_network))
   {
-	log_debug("Retry setting up the network later\n");
-	if(delayed_network)
-		  g_source_remove(delayed_network);
+	log_debug("Retry setting up the network when the interface appears\n");
+	network_wait_stop();
+	network_wait_data = data;
+	network_wait_started = usb_moded_trace_now();
+	usb_moded_netlink_link_watch_start(network_link_cb);
 	delayed_network = g_timeout_add_seconds(3, network_retry, data);
-  }
 
-  /* Needs to be called before application post synching so
-     that the dhcp server has the right config */
-  if(data->nat || data->dhcp_server)
-	usb_network_set_up_dhcpd(data);
+	/* the interface may have appeared before the watch was started,
+	   in which case no notification is coming for it */
+	if(usb_network_has_interface(data))
+	{
+		log_debug("interface exists already, retrying right away\n");
+		usb_moded_netlink_link_watch_stop();
+		network = usb_network_up(data);
+		usb_moded_trace_span(TRACE_NETWORK_UP, network_wait_started,
+				     "link existed: %d", network);
+		if(network == 0)
+			network_wait_stop();
+	}
+  }
 
+  /* dhcp server set up and post sync continue from transition steps */
+  ctx = g_malloc0(sizeof *ctx);
+  ctx->data = data;
+  ctx->dhcpd = (data->nat || data->dhcp_server) && !(plan && plan->keep_network);
   /* no need to execute the post sync if there was an error setting the mode */
-  if(data->appsync && !ret)
-  {
-	/* let's sleep for a bit (350ms) to allow interfaces to settle before running postsync */
-	usb_moded_msleep(350);
-	activate_sync_post(data->mode_name);
-  }
+  ctx->postsync = (data->appsync && !ret);
+  set_dynamic_mode_dhcpd(ctx);
 
 #ifdef CONNMAN
-  if(data->connman_tethering)
-	connman_set_tethering(data->connman_tethering, TRUE);
+  if(data->connman_tethering && !(plan && plan->keep_network))
+	usb_moded_connman_set_tethering(data->connman_tethering, TRUE);
 #endif
 
   if(ret)
@@ -580,35 +1349,32 @@ int set_dynamic_mode(void)
   return(ret);
 }
 
-void unset_dynamic_mode(void)
+/* tear down the current dynamic mode, skipping parts kept by the plan */
+static void unset_dynamic_mode_plan(const mode_plan_t *plan)
 { 
 
   struct mode_list_elem *data; 
 
   data = get_usb_mode_data();
 
-  if(delayed_network)
-  {
-	g_source_remove(delayed_network);
-	delayed_network = 0;
-  }
+  network_wait_stop();
 
   /* the modelist could be empty */
   if(!data)
 	return;
 
-  if(!strcmp(data->mode_name, MODE_MASS_STORAGE))
+  if(data->mode_id == MODE_ID_MASS_STORAGE)
   {
 	unset_mass_storage_mode(data);
 	return;
   }
 
 #ifdef CONNMAN
-  if(data->connman_tethering)
-	connman_set_tethering(data->connman_tethering, FALSE);
+  if(data->connman_tethering && !(plan && plan->keep_network))
+	usb_moded_connman_set_tethering(data->connman_tethering, FALSE);
 #endif
 
-  if(data->network)
+  if(data->network && !(plan && plan->keep_network))
   {
 	usb_network_down(data);
   }
@@ -618,12 +1384,17 @@ void unset_dynamic_mode(void)
   {
 	write_to_file(data->softconnect_path, data->softconnect_disconnect);
   }
-  if(data->sysfs_path)
+  if(data->sysfs_path && !(plan && plan->keep_sysfs_path))
   {
 	write_to_file(data->sysfs_path, data->sysfs_reset_value);
   }
+  /* unbind, unless the next mode relinks the configfs gadget anyway */
+  if(data->configfs_functions && !(plan && plan->to->configfs_functions))
+  {
+	usb_moded_configfs_disable();
+  }
   /* restore vendorid if the mode had an override */
-  if(data->idVendorOverride)
+  if(data->idVendorOverride && !data->configfs_functions && !(plan && plan->keep_vendor))
   {
 	char *id;
 	id = get_android_vendor_id();
@@ -631,13 +1402,87 @@ void unset_dynamic_mode(void)
 	g_free(id);
   }
 
-  /* enable after the changes have been made */
-  if(data->softconnect)
+  /* enable after the changes have been made, unless the next mode does it */
+  if(data->softconnect && !(plan && plan->to->softconnect))
   {
 	write_to_file(data->softconnect_path, data->softconnect);
   }
 }
 
+void unset_dynamic_mode(void)
+{
+  unset_dynamic_mode_plan(NULL);
+}
+
+/** plan a direct switch between two dynamic modes
+ *
+ * Compares the modes and marks the parts of the current mode that the new
+ * mode can use as they are. Switching is only planned between modes that
+ * use the same module; everything else needs a full clean-up.
+ *
+ * @param from The current mode
+ * @param to The mode to switch to
+ * @param plan Filled in with the parts to keep
+ * @return TRUE if the switch can be done according to the plan
+ */
+gboolean usb_moded_mode_plan(const struct mode_list_elem *from,
+			     const struct mode_list_elem *to, mode_plan_t *plan)
+{
+  memset(plan, 0, sizeof *plan);
+
+  if(!from || !to || from == to)
+	return FALSE;
+
+  if(from->mass_storage || to->mass_storage ||
+     from->mode_id == MODE_ID_MASS_STORAGE || to->mode_id == MODE_ID_MASS_STORAGE)
+  {
+	log_debug("switch plan %s -> %s: mass storage, full switch\n", from->mode_name, to->mode_name);
+	return FALSE;
+  }
+
+  if(g_strcmp0(from->mode_module, to->mode_module))
+  {
+	log_debug("switch plan %s -> %s: module changes, full switch\n", from->mode_name, to->mode_name);
+	return FALSE;
+  }
+
+  plan->from = from;
+  plan->to = to;
+
+  /* a pending network retry means the network is not up yet */
+  plan->keep_network = from->network && to->network && !delayed_network &&
+	!g_strcmp0(from->network_interface, to->network_interface) &&
+	from->nat == to->nat && from->dhcp_server == to->dhcp_server;
+#ifdef CONNMAN
+  plan->keep_network = plan->keep_network &&
+	!g_strcmp0(from->connman_tethering, to->connman_tethering);
+#endif
+#ifdef APP_SYNC
+  plan->keep_appsync = from->appsync && to->appsync;
+#endif
+  plan->keep_sysfs_path = from->sysfs_path && !g_strcmp0(from->sysfs_path, to->sysfs_path);
+  plan->keep_sysfs = plan->keep_sysfs_path && !g_strcmp0(from->sysfs_value, to->sysfs_value);
+  plan->keep_extra_sysfs =
+	!g_strcmp0(from->android_extra_sysfs_path, to->android_extra_sysfs_path) &&
+	!g_strcmp0(from->android_extra_sysfs_value, to->android_extra_sysfs_value) &&
+	!g_strcmp0(from->android_extra_sysfs_path2, to->android_extra_sysfs_path2) &&
+	!g_strcmp0(from->android_extra_sysfs_value2, to->android_extra_sysfs_value2);
+  plan->keep_product = !g_strcmp0(from->idProduct, to->idProduct);
+  plan->keep_vendor = !g_strcmp0(from->idVendorOverride, to->idVendorOverride);
+
+  log_debug("switch plan %s -> %s: keep module; %s network; %s appsync; "
+	    "%s sysfs; %s extra sysfs; %s product id; %s vendor id\n",
+	    from->mode_name, to->mode_name,
+	    plan->keep_network ? "keep" : "redo",
+	    plan->keep_appsync ? "keep common" : "redo",
+	    plan->keep_sysfs ? "keep" : plan->keep_sysfs_path ? "overwrite" : "redo",
+	    plan->keep_extra_sysfs ? "keep" : "redo",
+	    plan->keep_product ? "keep" : "redo",
+	    plan->keep_vendor ? "keep" : "redo");
+
+  return TRUE;
+}
+
 /** clean up mode changes or extra actions to perform after a mode change 
  * @param module Name of module currently in use
  * @return 0 on success, non-zero on failure
@@ -648,6 +1493,9 @@ int usb_moded_mode_cleanup(const char *module)
 
 	log_debug("Cleaning up mode\n");
 
+	/* steps of the mode activation must not run after this */
+	usb_moded_transition_cancel_mode();
+
 	if(!module)
 	{
 		log_warning("No module found to unload. Skipping cleanup\n");
@@ -663,7 +1511,7 @@ int usb_moded_mode_cleanup(const char *module)
         {
 		/* no clean-up needs to be done when we come from charging mode. We need
 		   to check since we use fake mass-storage for charging */
-		if(!strcmp(MODE_CHARGING, get_usb_mode()) || !strcmp(MODE_CHARGING_FALLBACK, get_usb_mode()))
+		if(get_usb_mode_id() == MODE_ID_CHARGING || get_usb_mode_id() == MODE_ID_CHARGING_FALLBACK)
 		  return 0;	
 		unset_mass_storage_mode(NULL);
         }
@@ -674,6 +1522,32 @@ int usb_moded_mode_cleanup(const char *module)
         return(0);
 }
 
+/** clean up the current mode for switching directly to another one
+ *
+ * @param plan Plan made by usb_moded_mode_plan()
+ * @return 0 on success, non-zero on failure
+ *
+ */
+int usb_moded_mode_cleanup_plan(const mode_plan_t *plan)
+{
+	log_debug("Cleaning up mode for switching to %s\n", plan->to->mode_name);
+
+	/* steps of the mode activation must not run after this */
+	usb_moded_transition_cancel_mode();
+
+#ifdef APP_SYNC
+	/* Stop applications the next mode does not use */
+	if(plan->keep_appsync)
+		appsync_stop_except(plan->to->mode_name);
+	else
+		appsync_stop(FALSE);
+#endif /* APP_SYNC */
+
+	unset_dynamic_mode_plan(plan);
+
+	return(0);
+}
+
 /** Allocate modesetting related dynamic resouces
  */
 void usb_moded_mode_init(void)
@@ -682,13 +1556,61 @@ void usb_moded_mode_init(void)
         tracked_values = g_hash_table_new_full(g_str_hash, g_str_equal,
                                                g_free, g_free);
     }
+    if( !sysfs_handles ) {
+        sysfs_handles = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                              g_free, sysfs_handle_free);
+    }
+    if( !drifted_values ) {
+        drifted_values = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                               g_free, 0);
+    }
+    if( !sysfs_watches ) {
+        sysfs_watches = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                              0, sysfs_watch_free);
+    }
+    if( !reported_holders ) {
+        reported_holders = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                                 g_free, 0);
+    }
+    if( sysfs_inotify_fd == -1 ) {
+        GIOChannel *chn;
+
+        if( (sysfs_inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) == -1 )
+            log_warning("sysfs watch: inotify_init: %m");
+        else if( (chn = g_io_channel_unix_new(sysfs_inotify_fd)) ) {
+            sysfs_inotify_id = g_io_add_watch(chn, G_IO_IN | G_IO_ERR |
+                                              G_IO_HUP | G_IO_NVAL,
+                                              sysfs_inotify_cb, 0);
+            g_io_channel_unref(chn);
+        }
+    }
 }
 
 /** Release modesetting related dynamic resouces
  */
 void usb_moded_mode_quit(void)
 {
+    usb_moded_mode_sysfs_stats();
+
+    if( sysfs_watches ) {
+        g_hash_table_unref(sysfs_watches), sysfs_watches = 0;
+    }
+    if( sysfs_inotify_id ) {
+        g_source_remove(sysfs_inotify_id), sysfs_inotify_id = 0;
+    }
+    if( sysfs_inotify_fd != -1 ) {
+        close(sysfs_inotify_fd), sysfs_inotify_fd = -1;
+    }
     if( tracked_values ) {
         g_hash_table_unref(tracked_values), tracked_values = 0;
     }
+    if( drifted_values ) {
+        g_hash_table_unref(drifted_values), drifted_values = 0;
+    }
+    if( sysfs_handles ) {
+        g_hash_table_unref(sysfs_handles), sysfs_handles = 0;
+    }
+    if( reported_holders ) {
+        g_hash_table_unref(reported_holders), reported_holders = 0;
+    }
 }
@@ -27,11 +27,35 @@ int write_to_file_real(const char *file, int line, const char *func, const char
 #define write_to_file(path,text)\
    write_to_file_real(__FILE__,__LINE__,__FUNCTION__,(path),(text))
 
+/** Parts of a mode switch that can be skipped
+ *
+ * Made by usb_moded_mode_plan() for switching between two dynamic modes
+ * that use the same module, which is always kept.
+ */
+typedef struct mode_plan_t
+{
+  const struct mode_list_elem *from;	/* mode being left */
+  const struct mode_list_elem *to;	/* mode being entered */
+  gboolean keep_network;		/* network, nat and dhcp server stay up */
+  gboolean keep_appsync;		/* apps used by both modes keep running */
+  gboolean keep_sysfs_path;		/* no sysfs reset, the new value overwrites it */
+  gboolean keep_sysfs;			/* same sysfs value, no write needed */
+  gboolean keep_extra_sysfs;		/* same android extra sysfs values */
+  gboolean keep_product;		/* same product id */
+  gboolean keep_vendor;			/* same vendor id override */
+} mode_plan_t;
+
 int set_mtp_mode(void);
-int set_dynamic_mode(void);
+int set_dynamic_mode(const mode_plan_t *plan);
 void unset_dynamic_mode(void);
+gboolean usb_moded_mode_plan(const struct mode_list_elem *from,
+			     const struct mode_list_elem *to, mode_plan_t *plan);
 /* clean up for the mode changes on disconnect */
 int usb_moded_mode_cleanup(const char *module);
+/* clean up for switching directly to another mode */
+int usb_moded_mode_cleanup_plan(const mode_plan_t *plan);
 void usb_moded_mode_verify_values(void);
+void usb_moded_mode_sysfs_stats(void);
+void usb_moded_mode_values_drifted(void);
 void usb_moded_mode_init(void);
 void usb_moded_mode_quit(void);
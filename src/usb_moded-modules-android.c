@@ -99,6 +99,13 @@ inline int usb_moded_module_cleanup(const char *module)
 	return(0);
 }
 
+/** stop waiting for a busy module to be released
+ *
+ */
+inline void usb_moded_module_unload_expire(void)
+{
+}
+
 /** try to unload modules to support switching
  *
  *
@@ -33,6 +33,7 @@
 #include <glib/gprintf.h>
 
 #include <libkmod.h>
+#include <libudev.h>
 
 #include "usb_moded.h"
 #include "usb_moded-modules.h"
@@ -42,23 +43,223 @@
 #include "usb_moded-dbus-private.h"
 #include "usb_moded-modesetting.h"
 #include "usb_moded-modes.h"
+#include "usb_moded-transition.h"
+#include "usb_moded-root.h"
+#include "usb_moded-trace.h"
 
 /* kmod context - initialized at start in usb_moded_init by ctx_init()
    and cleaned up by ctx_cleanup() functions */
 static struct kmod_ctx *ctx = 0;
 
+/* module "loaded" while module loading is stubbed, see usb_moded_root_stubbed() */
+static gchar *stub_module = 0;
+
+/* cached state of a kernel module, see module_state_get() */
+typedef struct module_state_t
+{
+	struct kmod_module *mod;	/* kmod handle, kept for the lifetime of ctx */
+	gboolean loaded;		/* module is live */
+} module_state_t;
+
+/* module name -> module_state_t, updated by our own load/unload calls
+   and by module uevents, reconciled with /proc/modules when stale */
+static GHashTable *module_states = 0;
+static gboolean module_states_stale = TRUE;
+
+/* module uevent monitor, without it the table is always considered stale */
+static struct udev *module_udev = 0;
+static struct udev_monitor *module_monitor = 0;
+static guint module_monitor_id = 0;
+
+static void module_state_free(gpointer aptr)
+{
+	module_state_t *state = aptr;
+
+	if(state->mod)
+		kmod_module_unref(state->mod);
+	g_free(state);
+}
+
+/* /proc/modules and uevents use underscores, kmod accepts both */
+static gchar *module_state_key(const char *module)
+{
+	return g_strdelimit(g_strdup(module), "-", '_');
+}
+
+/** Get cached state of a module, creating the kmod handle on first use
+ *
+ * @param module Name of the module
+ * @return module state, owned by the table
+ */
+static module_state_t *module_state_get(const char *module)
+{
+	gchar *key = module_state_key(module);
+	module_state_t *state = g_hash_table_lookup(module_states, key);
+
+	if(!state)
+	{
+		state = g_malloc0(sizeof *state);
+		if(kmod_module_new_from_name(ctx, module, &state->mod) < 0)
+			state->mod = 0;
+		g_hash_table_replace(module_states, key, state), key = 0;
+		/* loaded state not known yet */
+		module_states_stale = TRUE;
+	}
+	g_free(key);
+	return state;
+}
+
+/** Update loaded state of a module from our own actions or uevents */
+static void module_state_set(const char *module, gboolean loaded)
+{
+	gchar *key = module_state_key(module);
+	module_state_t *state = g_hash_table_lookup(module_states, key);
+
+	if(state && state->loaded != loaded)
+	{
+		log_debug("module %s %s\n", key, loaded ? "loaded" : "unloaded");
+		state->loaded = loaded;
+	}
+	g_free(key);
+}
+
+/** Reconcile the state table with a single read of /proc/modules */
+static void module_states_sync(void)
+{
+	GHashTableIter iter;
+	gpointer value;
+	FILE *file;
+	char *line = 0;
+	size_t size = 0;
+	char name[64], live[16];
+	gchar *path;
+
+	g_hash_table_iter_init(&iter, module_states);
+	while(g_hash_table_iter_next(&iter, 0, &value))
+		((module_state_t *)value)->loaded = FALSE;
+
+	path = usb_moded_root_path("/proc/modules");
+	file = fopen(path, "re");
+	g_free(path);
+	if(!file)
+	{
+		log_warning("/proc/modules: open: %m\n");
+		return;
+	}
+
+	/* name size refcount dependencies state address */
+	while(getline(&line, &size, file) != -1)
+	{
+		module_state_t *state;
+
+		if(sscanf(line, "%63s %*s %*s %*s %15s", name, live) != 2)
+			continue;
+		if((state = g_hash_table_lookup(module_states, name)))
+			state->loaded = !strcmp(live, "Live");
+	}
+
+	free(line);
+	fclose(file);
+
+	/* uevents keep the table up to date from here on */
+	module_states_stale = (module_monitor_id == 0);
+}
+
+static gboolean module_monitor_cb(GIOChannel *channel, GIOCondition cond, gpointer aptr)
+{
+	struct udev_device *dev;
+	const char *action, *name;
+
+	(void)channel;
+	(void)aptr;
+
+	if(cond & ~G_IO_IN)
+	{
+		log_warning("module uevent monitor failed\n");
+		module_monitor_id = 0;
+		module_states_stale = TRUE;
+		return FALSE;
+	}
+
+	if(!(dev = udev_monitor_receive_device(module_monitor)))
+		return TRUE;
+
+	action = udev_device_get_action(dev);
+	name = udev_device_get_sysname(dev);
+	if(action && name)
+	{
+		if(!strcmp(action, "add"))
+			module_state_set(name, TRUE);
+		else if(!strcmp(action, "remove"))
+			module_state_set(name, FALSE);
+	}
+
+	udev_device_unref(dev);
+	return TRUE;
+}
+
+/* follow module load/unload uevents, the table falls back to polling
+   /proc/modules on every lookup if this fails */
+static void module_monitor_start(void)
+{
+	GIOChannel *chn;
+
+	if(!(module_udev = udev_new()))
+		return;
+
+	module_monitor = udev_monitor_new_from_netlink(module_udev, "udev");
+	if(!module_monitor ||
+	   udev_monitor_filter_add_match_subsystem_devtype(module_monitor, "module", NULL) != 0 ||
+	   udev_monitor_enable_receiving(module_monitor) != 0)
+	{
+		log_warning("module uevents not available\n");
+		return;
+	}
+
+	chn = g_io_channel_unix_new(udev_monitor_get_fd(module_monitor));
+	module_monitor_id = g_io_add_watch(chn, G_IO_IN | G_IO_ERR | G_IO_HUP,
+					   module_monitor_cb, 0);
+	g_io_channel_unref(chn);
+}
+
+static void module_monitor_stop(void)
+{
+	if(module_monitor_id)
+		g_source_remove(module_monitor_id), module_monitor_id = 0;
+	if(module_monitor)
+		udev_monitor_unref(module_monitor), module_monitor = 0;
+	if(module_udev)
+		udev_unref(module_udev), module_udev = 0;
+}
+
 /* kmod module init */
 void usb_moded_module_ctx_init(void)
 {
+  if(usb_moded_root_stubbed())
+	return;
+
   ctx = kmod_new(NULL, NULL);
   kmod_load_resources(ctx);
+
+  module_states = g_hash_table_new_full(g_str_hash, g_str_equal,
+					g_free, module_state_free);
+  module_states_stale = TRUE;
+  module_monitor_start();
 }
 
 /* kmod module cleanup */
 void usb_moded_module_ctx_cleanup(void)
 {
+    module_monitor_stop();
+
+    /* kmod handles must be released before the context */
+    if( module_states )
+	g_hash_table_destroy(module_states), module_states = 0;
+
     if( ctx )
 	kmod_unref(ctx), ctx = 0;
+
+    g_free(stub_module), stub_module = 0;
 }
 
 /** load module 
@@ -79,6 +280,15 @@ int usb_moded_load_module(const char *module)
 	if(!strcmp(module, MODULE_NONE))
 		return 0;
 
+	if(usb_moded_root_stubbed())
+	{
+		log_debug("stub: load module %s\n", module);
+		g_free(stub_module);
+		stub_module = g_strdup(module);
+		usb_moded_mode_values_drifted();
+		return 0;
+	}
+
 	/* copy module to load as it might be modified if we're trying charging mode */
 	load = strdup(module);
 	if(!strcmp(module, MODULE_CHARGING) || !strcmp(module, MODULE_CHARGE_FALLBACK))
@@ -99,28 +309,38 @@ int usb_moded_load_module(const char *module)
 	  g_strfreev(strings);
 	  
 	}
-	ret = kmod_module_new_from_name(ctx, load, &mod);
+	mod = module_state_get(load)->mod;
 	/* since kmod_module_new_from_name does not check if the module
            exists we test it's path in case we deal with the mass-storage one */
 	if(!strcmp(module, MODULE_MASS_STORAGE) && 
-	    (kmod_module_get_path(mod) == NULL))
+	    (!mod || kmod_module_get_path(mod) == NULL))
 	{
 	  log_debug("Fallback on older g_file_storage\n");  
-	  ret = kmod_module_new_from_name(ctx, MODULE_FILE_STORAGE, &mod);
+	  free(load);
+	  load = strdup(MODULE_FILE_STORAGE);
+	  mod = module_state_get(load)->mod;
 	}
 
-	if(!charging_args)
+	if(!mod)
+		ret = -1;
+	else if(!charging_args)
 		ret = kmod_module_probe_insert_module(mod, probe_flags, NULL, NULL, NULL, NULL);
 	else
-	{
 		ret = kmod_module_probe_insert_module(mod, probe_flags, charging_args, NULL, NULL, NULL);
-		free(charging_args);
-	}
-	kmod_module_unref(mod);
+	free(charging_args);
+
+	if(ret == 0)
+		module_state_set(load, TRUE);
+	else
+		module_states_stale = TRUE;
 	free(load);
 
 	if( ret == 0)
+	{
 		log_info("Module %s loaded successfully\n", module);
+		/* new gadget, sysfs content is whatever the module set up */
+		usb_moded_mode_values_drifted();
+	}
 	else
 		log_info("Module %s failed to load\n", module);
 	return(ret);
@@ -141,9 +361,26 @@ int usb_moded_unload_module(const char *module)
 	if(!strcmp(module, MODULE_NONE))
 		return 0;
 
-	kmod_module_new_from_name(ctx, module, &mod);
+	if(usb_moded_root_stubbed())
+	{
+		log_debug("stub: unload module %s\n", module);
+		if(stub_module && !strcmp(stub_module, module))
+			g_free(stub_module), stub_module = 0;
+		usb_moded_mode_values_drifted();
+		return 0;
+	}
+
+	if(!(mod = module_state_get(module)->mod))
+		return(-1);
 	ret = kmod_module_remove_module(mod, KMOD_REMOVE_NOWAIT);
-	kmod_module_unref(mod);
+
+	if(ret == 0)
+	{
+		module_state_set(module, FALSE);
+		usb_moded_mode_values_drifted();
+	}
+	else
+		module_states_stale = TRUE;
 
 	return(ret);
 }
@@ -154,16 +391,16 @@ int usb_moded_unload_module(const char *module)
  */
 static int module_state_check(const char *module)
 {
-  int ret = 0;
-  struct kmod_module *mod;
-
-  kmod_module_new_from_name(ctx, module, &mod);
-  ret = kmod_module_get_initstate(mod);
-  kmod_module_unref(mod);
-  if( ret == KMOD_MODULE_LIVE)
-	return(1);
-  else
-	return(0);
+  module_state_t *state;
+
+  if(usb_moded_root_stubbed())
+	return(stub_module && !strcmp(stub_module, module));
+
+  state = module_state_get(module);
+  if(module_states_stale)
+	module_states_sync();
+
+  return(state->loaded ? 1 : 0);
 }
 
 /** find which module is loaded 
@@ -188,15 +425,185 @@ const char * usb_moded_find_module(void)
   return(0);
 }
 
+/* interval for checking the reference count of a busy module */
+#define MODULE_UNLOAD_POLL_MS 50
+
+/* default time to wait for a busy module to be released */
+#define MODULE_UNLOAD_TIMEOUT_MS 2000
+
+/* state of a pending module unload, see module_unload_wait() */
+typedef struct module_unload_t
+{
+	gchar *module;		/* module to unload */
+	gint64 started;		/* wait start time */
+	gint64 deadline;	/* give up unloading after this */
+	int attempts;		/* unload attempts made while waiting */
+	gboolean finished;	/* outcome has been reported */
+} module_unload_t;
+
+static module_unload_t *module_unload_pending = 0;
+
+static void module_unload_report(module_unload_t *unload, gboolean done);
+
+static void module_unload_free(gpointer aptr)
+{
+	module_unload_t *unload = aptr;
+
+	if(module_unload_pending == unload)
+		module_unload_pending = 0;
+
+	g_free(unload->module);
+	g_free(unload);
+}
+
+/** Drop a pending module unload wait
+ *
+ * Used when a new unload wait takes the place of the pending one;
+ * the old wait is recorded as abandoned, without further unload
+ * attempts or error signals.
+ */
+static void module_unload_cancel(void)
+{
+	module_unload_t *unload = module_unload_pending;
+
+	if(!unload)
+		return;
+
+	if(!unload->finished)
+	{
+		unload->finished = TRUE;
+		log_warning("Module %s: unload wait abandoned\n", unload->module);
+		usb_moded_trace_span(TRACE_MODULE_UNLOAD, unload->started,
+				     "%s: abandoned, %d attempts",
+				     unload->module, unload->attempts);
+	}
+	usb_moded_transition_cancel(TRANSITION_MODULE_UNLOAD_RETRY);
+}
+
+/** Check if a module is still in use
+ *
+ * @return TRUE if the module has references or holders, FALSE otherwise
+ */
+static gboolean module_is_busy(const char *module)
+{
+	gboolean busy = FALSE;
+	gchar *path, *real, *text = 0;
+	GDir *dir;
+
+	path = g_strdup_printf("/sys/module/%s/refcnt", module);
+	real = usb_moded_root_path(path);
+	if(g_file_get_contents(real, &text, 0, 0))
+		busy = (atoi(text) > 0);
+	g_free(text);
+	g_free(real);
+	g_free(path);
+
+	path = g_strdup_printf("/sys/module/%s/holders", module);
+	real = usb_moded_root_path(path);
+	if(!busy && (dir = g_dir_open(real, 0, 0)))
+	{
+		busy = (g_dir_read_name(dir) != NULL);
+		g_dir_close(dir);
+	}
+	g_free(real);
+	g_free(path);
+
+	return busy;
+}
+
+/** Wait for a busy module to be released and unload it
+ *
+ * The reference count and holders are checked every
+ * MODULE_UNLOAD_POLL_MS, unloading is retried as soon as the module
+ * is no longer in use, or one last time when the deadline is reached.
+ */
+static void module_unload_wait(gpointer data)
+{
+	module_unload_t *unload = data;
+	gint64 now = g_get_monotonic_time();
+	gboolean expired = (now >= unload->deadline);
+	gboolean done = FALSE;
+
+	if(!module_state_check(unload->module))
+		done = TRUE;
+	else if(expired || !module_is_busy(unload->module))
+	{
+		unload->attempts++;
+		done = (usb_moded_unload_module(unload->module) == 0);
+	}
+
+	if(!done && !expired)
+	{
+		usb_moded_transition_schedule(TRANSITION_MODULE_UNLOAD_RETRY,
+					      MODULE_UNLOAD_POLL_MS,
+					      module_unload_wait, unload,
+					      module_unload_free);
+		return;
+	}
+
+	module_unload_report(unload, done);
+
+	/* a mode that could not load its module while the old one was
+	   busy can be set up now */
+	if(done && get_usb_connection_state() &&
+	   get_usb_mode_id() == MODE_ID_UNDEFINED)
+	{
+		log_debug("Module %s released, deciding mode again\n", unload->module);
+		set_usb_connected_state();
+	}
+
+	module_unload_free(unload);
+}
+
+/** Report the outcome of waiting for a busy module
+ *
+ * A module that stays in use is signalled as an error, so that
+ * the mode change does not just silently stall.
+ */
+static void module_unload_report(module_unload_t *unload, gboolean done)
+{
+	gint64 now = g_get_monotonic_time();
+
+	unload->finished = TRUE;
+
+	usb_moded_trace_span(TRACE_MODULE_UNLOAD, unload->started, "%s: %s, %d attempts",
+			     unload->module, done ? "unloaded" : "failed",
+			     unload->attempts);
+	if(done)
+	{
+		log_info("Module %s unloaded successfully after %" G_GINT64_FORMAT " ms\n",
+			 unload->module, (now - unload->started) / 1000);
+	}
+	else
+	{
+		log_err("Module %s did not unload!\n", unload->module);
+		usb_moded_send_error_signal(MODULE_UNLOAD_FAILED);
+	}
+}
+
+/** Give up waiting for a busy module
+ *
+ * A pending unload is tried once more and then given up, the next
+ * time the transition step runs.
+ */
+void usb_moded_module_unload_expire(void)
+{
+	if(module_unload_pending)
+		module_unload_pending->deadline = 0;
+}
+
 /** clean up for modules when usb gets disconnected
+ *
+ * If the module does not unload, unloading is retried later from
+ * a transition step.
  *
  * @param module The name of the module to unload
- * @return 0 on success, non-zero on failure
+ * @return 0 on success, non-zero on failure or if unloading is still pending
  *
  */
 int usb_moded_module_cleanup(const char *module)
 {
-  	int retry = 0, failure;
+  	int failure;
 
 	if(!strcmp(module, MODULE_NONE))
 		goto END;
@@ -218,32 +625,29 @@ int usb_moded_module_cleanup(const char *module)
 	   so we clean up the mode to be sure */
 	if(failure)
 	{
+		module_unload_t *unload;
+		int timeout = get_module_unload_timeout();
+
+		module_unload_cancel();
 		usb_moded_mode_cleanup(usb_moded_find_module());
-	}
 
-	while(failure)
-	{
-		/* module did not get unloaded. We will wait a bit and try again */
-		usb_moded_sleep(1);
-		/* send the REALLY  disconnect message */
+		/* tell users of the gadget to let go, then wait for the
+		   module to be released */
 		usb_moded_send_signal(USB_REALLY_DISCONNECT);
-		failure = usb_moded_unload_module(module);
-		log_debug("unloading failure = %d\n", failure);
-		if(!failure)
-			break;
-		if(!usb_moded_find_module())
-			goto END;
-		retry++;
-		if(retry == 2)
-			break;
-	}
-	if(!failure)
-		log_info("Module %s unloaded successfully\n", module);
-	else
-	{
-		log_err("Module %s did not unload! Failing and going to undefined.\n", module);
+
+		unload = g_malloc0(sizeof *unload);
+		unload->module = g_strdup(module);
+		unload->started = g_get_monotonic_time();
+		unload->deadline = unload->started +
+			(gint64)(timeout > 0 ? timeout : MODULE_UNLOAD_TIMEOUT_MS) * 1000;
+		module_unload_pending = unload;
+		usb_moded_transition_schedule(TRANSITION_MODULE_UNLOAD_RETRY,
+					      MODULE_UNLOAD_POLL_MS,
+					      module_unload_wait, unload,
+					      module_unload_free);
 		return(1);
 	}
+	log_info("Module %s unloaded successfully\n", module);
 END:
 	return(0);
 }
@@ -45,6 +45,9 @@ const char * usb_moded_find_module(void);
 /* clean up modules when usb gets disconnected */
 int usb_moded_module_cleanup(const char *module);
 
+/* stop waiting for a busy module to be released */
+void usb_moded_module_unload_expire(void);
+
 /* clean up to allow for switching */
 int usb_moded_module_switch_prepare(int force);
 
@@ -0,0 +1,771 @@
+/**
+  @file usb_moded-mount.c
+
+  Copyright (C) 2016 Jolla. All rights reserved.
+
+  @author: Philippe De Swert <philippe.deswert@jollamobile.com>
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the Lesser GNU General Public License
+  version 2 as published by the Free Software Foundation.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  General Public License for more details.
+
+  You should have received a copy of the Lesser GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+  02110-1301 USA
+*/
+
+/*
+ * Mount table handling for mass storage mode
+ *
+ * Mount state is looked up from /proc/self/mountinfo and mounting is
+ * done with mount(2) / umount2(2) directly, using the options from
+ * /etc/fstab, instead of running mount and umount via the shell.
+ *
+ * Changes to the mount table can be followed by polling mountinfo for
+ * POLLPRI, which the kernel signals whenever something is mounted or
+ * unmounted in the namespace.
+ *
+ * Processes keeping a mount busy are found by walking /proc and
+ * comparing the device of open files, working directories and mapped
+ * files against the device of the mount. The scan is done in small
+ * slices from an idle callback so that the mainloop keeps running.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <mntent.h>
+#include <dirent.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+
+#include <glib.h>
+
+#include "usb_moded-mount.h"
+#include "usb_moded-log.h"
+#include "usb_moded-root.h"
+
+/* ========================================================================= *
+ * State data
+ * ========================================================================= */
+
+#define MOUNT_MOUNTINFO_PATH "/proc/self/mountinfo"
+#define MOUNT_FSTAB_PATH     "/etc/fstab"
+#define MOUNT_FILESYSTEMS    "/etc/filesystems"
+#define MOUNT_PROC_FS_PATH   "/proc/filesystems"
+
+/** Mount options that map to mount(2) flags */
+static const struct
+{
+    const char    *name;
+    unsigned long  set;
+    unsigned long  clear;
+} mount_flag_options[] =
+{
+    { "ro",         MS_RDONLY,      0             },
+    { "rw",         0,              MS_RDONLY     },
+    { "nosuid",     MS_NOSUID,      0             },
+    { "suid",       0,              MS_NOSUID     },
+    { "nodev",      MS_NODEV,       0             },
+    { "dev",        0,              MS_NODEV      },
+    { "noexec",     MS_NOEXEC,      0             },
+    { "exec",       0,              MS_NOEXEC     },
+    { "sync",       MS_SYNCHRONOUS, 0             },
+    { "async",      0,              MS_SYNCHRONOUS},
+    { "dirsync",    MS_DIRSYNC,     0             },
+    { "noatime",    MS_NOATIME,     0             },
+    { "atime",      0,              MS_NOATIME    },
+    { "nodiratime", MS_NODIRATIME,  0             },
+    { "relatime",   MS_RELATIME,    0             },
+};
+
+/** Options that only mean something to mount(8) */
+static const char * const mount_ignored_options[] =
+{
+    "defaults", "auto", "noauto", "user", "nouser", "users", "nofail",
+    "owner", "group", "_netdev",
+};
+
+/** Mount table change callback and its io watch */
+static void (*mount_watch_cb)(void) = 0;
+static guint mount_watch_id = 0;
+
+/** Time spent scanning per mainloop iteration [us] */
+#define MOUNT_SCAN_SLICE_US   (10 * 1000)
+
+/** Time after which a scan is abandoned [us] */
+#define MOUNT_SCAN_BUDGET_US  (2 * 1000 * 1000)
+
+/** State of a holder scan in progress */
+typedef struct mount_scan_t
+{
+    gchar           *mounts;    /* mount points as requested */
+    dev_t           *devs;      /* devices of the scanned mounts */
+    int              ndevs;     /* number of entries in devs */
+    DIR             *proc;      /* /proc directory stream */
+    mount_holder_fn  holder_cb; /* called for each holder found */
+    gint64           started;   /* scan start time */
+    int              pids;      /* processes checked */
+    int              holders;   /* processes found holding mounts */
+} mount_scan_t;
+
+static mount_scan_t *mount_scan = 0;
+static guint mount_scan_id = 0;
+
+/* ========================================================================= *
+ * Internal helpers
+ * ========================================================================= */
+
+/** Undo octal escapes mountinfo uses for white space etc, in place */
+static void mount_unescape(char *str)
+{
+    char *dst = str;
+
+    for( ; *str; ++dst ) {
+        if( str[0] == '\\' &&
+            str[1] >= '0' && str[1] <= '3' &&
+            str[2] >= '0' && str[2] <= '7' &&
+            str[3] >= '0' && str[3] <= '7' ) {
+            *dst = (char)((str[1] - '0') << 6 | (str[2] - '0') << 3 |
+                          (str[3] - '0'));
+            str += 4;
+        }
+        else {
+            *dst = *str++;
+        }
+    }
+    *dst = 0;
+}
+
+/** Split fstab options into mount(2) flags and file system data */
+static unsigned long mount_parse_options(const char *opts, GString *data)
+{
+    unsigned long flags = 0;
+    gchar **vec = g_strsplit(opts ?: "", ",", 0);
+
+    for( int i = 0; vec[i]; ++i ) {
+        const char *opt = vec[i];
+        bool handled = false;
+
+        if( !*opt || g_str_has_prefix(opt, "x-") ||
+            g_str_has_prefix(opt, "comment=") )
+            continue;
+
+        for( size_t k = 0; k < G_N_ELEMENTS(mount_ignored_options); ++k ) {
+            if( !strcmp(opt, mount_ignored_options[k]) )
+                handled = true;
+        }
+
+        for( size_t k = 0; !handled && k < G_N_ELEMENTS(mount_flag_options); ++k ) {
+            if( !strcmp(opt, mount_flag_options[k].name) ) {
+                flags |= mount_flag_options[k].set;
+                flags &= ~mount_flag_options[k].clear;
+                handled = true;
+            }
+        }
+
+        if( !handled ) {
+            if( data->len )
+                g_string_append_c(data, ',');
+            g_string_append(data, opt);
+        }
+    }
+
+    g_strfreev(vec);
+    return flags;
+}
+
+/** Resolve UUID= / LABEL= device specifications */
+static gchar *mount_resolve_device(const char *spec)
+{
+    if( g_str_has_prefix(spec, "UUID=") )
+        return g_strconcat("/dev/disk/by-uuid/", spec + 5, NULL);
+
+    if( g_str_has_prefix(spec, "LABEL=") )
+        return g_strconcat("/dev/disk/by-label/", spec + 6, NULL);
+
+    return g_strdup(spec);
+}
+
+static bool mount_has_type(const GPtrArray *types, const char *type)
+{
+    for( guint i = 0; i < types->len; ++i ) {
+        if( !strcmp(g_ptr_array_index(types, i), type) )
+            return true;
+    }
+    return false;
+}
+
+/** Add file system types listed in a filesystems file
+ *
+ * Handles both /etc/filesystems (one type per line, "*" meaning the
+ * kernel list should be consulted too) and /proc/filesystems (types
+ * not needing a block device are prefixed with "nodev").
+ *
+ * @return true if the kernel list should be read as well
+ */
+static bool mount_read_fs_types(const char *path, GPtrArray *types)
+{
+    bool    more = true;
+    gchar  *real = usb_moded_root_path(path);
+    gchar  *text = 0;
+    gchar **vec  = 0;
+
+    if( !g_file_get_contents(real, &text, 0, 0) )
+        goto EXIT;
+
+    more = false;
+    vec = g_strsplit(text, "\n", 0);
+    for( int i = 0; vec[i]; ++i ) {
+        gchar *type = g_strstrip(vec[i]);
+
+        if( !*type || *type == '#' )
+            continue;
+        if( !strcmp(type, "*") ) {
+            more = true;
+            continue;
+        }
+        if( g_str_has_prefix(type, "nodev") )
+            continue;
+        if( !mount_has_type(types, type) )
+            g_ptr_array_add(types, g_strdup(type));
+    }
+
+EXIT:
+    g_strfreev(vec);
+    g_free(text);
+    g_free(real);
+    return more;
+}
+
+/** Get file system types to try for an fstab type field
+ *
+ * "auto" expands to the types listed in /etc/filesystems and the
+ * block device types the kernel knows about, like mount(8) does.
+ * A comma separated list is tried in the order given.
+ *
+ * @return NULL terminated array of types, free with g_strfreev()
+ */
+static gchar **mount_fs_candidates(const char *type)
+{
+    GPtrArray *types;
+
+    if( type && strcmp(type, "auto") )
+        return g_strsplit(type, ",", 0);
+
+    types = g_ptr_array_new();
+    if( mount_read_fs_types(MOUNT_FILESYSTEMS, types) )
+        mount_read_fs_types(MOUNT_PROC_FS_PATH, types);
+    g_ptr_array_add(types, 0);
+
+    return (gchar **)g_ptr_array_free(types, FALSE);
+}
+
+static gboolean mount_watch_io_cb(GIOChannel *channel, GIOCondition condition,
+                                  gpointer aptr)
+{
+    (void)channel;
+    (void)condition;
+    (void)aptr;
+
+    /* mountinfo reports changes as POLLERR | POLLPRI, the event
+     * is consumed by the poll itself */
+    log_debug("mount table changed");
+
+    if( mount_watch_cb )
+        mount_watch_cb();
+
+    return TRUE;
+}
+
+static bool mount_scan_match(const mount_scan_t *scan, dev_t dev)
+{
+    for( int i = 0; i < scan->ndevs; ++i ) {
+        if( scan->devs[i] == dev )
+            return true;
+    }
+    return false;
+}
+
+static bool mount_scan_path(const mount_scan_t *scan, const char *path)
+{
+    bool         found = false;
+    gchar       *real  = usb_moded_root_path(path);
+    struct stat  st;
+
+    if( stat(real, &st) == -1 )
+        goto EXIT;
+
+    found = mount_scan_match(scan, st.st_dev);
+
+EXIT:
+    g_free(real);
+    return found;
+}
+
+static bool mount_scan_fds(const mount_scan_t *scan, const char *pid)
+{
+    bool           found = false;
+    char           path[PATH_MAX];
+    gchar         *real  = 0;
+    DIR           *dir;
+    struct dirent *de;
+
+    snprintf(path, sizeof path, "/proc/%s/fd", pid);
+    real = usb_moded_root_path(path);
+    if( !(dir = opendir(real)) )
+        goto EXIT;
+
+    while( !found && (de = readdir(dir)) ) {
+        if( de->d_name[0] == '.' )
+            continue;
+        snprintf(path, sizeof path, "/proc/%s/fd/%s", pid, de->d_name);
+        found = mount_scan_path(scan, path);
+    }
+
+    closedir(dir);
+EXIT:
+    g_free(real);
+    return found;
+}
+
+static bool mount_scan_maps(const mount_scan_t *scan, const char *pid)
+{
+    bool      found = false;
+    char      path[PATH_MAX];
+    FILE     *file;
+    char     *line = 0;
+    size_t    size = 0;
+    unsigned  maj, min;
+    unsigned long ino;
+    gchar    *real = 0;
+
+    snprintf(path, sizeof path, "/proc/%s/maps", pid);
+    real = usb_moded_root_path(path);
+    if( !(file = fopen(real, "re")) )
+        goto EXIT;
+
+    /* address perms offset major:minor inode path */
+    while( !found && getline(&line, &size, file) != -1 ) {
+        if( sscanf(line, "%*s %*s %*s %x:%x %lu", &maj, &min, &ino) != 3 )
+            continue;
+        if( ino == 0 )
+            continue;
+        found = mount_scan_match(scan, makedev(maj, min));
+    }
+
+    free(line);
+    fclose(file);
+EXIT:
+    g_free(real);
+    return found;
+}
+
+static void mount_scan_process(mount_scan_t *scan, const char *pid)
+{
+    char   path[PATH_MAX];
+    char  *comm = 0;
+    gchar *real = 0;
+
+    scan->pids++;
+
+    snprintf(path, sizeof path, "/proc/%s/cwd", pid);
+    if( mount_scan_path(scan, path) )
+        goto FOUND;
+
+    snprintf(path, sizeof path, "/proc/%s/root", pid);
+    if( mount_scan_path(scan, path) )
+        goto FOUND;
+
+    if( mount_scan_fds(scan, pid) || mount_scan_maps(scan, pid) )
+        goto FOUND;
+
+    return;
+
+FOUND:
+    scan->holders++;
+
+    snprintf(path, sizeof path, "/proc/%s/comm", pid);
+    real = usb_moded_root_path(path);
+    if( g_file_get_contents(real, &comm, 0, 0) )
+        g_strchomp(comm);
+
+    log_debug("mount held by %s (%s)", comm ?: "unknown", pid);
+
+    if( scan->holder_cb )
+        scan->holder_cb(atoi(pid), comm ?: "unknown");
+
+    g_free(comm);
+    g_free(real);
+}
+
+static void mount_scan_free(mount_scan_t *scan)
+{
+    if( !scan )
+        return;
+
+    if( scan->proc )
+        closedir(scan->proc);
+    g_free(scan->mounts);
+    g_free(scan->devs);
+    g_free(scan);
+}
+
+static gboolean mount_scan_cb(gpointer aptr)
+{
+    mount_scan_t  *scan  = mount_scan;
+    gint64         now   = g_get_monotonic_time();
+    gint64         limit = now + MOUNT_SCAN_SLICE_US;
+    struct dirent *de    = 0;
+
+    (void)aptr;
+
+    if( now > scan->started + MOUNT_SCAN_BUDGET_US ) {
+        log_warning("mount holder scan abandoned after %d processes",
+                    scan->pids);
+        goto DONE;
+    }
+
+    do {
+        if( !(de = readdir(scan->proc)) )
+            goto DONE;
+
+        if( de->d_name[0] >= '1' && de->d_name[0] <= '9' )
+            mount_scan_process(scan, de->d_name);
+    } while( g_get_monotonic_time() < limit );
+
+    return TRUE;
+
+DONE:
+    log_debug("mount holder scan: %d processes, %d holders, %" G_GINT64_FORMAT " ms",
+              scan->pids, scan->holders,
+              (g_get_monotonic_time() - scan->started) / 1000);
+
+    mount_scan_id = 0;
+    mount_scan_free(mount_scan), mount_scan = 0;
+    return FALSE;
+}
+
+/* ========================================================================= *
+ * External API
+ * ========================================================================= */
+
+/** Check if something is mounted on a path
+ *
+ * @param path mount point
+ *
+ * @return TRUE if path is a mount point, FALSE otherwise
+ */
+gboolean usb_moded_mount_is_mounted(const char *path)
+{
+    gboolean  mounted = FALSE;
+    char     *real = realpath(path, NULL);
+    FILE     *file = 0;
+    char     *line = 0;
+    size_t    size = 0;
+    gchar    *info = usb_moded_root_path(MOUNT_MOUNTINFO_PATH);
+
+    if( !(file = fopen(info, "re")) ) {
+        log_warning("%s: open: %m", MOUNT_MOUNTINFO_PATH);
+        goto EXIT;
+    }
+
+    /* id parent major:minor root mountpoint options ... */
+    while( !mounted && getline(&line, &size, file) != -1 ) {
+        char *pos = line;
+        char *dir = 0;
+
+        for( int field = 0; field < 5 && pos; ++field ) {
+            dir = strsep(&pos, " ");
+        }
+        if( !dir || !pos )
+            continue;
+
+        mount_unescape(dir);
+        mounted = !strcmp(dir, real ?: path);
+    }
+
+EXIT:
+    free(line);
+    if( file )
+        fclose(file);
+    free(real);
+    g_free(info);
+
+    return mounted;
+}
+
+/** Unmount a file system
+ *
+ * @param path mount point
+ *
+ * @return 0 on success, or errno value
+ */
+int usb_moded_mount_umount(const char *path)
+{
+    int   err = 0;
+    char *real = realpath(path, NULL);
+
+    log_debug("umount %s", real ?: path);
+
+    if( usb_moded_root_stubbed() )
+        goto EXIT;
+
+    if( umount2(real ?: path, UMOUNT_NOFOLLOW) == -1 ) {
+        err = errno;
+        log_warning("umount %s: %s", path, strerror(err));
+    }
+
+EXIT:
+    free(real);
+    return err;
+}
+
+/** Mount a file system as configured in fstab
+ *
+ * File system type "auto" is resolved by trying the candidate types
+ * in turn, the same way mount(8) would.
+ *
+ * @param path mount point listed in /etc/fstab
+ *
+ * @return 0 on success, or errno value
+ */
+int usb_moded_mount_mount(const char *path)
+{
+    int             err = ENOENT;
+    char           *real = realpath(path, NULL);
+    FILE           *fstab = 0;
+    struct mntent  *ent;
+    GString        *data = g_string_new(0);
+    gchar          *dev = 0;
+    unsigned long   flags = 0;
+    gchar         **types = 0;
+    gchar          *tab = usb_moded_root_path(MOUNT_FSTAB_PATH);
+
+    if( !(fstab = setmntent(tab, "re")) ) {
+        log_warning("%s: open: %m", MOUNT_FSTAB_PATH);
+        goto EXIT;
+    }
+
+    while( (ent = getmntent(fstab)) ) {
+        if( !strcmp(ent->mnt_dir, path) || (real && !strcmp(ent->mnt_dir, real)) )
+            break;
+    }
+
+    if( !ent ) {
+        log_warning("mount %s: not in %s", path, MOUNT_FSTAB_PATH);
+        goto EXIT;
+    }
+
+    flags = mount_parse_options(ent->mnt_opts, data);
+    dev = mount_resolve_device(ent->mnt_fsname);
+
+    types = mount_fs_candidates(ent->mnt_type);
+
+    /* a type that does not match the device fails with EINVAL or
+     * ENODEV, move on to the next candidate on those only */
+    err = ENODEV;
+    for( int i = 0; types[i] && (err == ENODEV || err == EINVAL); ++i ) {
+        log_debug("mount %s on %s type %s flags 0x%lx data '%s'",
+                  dev, ent->mnt_dir, types[i], flags, data->str);
+
+        err = 0;
+        if( usb_moded_root_stubbed() )
+            goto EXIT;
+
+        if( mount(dev, ent->mnt_dir, types[i], flags,
+                  data->len ? data->str : 0) == -1 )
+            err = errno;
+    }
+
+    if( err )
+        log_warning("mount %s: %s", path, strerror(err));
+
+EXIT:
+    g_strfreev(types);
+    g_free(dev);
+    g_string_free(data, TRUE);
+    if( fstab )
+        endmntent(fstab);
+    free(real);
+    g_free(tab);
+
+    return err;
+}
+
+/** Mount small read only tmpfs, as a placeholder for a failed mount
+ *
+ * @param path mount point
+ *
+ * @return 0 on success, or errno value
+ */
+int usb_moded_mount_tmpfs(const char *path)
+{
+    int err = 0;
+
+    log_debug("mount tmpfs on %s", path);
+
+    if( usb_moded_root_stubbed() )
+        goto EXIT;
+
+    if( mount("tmpfs", path, "tmpfs", MS_RDONLY, "size=512K") == -1 ) {
+        err = errno;
+        log_warning("mount tmpfs %s: %s", path, strerror(err));
+    }
+
+EXIT:
+    return err;
+}
+
+/** Start following mount table changes
+ *
+ * Only one watch can be active at a time, starting a new one replaces
+ * the callback of the previous one.
+ *
+ * @param changed_cb function to call when the mount table changes
+ *
+ * @return TRUE if changes can be followed, FALSE otherwise
+ */
+gboolean usb_moded_mount_watch_start(void (*changed_cb)(void))
+{
+    GIOChannel *chn = 0;
+    int fd = -1;
+    gchar *info = 0;
+
+    mount_watch_cb = changed_cb;
+
+    if( mount_watch_id )
+        goto EXIT;
+
+    info = usb_moded_root_path(MOUNT_MOUNTINFO_PATH);
+    fd = open(info, O_RDONLY | O_CLOEXEC);
+    if( fd == -1 ) {
+        log_warning("%s: open: %m", MOUNT_MOUNTINFO_PATH);
+        goto EXIT;
+    }
+
+    if( !(chn = g_io_channel_unix_new(fd)) )
+        goto EXIT;
+
+    g_io_channel_set_close_on_unref(chn, TRUE), fd = -1;
+    mount_watch_id = g_io_add_watch(chn, G_IO_PRI | G_IO_ERR,
+                                    mount_watch_io_cb, 0);
+
+EXIT:
+    if( chn )
+        g_io_channel_unref(chn);
+    if( fd != -1 )
+        close(fd);
+    g_free(info);
+
+    return mount_watch_id != 0;
+}
+
+/** Stop following mount table changes
+ */
+void usb_moded_mount_watch_stop(void)
+{
+    mount_watch_cb = 0;
+
+    if( mount_watch_id )
+        g_source_remove(mount_watch_id), mount_watch_id = 0;
+}
+
+/** Start looking for processes that keep mounts busy
+ *
+ * A scan of the same mounts that is already in progress is left to
+ * finish, a scan of other mounts is cancelled. The scan runs from
+ * idle callbacks and reports each process holding files, working
+ * directory, root or mappings on the mounts once. Mount points that
+ * are not mounted are skipped.
+ *
+ * @param mounts    comma separated list of mount points
+ * @param holder_cb function to call for each holder found
+ */
+void usb_moded_mount_scan_holders(const char *mounts, mount_holder_fn holder_cb)
+{
+    gchar       **vec  = 0;
+    mount_scan_t *scan = 0;
+    gchar        *real = 0;
+    struct stat   st;
+
+    if( mount_scan && mount_scan->holder_cb == holder_cb &&
+        !g_strcmp0(mount_scan->mounts, mounts ?: "") ) {
+        log_debug("mount holder scan of %s already in progress", mounts);
+        goto EXIT;
+    }
+
+    usb_moded_mount_scan_cancel();
+
+    vec  = g_strsplit(mounts ?: "", ",", 0);
+    scan = g_malloc0(sizeof *scan);
+    scan->mounts    = g_strdup(mounts ?: "");
+    scan->holder_cb = holder_cb;
+    scan->started   = g_get_monotonic_time();
+    scan->devs      = g_new0(dev_t, g_strv_length(vec) + 1);
+
+    for( int i = 0; vec[i]; ++i ) {
+        /* an unmounted mountpoint would stat to the device of its
+         * parent and match everything living there */
+        if( !usb_moded_mount_is_mounted(vec[i]) ) {
+            log_debug("%s: not mounted, not scanned", vec[i]);
+            continue;
+        }
+
+        real = usb_moded_root_path(vec[i]);
+        if( stat(real, &st) == -1 )
+            log_warning("%s: stat: %m", vec[i]);
+        else
+            scan->devs[scan->ndevs++] = st.st_dev;
+        g_free(real);
+    }
+
+    if( !scan->ndevs )
+        goto EXIT;
+
+    real = usb_moded_root_path("/proc");
+    scan->proc = opendir(real);
+    g_free(real);
+    if( !scan->proc ) {
+        log_warning("/proc: opendir: %m");
+        goto EXIT;
+    }
+
+    mount_scan = scan, scan = 0;
+    mount_scan_id = g_idle_add(mount_scan_cb, 0);
+
+EXIT:
+    mount_scan_free(scan);
+    g_strfreev(vec);
+}
+
+/** Cancel holder scan in progress
+ */
+void usb_moded_mount_scan_cancel(void)
+{
+    if( mount_scan_id )
+        g_source_remove(mount_scan_id), mount_scan_id = 0;
+
+    mount_scan_free(mount_scan), mount_scan = 0;
+}
+
+/** Release mount tracking resources on exit
+ */
+void usb_moded_mount_quit(void)
+{
+    usb_moded_mount_scan_cancel();
+    usb_moded_mount_watch_stop();
+}
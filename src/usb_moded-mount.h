@@ -0,0 +1,45 @@
+/**
+  @file usb_moded-mount.h
+
+  Copyright (C) 2016 Jolla. All rights reserved.
+
+  @author: Philippe De Swert <philippe.deswert@jollamobile.com>
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the Lesser GNU General Public License 
+  version 2 as published by the Free Software Foundation. 
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  General Public License for more details.
+ 
+  You should have received a copy of the Lesser GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+  02110-1301 USA
+*/
+
+#ifndef USB_MODED_MOUNT_H_
+#define USB_MODED_MOUNT_H_
+
+#include <sys/types.h>
+#include <glib.h>
+
+/** Called for each process found holding files on scanned mounts */
+typedef void (*mount_holder_fn)(pid_t pid, const char *comm);
+
+gboolean usb_moded_mount_is_mounted(const char *path);
+int      usb_moded_mount_umount(const char *path);
+int      usb_moded_mount_mount(const char *path);
+int      usb_moded_mount_tmpfs(const char *path);
+
+gboolean usb_moded_mount_watch_start(void (*changed_cb)(void));
+void     usb_moded_mount_watch_stop(void);
+
+void     usb_moded_mount_scan_holders(const char *mounts, mount_holder_fn holder_cb);
+void     usb_moded_mount_scan_cancel(void);
+
+void     usb_moded_mount_quit(void);
+
+#endif /* USB_MODED_MOUNT_H_ */
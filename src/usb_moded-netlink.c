@@ -0,0 +1,583 @@
+/**
+  @file usb_moded-netlink.c
+
+  Copyright (C) 2016 Jolla. All rights reserved.
+
+  @author: Philippe De Swert <philippe.deswert@jollamobile.com>
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the Lesser GNU General Public License
+  version 2 as published by the Free Software Foundation.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  General Public License for more details.
+
+  You should have received a copy of the Lesser GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+  02110-1301 USA
+*/
+
+/*
+ * Usb network interface configuration over rtnetlink
+ *
+ * Replaces running ifconfig and route: bringing the link up, setting
+ * the address and adding the default route are sent to the kernel as
+ * one batch of requests, and the acknowledgement of each request is
+ * checked.
+ *
+ * Interfaces appearing and changing state can be followed from the
+ * RTNLGRP_LINK multicast group.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+
+#include <glib.h>
+
+#include "usb_moded-netlink.h"
+#include "usb_moded-log.h"
+#include "usb_moded-root.h"
+#include "usb_moded-trace.h"
+
+/* ========================================================================= *
+ * State data
+ * ========================================================================= */
+
+/** Link notification socket and its io watch */
+static int             netlink_link_fd = -1;
+static guint           netlink_link_id = 0;
+static netlink_link_fn netlink_link_cb = 0;
+
+/* ========================================================================= *
+ * Request batch
+ * ========================================================================= */
+
+/** Maximum number of requests in one batch */
+#define NETLINK_BATCH_MAX 4
+
+/** Requests to send in one go */
+typedef struct netlink_batch_t
+{
+    char         buf[1024] __attribute__((aligned(NLMSG_ALIGNTO)));
+    size_t       len;
+    int          count;
+    const char  *what[NETLINK_BATCH_MAX];
+} netlink_batch_t;
+
+/** Start a new request in the batch
+ *
+ * @return request header, or NULL if the batch is full
+ */
+static struct nlmsghdr *netlink_batch_add(netlink_batch_t *batch,
+                                          const char *what, int type,
+                                          int flags, size_t payload)
+{
+    struct nlmsghdr *nh;
+    size_t           len = NLMSG_SPACE(payload);
+
+    if( batch->count >= NETLINK_BATCH_MAX ||
+        batch->len + len > sizeof batch->buf )
+        return 0;
+
+    nh = (struct nlmsghdr *)(batch->buf + batch->len);
+    memset(nh, 0, len);
+    nh->nlmsg_len   = NLMSG_LENGTH(payload);
+    nh->nlmsg_type  = type;
+    nh->nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK | flags;
+    nh->nlmsg_seq   = ++batch->count;
+
+    batch->what[batch->count - 1] = what;
+    return nh;
+}
+
+/** Append attribute to the request last added */
+static bool netlink_batch_attr(netlink_batch_t *batch, struct nlmsghdr *nh,
+                               int type, const void *data, size_t size)
+{
+    struct rtattr *rta;
+    size_t         len = RTA_SPACE(size);
+
+    if( !nh || batch->len + NLMSG_ALIGN(nh->nlmsg_len) + len > sizeof batch->buf )
+        return false;
+
+    rta = (struct rtattr *)((char *)nh + NLMSG_ALIGN(nh->nlmsg_len));
+    rta->rta_type = type;
+    rta->rta_len  = RTA_LENGTH(size);
+    memcpy(RTA_DATA(rta), data, size);
+    nh->nlmsg_len = NLMSG_ALIGN(nh->nlmsg_len) + len;
+    return true;
+}
+
+/** Close the request last added */
+static void netlink_batch_end(netlink_batch_t *batch, struct nlmsghdr *nh)
+{
+    if( nh )
+        batch->len += NLMSG_ALIGN(nh->nlmsg_len);
+}
+
+static struct nlmsghdr *netlink_add_link(netlink_batch_t *batch, int ifindex,
+                                         bool up)
+{
+    struct nlmsghdr  *nh;
+    struct ifinfomsg *ifi;
+
+    nh = netlink_batch_add(batch, up ? "link up" : "link down",
+                           RTM_NEWLINK, 0, sizeof *ifi);
+    if( nh ) {
+        ifi = NLMSG_DATA(nh);
+        ifi->ifi_family = AF_UNSPEC;
+        ifi->ifi_index  = ifindex;
+        ifi->ifi_flags  = up ? IFF_UP : 0;
+        ifi->ifi_change = IFF_UP;
+    }
+    return nh;
+}
+
+static struct nlmsghdr *netlink_add_address(netlink_batch_t *batch, int ifindex,
+                                            struct in_addr addr, int prefix,
+                                            bool add)
+{
+    struct nlmsghdr  *nh;
+    struct ifaddrmsg *ifa;
+    struct in_addr    brd = addr;
+
+    if( prefix < 32 )
+        brd.s_addr |= htonl(0xffffffffu >> prefix);
+
+    if( add )
+        nh = netlink_batch_add(batch, "address", RTM_NEWADDR,
+                               NLM_F_CREATE | NLM_F_REPLACE, sizeof *ifa);
+    else
+        nh = netlink_batch_add(batch, "delete address", RTM_DELADDR,
+                               0, sizeof *ifa);
+    if( nh ) {
+        ifa = NLMSG_DATA(nh);
+        ifa->ifa_family    = AF_INET;
+        ifa->ifa_prefixlen = prefix;
+        ifa->ifa_index     = ifindex;
+        ifa->ifa_scope     = RT_SCOPE_UNIVERSE;
+        netlink_batch_attr(batch, nh, IFA_LOCAL, &addr, sizeof addr);
+        netlink_batch_attr(batch, nh, IFA_ADDRESS, &addr, sizeof addr);
+        netlink_batch_attr(batch, nh, IFA_BROADCAST, &brd, sizeof brd);
+    }
+    return nh;
+}
+
+static struct nlmsghdr *netlink_add_default_route(netlink_batch_t *batch,
+                                                  int ifindex,
+                                                  struct in_addr gw,
+                                                  int type, int flags)
+{
+    struct nlmsghdr *nh;
+    struct rtmsg    *rtm;
+    uint32_t         oif = ifindex;
+
+    nh = netlink_batch_add(batch,
+                           type == RTM_DELROUTE ? "delete default route"
+                                                : "default route",
+                           type, flags, sizeof *rtm);
+    if( nh ) {
+        rtm = NLMSG_DATA(nh);
+        rtm->rtm_family   = AF_INET;
+        rtm->rtm_table    = RT_TABLE_MAIN;
+        rtm->rtm_protocol = RTPROT_BOOT;
+        rtm->rtm_scope    = RT_SCOPE_UNIVERSE;
+        rtm->rtm_type     = RTN_UNICAST;
+        netlink_batch_attr(batch, nh, RTA_GATEWAY, &gw, sizeof gw);
+        netlink_batch_attr(batch, nh, RTA_OIF, &oif, sizeof oif);
+    }
+    return nh;
+}
+
+/** Send batch and wait for the acknowledgements
+ *
+ * @return 0 if all requests succeeded, -1 otherwise
+ */
+static int netlink_batch_send(netlink_batch_t *batch)
+{
+    int                 ret   = -1;
+    int                 fd    = -1;
+    int                 acked = 0;
+    struct sockaddr_nl  kernel = { .nl_family = AF_NETLINK };
+    char                buf[4096] __attribute__((aligned(NLMSG_ALIGNTO)));
+    gint64              start = usb_moded_trace_now();
+
+    if( batch->count == 0 )
+        return 0;
+
+    fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+    if( fd == -1 ) {
+        log_err("netlink: socket: %m");
+        goto EXIT;
+    }
+
+    if( sendto(fd, batch->buf, batch->len, 0,
+               (struct sockaddr *)&kernel, sizeof kernel) != (ssize_t)batch->len ) {
+        log_err("netlink: send: %m");
+        goto EXIT;
+    }
+
+    ret = 0;
+    while( acked < batch->count ) {
+        ssize_t          len = recv(fd, buf, sizeof buf, 0);
+        struct nlmsghdr *nh;
+
+        if( len < 0 ) {
+            if( errno == EINTR )
+                continue;
+            log_err("netlink: recv: %m");
+            ret = -1;
+            goto EXIT;
+        }
+
+        for( nh = (struct nlmsghdr *)buf; NLMSG_OK(nh, (size_t)len);
+             nh = NLMSG_NEXT(nh, len) ) {
+            struct nlmsgerr *err = NLMSG_DATA(nh);
+            const char      *what;
+
+            if( nh->nlmsg_type != NLMSG_ERROR || nh->nlmsg_seq < 1 ||
+                nh->nlmsg_seq > (unsigned)batch->count )
+                continue;
+
+            acked++;
+            what = batch->what[nh->nlmsg_seq - 1];
+
+            /* the same default route being there already is fine */
+            if( err->error == 0 ||
+                (err->error == -EEXIST && !strcmp(what, "default route")) )
+                continue;
+
+            log_err("netlink: %s: %s", what, strerror(-err->error));
+            ret = -1;
+        }
+    }
+
+EXIT:
+    if( fd != -1 )
+        close(fd);
+
+    usb_moded_trace_span(TRACE_EXEC, start, "netlink: %d requests%s",
+                         batch->count, ret ? " failed" : "");
+    return ret;
+}
+
+/* ========================================================================= *
+ * Helpers
+ * ========================================================================= */
+
+/** Prefix length from netmask, or from the address class like ifconfig */
+static int netlink_prefix(struct in_addr addr, const char *netmask)
+{
+    struct in_addr mask;
+    uint32_t       bits;
+    int            prefix = 0;
+
+    if( netmask && inet_pton(AF_INET, netmask, &mask) == 1 ) {
+        for( bits = ntohl(mask.s_addr); bits & 0x80000000u; bits <<= 1 )
+            prefix++;
+        return prefix;
+    }
+
+    bits = ntohl(addr.s_addr);
+    if( (bits & 0x80000000u) == 0 )
+        return 8;
+    if( (bits & 0xc0000000u) == 0x80000000u )
+        return 16;
+    return 24;
+}
+
+/* ========================================================================= *
+ * Link notifications
+ * ========================================================================= */
+
+/** Dispatch RTM_NEWLINK notifications to the link callback */
+static gboolean netlink_link_io_cb(GIOChannel *channel, GIOCondition condition,
+                                   gpointer aptr)
+{
+    char    buf[8192] __attribute__((aligned(NLMSG_ALIGNTO)));
+    ssize_t len;
+
+    (void)channel;
+    (void)aptr;
+
+    if( condition & ~G_IO_IN ) {
+        log_err("netlink: link notifications failed");
+        netlink_link_id = 0;
+        usb_moded_netlink_link_watch_stop();
+        return FALSE;
+    }
+
+    if( (len = recv(netlink_link_fd, buf, sizeof buf, MSG_DONTWAIT)) < 0 ) {
+        if( errno != EAGAIN && errno != EINTR )
+            log_warning("netlink: recv: %m");
+        return TRUE;
+    }
+
+    for( struct nlmsghdr *nh = (struct nlmsghdr *)buf;
+         NLMSG_OK(nh, (size_t)len); nh = NLMSG_NEXT(nh, len) ) {
+        struct ifinfomsg *ifi = NLMSG_DATA(nh);
+        struct rtattr    *rta = IFLA_RTA(ifi);
+        int               rtl = IFLA_PAYLOAD(nh);
+        const char       *ifname = 0;
+
+        if( nh->nlmsg_type != RTM_NEWLINK )
+            continue;
+
+        for( ; RTA_OK(rta, rtl); rta = RTA_NEXT(rta, rtl) ) {
+            if( rta->rta_type == IFLA_IFNAME )
+                ifname = RTA_DATA(rta);
+        }
+
+        if( !ifname )
+            continue;
+
+        log_debug("netlink: link %s flags 0x%x", ifname, ifi->ifi_flags);
+
+        /* the callback may stop the watch */
+        if( !netlink_link_cb )
+            break;
+        netlink_link_cb(ifname, ifi->ifi_flags);
+    }
+
+    return netlink_link_id != 0;
+}
+
+/* ========================================================================= *
+ * External API
+ * ========================================================================= */
+
+/** Configure and bring up a network interface
+ *
+ * @param ifname  interface name
+ * @param ip      ipv4 address
+ * @param netmask netmask, or NULL for the default of the address class
+ * @param gateway default gateway, or NULL for none
+ *
+ * @return 0 on success, -1 on failure
+ */
+int usb_moded_netlink_up(const char *ifname, const char *ip,
+                         const char *netmask, const char *gateway)
+{
+    netlink_batch_t  batch = { .len = 0 };
+    struct in_addr   addr, gw;
+    int              ifindex;
+
+    log_debug("netlink: %s up %s/%s gw %s", ifname, ip ?: "-",
+              netmask ?: "-", gateway ?: "-");
+
+    if( usb_moded_root_stubbed() )
+        return 0;
+
+    if( !(ifindex = if_nametoindex(ifname)) ) {
+        log_err("netlink: %s: %m", ifname);
+        return -1;
+    }
+
+    netlink_batch_end(&batch, netlink_add_link(&batch, ifindex, true));
+
+    if( ip ) {
+        if( inet_pton(AF_INET, ip, &addr) != 1 ) {
+            log_err("netlink: invalid address '%s'", ip);
+            return -1;
+        }
+        netlink_batch_end(&batch,
+                          netlink_add_address(&batch, ifindex, addr,
+                                              netlink_prefix(addr, netmask),
+                                              true));
+    }
+
+    if( gateway ) {
+        if( inet_pton(AF_INET, gateway, &gw) != 1 ) {
+            log_err("netlink: invalid gateway '%s'", gateway);
+            return -1;
+        }
+        /* like route add: another default route with a different
+         * gateway is not replaced */
+        netlink_batch_end(&batch,
+                          netlink_add_default_route(&batch, ifindex, gw,
+                                                    RTM_NEWROUTE,
+                                                    NLM_F_CREATE));
+    }
+
+    return netlink_batch_send(&batch);
+}
+
+/** Apply changed settings to an interface that is up
+ *
+ * Only the differences are sent: the old address is replaced if the
+ * address or netmask changed, and the default route is replaced or
+ * removed if the gateway changed. The link itself is not touched.
+ *
+ * @param ifname      interface name
+ * @param old_ip      address currently set, or NULL
+ * @param old_netmask netmask currently set, or NULL
+ * @param old_gateway gateway currently set, or NULL
+ * @param ip          new address
+ * @param netmask     new netmask, or NULL for the default of the address class
+ * @param gateway     new gateway, or NULL for none
+ *
+ * @return 0 on success, -1 on failure
+ */
+int usb_moded_netlink_update(const char *ifname,
+                             const char *old_ip, const char *old_netmask,
+                             const char *old_gateway,
+                             const char *ip, const char *netmask,
+                             const char *gateway)
+{
+    netlink_batch_t  batch = { .len = 0 };
+    struct in_addr   addr, gw;
+    int              ifindex;
+    bool             readdress = (g_strcmp0(old_ip, ip) ||
+                                  g_strcmp0(old_netmask, netmask));
+
+    log_debug("netlink: %s update %s/%s gw %s", ifname, ip ?: "-",
+              netmask ?: "-", gateway ?: "-");
+
+    if( usb_moded_root_stubbed() )
+        return 0;
+
+    if( !(ifindex = if_nametoindex(ifname)) ) {
+        log_err("netlink: %s: %m", ifname);
+        return -1;
+    }
+
+    /* drop the old route first, removing the address might take it too */
+    if( old_gateway && !gateway &&
+        inet_pton(AF_INET, old_gateway, &gw) == 1 ) {
+        netlink_batch_end(&batch,
+                          netlink_add_default_route(&batch, ifindex, gw,
+                                                    RTM_DELROUTE, 0));
+    }
+
+    if( readdress ) {
+        if( old_ip && inet_pton(AF_INET, old_ip, &addr) == 1 ) {
+            netlink_batch_end(&batch,
+                              netlink_add_address(&batch, ifindex, addr,
+                                                  netlink_prefix(addr, old_netmask),
+                                                  false));
+        }
+        if( !ip || inet_pton(AF_INET, ip, &addr) != 1 ) {
+            log_err("netlink: invalid address '%s'", ip ?: "-");
+            return -1;
+        }
+        netlink_batch_end(&batch,
+                          netlink_add_address(&batch, ifindex, addr,
+                                              netlink_prefix(addr, netmask),
+                                              true));
+    }
+
+    if( gateway && (readdress || g_strcmp0(old_gateway, gateway)) ) {
+        if( inet_pton(AF_INET, gateway, &gw) != 1 ) {
+            log_err("netlink: invalid gateway '%s'", gateway);
+            return -1;
+        }
+        netlink_batch_end(&batch,
+                          netlink_add_default_route(&batch, ifindex, gw,
+                                                    RTM_NEWROUTE,
+                                                    NLM_F_CREATE |
+                                                    NLM_F_REPLACE));
+    }
+
+    return netlink_batch_send(&batch);
+}
+
+/** Bring down a network interface
+ *
+ * @param ifname interface name
+ *
+ * @return 0 on success, -1 on failure
+ */
+int usb_moded_netlink_down(const char *ifname)
+{
+    netlink_batch_t batch = { .len = 0 };
+    int             ifindex;
+
+    log_debug("netlink: %s down", ifname);
+
+    if( usb_moded_root_stubbed() )
+        return 0;
+
+    if( !(ifindex = if_nametoindex(ifname)) ) {
+        log_err("netlink: %s: %m", ifname);
+        return -1;
+    }
+
+    netlink_batch_end(&batch, netlink_add_link(&batch, ifindex, false));
+
+    return netlink_batch_send(&batch);
+}
+
+/** Start following network interfaces appearing and changing state
+ *
+ * Only one watch can be active at a time, starting a new one replaces
+ * the callback of the previous one.
+ *
+ * @param link_cb function to call for each link notification
+ *
+ * @return 0 on success, -1 on failure
+ */
+int usb_moded_netlink_link_watch_start(netlink_link_fn link_cb)
+{
+    struct sockaddr_nl  sa  = {
+        .nl_family = AF_NETLINK,
+        .nl_groups = RTMGRP_LINK,
+    };
+    GIOChannel         *chn = 0;
+
+    netlink_link_cb = link_cb;
+
+    if( netlink_link_id || usb_moded_root_stubbed() )
+        return 0;
+
+    netlink_link_fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+    if( netlink_link_fd == -1 ) {
+        log_err("netlink: socket: %m");
+        goto FAIL;
+    }
+
+    if( bind(netlink_link_fd, (struct sockaddr *)&sa, sizeof sa) == -1 ) {
+        log_err("netlink: bind: %m");
+        goto FAIL;
+    }
+
+    if( !(chn = g_io_channel_unix_new(netlink_link_fd)) )
+        goto FAIL;
+    netlink_link_id = g_io_add_watch(chn, G_IO_IN | G_IO_ERR | G_IO_HUP,
+                                     netlink_link_io_cb, 0);
+    g_io_channel_unref(chn);
+    if( !netlink_link_id )
+        goto FAIL;
+
+    return 0;
+
+FAIL:
+    usb_moded_netlink_link_watch_stop();
+    return -1;
+}
+
+/** Stop following network interfaces
+ */
+void usb_moded_netlink_link_watch_stop(void)
+{
+    netlink_link_cb = 0;
+
+    if( netlink_link_id )
+        g_source_remove(netlink_link_id), netlink_link_id = 0;
+
+    if( netlink_link_fd != -1 )
+        close(netlink_link_fd), netlink_link_fd = -1;
+}
@@ -0,0 +1,41 @@
+/**
+  @file usb_moded-netlink.h
+
+  Copyright (C) 2016 Jolla. All rights reserved.
+
+  @author: Philippe De Swert <philippe.deswert@jollamobile.com>
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the Lesser GNU General Public License 
+  version 2 as published by the Free Software Foundation. 
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  General Public License for more details.
+ 
+  You should have received a copy of the Lesser GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+  02110-1301 USA
+*/
+
+#ifndef USB_MODED_NETLINK_H_
+#define USB_MODED_NETLINK_H_
+
+int usb_moded_netlink_up(const char *ifname, const char *ip,
+                         const char *netmask, const char *gateway);
+int usb_moded_netlink_down(const char *ifname);
+int usb_moded_netlink_update(const char *ifname,
+                             const char *old_ip, const char *old_netmask,
+                             const char *old_gateway,
+                             const char *ip, const char *netmask,
+                             const char *gateway);
+
+/** Called when a network interface appears or changes state */
+typedef void (*netlink_link_fn)(const char *ifname, unsigned flags);
+
+int  usb_moded_netlink_link_watch_start(netlink_link_fn link_cb);
+void usb_moded_netlink_link_watch_stop(void);
+
+#endif /* USB_MODED_NETLINK_H_ */
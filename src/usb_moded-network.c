@@ -30,17 +30,32 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <limits.h>
 
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/wait.h>
 
 #include <glib.h>
 
 #include "usb_moded.h"
 #include "usb_moded-network.h"
 #include "usb_moded-config.h"
+#include "usb_moded-dbus.h"
+#include "usb_moded-dbus-private.h"
 #include "usb_moded-log.h"
 #include "usb_moded-modesetting.h"
+#include "usb_moded-root.h"
+#include "usb_moded-netlink.h"
+#include "usb_moded-trace.h"
+#include "usb_moded-dhcpd.h"
+#include "usb_moded-transition.h"
+#ifdef CONNMAN
+#include "usb_moded-connman.h"
+#endif
+#ifdef OFONO
+#include "usb_moded-ofono.h"
+#endif
 
 #if CONNMAN || OFONO
 #include <dbus/dbus.h>
@@ -65,10 +80,6 @@ typedef struct ipforward_data
 	char *nat_interface;
 }ipforward_data;
 
-#ifdef CONNMAN
-static int connman_reset_state(void);
-#endif
-
 static void free_ipforward_data (struct ipforward_data *ipforward)
 {
   if(ipforward)
@@ -83,6 +94,39 @@ static void free_ipforward_data (struct ipforward_data *ipforward)
   }
 }
 
+/* Settings last applied by usb_network_up(), so that usb_network_update()
+   can apply only what changed */
+static struct
+{
+	char *interface;
+	char *ip;
+	char *netmask;
+	char *gateway;
+	char *nat_interface;
+} network_applied;
+
+static void network_applied_clear(void)
+{
+  free(network_applied.interface);
+  free(network_applied.ip);
+  free(network_applied.netmask);
+  free(network_applied.gateway);
+  free(network_applied.nat_interface);
+  memset(&network_applied, 0, sizeof network_applied);
+}
+
+/* takes ownership of the strings */
+static void network_applied_set(char *interface, char *ip, char *netmask,
+				char *gateway, char *nat_interface)
+{
+  network_applied_clear();
+  network_applied.interface = interface;
+  network_applied.ip = ip;
+  network_applied.netmask = netmask;
+  network_applied.gateway = gateway;
+  network_applied.nat_interface = nat_interface;
+}
+
 /* This function checks if the configured interface exists */
 static int check_interface(char *interface)
 {
@@ -91,8 +135,12 @@ static int check_interface(char *interface)
   if(interface)
   {
     char path[256];
+    gchar *real;
+
     snprintf(path, sizeof path, "/sys/class/net/%s", interface);
-    ret = access(path, F_OK);
+    real = usb_moded_root_path(path);
+    ret = access(real, F_OK);
+    g_free(real);
   }
 
   return ret;
@@ -127,6 +175,235 @@ static char* get_interface(struct mode_list_elem *data)
   return interface;
 }
 
+/**
+ * Check whether a network interface is the one usb networking uses
+ *
+ * @param data the mode data
+ * @param ifname the name of the interface
+ * @return TRUE if ifname is the configured or the fallback interface,
+ *         i.e. one get_interface() could pick
+ */
+gboolean usb_network_is_interface(struct mode_list_elem *data, const char *ifname)
+{
+  gboolean ret = FALSE;
+  char *setting = get_network_setting(NETWORK_INTERFACE_KEY);
+
+  (void)data;
+
+  if(ifname)
+	ret = (setting && !strcmp(ifname, setting)) ||
+		!strcmp(ifname, default_interface);
+
+  free(setting);
+  return ret;
+}
+
+/**
+ * Check whether the interface usb networking uses exists already
+ *
+ * @param data the mode data
+ * @return TRUE if the configured or the fallback interface exists
+ */
+gboolean usb_network_has_interface(struct mode_list_elem *data)
+{
+  gboolean ret;
+  char *setting = get_network_setting(NETWORK_INTERFACE_KEY);
+
+  (void)data;
+
+  ret = (check_interface(setting) == 0) ||
+	(check_interface((char *)default_interface) == 0);
+
+  free(setting);
+  return ret;
+}
+
+/* NAT rules are kept in a table / chains of their own, so that
+   tearing them down does not touch rules installed by others */
+#define NAT_CHAIN		"usb_moded"
+#define NAT_NFT			"/usr/sbin/nft"
+#define NAT_IPTABLES_RESTORE	"/sbin/iptables-restore"
+#define NAT_IPTABLES_SAVE	"/sbin/iptables-save"
+
+/* rules have been installed, and by which tool */
+static const char *nat_installed = NULL;
+
+/* feed a ruleset to nft or iptables-restore, applied as one transaction */
+static int nat_apply(const char *tool, const char *ruleset)
+{
+  char command[128];
+  FILE *stream;
+  int status;
+
+  if(!strcmp(tool, NAT_NFT))
+	snprintf(command, sizeof command, "%s -f -", tool);
+  else
+	snprintf(command, sizeof command, "%s --noflush", tool);
+
+  log_debug("nat ruleset:\n%s", ruleset);
+
+  if(!(stream = usb_moded_popen(command, "w")))
+	return(1);
+  fputs(ruleset, stream);
+  status = pclose(stream);
+  if(status == -1)
+	log_warning("%s: pclose: %m\n", command);
+  else if(!WIFEXITED(status))
+	log_warning("%s: terminated abnormally, status 0x%x\n", command, status);
+  else if(WEXITSTATUS(status) == 0)
+	return(0);
+  else
+	log_warning("%s: exit code %d\n", command, WEXITSTATUS(status));
+  return(1);
+}
+
+/* the whole table is replaced in one batch, creating it first makes the
+   delete succeed also when it does not exist yet; without interfaces
+   the table is only removed */
+static gchar *nat_nft_ruleset(const char *interface, const char *nat_interface)
+{
+  if(!interface)
+	return g_strdup("table ip " NAT_CHAIN " {}\n"
+			"delete table ip " NAT_CHAIN "\n");
+
+  return g_strdup_printf(
+	"table ip " NAT_CHAIN " {}\n"
+	"delete table ip " NAT_CHAIN "\n"
+	"table ip " NAT_CHAIN " {\n"
+	"  chain postrouting {\n"
+	"    type nat hook postrouting priority 100;\n"
+	"    oifname \"%s\" masquerade\n"
+	"  }\n"
+	"  chain forward {\n"
+	"    type filter hook forward priority 0;\n"
+	"    iifname \"%s\" oifname \"%s\" ct state related,established accept\n"
+	"    iifname \"%s\" oifname \"%s\" accept\n"
+	"  }\n"
+	"}\n",
+	nat_interface,
+	nat_interface, interface,
+	interface, nat_interface);
+}
+
+/* add deletes for the jumps to our chains that are currently installed,
+   also ones left behind by an earlier instance, to the nat and filter
+   parts of a ruleset; deleting a missing rule would abort the whole
+   transaction, so only the jumps iptables-save lists are deleted */
+static void nat_iptables_unjump(GString *nat, GString *filter)
+{
+  GString *table = NULL;
+  FILE *stream;
+  char *line = 0;
+  size_t size = 0;
+
+  if(!(stream = usb_moded_popen(NAT_IPTABLES_SAVE, "r")))
+	return;
+
+  while(getline(&line, &size, stream) != -1)
+  {
+	g_strchomp(line);
+	if(*line == '*')
+		table = !strcmp(line, "*nat") ? nat :
+			!strcmp(line, "*filter") ? filter : NULL;
+	else if(table && !strncmp(line, "-A ", 3) &&
+		g_str_has_suffix(line, " -j " NAT_CHAIN))
+		g_string_append_printf(table, "-D %s\n", line + 3);
+  }
+
+  free(line);
+  pclose(stream);
+}
+
+/* one transaction that replaces the jumps and the rules in our chains;
+   declaring the chains creates them, or flushes them if they exist.
+   Without interfaces the chains and jumps are only removed */
+static gchar *nat_iptables_ruleset(const char *interface, const char *nat_interface)
+{
+  GString *nat = g_string_new("*nat\n:" NAT_CHAIN " - [0:0]\n");
+  GString *filter = g_string_new("*filter\n:" NAT_CHAIN " - [0:0]\n");
+
+  nat_iptables_unjump(nat, filter);
+
+  if(interface)
+  {
+	g_string_append_printf(nat,
+		"-A " NAT_CHAIN " -o %s -j MASQUERADE\n"
+		"-I POSTROUTING -j " NAT_CHAIN "\n",
+		nat_interface);
+	g_string_append_printf(filter,
+		"-A " NAT_CHAIN " -i %s -o %s -m state --state RELATED,ESTABLISHED -j ACCEPT\n"
+		"-A " NAT_CHAIN " -i %s -o %s -j ACCEPT\n"
+		"-I FORWARD -j " NAT_CHAIN "\n",
+		nat_interface, interface,
+		interface, nat_interface);
+  }
+  else
+  {
+	g_string_append(nat, "-X " NAT_CHAIN "\n");
+	g_string_append(filter, "-X " NAT_CHAIN "\n");
+  }
+
+  g_string_append(nat, "COMMIT\n");
+  g_string_append(filter, "COMMIT\n");
+  g_string_append(nat, filter->str);
+  g_string_free(filter, TRUE);
+  return g_string_free(nat, FALSE);
+}
+
+/* remove the rules installed by nat_setup() */
+static void nat_teardown(void)
+{
+  const char *tool = nat_installed;
+  gchar *ruleset;
+
+  if(!tool)
+	return;
+  nat_installed = NULL;
+
+  if(!strcmp(tool, NAT_NFT))
+	ruleset = nat_nft_ruleset(NULL, NULL);
+  else
+	ruleset = nat_iptables_ruleset(NULL, NULL);
+  nat_apply(tool, ruleset);
+  g_free(ruleset);
+}
+
+/* install masquerading and forwarding between the usb and nat interfaces,
+   replacing rules installed earlier with the same tool in the same
+   transaction, so forwarded traffic is not interrupted */
+static int nat_setup(const char *interface, const char *nat_interface)
+{
+  gchar *ruleset;
+  const char *tool;
+  int ret;
+
+  if(access(NAT_NFT, X_OK) == 0 || usb_moded_root_stubbed())
+	tool = NAT_NFT;
+  else if(access(NAT_IPTABLES_RESTORE, X_OK) == 0)
+	tool = NAT_IPTABLES_RESTORE;
+  else
+  {
+	nat_teardown();
+	log_err("neither %s nor %s available for nat\n", NAT_NFT, NAT_IPTABLES_RESTORE);
+	return(1);
+  }
+
+  /* rules of the other tool are not part of the replaced set */
+  if(nat_installed && strcmp(nat_installed, tool))
+	nat_teardown();
+
+  if(!strcmp(tool, NAT_NFT))
+	ruleset = nat_nft_ruleset(interface, nat_interface);
+  else
+	ruleset = nat_iptables_ruleset(interface, nat_interface);
+
+  ret = nat_apply(tool, ruleset);
+  if(!ret)
+	nat_installed = tool;
+  g_free(ruleset);
+  return(ret);
+}
+
 /**
  * Turn on ip forwarding on the usb interface
  * @return: 0 on success, 1 on failure
@@ -134,37 +411,39 @@ static char* get_interface(struct mode_list_elem *data)
 static int set_usb_ip_forward(struct mode_list_elem *data, struct ipforward_data *ipforward)
 {
   char *interface, *nat_interface;
-  char command[128];
+  gint64 start;
+  int ret;
 
   interface = get_interface(data);
   if(interface == NULL)
 	return(1);
   nat_interface = get_network_setting(NETWORK_NAT_INTERFACE_KEY);
-  if((nat_interface == NULL) && (ipforward->nat_interface != NULL))
+  /* a configured nat interface takes precedence over the detected one */
+  if((nat_interface == NULL) && ipforward && (ipforward->nat_interface != NULL))
 	nat_interface = strdup(ipforward->nat_interface);
-  else
+  if(nat_interface == NULL)
   {
 	log_debug("No nat interface available!\n");
 #ifdef CONNMAN
 	/* in case the cellular did not come up we want to make sure wifi gets restored */
-	connman_reset_state();
+	usb_moded_connman_reset_state();
 #endif
 	free(interface);
 	free(nat_interface);
 	return(1);
   }
+  start = usb_moded_trace_now();
   write_to_file("/proc/sys/net/ipv4/ip_forward", "1");
-  snprintf(command, 128, "/sbin/iptables -t nat -A POSTROUTING -o %s -j MASQUERADE", nat_interface);
-  usb_moded_system(command);
-
-  snprintf(command, 128, "/sbin/iptables -A FORWARD -i %s -o %s  -m state  --state RELATED,ESTABLISHED -j ACCEPT", nat_interface, interface);
-  usb_moded_system(command);
-
-  snprintf(command, 128, "/sbin/iptables -A FORWARD -i %s -o %s -j ACCEPT", interface, nat_interface);
-  usb_moded_system(command);
+  ret = nat_setup(interface, nat_interface);
+  usb_moded_trace_span(TRACE_NAT, start, "%s -> %s%s", interface, nat_interface,
+		       ret ? " failed" : "");
+  log_debug("nat set up in %" G_GINT64_FORMAT " ms\n",
+	    (usb_moded_trace_now() - start) / 1000);
 
   free(interface);
   free(nat_interface);
+  if(ret)
+	return(1);
   log_debug("ipforwarding success!\n");
   return(0);
 }
@@ -175,85 +454,11 @@ static int set_usb_ip_forward(struct mode_list_elem *data, struct ipforward_data
 static void clean_usb_ip_forward(void)
 {
 #ifdef CONNMAN
-  connman_reset_state();
+  usb_moded_connman_reset_state();
 #endif
   write_to_file("/proc/sys/net/ipv4/ip_forward", "0");
-  usb_moded_system("/sbin/iptables -F FORWARD");
-}
-
-#ifdef OFONO
-/**
- * Get roaming data from ofono
- * 
- * @return : 1 if roaming, 0 when not (or when ofono is unavailable)
- */
-static int get_roaming(void)
-{
-  int ret = 0, type;
-  DBusError error;
-  DBusMessage *msg = NULL, *reply;
-  DBusConnection *dbus_conn_ofono = NULL;
-  char *modem = NULL;
-  DBusMessageIter iter, subiter;
-
-  dbus_error_init(&error);
-
-  if( (dbus_conn_ofono = dbus_bus_get(DBUS_BUS_SYSTEM, &error)) == 0 )
-  {
-         log_err("Could not connect to dbus for ofono\n");
-  }
-
-  /* find the modem object path so can find out if it is roaming or not (one modem only is assumed) */
-  if ((msg = dbus_message_new_method_call("org.ofono", "/", "org.ofono.Manager", "GetModems")) != NULL)
-  {
-        if ((reply = dbus_connection_send_with_reply_and_block(dbus_conn_ofono, msg, -1, NULL)) != NULL)
-        {
-	  dbus_message_iter_init(reply, &iter);
-	  dbus_message_iter_recurse(&iter, &subiter);
-	  iter = subiter;
-	  dbus_message_iter_recurse(&iter, &subiter);
-	  type = dbus_message_iter_get_arg_type(&subiter);
-	  if(type == DBUS_TYPE_OBJECT_PATH)
-	  {
-		dbus_message_iter_get_basic(&subiter, &modem);
-		log_debug("modem = %s\n", modem);
-	  }
-          dbus_message_unref(reply);
-        }
-        dbus_message_unref(msg);
-  }
-  /* if modem found then we check roaming state */
-  if(modem != NULL)
-  {
-	if ((msg = dbus_message_new_method_call("org.ofono", modem, "org.ofono.NetworkRegistration", "GetProperties")) != NULL)
-	{
-		if ((reply = dbus_connection_send_with_reply_and_block(dbus_conn_ofono, msg, -1, NULL)) != NULL)
-		{
-		  dbus_message_iter_init(reply, &iter);
-		  dbus_message_iter_recurse(&iter, &subiter);
-		  iter = subiter;
-		  dbus_message_iter_recurse(&iter, &subiter);
-		  type = dbus_message_iter_get_arg_type(&subiter);
-		    if(type == DBUS_TYPE_STRING)
-		    {
-			dbus_message_iter_next (&subiter);
-			iter = subiter;
-			dbus_message_iter_recurse(&iter, &subiter);
-			dbus_message_iter_get_basic(&subiter, &modem);
-			log_debug("modem status = %s\n", modem);
-		    }
-		}
-		dbus_message_unref(reply);
-		}
-        dbus_message_unref(msg);
-	
-	if(!strcmp("roaming", modem))
-		ret = 1;
-  }
-
-  return(ret);
+  nat_teardown();
 }
-#endif
 
 #ifndef CONNMAN
 /**
@@ -266,9 +471,12 @@ static int resolv_conf_dns(struct ipforward_data *ipforward)
   char *line = NULL, **tokens;
   size_t len = 0;
   ssize_t read;
+  gchar *path;
 
 
-  resolv = fopen("/etc/resolv.conf", "r");
+  path = usb_moded_root_path("/etc/resolv.conf");
+  resolv = fopen(path, "r");
+  g_free(path);
   if (resolv == NULL)
 	return(1);
 
@@ -299,16 +507,16 @@ end:
 }
 #endif
 
-static int checklink(void)
+static int checklink(const char *link, const char *target)
 {
   int ret = -1;
-  char dest[sizeof(UDHCP_CONFIG_PATH)+1];
-  size_t len = readlink(UDHCP_CONFIG_LINK, dest, sizeof(dest)-1);
+  char dest[PATH_MAX];
+  ssize_t len = readlink(link, dest, sizeof(dest)-1);
 
   if (len > 0)
   {
 	dest[len] = 0;
-	ret = strcmp(dest, UDHCP_CONFIG_PATH);
+	ret = strcmp(dest, target);
   }
   return(ret);
 }
@@ -322,23 +530,27 @@ static int write_udhcpd_conf(struct ipforward_data *ipforward, struct mode_list_
   FILE *conffile;
   char *ip, *interface, *netmask;
   char *ipstart, *ipend;
-  int dot = 0, i = 0, test;
+  int dot = 0, i = 0, test, ret = 1;
   struct stat st;
+  /* the link has to point to the file under the same root */
+  gchar *conf_dir  = usb_moded_root_path(UDHCP_CONFIG_DIR);
+  gchar *conf_path = usb_moded_root_path(UDHCP_CONFIG_PATH);
+  gchar *conf_link = usb_moded_root_path(UDHCP_CONFIG_LINK);
 
   /* /tmp and /run is often tmpfs, so we avoid writing to flash */
-  mkdir(UDHCP_CONFIG_DIR, 0664);
-  conffile = fopen(UDHCP_CONFIG_PATH, "w");
+  mkdir(conf_dir, 0664);
+  conffile = fopen(conf_path, "w");
   if(conffile == NULL)
   {
 	log_debug("Error creating "UDHCP_CONFIG_PATH"!\n");
-	return(1);
+	goto cleanup;
   }
 
   interface = get_interface(data);
   if(interface == NULL)
   {
 	fclose(conffile);
-	return(1);
+	goto cleanup;
   }
   /* generate start and end ip based on the setting */
   ip = get_network_setting(NETWORK_IP_KEY);
@@ -393,485 +605,126 @@ static int write_udhcpd_conf(struct ipforward_data *ipforward, struct mode_list_
   fclose(conffile);
 
   /* check if it is a symlink, if not remove and link, create the link if missing */
-  test = lstat(UDHCP_CONFIG_LINK, &st);
+  test = lstat(conf_link, &st);
   /* if stat fails there is no file or link */
   if(test == -1)
 	goto link;
   /* if it is not a link, or points to the wrong place we remove it */
-  if(((st.st_mode & S_IFMT) != S_IFLNK) || checklink())
+  if(((st.st_mode & S_IFMT) != S_IFLNK) || checklink(conf_link, conf_path))
   {
-	unlink(UDHCP_CONFIG_LINK);
+	unlink(conf_link);
   }
   else
 	goto end;
 
 link:
-  if (symlink(UDHCP_CONFIG_PATH, UDHCP_CONFIG_LINK) == -1)
+  if (symlink(conf_path, conf_link) == -1)
   {
 	log_debug("Error creating link "UDHCP_CONFIG_LINK" -> "UDHCP_CONFIG_PATH": %m\n");
-	unlink(UDHCP_CONFIG_PATH);
-	return(1);
+	unlink(conf_path);
+	goto cleanup;
   }
 
 end:
   log_debug(UDHCP_CONFIG_LINK" created\n");
-  return(0);
-}
-
-#ifdef CONNMAN
-
-#define CONNMAN_SERVICE                "net.connman"
-#define CONNMAN_TECH_INTERFACE         "net.connman.Technology"
-#define CONNMAN_ERROR_INTERFACE        CONNMAN_SERVICE ".Error"
-#define CONNMAN_ERROR_ALREADY_ENABLED  CONNMAN_ERROR_INTERFACE ".AlreadyEnabled"
-#define CONNMAN_ERROR_ALREADY_DISABLED CONNMAN_ERROR_INTERFACE ".AlreadyDisabled"
+  ret = 0;
 
-/*
- * Configures tethering for the specified connman technology.
- */
-static gboolean connman_try_set_tethering(DBusConnection *connection, const char *path, gboolean on)
-{
-  gboolean ok = FALSE;
-  DBusMessage *message = dbus_message_new_method_call(CONNMAN_SERVICE, path, CONNMAN_TECH_INTERFACE, "SetProperty");
-  if (message)
-  {
-	DBusMessage *reply;
-	DBusMessageIter iter;
-	DBusMessageIter iter2;
-	DBusError error;
-
-	const char* key = "Tethering";
-	dbus_bool_t value = (on != FALSE);
-
-	dbus_message_iter_init_append(message, &iter);
-	dbus_message_iter_append_basic(&iter, DBUS_TYPE_STRING, &key);
-	dbus_message_iter_open_container(&iter, DBUS_TYPE_VARIANT, DBUS_TYPE_BOOLEAN_AS_STRING, &iter2);
-	dbus_message_iter_append_basic(&iter2, DBUS_TYPE_BOOLEAN, &value);
-	dbus_message_iter_close_container(&iter, &iter2);
-
-	dbus_error_init(&error);
-	reply = dbus_connection_send_with_reply_and_block(connection, message,  DBUS_TIMEOUT_USE_DEFAULT, &error);
-	dbus_message_unref(message);
-	if (reply)
-	{
-		log_debug("%s tethering %s", path, on ? "on" : "off");
-		dbus_message_unref(reply);
-		ok = TRUE;
-	}
-	else
-	{
-		if ((on && !g_strcmp0(error.name, CONNMAN_ERROR_ALREADY_ENABLED)) ||
-		    (!on && (!g_strcmp0(error.name, CONNMAN_ERROR_ALREADY_DISABLED) ||
-			     !g_strcmp0(error.name, DBUS_ERROR_UNKNOWN_OBJECT))))
-		{
-			ok = TRUE;
-		}
-		else
-		{
-			log_err("%s\n", error.message);
-		}
-		dbus_error_free(&error);
-	}
-  }
-  return ok;
+cleanup:
+  g_free(conf_link);
+  g_free(conf_path);
+  g_free(conf_dir);
+  return(ret);
 }
 
-gboolean connman_set_tethering(const char *path, gboolean on)
+/* serve addresses from usb_moded itself instead of udhcpd */
+static int start_builtin_dhcpd(struct ipforward_data *ipforward, struct mode_list_elem *data)
 {
-  gboolean ok = FALSE;
-  DBusError error;
-  DBusConnection *connection;
+  char *interface, *ip, *netmask;
+  int ret = 1;
 
-  dbus_error_init(&error);
-  connection = dbus_bus_get(DBUS_BUS_SYSTEM, &error);
-  if (connection)
-  {
-	int i;
-	for (i=0; i<10; i++)
-	{
-		if (i>0)
-		{
-			usb_moded_msleep(200);
-		}
-		if (connman_try_set_tethering(connection, path, on))
-		{
-			ok = TRUE;
-			break;
-		}
-	}
-	dbus_connection_unref(connection);
-  }
-  else
-  {
-	log_err("%s\n", error.message);
-	dbus_error_free (&error);
-  }
+  interface = get_interface(data);
+  if(interface == NULL)
+	return(1);
 
-  return ok;
-}
+  ip = get_network_setting(NETWORK_IP_KEY);
+  netmask = get_network_setting(NETWORK_NETMASK_KEY);
 
-/**
- * Connman message handling
- */
-static char * connman_parse_manager_reply(DBusMessage *reply, const char *req_service)
-{
-  DBusMessageIter iter, subiter, origiter;
-  int type;
-  char *service;
-  
-  dbus_message_iter_init(reply, &iter);
-  type = dbus_message_iter_get_arg_type(&iter);
-  dbus_message_iter_recurse(&iter, &subiter);
-  type = dbus_message_iter_get_arg_type(&subiter);
-  origiter = subiter;
-  iter = subiter;
-  while(type != DBUS_TYPE_INVALID)
-  {
+  /* like for udhcpd, router and dns are only handed out with nat; a
+     running server is updated in place so that leases are kept */
+  ret = usb_moded_dhcpd_update(interface, ip, netmask,
+			      ipforward ? ip : NULL,
+			      ipforward ? ipforward->dns1 : NULL,
+			      ipforward ? ipforward->dns2 : NULL);
 
-	  if(type == DBUS_TYPE_STRUCT)
-	  {
-		origiter = iter;
-		dbus_message_iter_recurse(&iter, &subiter);
-		type = dbus_message_iter_get_arg_type(&subiter);
-		if(type == DBUS_TYPE_OBJECT_PATH)
-		{
-			dbus_message_iter_get_basic(&subiter, &service);
-			log_debug("service = %s\n", service);
-			if(strstr(service, req_service))
-			{
-				log_debug("%s service found!\n", req_service);
-				return(strdup(service));
-			}
-		}
-	   }
-	dbus_message_iter_next(&origiter);
-	type = dbus_message_iter_get_arg_type(&origiter);
-	iter = origiter;
-  }
-  log_debug("end of list\n");
-  return(0);
+  free(interface);
+  free(ip);
+  free(netmask);
+  return(ret);
 }
 
-static int connman_fill_connection_data(DBusMessage *reply, struct ipforward_data *ipforward)
+/* stop sharing the connection while keeping the usb network up: nat
+   and forwarding are removed, and the dhcp server no longer hands out
+   the device as router and dns, as if sharing had never been set up */
+static void network_stop_sharing(struct mode_list_elem *data)
 {
-  DBusMessageIter array_iter, dict_iter, inside_dict_iter, variant_iter;
-  DBusMessageIter sub_array_iter, string_iter;
-  int type, next;
-  char *string;
-  
-  log_debug("Filling in dns data\n");
-  dbus_message_iter_init(reply, &array_iter);
-  type = dbus_message_iter_get_arg_type(&array_iter);
-
-  dbus_message_iter_recurse(&array_iter, &dict_iter);
-  type = dbus_message_iter_get_arg_type(&dict_iter);
-	  
-  while(type != DBUS_TYPE_INVALID)
-  {
-		dbus_message_iter_recurse(&dict_iter, &inside_dict_iter);
-		type = dbus_message_iter_get_arg_type(&inside_dict_iter);
-		if(type == DBUS_TYPE_STRING)
-		{
-			dbus_message_iter_get_basic(&inside_dict_iter, &string);
-			//log_debug("string = %s\n", string);
-			if(!strcmp(string, "Nameservers"))
-			{
-				//log_debug("Trying to get Nameservers");
-				dbus_message_iter_next (&inside_dict_iter);
-				type = dbus_message_iter_get_arg_type(&inside_dict_iter);
-				dbus_message_iter_recurse(&inside_dict_iter, &variant_iter);
-				type = dbus_message_iter_get_arg_type(&variant_iter);
-				if(type == DBUS_TYPE_ARRAY)
-				{
-					dbus_message_iter_recurse(&variant_iter, &string_iter);
-					type = dbus_message_iter_get_arg_type(&string_iter);
-					if(type != DBUS_TYPE_STRING)
-					{
-						/* not online */
-						return(1);
-					}
-					dbus_message_iter_get_basic(&string_iter, &string);
-					log_debug("dns = %s\n", string);
-					ipforward->dns1 = strdup(string);
-					next = dbus_message_iter_next (&string_iter);
-					if(!next)
-					{
-						log_debug("No secundary dns\n");
-						/* FIXME: set the same dns for dns2 to avoid breakage */
-						ipforward->dns2 = strdup(string);
-						return(0);
-					}
-					dbus_message_iter_get_basic(&string_iter, &string);
-					log_debug("dns2 = %s\n", string);
-					ipforward->dns2 = strdup(string);
-					return(0);
-				}
-			}
-			else if(!strcmp(string, "State"))
-			{
-				//log_debug("Trying to get online state");
-				dbus_message_iter_next (&inside_dict_iter);
-				type = dbus_message_iter_get_arg_type(&inside_dict_iter);
-				dbus_message_iter_recurse(&inside_dict_iter, &variant_iter);
-				type = dbus_message_iter_get_arg_type(&variant_iter);
-                                if(type == DBUS_TYPE_STRING)
-                                {
-                                        dbus_message_iter_get_basic(&variant_iter, &string);
-					log_debug("Connection state = %s\n", string);
-					/* if cellular not online, connect it */
-					if(strcmp(string, "online"))
-					{
-						/* if in ready state connection might be up anyway */
-						if(strcmp(string, "ready"))
-							log_debug("Not online. Turning on cellular data connection.\n");
-							return(1);
-					}
-					
-				}
-
-			}
-			else if(!strcmp(string, "Ethernet"))
-			{
-				dbus_message_iter_next (&inside_dict_iter);
-				type = dbus_message_iter_get_arg_type(&inside_dict_iter);
-				dbus_message_iter_recurse(&inside_dict_iter, &variant_iter);
-				type = dbus_message_iter_get_arg_type(&variant_iter);
-				if(type == DBUS_TYPE_ARRAY)
-				{
-					dbus_message_iter_recurse(&variant_iter, &sub_array_iter);
-					/* we want the second dict */
-					dbus_message_iter_next(&sub_array_iter);
-					/* we go into the dict and get the string */
-					dbus_message_iter_recurse(&sub_array_iter, &variant_iter);
-					type = dbus_message_iter_get_arg_type(&variant_iter);
-					if(type == DBUS_TYPE_STRING)
-					{
-						dbus_message_iter_get_basic(&variant_iter, &string);
-						if(!strcmp(string, "Interface"))
-						{
-							/* get variant and iter down in it */
-							dbus_message_iter_next(&variant_iter);
-							dbus_message_iter_recurse(&variant_iter, &string_iter);
-							dbus_message_iter_get_basic(&string_iter, &string);
-							log_debug("cellular interface = %s\n", string);
-							ipforward->nat_interface = strdup(string);
-						}
-					}
-				}
-
-			}
-		}
-	dbus_message_iter_next (&dict_iter);
-	type = dbus_message_iter_get_arg_type(&dict_iter);
-  }
-  return(0);
+  clean_usb_ip_forward();
+  if(use_builtin_dhcp_server())
+	start_builtin_dhcpd(NULL, data);
+  else
+	write_udhcpd_conf(NULL, data);
+  usb_moded_send_error_signal(CONNECTION_SHARING_STOPPED);
 }
 
+#ifdef OFONO
 /**
- * Turn on cellular connection if it is not on 
+ * Stop sharing the connection when roaming starts and it is not allowed
+ *
+ * Called by the ofono tracker whenever the roaming state changes.
  */
-static int connman_set_cellular_online(DBusConnection *dbus_conn_connman, const char *service, int retry)
+void usb_network_roaming_changed(gboolean roaming)
 {
-  DBusMessage *msg = NULL, *reply;
-  DBusError error;
-  int ret = 0;
-  char *wifi = NULL;
+  struct mode_list_elem *data;
 
-  dbus_error_init(&error);
+  if(!roaming || !nat_installed || !is_roaming_not_allowed())
+	return;
 
-  if(!retry)
-  {
-	if ((msg = dbus_message_new_method_call("net.connman", "/", "net.connman.Manager", "GetServices")) != NULL)
-	{
-		if ((reply = dbus_connection_send_with_reply_and_block(dbus_conn_connman, msg, -1, NULL)) != NULL)
-		{
-		  wifi = connman_parse_manager_reply(reply, "wifi");
-		  dbus_message_unref(reply);
-		}
-		dbus_message_unref(msg);
-	}
-
-	if(wifi != NULL)
-	{
-		/* we must make sure that wifi is disconnected as sometimes cellular will not come up otherwise */
-		if ((msg = dbus_message_new_method_call("net.connman", wifi, "net.connman.Service", "Disconnect")) != NULL)
-		{
-		  /* we don't care for the reply, which is empty anyway if all goes well */
-		  ret = !dbus_connection_send(dbus_conn_connman, msg, NULL);
-		  dbus_connection_flush(dbus_conn_connman);
-		  dbus_message_unref(msg);
-		}
-	}
-  }
-  if ((msg = dbus_message_new_method_call("net.connman", service, "net.connman.Service", "Connect")) != NULL)
-  {
-	/* we don't care for the reply, which is empty anyway if all goes well */
-        ret = !dbus_connection_send(dbus_conn_connman, msg, NULL);
-	/* sleep for the connection to come up */
-	usb_moded_sleep(5);
-	/* make sure the message is sent before cleaning up and closing the connection */
-	dbus_connection_flush(dbus_conn_connman);
-        dbus_message_unref(msg);
-  }
+  if(!(data = get_usb_mode_data()))
+	return;
 
-  if(wifi)
-	free(wifi);
-
-  return(ret);
+  log_warning("roaming started, stopping connection sharing\n");
+  network_stop_sharing(data);
 }
+#endif
 
-/*
- * Turn on or off the wifi service
- * wifistatus static variable tracks the state so we do not turn on the wifi if it was off
+#ifdef CONNMAN
+/**
+ * Fill in the dns and nat interface from the cellular data connection
  *
-*/
-static int connman_wifi_power_control(DBusConnection *dbus_conn_connman, int on)
-{
-  static int wifistatus = 0;
-  int type = 0;
-  char *string;
-  DBusMessage *msg = NULL, *reply;
-  //DBusError error;
-  DBusMessageIter array_iter, dict_iter, inside_dict_iter, variant_iter;
-
-  if(!on)
-  {
-	/* check wifi status only before turning off */
-	if ((msg = dbus_message_new_method_call("net.connman", "/net/connman/technology/wifi", "net.connman.Technology", "GetProperties")) != NULL)
-	{
-		if ((reply = dbus_connection_send_with_reply_and_block(dbus_conn_connman, msg, -1, NULL)) != NULL)
-		{
-		  dbus_message_iter_init(reply, &array_iter);
-
-		  dbus_message_iter_recurse(&array_iter, &dict_iter);
-		  type = dbus_message_iter_get_arg_type(&dict_iter);
-
-		  while(type != DBUS_TYPE_INVALID)
-		  {
-		    dbus_message_iter_recurse(&dict_iter, &inside_dict_iter);
-		    type = dbus_message_iter_get_arg_type(&inside_dict_iter);
-		    if(type == DBUS_TYPE_STRING)
-		    {
-			dbus_message_iter_get_basic(&inside_dict_iter, &string);
-                        log_debug("string = %s\n", string);
-                        if(!strcmp(string, "Powered"))
-                        {
-				dbus_message_iter_next (&inside_dict_iter);
-				type = dbus_message_iter_get_arg_type(&inside_dict_iter);
-				dbus_message_iter_recurse(&inside_dict_iter, &variant_iter);
-				type = dbus_message_iter_get_arg_type(&variant_iter);
-                                if(type == DBUS_TYPE_BOOLEAN)
-                                {
-                                        dbus_message_iter_get_basic(&variant_iter, &wifistatus);
-					log_debug("Powered state = %d\n", wifistatus);
-				}
-				break;
-			}
-		     }
-		     dbus_message_iter_next (&dict_iter);
-		     type = dbus_message_iter_get_arg_type(&dict_iter);
-		  }
-		  dbus_message_unref(reply);
-		}
-		dbus_message_unref(msg);
-	}
-  }
-
-  /*  /net/connman/technology/wifi net.connman.Technology.SetProperty string:Powered variant:boolean:false */
-  if(wifistatus && !on)
-	usb_moded_system("/bin/dbus-send --print-reply --type=method_call --system --dest=net.connman /net/connman/technology/wifi net.connman.Technology.SetProperty string:Powered variant:boolean:false");
-  if(wifistatus && on)
-       /* turn on wifi after tethering is over and wifi was on before */
-	usb_moded_system("/bin/dbus-send --print-reply --type=method_call --system --dest=net.connman /net/connman/technology/wifi net.connman.Technology.SetProperty string:Powered variant:boolean:true");
-
-  return(0);
-}
-
+ * @return 0 on success, NETWORK_PENDING if cellular data is being
+ *         brought up, other non-zero on failure
+ */
 static int connman_get_connection_data(struct ipforward_data *ipforward)
 {
-  DBusConnection *dbus_conn_connman = NULL;
-  DBusMessage *msg = NULL, *reply = NULL;
-  DBusError error;
-  char *service = NULL;
-  int online = 0, ret = 0;
-
-  dbus_error_init(&error);
-
-  if( (dbus_conn_connman = dbus_bus_get(DBUS_BUS_SYSTEM, &error)) == 0 )
+  switch(usb_moded_connman_cellular_data(&ipforward->dns1, &ipforward->dns2,
+					 &ipforward->nat_interface))
   {
-         log_err("Could not connect to dbus for connman\n");
-  }
-
-  /* turn off wifi in preparation for cellular connection if needed */
-  connman_wifi_power_control(dbus_conn_connman, 0);
-
-  /* get list of services so we can find out which one is the cellular */
-  if ((msg = dbus_message_new_method_call("net.connman", "/", "net.connman.Manager", "GetServices")) != NULL)
-  {
-        if ((reply = dbus_connection_send_with_reply_and_block(dbus_conn_connman, msg, -1, NULL)) != NULL)
-        {
-	    service = connman_parse_manager_reply(reply, "cellular");
-            dbus_message_unref(reply);
-        }
-        dbus_message_unref(msg);
-  }
-  
-  log_debug("service = %s\n", service);
-  if(service)
-  {
-try_again:
-	if ((msg = dbus_message_new_method_call("net.connman", service, "net.connman.Service", "GetProperties")) != NULL)
-	{
-		if ((reply = dbus_connection_send_with_reply_and_block(dbus_conn_connman, msg, -1, NULL)) != NULL)
-		{
-			if(connman_fill_connection_data(reply, ipforward))
-			{
-				if(!connman_set_cellular_online(dbus_conn_connman, service, online) && !online)
-				{
-					online = 1;
-					goto try_again;
-				}
-				else
-				{
-					log_debug("Cannot connect to cellular data\n");
-					ret = 1;
-				}
-			}
-			dbus_message_unref(reply);
-		}
-		dbus_message_unref(msg);
-	}
-  }
-  dbus_connection_unref(dbus_conn_connman);
-  dbus_error_free(&error);
-  free(service);
-  return(ret);
-}
-
-static int connman_reset_state(void)
-{
-  DBusConnection *dbus_conn_connman = NULL;
-  DBusError error;
-
-  dbus_error_init(&error);
-
-  if( (dbus_conn_connman = dbus_bus_get(DBUS_BUS_SYSTEM, &error)) == 0 )
-  {
-         log_err("Could not connect to dbus for connman\n");
+  case CONNMAN_CELLULAR_ONLINE:
+	return(0);
+  case CONNMAN_CELLULAR_CONNECTING:
+	log_debug("Waiting for cellular data\n");
+	return(NETWORK_PENDING);
+  default:
+	log_debug("Cannot connect to cellular data\n");
+	return(1);
   }
-
-  /* make sure connman turns wifi back on when we disconnect */
-  log_debug("Turning wifi back on\n");
-  connman_wifi_power_control(dbus_conn_connman, 1);
-  dbus_connection_unref(dbus_conn_connman);
-  dbus_error_free(&error);
-
-  return(0);
 }
 #endif /* CONNMAN */
 
 /** 
  * Write out /etc/udhcpd.conf conf so the config is available when it gets started
+ *
+ * @return 0 on success, NETWORK_PENDING if cellular data is being brought up
+ *         and the call should be repeated later, other non-zero on failure
  */
 int usb_network_set_up_dhcpd(struct mode_list_elem *data)
 {
@@ -883,7 +736,7 @@ int usb_network_set_up_dhcpd(struct mode_list_elem *data)
   {
 #ifdef OFONO
 	/* check if we are roaming or not */
-	if(get_roaming())
+	if(usb_moded_ofono_roaming())
 	{
 		/* get permission to use roaming */
 		if(is_roaming_not_allowed())
@@ -893,9 +746,11 @@ int usb_network_set_up_dhcpd(struct mode_list_elem *data)
 	ipforward = malloc(sizeof(struct ipforward_data));
 	memset(ipforward, 0, sizeof(struct ipforward_data));
 #ifdef CONNMAN
-	if(connman_get_connection_data(ipforward))
+	ret = connman_get_connection_data(ipforward);
+	if(ret)
 	{
-		log_debug("data connection not available!\n");
+		if(ret != NETWORK_PENDING)
+			log_debug("data connection not available!\n");
 		/* TODO: send a message to the UI */
 		goto end;
 	}
@@ -905,7 +760,10 @@ int usb_network_set_up_dhcpd(struct mode_list_elem *data)
 #endif /*CONNMAN */
   }
   /* ipforward can be NULL here, which is expected and handled in this function */
-  ret = write_udhcpd_conf(ipforward, data);
+  if(use_builtin_dhcp_server())
+	ret = start_builtin_dhcpd(ipforward, data);
+  else
+	ret = write_udhcpd_conf(ipforward, data);
 
   if(data->nat)
 	ret = set_usb_ip_forward(data, ipforward);
@@ -1083,7 +941,7 @@ int usb_network_up(struct mode_list_elem *data)
   gateway = get_network_setting(NETWORK_GATEWAY_KEY);
   netmask = get_network_setting(NETWORK_NETMASK_KEY);
 
-  if(!strcmp(ip, "dhcp"))
+  if(ip && !strcmp(ip, "dhcp"))
   {
 	sprintf(command, "dhclient -d %s\n", interface);
 	ret = usb_moded_system(command);
@@ -1092,21 +950,22 @@ int usb_network_up(struct mode_list_elem *data)
 		sprintf(command, "udhcpc -i %s\n", interface);
 		usb_moded_system(command);
 	}
-
+	/* address comes from dhcp, only the gateway is set up here */
+	if(gateway)
+		usb_moded_netlink_up(interface, NULL, NULL, gateway);
   }
   else
   {
-	sprintf(command, "ifconfig %s %s %s\n", interface, ip, netmask);
-	usb_moded_system(command);
-  }
-
-  /* TODO: Check first if there is a gateway set */
-  if(gateway)
-  {
-	sprintf(command, "route add default gw %s\n", gateway);
-        usb_moded_system(command);
+	/* link, address and default route in one netlink batch */
+	if(usb_moded_netlink_up(interface, ip, netmask, gateway) == 0)
+	{
+		network_applied_set(interface, ip, netmask, gateway,
+				    get_network_setting(NETWORK_NAT_INTERFACE_KEY));
+		return(0);
+	}
   }
 
+  network_applied_clear();
   free(interface);
   free(gateway);
   free(ip);
@@ -1169,14 +1028,14 @@ int usb_network_down(struct mode_list_elem *data)
   return(ret);
 #else
   char *interface;
-  char command[128];
 
   interface = get_interface(data);
   if(interface == NULL)
 	return(0);
 
-  sprintf(command, "ifconfig %s down\n", interface);
-  usb_moded_system(command);
+  usb_moded_netlink_down(interface);
+  usb_moded_dhcpd_stop();
+  network_applied_clear();
 
   /* dhcp client shutdown happens on disconnect automatically */
   if(data->nat)
@@ -1188,27 +1047,138 @@ int usb_network_down(struct mode_list_elem *data)
 #endif /* CONNMAN_IS_EVER_FIXED_FOR_USB */
 }
 
+/* deadline for cellular data to come online for a nat update [ms] */
+#define NETWORK_UPDATE_WAIT_TIMEOUT	10000
+
+#ifdef CONNMAN
+/* cellular data came online while an update was waiting for it */
+static void network_update_online(void)
+{
+  usb_moded_transition_flush(TRANSITION_NETWORK_UPDATE_WAIT);
+}
+#endif
+
+static void network_update_dhcpd_waited(gpointer aptr);
+
+/* refresh the dhcp options and nat rules after a settings change,
+   waiting for cellular data once if it is still being brought up */
+static void network_update_dhcpd_try(struct mode_list_elem *data, int waited)
+{
+  int ret;
+
+#ifdef CONNMAN
+  usb_moded_connman_wait_online_cancel(network_update_online);
+#endif
+  usb_moded_transition_cancel(TRANSITION_NETWORK_UPDATE_WAIT);
+
+  ret = usb_network_set_up_dhcpd(data);
+  if(ret == 0)
+	return;
+
+  if(ret == NETWORK_PENDING && !waited)
+  {
+	/* do not keep forwarding to the old connection, set up nat
+	   again once cellular data is up; the timeout is only a
+	   deadline, waiting ends as soon as connman reports it online */
+	log_debug("waiting for cellular data to update nat\n");
+	nat_teardown();
+#ifdef CONNMAN
+	usb_moded_connman_wait_online(network_update_online);
+#endif
+	usb_moded_transition_schedule(TRANSITION_NETWORK_UPDATE_WAIT,
+				      NETWORK_UPDATE_WAIT_TIMEOUT,
+				      network_update_dhcpd_waited, data, NULL);
+	return;
+  }
+
+  /* roaming is not allowed, cellular data did not come up in time,
+     or the new settings could not be applied */
+  log_warning("updating dhcp server / nat failed, stopping connection sharing\n");
+  if(data->nat)
+	network_stop_sharing(data);
+}
+
+static void network_update_dhcpd_waited(gpointer aptr)
+{
+  network_update_dhcpd_try(aptr, 1);
+}
+
+static void network_update_dhcpd(struct mode_list_elem *data)
+{
+  network_update_dhcpd_try(data, 0);
+}
+
 /**
  * Update the network interface with the new setting if connected.
- * 
-*/
+ *
+ * Only what changed is applied: the address and default route are
+ * replaced on the interface that stays up, and the dhcp options and
+ * nat rules are refreshed, keeping the leases of the built-in dhcp
+ * server. If nat can not be set up with the new settings it is torn
+ * down. A change of interface or to / from dhcp still takes the
+ * network down and up again.
+ */
 int usb_network_update(void)
 {
   struct mode_list_elem * data;
+  char *interface, *ip, *netmask, *gateway, *nat_interface;
 
   if(!get_usb_connection_state())
 	return(0);
 
   data = get_usb_mode_data();
-  if(data == NULL)
+  if(data == NULL || !data->network)
 	return(0);
-  if(data->network)
+
+  interface = get_interface(data);
+  ip = get_network_setting(NETWORK_IP_KEY);
+  netmask = get_network_setting(NETWORK_NETMASK_KEY);
+  gateway = get_network_setting(NETWORK_GATEWAY_KEY);
+  nat_interface = get_network_setting(NETWORK_NAT_INTERFACE_KEY);
+
+  if(!network_applied.interface || !interface || !ip || !strcmp(ip, "dhcp") ||
+     strcmp(interface, network_applied.interface))
+	goto RESTART;
+
+  if(!g_strcmp0(ip, network_applied.ip) &&
+     !g_strcmp0(netmask, network_applied.netmask) &&
+     !g_strcmp0(gateway, network_applied.gateway) &&
+     !g_strcmp0(nat_interface, network_applied.nat_interface))
   {
-	usb_network_down(data);	
-	usb_network_up(data);	
-	return(0);
+	/* nat torn down by an earlier failed update is set up again */
+	if(data->nat && !nat_installed)
+	{
+		log_debug("network settings unchanged, restoring nat\n");
+		network_update_dhcpd(data);
+	}
+	else
+		log_debug("network settings unchanged\n");
+	goto EXIT;
   }
-  else
-	return(0);
 
+  if(usb_moded_netlink_update(interface, network_applied.ip,
+			      network_applied.netmask, network_applied.gateway,
+			      ip, netmask, gateway))
+  {
+	log_warning("updating %s failed, restarting network\n", interface);
+	goto RESTART;
+  }
+  network_applied_set(interface, ip, netmask, gateway, nat_interface);
+
+  /* the address, router and dns handed out may have changed */
+  if(data->nat || data->dhcp_server)
+	network_update_dhcpd(data);
+  return(0);
+
+RESTART:
+  usb_network_down(data);
+  usb_network_up(data);
+
+EXIT:
+  free(interface);
+  free(ip);
+  free(netmask);
+  free(gateway);
+  free(nat_interface);
+  return(0);
 }
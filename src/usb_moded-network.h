@@ -25,13 +25,18 @@
 
 #include "usb_moded-dyn-config.h"
 
+/** usb_network_set_up_dhcpd() result when waiting for cellular data */
+#define NETWORK_PENDING 2
+
 int usb_network_up(struct mode_list_elem *data);
 int usb_network_down(struct mode_list_elem *data);
 int usb_network_update(void);
 int usb_network_set_up_dhcpd(struct mode_list_elem *data);
+gboolean usb_network_is_interface(struct mode_list_elem *data, const char *ifname);
+gboolean usb_network_has_interface(struct mode_list_elem *data);
 
-#ifdef CONNMAN
-gboolean connman_set_tethering(const char *path, gboolean on);
+#ifdef OFONO
+void usb_network_roaming_changed(gboolean roaming);
 #endif
 
 #endif /* USB_MODED_NETWORK_H_ */
@@ -0,0 +1,650 @@
+/**
+  @file usb_moded-ofono.c
+
+  Copyright (C) 2016 Jolla. All rights reserved.
+
+  @author: Philippe De Swert <philippe.deswert@jollamobile.com>
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the Lesser GNU General Public License
+  version 2 as published by the Free Software Foundation.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  General Public License for more details.
+
+  You should have received a copy of the Lesser GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+  02110-1301 USA
+*/
+
+/*
+ * oFono roaming tracker
+ *
+ * Modems are followed from the GetModems reply and the ModemAdded /
+ * ModemRemoved signals. For each modem with a NetworkRegistration
+ * interface the registration status is queried once and then kept up
+ * to date from PropertyChanged signals, so that the roaming state is
+ * known without ipc when usb networking is set up.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <glib.h>
+
+#include "usb_moded-ofono.h"
+#include "usb_moded-log.h"
+#include "usb_moded-network.h"
+#include "usb_moded-dbus-private.h"
+
+/* ========================================================================= *
+ * Constants
+ * ========================================================================= */
+
+#define OFONO_SERVICE                  "org.ofono"
+#define OFONO_MANAGER_PATH             "/"
+#define OFONO_MANAGER_INTERFACE        OFONO_SERVICE ".Manager"
+#define OFONO_MODEM_INTERFACE          OFONO_SERVICE ".Modem"
+#define OFONO_NETREG_INTERFACE         OFONO_SERVICE ".NetworkRegistration"
+
+#define OFONO_GET_MODEMS_REQ           "GetModems"
+#define OFONO_GET_PROPERTIES_REQ       "GetProperties"
+
+#define OFONO_MODEM_ADDED_SIG          "ModemAdded"
+#define OFONO_MODEM_REMOVED_SIG        "ModemRemoved"
+#define OFONO_PROPERTY_CHANGED_SIG     "PropertyChanged"
+
+#define OFONO_MANAGER_MATCH\
+     "type='signal'"\
+     ",sender='"OFONO_SERVICE"'"\
+     ",interface='"OFONO_MANAGER_INTERFACE"'"
+
+#define OFONO_MODEM_MATCH\
+     "type='signal'"\
+     ",sender='"OFONO_SERVICE"'"\
+     ",interface='"OFONO_MODEM_INTERFACE"'"\
+     ",member='"OFONO_PROPERTY_CHANGED_SIG"'"
+
+#define OFONO_NETREG_MATCH\
+     "type='signal'"\
+     ",sender='"OFONO_SERVICE"'"\
+     ",interface='"OFONO_NETREG_INTERFACE"'"\
+     ",member='"OFONO_PROPERTY_CHANGED_SIG"'"
+
+#define OFONO_NAME_OWNER_CHANGED_MATCH\
+     "type='signal'"\
+     ",interface='"DBUS_INTERFACE_DBUS"'"\
+     ",member='"DBUS_NAME_OWNER_CHANGED_SIG"'"\
+     ",arg0='"OFONO_SERVICE"'"
+
+/* ========================================================================= *
+ * Types
+ * ========================================================================= */
+
+/** Cached state of an ofono modem */
+typedef struct ofono_modem_t
+{
+    char            *path;
+    gboolean         has_netreg;
+    char            *status;
+    DBusPendingCall *pc;
+} ofono_modem_t;
+
+/* ========================================================================= *
+ * State data
+ * ========================================================================= */
+
+/** SystemBus connection ref used for ofono ipc */
+static DBusConnection *ofono_con = 0;
+
+/** Flag for: ofono is available on system bus */
+static gboolean ofono_is_available = FALSE;
+
+/** Object path -> ofono_modem_t */
+static GHashTable *ofono_modems = 0;
+
+/** Cached roaming state */
+static gboolean ofono_roaming = FALSE;
+
+static DBusPendingCall *ofono_available_pc = 0;
+static DBusPendingCall *ofono_modems_pc    = 0;
+
+/* ========================================================================= *
+ * Roaming state
+ * ========================================================================= */
+
+/** Update roaming state after a modem has changed */
+static void ofono_roaming_rethink(void)
+{
+    gboolean       roaming = FALSE;
+    GHashTableIter iter;
+    gpointer       val;
+
+    g_hash_table_iter_init(&iter, ofono_modems);
+    while( g_hash_table_iter_next(&iter, 0, &val) ) {
+        ofono_modem_t *modem = val;
+
+        if( !g_strcmp0(modem->status, "roaming") )
+            roaming = TRUE;
+    }
+
+    if( ofono_roaming == roaming )
+        return;
+
+    log_debug("ofono roaming: %d -> %d", ofono_roaming, roaming);
+    ofono_roaming = roaming;
+
+    usb_network_roaming_changed(ofono_roaming);
+}
+
+/* ========================================================================= *
+ * Modems
+ * ========================================================================= */
+
+static void ofono_pending_cancel(DBusPendingCall **ppc)
+{
+    if( *ppc ) {
+        dbus_pending_call_cancel(*ppc);
+        dbus_pending_call_unref(*ppc), *ppc = 0;
+    }
+}
+
+static void ofono_modem_free(gpointer aptr)
+{
+    ofono_modem_t *self = aptr;
+
+    ofono_pending_cancel(&self->pc);
+    g_free(self->path);
+    g_free(self->status);
+    g_free(self);
+}
+
+static void ofono_modem_set_status(ofono_modem_t *self, DBusMessageIter *var)
+{
+    const char *status = 0;
+
+    if( dbus_message_iter_get_arg_type(var) == DBUS_TYPE_STRING )
+        dbus_message_iter_get_basic(var, &status);
+
+    log_debug("modem %s status = %s", self->path, status ?: "NULL");
+    g_free(self->status), self->status = g_strdup(status);
+}
+
+/** Handle a registration property from GetProperties or PropertyChanged */
+static void ofono_modem_netreg_property(ofono_modem_t *self, const char *key,
+                                        DBusMessageIter *var)
+{
+    if( !strcmp(key, "Status") )
+        ofono_modem_set_status(self, var);
+}
+
+static void ofono_netreg_query_cb(DBusPendingCall *pc, void *aptr)
+{
+    ofono_modem_t   *self = aptr;
+    DBusMessage     *rsp  = 0;
+    DBusError        err  = DBUS_ERROR_INIT;
+    DBusMessageIter  iter, arr, ent, var;
+    const char      *key  = 0;
+
+    if( !(rsp = dbus_pending_call_steal_reply(pc)) ) {
+        log_err("%s.%s: no reply",
+                OFONO_NETREG_INTERFACE, OFONO_GET_PROPERTIES_REQ);
+        goto EXIT;
+    }
+
+    if( dbus_set_error_from_message(&err, rsp) ) {
+        log_err("%s.%s: error reply: %s: %s",
+                OFONO_NETREG_INTERFACE, OFONO_GET_PROPERTIES_REQ,
+                err.name, err.message);
+        goto EXIT;
+    }
+
+    dbus_message_iter_init(rsp, &iter);
+    if( dbus_message_iter_get_arg_type(&iter) != DBUS_TYPE_ARRAY )
+        goto EXIT;
+
+    dbus_message_iter_recurse(&iter, &arr);
+    while( dbus_message_iter_get_arg_type(&arr) == DBUS_TYPE_DICT_ENTRY ) {
+        dbus_message_iter_recurse(&arr, &ent);
+        if( dbus_message_iter_get_arg_type(&ent) == DBUS_TYPE_STRING ) {
+            dbus_message_iter_get_basic(&ent, &key);
+            dbus_message_iter_next(&ent);
+            if( dbus_message_iter_get_arg_type(&ent) == DBUS_TYPE_VARIANT ) {
+                dbus_message_iter_recurse(&ent, &var);
+                ofono_modem_netreg_property(self, key, &var);
+            }
+        }
+        dbus_message_iter_next(&arr);
+    }
+
+    ofono_roaming_rethink();
+
+EXIT:
+    if( rsp ) dbus_message_unref(rsp);
+    dbus_error_free(&err);
+
+    dbus_pending_call_unref(self->pc), self->pc = 0;
+}
+
+/** Query registration status of a modem */
+static void ofono_modem_query_netreg(ofono_modem_t *self)
+{
+    DBusMessage     *req = 0;
+    DBusPendingCall *pc  = 0;
+
+    ofono_pending_cancel(&self->pc);
+
+    req = dbus_message_new_method_call(OFONO_SERVICE, self->path,
+                                       OFONO_NETREG_INTERFACE,
+                                       OFONO_GET_PROPERTIES_REQ);
+    if( !req ) {
+        log_err("%s.%s: failed to construct request",
+                OFONO_NETREG_INTERFACE, OFONO_GET_PROPERTIES_REQ);
+        goto EXIT;
+    }
+
+    if( !dbus_connection_send_with_reply(ofono_con, req, &pc, -1) )
+        goto EXIT;
+
+    if( !pc )
+        goto EXIT;
+
+    if( !dbus_pending_call_set_notify(pc, ofono_netreg_query_cb, self, 0) )
+        goto EXIT;
+
+    self->pc = pc, pc = 0;
+
+EXIT:
+    if( pc  ) dbus_pending_call_unref(pc);
+    if( req ) dbus_message_unref(req);
+}
+
+/** Track whether the modem has a NetworkRegistration interface */
+static void ofono_modem_set_interfaces(ofono_modem_t *self, DBusMessageIter *var)
+{
+    DBusMessageIter  arr;
+    const char      *name = 0;
+    gboolean         has_netreg = FALSE;
+
+    if( dbus_message_iter_get_arg_type(var) == DBUS_TYPE_ARRAY ) {
+        dbus_message_iter_recurse(var, &arr);
+        while( dbus_message_iter_get_arg_type(&arr) == DBUS_TYPE_STRING ) {
+            dbus_message_iter_get_basic(&arr, &name);
+            if( !strcmp(name, OFONO_NETREG_INTERFACE) )
+                has_netreg = TRUE;
+            dbus_message_iter_next(&arr);
+        }
+    }
+
+    if( self->has_netreg == has_netreg )
+        return;
+
+    self->has_netreg = has_netreg;
+    if( has_netreg ) {
+        ofono_modem_query_netreg(self);
+    }
+    else {
+        ofono_pending_cancel(&self->pc);
+        g_free(self->status), self->status = 0;
+        ofono_roaming_rethink();
+    }
+}
+
+static void ofono_modem_property(ofono_modem_t *self, const char *key,
+                                 DBusMessageIter *var)
+{
+    if( !strcmp(key, "Interfaces") )
+        ofono_modem_set_interfaces(self, var);
+}
+
+/** Add or update a modem from its property dictionary */
+static void ofono_modem_update(const char *path, DBusMessageIter *props)
+{
+    ofono_modem_t   *self = g_hash_table_lookup(ofono_modems, path);
+    DBusMessageIter  arr, ent, var;
+    const char      *key = 0;
+
+    if( !self ) {
+        log_debug("modem = %s", path);
+        self = g_new0(ofono_modem_t, 1);
+        self->path = g_strdup(path);
+        g_hash_table_replace(ofono_modems, self->path, self);
+    }
+
+    if( dbus_message_iter_get_arg_type(props) != DBUS_TYPE_ARRAY )
+        return;
+
+    dbus_message_iter_recurse(props, &arr);
+    while( dbus_message_iter_get_arg_type(&arr) == DBUS_TYPE_DICT_ENTRY ) {
+        dbus_message_iter_recurse(&arr, &ent);
+        if( dbus_message_iter_get_arg_type(&ent) == DBUS_TYPE_STRING ) {
+            dbus_message_iter_get_basic(&ent, &key);
+            dbus_message_iter_next(&ent);
+            if( dbus_message_iter_get_arg_type(&ent) == DBUS_TYPE_VARIANT ) {
+                dbus_message_iter_recurse(&ent, &var);
+                ofono_modem_property(self, key, &var);
+            }
+        }
+        dbus_message_iter_next(&arr);
+    }
+}
+
+static void ofono_modems_query_cb(DBusPendingCall *pc, void *aptr)
+{
+    DBusMessage     *rsp  = 0;
+    DBusError        err  = DBUS_ERROR_INIT;
+    DBusMessageIter  iter, arr, obj;
+    const char      *path = 0;
+
+    (void)aptr;
+
+    if( !(rsp = dbus_pending_call_steal_reply(pc)) ) {
+        log_err("%s.%s: no reply",
+                OFONO_MANAGER_INTERFACE, OFONO_GET_MODEMS_REQ);
+        goto EXIT;
+    }
+
+    if( dbus_set_error_from_message(&err, rsp) ) {
+        log_err("%s.%s: error reply: %s: %s",
+                OFONO_MANAGER_INTERFACE, OFONO_GET_MODEMS_REQ,
+                err.name, err.message);
+        goto EXIT;
+    }
+
+    dbus_message_iter_init(rsp, &iter);
+    if( dbus_message_iter_get_arg_type(&iter) != DBUS_TYPE_ARRAY )
+        goto EXIT;
+
+    dbus_message_iter_recurse(&iter, &arr);
+    while( dbus_message_iter_get_arg_type(&arr) == DBUS_TYPE_STRUCT ) {
+        dbus_message_iter_recurse(&arr, &obj);
+        if( dbus_message_iter_get_arg_type(&obj) == DBUS_TYPE_OBJECT_PATH ) {
+            dbus_message_iter_get_basic(&obj, &path);
+            dbus_message_iter_next(&obj);
+            ofono_modem_update(path, &obj);
+        }
+        dbus_message_iter_next(&arr);
+    }
+
+EXIT:
+    if( rsp ) dbus_message_unref(rsp);
+    dbus_error_free(&err);
+
+    dbus_pending_call_unref(ofono_modems_pc), ofono_modems_pc = 0;
+}
+
+static void ofono_modems_query(void)
+{
+    DBusMessage     *req = 0;
+    DBusPendingCall *pc  = 0;
+
+    ofono_pending_cancel(&ofono_modems_pc);
+
+    req = dbus_message_new_method_call(OFONO_SERVICE, OFONO_MANAGER_PATH,
+                                       OFONO_MANAGER_INTERFACE,
+                                       OFONO_GET_MODEMS_REQ);
+    if( !req ) {
+        log_err("%s.%s: failed to construct request",
+                OFONO_MANAGER_INTERFACE, OFONO_GET_MODEMS_REQ);
+        goto EXIT;
+    }
+
+    if( !dbus_connection_send_with_reply(ofono_con, req, &pc, -1) )
+        goto EXIT;
+
+    if( !pc )
+        goto EXIT;
+
+    if( !dbus_pending_call_set_notify(pc, ofono_modems_query_cb, 0, 0) )
+        goto EXIT;
+
+    ofono_modems_pc = pc, pc = 0;
+
+EXIT:
+    if( pc  ) dbus_pending_call_unref(pc);
+    if( req ) dbus_message_unref(req);
+}
+
+/* ========================================================================= *
+ * Signal handling
+ * ========================================================================= */
+
+static void ofono_modem_added_signal(DBusMessage *msg)
+{
+    DBusMessageIter  iter;
+    const char      *path = 0;
+
+    dbus_message_iter_init(msg, &iter);
+    if( dbus_message_iter_get_arg_type(&iter) != DBUS_TYPE_OBJECT_PATH )
+        return;
+
+    dbus_message_iter_get_basic(&iter, &path);
+    dbus_message_iter_next(&iter);
+    ofono_modem_update(path, &iter);
+}
+
+static void ofono_modem_removed_signal(DBusMessage *msg)
+{
+    const char *path = 0;
+
+    if( !dbus_message_get_args(msg, 0, DBUS_TYPE_OBJECT_PATH, &path,
+                               DBUS_TYPE_INVALID) )
+        return;
+
+    log_debug("modem %s removed", path);
+    g_hash_table_remove(ofono_modems, path);
+    ofono_roaming_rethink();
+}
+
+/** Handle PropertyChanged from the modem or its registration interface */
+static void ofono_property_changed_signal(DBusMessage *msg, gboolean netreg)
+{
+    DBusMessageIter  iter, var;
+    const char      *key  = 0;
+    const char      *path = dbus_message_get_path(msg);
+    ofono_modem_t   *self = path ? g_hash_table_lookup(ofono_modems, path) : 0;
+
+    if( !self )
+        return;
+
+    dbus_message_iter_init(msg, &iter);
+    if( dbus_message_iter_get_arg_type(&iter) != DBUS_TYPE_STRING )
+        return;
+
+    dbus_message_iter_get_basic(&iter, &key);
+    dbus_message_iter_next(&iter);
+    if( dbus_message_iter_get_arg_type(&iter) != DBUS_TYPE_VARIANT )
+        return;
+
+    dbus_message_iter_recurse(&iter, &var);
+    if( netreg ) {
+        ofono_modem_netreg_property(self, key, &var);
+        ofono_roaming_rethink();
+    }
+    else {
+        ofono_modem_property(self, key, &var);
+    }
+}
+
+/* ========================================================================= *
+ * Name owner tracking
+ * ========================================================================= */
+
+static void ofono_available_changed(const char *owner)
+{
+    gboolean is_available = (owner && *owner);
+
+    if( ofono_is_available == is_available )
+        return;
+
+    ofono_is_available = is_available;
+    log_debug("ofono is %s", ofono_is_available ? "running" : "stopped");
+
+    /* Forget cached modems */
+    ofono_pending_cancel(&ofono_modems_pc);
+    g_hash_table_remove_all(ofono_modems);
+    ofono_roaming_rethink();
+
+    /* Query modems on ofono startup */
+    if( ofono_is_available )
+        ofono_modems_query();
+}
+
+static void ofono_available_cb(const char *owner)
+{
+    ofono_available_changed(owner);
+
+    dbus_pending_call_unref(ofono_available_pc),
+        ofono_available_pc = 0;
+}
+
+static void ofono_name_owner_signal(DBusMessage *msg)
+{
+    DBusError   err  = DBUS_ERROR_INIT;
+    const char *name = 0;
+    const char *prev = 0;
+    const char *curr = 0;
+
+    if( !dbus_message_get_args(msg, &err,
+                               DBUS_TYPE_STRING, &name,
+                               DBUS_TYPE_STRING, &prev,
+                               DBUS_TYPE_STRING, &curr,
+                               DBUS_TYPE_INVALID) )
+    {
+        log_err("failed to parse signal: %s: %s",
+                err.name, err.message);
+    }
+    else if( !strcmp(name, OFONO_SERVICE) )
+    {
+        ofono_available_changed(curr);
+    }
+    dbus_error_free(&err);
+}
+
+/* ========================================================================= *
+ * dbus message filter
+ * ========================================================================= */
+
+static DBusHandlerResult
+ofono_dbus_filter_cb(DBusConnection *con, DBusMessage *msg, void *aptr)
+{
+    (void)con;
+    (void)aptr;
+
+    if( dbus_message_get_type(msg) != DBUS_MESSAGE_TYPE_SIGNAL )
+        goto EXIT;
+
+    if( dbus_message_is_signal(msg, OFONO_MANAGER_INTERFACE,
+                               OFONO_MODEM_ADDED_SIG) )
+        ofono_modem_added_signal(msg);
+    else if( dbus_message_is_signal(msg, OFONO_MANAGER_INTERFACE,
+                                    OFONO_MODEM_REMOVED_SIG) )
+        ofono_modem_removed_signal(msg);
+    else if( dbus_message_is_signal(msg, OFONO_MODEM_INTERFACE,
+                                    OFONO_PROPERTY_CHANGED_SIG) )
+        ofono_property_changed_signal(msg, FALSE);
+    else if( dbus_message_is_signal(msg, OFONO_NETREG_INTERFACE,
+                                    OFONO_PROPERTY_CHANGED_SIG) )
+        ofono_property_changed_signal(msg, TRUE);
+    else if( dbus_message_is_signal(msg, DBUS_INTERFACE_DBUS,
+                                    DBUS_NAME_OWNER_CHANGED_SIG) )
+        ofono_name_owner_signal(msg);
+
+EXIT:
+    return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+}
+
+/* ========================================================================= *
+ * External API
+ * ========================================================================= */
+
+/** Get cached roaming state
+ *
+ * @return TRUE if a modem is roaming, FALSE when not (or when ofono
+ *         is unavailable)
+ */
+gboolean usb_moded_ofono_roaming(void)
+{
+    return ofono_roaming;
+}
+
+/** Start tracking ofono roaming state
+ *
+ * @return TRUE on success, FALSE otherwise
+ */
+gboolean usb_moded_ofono_start(void)
+{
+    gboolean ack = FALSE;
+
+    log_debug("starting ofono tracking");
+
+    ofono_modems = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                         0, ofono_modem_free);
+
+    /* Get connection ref */
+    if( (ofono_con = usb_moded_dbus_get_connection()) == 0 )
+    {
+        log_err("Could not connect to dbus for ofono\n");
+        goto EXIT;
+    }
+
+    /* Add filter callback */
+    if( !dbus_connection_add_filter(ofono_con, ofono_dbus_filter_cb, 0, 0) )
+    {
+        log_err("adding system dbus filter for ofono failed");
+        goto EXIT;
+    }
+
+    /* Add match without blocking / error checking */
+    dbus_bus_add_match(ofono_con, OFONO_MANAGER_MATCH, 0);
+    dbus_bus_add_match(ofono_con, OFONO_MODEM_MATCH, 0);
+    dbus_bus_add_match(ofono_con, OFONO_NETREG_MATCH, 0);
+    dbus_bus_add_match(ofono_con, OFONO_NAME_OWNER_CHANGED_MATCH, 0);
+
+    /* Initiate async ofono name owner query */
+    usb_moded_get_name_owner_async(OFONO_SERVICE, ofono_available_cb,
+                                   &ofono_available_pc);
+
+    ack = TRUE;
+
+EXIT:
+    return ack;
+}
+
+/** Stop tracking ofono roaming state
+ */
+void usb_moded_ofono_stop(void)
+{
+    log_debug("stopping ofono tracking");
+
+    /* Do note leave pending queries behind */
+    ofono_pending_cancel(&ofono_available_pc);
+    ofono_pending_cancel(&ofono_modems_pc);
+
+    if( ofono_con )
+    {
+        /* Remove filter callback */
+        dbus_connection_remove_filter(ofono_con, ofono_dbus_filter_cb, 0);
+
+        if( dbus_connection_get_is_connected(ofono_con) ) {
+            /* Remove match without blocking / error checking */
+            dbus_bus_remove_match(ofono_con, OFONO_MANAGER_MATCH, 0);
+            dbus_bus_remove_match(ofono_con, OFONO_MODEM_MATCH, 0);
+            dbus_bus_remove_match(ofono_con, OFONO_NETREG_MATCH, 0);
+            dbus_bus_remove_match(ofono_con, OFONO_NAME_OWNER_CHANGED_MATCH, 0);
+        }
+
+        /* Let go of connection ref */
+        dbus_connection_unref(ofono_con),
+            ofono_con = 0;
+    }
+
+    /* Modems hold pending calls, drop them too */
+    if( ofono_modems )
+        g_hash_table_destroy(ofono_modems), ofono_modems = 0;
+    ofono_is_available = FALSE;
+    ofono_roaming = FALSE;
+}
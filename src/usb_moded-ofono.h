@@ -0,0 +1,33 @@
+/**
+  @file usb_moded-ofono.h
+
+  Copyright (C) 2016 Jolla. All rights reserved.
+
+  @author: Philippe De Swert <philippe.deswert@jollamobile.com>
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the Lesser GNU General Public License 
+  version 2 as published by the Free Software Foundation. 
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  General Public License for more details.
+ 
+  You should have received a copy of the Lesser GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+  02110-1301 USA
+*/
+
+#ifndef USB_MODED_OFONO_H_
+#define USB_MODED_OFONO_H_
+
+#include <glib.h>
+
+gboolean usb_moded_ofono_start(void);
+void     usb_moded_ofono_stop(void);
+
+gboolean usb_moded_ofono_roaming(void);
+
+#endif /* USB_MODED_OFONO_H_ */
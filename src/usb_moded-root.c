@@ -0,0 +1,118 @@
+/**
+  @file usb_moded-root.c
+
+  Copyright (C) 2016 Jolla. All rights reserved.
+
+  @author: Philippe De Swert <philippe.deswert@jollamobile.com>
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the Lesser GNU General Public License
+  version 2 as published by the Free Software Foundation.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  General Public License for more details.
+
+  You should have received a copy of the Lesser GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+  02110-1301 USA
+*/
+
+/*
+ * Alternate root directory
+ *
+ * Normally usb_moded operates on the real /sys, /proc, /etc and so on.
+ * For running it off-device, a root directory can be given on the
+ * command line (--root), and then every file system path usb_moded
+ * accesses is looked up under that directory instead. Fixture trees
+ * can then stand in for sysfs, procfs and the configuration.
+ *
+ * Kernel modules and external commands can not be redirected like that,
+ * so while an alternate root is in use module loading and command
+ * execution are stubbed: they are logged and reported as successful
+ * without touching the host.
+ */
+
+#include <string.h>
+#include <glib.h>
+
+#include "usb_moded-root.h"
+#include "usb_moded-log.h"
+
+/* ========================================================================= *
+ * State data
+ * ========================================================================= */
+
+/** Alternate root directory, or NULL when using the real root */
+static gchar *root_dir = 0;
+
+/* ========================================================================= *
+ * External API
+ * ========================================================================= */
+
+/** Set alternate root directory
+ *
+ * @param root directory to use as root, or NULL / "" / "/" for real root
+ */
+void usb_moded_root_set(const char *root)
+{
+    size_t len;
+
+    g_free(root_dir), root_dir = 0;
+
+    if( !root || !*root || !strcmp(root, "/") )
+        return;
+
+    /* trailing slashes would just double up in prefixed paths */
+    root_dir = g_strdup(root);
+    len = strlen(root_dir);
+    while( len > 1 && root_dir[len - 1] == '/' )
+        root_dir[--len] = 0;
+
+    log_warning("using %s as root, modules and commands are stubbed",
+                root_dir);
+}
+
+/** Get alternate root directory
+ *
+ * @return root directory, or NULL when using the real root
+ */
+const char *usb_moded_root(void)
+{
+    return root_dir;
+}
+
+/** Check if module loading and command execution should be stubbed
+ *
+ * @return TRUE when running under an alternate root, FALSE otherwise
+ */
+gboolean usb_moded_root_stubbed(void)
+{
+    return root_dir != 0;
+}
+
+/** Map absolute path to the alternate root
+ *
+ * Without an alternate root a copy of the path is returned as is,
+ * so callers do not need to care whether prefixing took place.
+ *
+ * @param path absolute path
+ *
+ * @return path to use for accessing the file, release with g_free()
+ */
+gchar *usb_moded_root_path(const char *path)
+{
+    if( !root_dir || !path || *path != '/' )
+        return g_strdup(path);
+
+    return g_strconcat(root_dir, path, NULL);
+}
+
+/** Release alternate root data on exit
+ */
+void usb_moded_root_quit(void)
+{
+    g_free(root_dir), root_dir = 0;
+}
@@ -0,0 +1,34 @@
+/**
+  @file usb_moded-root.h
+
+  Copyright (C) 2016 Jolla. All rights reserved.
+
+  @author: Philippe De Swert <philippe.deswert@jollamobile.com>
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the Lesser GNU General Public License 
+  version 2 as published by the Free Software Foundation. 
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  General Public License for more details.
+ 
+  You should have received a copy of the Lesser GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+  02110-1301 USA
+*/
+
+#ifndef USB_MODED_ROOT_H_
+#define USB_MODED_ROOT_H_
+
+#include <glib.h>
+
+void        usb_moded_root_set(const char *root);
+const char *usb_moded_root(void);
+gboolean    usb_moded_root_stubbed(void);
+gchar      *usb_moded_root_path(const char *path);
+void        usb_moded_root_quit(void);
+
+#endif /* USB_MODED_ROOT_H_ */
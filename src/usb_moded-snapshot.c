@@ -0,0 +1,781 @@
+/**
+  @file usb_moded-snapshot.c
+
+  Copyright (C) 2016 Jolla. All rights reserved.
+
+  @author: Philippe De Swert <philippe.deswert@jollamobile.com>
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the Lesser GNU General Public License
+  version 2 as published by the Free Software Foundation.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  General Public License for more details.
+
+  You should have received a copy of the Lesser GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+  02110-1301 USA
+*/
+
+/*
+ * Binary snapshot of the configuration data parsed at startup
+ *
+ * The merged settings, the dynamic mode list and the appsync list are
+ * stored in a flat file that can be mapped and validated without any
+ * text parsing. The snapshot is only used while usb_moded_init() runs;
+ * if it is missing, corrupted or older than the ini-files it was made
+ * from, the data is parsed as usual and a new snapshot is written.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <glob.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <glib.h>
+
+#include "usb_moded-snapshot.h"
+#include "usb_moded-config.h"
+#include "usb_moded-dyn-config.h"
+#include "usb_moded-log.h"
+#include "usb_moded-root.h"
+
+#ifdef APP_SYNC
+# include "usb_moded-appsync.h"
+#endif
+
+/* ========================================================================= *
+ * File format
+ * ========================================================================= */
+
+#define SNAPSHOT_MAGIC		0x53534d55 /* "UMSS" */
+#define SNAPSHOT_VERSION	2 /* 2: sysfs_always_write stored normalized */
+
+/** Sections stored in the snapshot */
+typedef enum
+{
+    SNAPSHOT_SETTINGS,
+    SNAPSHOT_MODES,
+    SNAPSHOT_APPSYNC,
+    SNAPSHOT_SECTION_COUNT
+} snapshot_section_t;
+
+/** Location of one section in the file
+ *
+ * A record consists of nstr string offsets followed by nnum integers,
+ * all stored as 32 bit values. String offsets point to the string table,
+ * offset zero is used for NULL strings.
+ */
+typedef struct
+{
+    uint32_t offset;
+    uint32_t count;
+    uint32_t nstr;
+    uint32_t nnum;
+} snapshot_extent_t;
+
+typedef struct
+{
+    uint32_t          magic;
+    uint32_t          version;
+    uint32_t          size;      /* total file size */
+    uint32_t          checksum;  /* over everything after the header */
+    uint32_t          present;   /* mask of sections that are filled in */
+    uint32_t          stamp;     /* string offset of input fingerprint */
+    uint32_t          strings;   /* offset of string table */
+    uint32_t          strings_size;
+    snapshot_extent_t section[SNAPSHOT_SECTION_COUNT];
+} snapshot_header_t;
+
+/* ========================================================================= *
+ * Record layouts
+ * ========================================================================= */
+
+typedef struct
+{
+    size_t        size;
+    const size_t *str;
+    uint32_t      nstr;
+    const size_t *num;
+    uint32_t      nnum;
+} snapshot_layout_t;
+
+static const size_t snapshot_mode_str[] =
+{
+    offsetof(mode_list_elem, mode_name),
+    offsetof(mode_list_elem, mode_module),
+    offsetof(mode_list_elem, network_interface),
+    offsetof(mode_list_elem, sysfs_path),
+    offsetof(mode_list_elem, sysfs_value),
+    offsetof(mode_list_elem, sysfs_reset_value),
+    offsetof(mode_list_elem, softconnect),
+    offsetof(mode_list_elem, softconnect_disconnect),
+    offsetof(mode_list_elem, softconnect_path),
+    offsetof(mode_list_elem, sysfs_always_write),
+    offsetof(mode_list_elem, android_extra_sysfs_path),
+    offsetof(mode_list_elem, android_extra_sysfs_value),
+    offsetof(mode_list_elem, android_extra_sysfs_path2),
+    offsetof(mode_list_elem, android_extra_sysfs_value2),
+    offsetof(mode_list_elem, android_extra_sysfs_path3),
+    offsetof(mode_list_elem, android_extra_sysfs_value3),
+    offsetof(mode_list_elem, android_extra_sysfs_path4),
+    offsetof(mode_list_elem, android_extra_sysfs_value4),
+    offsetof(mode_list_elem, idProduct),
+    offsetof(mode_list_elem, idVendorOverride),
+    offsetof(mode_list_elem, configfs_functions),
+#ifdef CONNMAN
+    offsetof(mode_list_elem, connman_tethering),
+#endif
+};
+
+static const size_t snapshot_mode_num[] =
+{
+    offsetof(mode_list_elem, appsync),
+    offsetof(mode_list_elem, network),
+    offsetof(mode_list_elem, mass_storage),
+    offsetof(mode_list_elem, nat),
+    offsetof(mode_list_elem, dhcp_server),
+};
+
+static const snapshot_layout_t snapshot_mode_layout =
+{
+    .size = sizeof(mode_list_elem),
+    .str  = snapshot_mode_str,
+    .nstr = G_N_ELEMENTS(snapshot_mode_str),
+    .num  = snapshot_mode_num,
+    .nnum = G_N_ELEMENTS(snapshot_mode_num),
+};
+
+#ifdef APP_SYNC
+static const size_t snapshot_app_str[] =
+{
+    offsetof(list_elem, name),
+    offsetof(list_elem, mode),
+    offsetof(list_elem, launch),
+};
+
+static const size_t snapshot_app_num[] =
+{
+    offsetof(list_elem, systemd),
+    offsetof(list_elem, post),
+};
+
+static const snapshot_layout_t snapshot_app_layout =
+{
+    .size = sizeof(list_elem),
+    .str  = snapshot_app_str,
+    .nstr = G_N_ELEMENTS(snapshot_app_str),
+    .num  = snapshot_app_num,
+    .nnum = G_N_ELEMENTS(snapshot_app_num),
+};
+#endif
+
+/* ========================================================================= *
+ * Prototypes
+ * ========================================================================= */
+
+static uint32_t           snapshot_checksum        (const void *data, size_t size);
+static void               snapshot_stamp_file      (GString *stamp, const char *path);
+static void               snapshot_stamp_dir       (GString *stamp, const char *dir, const char *pattern);
+static gchar             *snapshot_stamp           (int diag);
+
+static const char        *snapshot_string          (uint32_t offset);
+static const uint32_t    *snapshot_records         (snapshot_section_t sec, const snapshot_layout_t *layout);
+static gboolean           snapshot_map             (const char *stamp);
+static void               snapshot_unmap           (void);
+static GList             *snapshot_get_list        (snapshot_section_t sec, const snapshot_layout_t *layout);
+
+static uint32_t           snapshot_intern          (const char *str);
+static void               snapshot_put32           (GByteArray *buf, uint32_t val);
+static void               snapshot_add_list        (snapshot_section_t sec, const snapshot_layout_t *layout, GList *list);
+static void               snapshot_build_begin     (void);
+static void               snapshot_build_end       (void);
+static gboolean           snapshot_save            (void);
+
+/* ========================================================================= *
+ * State data
+ * ========================================================================= */
+
+/** Fingerprint of the files the snapshot data is made from */
+static gchar *snapshot_input_stamp = 0;
+
+/** Mapped and validated snapshot file, or NULL */
+static const uint8_t *snapshot_data = 0;
+static size_t snapshot_size = 0;
+
+/** Snapshot builder state, used when the mapped snapshot is not valid */
+static gboolean    snapshot_building = FALSE;
+static uint32_t    snapshot_added    = 0;
+static GByteArray *snapshot_strtab   = 0;
+static GHashTable *snapshot_strmap   = 0;
+static GByteArray *snapshot_sect[SNAPSHOT_SECTION_COUNT];
+static uint32_t    snapshot_count[SNAPSHOT_SECTION_COUNT];
+
+/** Sections that must be present for the snapshot to be saved */
+static const uint32_t snapshot_required =
+    (1u << SNAPSHOT_SETTINGS) |
+#ifdef APP_SYNC
+    (1u << SNAPSHOT_APPSYNC) |
+#endif
+    (1u << SNAPSHOT_MODES);
+
+/* ========================================================================= *
+ * Input fingerprint
+ * ========================================================================= */
+
+/** FNV-1a hash used as snapshot checksum
+ */
+static uint32_t snapshot_checksum(const void *data, size_t size)
+{
+    const uint8_t *pos = data;
+    uint32_t       sum = 2166136261u;
+
+    while( size-- )
+        sum = (sum ^ *pos++) * 16777619u;
+
+    return sum;
+}
+
+static void snapshot_stamp_file(GString *stamp, const char *path)
+{
+    struct stat st;
+
+    if( stat(path, &st) == -1 ) {
+        g_string_append_printf(stamp, "%s -\n", path);
+        return;
+    }
+
+    g_string_append_printf(stamp, "%s %lu %lu %lld %ld.%09ld\n", path,
+                           (unsigned long)st.st_dev,
+                           (unsigned long)st.st_ino,
+                           (long long)st.st_size,
+                           (long)st.st_mtim.tv_sec,
+                           (long)st.st_mtim.tv_nsec);
+}
+
+/** Add fingerprint of directory and matching files in it
+ *
+ * The directory itself is included so that files added or
+ * removed are noticed even if they do not match the pattern.
+ */
+static void snapshot_stamp_dir(GString *stamp, const char *dir,
+                               const char *pattern)
+{
+    gchar *real = usb_moded_root_path(dir);
+    gchar *path = g_strconcat(real, "/", pattern, NULL);
+    glob_t gb;
+
+    memset(&gb, 0, sizeof gb);
+
+    snapshot_stamp_file(stamp, real);
+
+    if( glob(path, 0, 0, &gb) == 0 ) {
+        for( size_t i = 0; i < gb.gl_pathc; ++i )
+            snapshot_stamp_file(stamp, gb.gl_pathv[i]);
+    }
+
+    globfree(&gb);
+    g_free(path);
+    g_free(real);
+}
+
+/** Get fingerprint of all files snapshot data is made from
+ */
+static gchar *snapshot_stamp(int diag)
+{
+    GString *stamp = g_string_new(NULL);
+
+    g_string_append_printf(stamp, "diag=%d\n", diag ? 1 : 0);
+
+    /* Record layouts depend on build options */
+    g_string_append_printf(stamp, "modes=%u/%u\n",
+                           snapshot_mode_layout.nstr,
+                           snapshot_mode_layout.nnum);
+#ifdef APP_SYNC
+    g_string_append_printf(stamp, "appsync=%u/%u\n",
+                           snapshot_app_layout.nstr,
+                           snapshot_app_layout.nnum);
+#endif
+
+    snapshot_stamp_dir(stamp, CONFIG_FILE_DIR, "*.ini");
+    snapshot_stamp_dir(stamp, diag ? DIAG_DIR_PATH : MODE_DIR_PATH, "*");
+#ifdef APP_SYNC
+    snapshot_stamp_dir(stamp, diag ? CONF_DIR_DIAG_PATH : CONF_DIR_PATH, "*");
+#endif
+
+    return g_string_free(stamp, FALSE);
+}
+
+/* ========================================================================= *
+ * Reading
+ * ========================================================================= */
+
+static const char *snapshot_string(uint32_t offset)
+{
+    const snapshot_header_t *hdr = (const snapshot_header_t *)snapshot_data;
+
+    if( offset == 0 || offset >= hdr->strings_size )
+        return 0;
+
+    return (const char *)snapshot_data + hdr->strings + offset;
+}
+
+/** Get records of a section, if present and matching the layout
+ */
+static const uint32_t *snapshot_records(snapshot_section_t sec,
+                                        const snapshot_layout_t *layout)
+{
+    const snapshot_header_t *hdr = (const snapshot_header_t *)snapshot_data;
+    const snapshot_extent_t *ext;
+
+    if( !snapshot_data || !(hdr->present & (1u << sec)) )
+        return 0;
+
+    ext = &hdr->section[sec];
+
+    if( ext->nstr != layout->nstr || ext->nnum != layout->nnum )
+        return 0;
+
+    return (const uint32_t *)(snapshot_data + ext->offset);
+}
+
+/** Map snapshot file and check that it can be used
+ *
+ * @param stamp fingerprint of current input files
+ *
+ * @return TRUE if the snapshot is valid and up to date, FALSE otherwise
+ */
+static gboolean snapshot_map(const char *stamp)
+{
+    gboolean                 ack = FALSE;
+    int                      fd  = -1;
+    void                    *map = MAP_FAILED;
+    struct stat              st;
+    const snapshot_header_t *hdr;
+    gchar                   *path = usb_moded_root_path(SNAPSHOT_FILE_PATH);
+
+    if( (fd = open(path, O_RDONLY | O_CLOEXEC)) == -1 ) {
+        log_debug("%s: no snapshot", SNAPSHOT_FILE_PATH);
+        goto EXIT;
+    }
+
+    if( fstat(fd, &st) == -1 || st.st_size < (off_t)sizeof *hdr ) {
+        log_debug("%s: truncated snapshot", SNAPSHOT_FILE_PATH);
+        goto EXIT;
+    }
+
+    map = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if( map == MAP_FAILED ) {
+        log_warning("%s: mmap: %m", SNAPSHOT_FILE_PATH);
+        goto EXIT;
+    }
+
+    hdr = map;
+
+    if( hdr->magic != SNAPSHOT_MAGIC || hdr->version != SNAPSHOT_VERSION ||
+        hdr->size != (uint32_t)st.st_size ) {
+        log_debug("%s: incompatible snapshot", SNAPSHOT_FILE_PATH);
+        goto EXIT;
+    }
+
+    if( hdr->checksum != snapshot_checksum((const uint8_t *)map + sizeof *hdr,
+                                           hdr->size - sizeof *hdr) ) {
+        log_warning("%s: checksum mismatch", SNAPSHOT_FILE_PATH);
+        goto EXIT;
+    }
+
+    /* String table must be within the file and nul terminated */
+    if( hdr->strings_size < 1 || hdr->strings < sizeof *hdr ||
+        hdr->strings > hdr->size ||
+        hdr->strings_size > hdr->size - hdr->strings ||
+        ((const char *)map)[hdr->strings + hdr->strings_size - 1] != 0 ) {
+        log_warning("%s: invalid string table", SNAPSHOT_FILE_PATH);
+        goto EXIT;
+    }
+
+    for( int i = 0; i < SNAPSHOT_SECTION_COUNT; ++i ) {
+        const snapshot_extent_t *ext = &hdr->section[i];
+        uint64_t len = (uint64_t)ext->count * (ext->nstr + ext->nnum) * 4;
+
+        if( ext->offset < sizeof *hdr || ext->offset + len > hdr->strings ) {
+            log_warning("%s: invalid section %d", SNAPSHOT_FILE_PATH, i);
+            goto EXIT;
+        }
+    }
+
+    snapshot_data = map, snapshot_size = st.st_size, map = MAP_FAILED;
+
+    if( g_strcmp0(snapshot_string(hdr->stamp), stamp) ) {
+        log_debug("%s: snapshot is out of date", SNAPSHOT_FILE_PATH);
+        snapshot_unmap();
+        goto EXIT;
+    }
+
+    ack = TRUE;
+
+EXIT:
+    if( map != MAP_FAILED )
+        munmap(map, st.st_size);
+
+    if( fd != -1 )
+        close(fd);
+
+    g_free(path);
+
+    return ack;
+}
+
+static void snapshot_unmap(void)
+{
+    if( snapshot_data )
+        munmap((void *)snapshot_data, snapshot_size);
+    snapshot_data = 0, snapshot_size = 0;
+}
+
+/** Create list of items from snapshot section
+ */
+static GList *snapshot_get_list(snapshot_section_t sec,
+                                const snapshot_layout_t *layout)
+{
+    const snapshot_header_t *hdr = (const snapshot_header_t *)snapshot_data;
+    const uint32_t *rec = snapshot_records(sec, layout);
+    GList *list = 0;
+
+    for( uint32_t i = 0; rec && i < hdr->section[sec].count; ++i ) {
+        char *item = calloc(1, layout->size);
+
+        for( uint32_t k = 0; k < layout->nstr; ++k )
+            *(char **)(item + layout->str[k]) = g_strdup(snapshot_string(*rec++));
+
+        for( uint32_t k = 0; k < layout->nnum; ++k )
+            *(int *)(item + layout->num[k]) = (int32_t)*rec++;
+
+        list = g_list_prepend(list, item);
+    }
+
+    return g_list_reverse(list);
+}
+
+/* ========================================================================= *
+ * Writing
+ * ========================================================================= */
+
+/** Add string to string table, reusing already stored copies
+ *
+ * @return string table offset, or zero for NULL strings
+ */
+static uint32_t snapshot_intern(const char *str)
+{
+    gpointer offset;
+
+    if( !str )
+        return 0;
+
+    if( !(offset = g_hash_table_lookup(snapshot_strmap, str)) ) {
+        offset = GUINT_TO_POINTER(snapshot_strtab->len);
+        g_byte_array_append(snapshot_strtab, (const guint8 *)str, strlen(str) + 1);
+        g_hash_table_insert(snapshot_strmap, g_strdup(str), offset);
+    }
+
+    return GPOINTER_TO_UINT(offset);
+}
+
+static void snapshot_put32(GByteArray *buf, uint32_t val)
+{
+    g_byte_array_append(buf, (const guint8 *)&val, sizeof val);
+}
+
+static void snapshot_add_list(snapshot_section_t sec,
+                              const snapshot_layout_t *layout, GList *list)
+{
+    if( !snapshot_building )
+        return;
+
+    /* Lists may be reloaded; only the latest copy is kept */
+    g_byte_array_set_size(snapshot_sect[sec], 0);
+    snapshot_count[sec] = 0;
+
+    for( GList *iter = list; iter; iter = iter->next ) {
+        const char *item = iter->data;
+
+        for( uint32_t k = 0; k < layout->nstr; ++k )
+            snapshot_put32(snapshot_sect[sec],
+                           snapshot_intern(*(char **)(item + layout->str[k])));
+
+        for( uint32_t k = 0; k < layout->nnum; ++k )
+            snapshot_put32(snapshot_sect[sec],
+                           (uint32_t)*(const int *)(item + layout->num[k]));
+
+        snapshot_count[sec]++;
+    }
+
+    snapshot_added |= 1u << sec;
+}
+
+static void snapshot_build_begin(void)
+{
+    static const guint8 null_string = 0;
+
+    snapshot_build_end();
+
+    snapshot_strtab = g_byte_array_new();
+    snapshot_strmap = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, 0);
+
+    /* offset zero is reserved for NULL */
+    g_byte_array_append(snapshot_strtab, &null_string, 1);
+
+    for( int i = 0; i < SNAPSHOT_SECTION_COUNT; ++i ) {
+        snapshot_sect[i]  = g_byte_array_new();
+        snapshot_count[i] = 0;
+    }
+
+    snapshot_added    = 0;
+    snapshot_building = TRUE;
+}
+
+static void snapshot_build_end(void)
+{
+    snapshot_building = FALSE;
+
+    if( snapshot_strtab )
+        g_byte_array_free(snapshot_strtab, TRUE), snapshot_strtab = 0;
+
+    if( snapshot_strmap )
+        g_hash_table_unref(snapshot_strmap), snapshot_strmap = 0;
+
+    for( int i = 0; i < SNAPSHOT_SECTION_COUNT; ++i ) {
+        if( snapshot_sect[i] )
+            g_byte_array_free(snapshot_sect[i], TRUE), snapshot_sect[i] = 0;
+    }
+}
+
+/** Write collected data to SNAPSHOT_FILE_PATH
+ */
+static gboolean snapshot_save(void)
+{
+    static const uint32_t nstr[SNAPSHOT_SECTION_COUNT] =
+    {
+        [SNAPSHOT_SETTINGS] = 3,
+        [SNAPSHOT_MODES]    = G_N_ELEMENTS(snapshot_mode_str),
+#ifdef APP_SYNC
+        [SNAPSHOT_APPSYNC]  = G_N_ELEMENTS(snapshot_app_str),
+#endif
+    };
+    static const uint32_t nnum[SNAPSHOT_SECTION_COUNT] =
+    {
+        [SNAPSHOT_MODES]    = G_N_ELEMENTS(snapshot_mode_num),
+#ifdef APP_SYNC
+        [SNAPSHOT_APPSYNC]  = G_N_ELEMENTS(snapshot_app_num),
+#endif
+    };
+
+    gboolean          ack = FALSE;
+    GByteArray       *out = 0;
+    snapshot_header_t hdr;
+    GError           *err = 0;
+    gchar            *dir  = 0;
+    gchar            *path = 0;
+
+    memset(&hdr, 0, sizeof hdr);
+    hdr.magic   = SNAPSHOT_MAGIC;
+    hdr.version = SNAPSHOT_VERSION;
+    hdr.present = snapshot_added;
+    hdr.stamp   = snapshot_intern(snapshot_input_stamp);
+
+    out = g_byte_array_new();
+    g_byte_array_append(out, (const guint8 *)&hdr, sizeof hdr);
+
+    for( int i = 0; i < SNAPSHOT_SECTION_COUNT; ++i ) {
+        hdr.section[i].offset = out->len;
+        hdr.section[i].count  = snapshot_count[i];
+        hdr.section[i].nstr   = nstr[i];
+        hdr.section[i].nnum   = nnum[i];
+        g_byte_array_append(out, snapshot_sect[i]->data, snapshot_sect[i]->len);
+    }
+
+    hdr.strings      = out->len;
+    hdr.strings_size = snapshot_strtab->len;
+    g_byte_array_append(out, snapshot_strtab->data, snapshot_strtab->len);
+
+    hdr.size     = out->len;
+    hdr.checksum = snapshot_checksum(out->data + sizeof hdr, out->len - sizeof hdr);
+    memcpy(out->data, &hdr, sizeof hdr);
+
+    dir = usb_moded_root_path(SNAPSHOT_DIR_PATH);
+    if( g_mkdir_with_parents(dir, 0755) == -1 ) {
+        log_debug("%s: can't create: %m", SNAPSHOT_DIR_PATH);
+        goto EXIT;
+    }
+
+    path = usb_moded_root_path(SNAPSHOT_FILE_PATH);
+    if( !g_file_set_contents(path, (const gchar *)out->data, out->len, &err) ) {
+        log_debug("%s: can't save: %s", SNAPSHOT_FILE_PATH, err->message);
+        goto EXIT;
+    }
+
+    log_debug("%s: saved %u bytes", SNAPSHOT_FILE_PATH, out->len);
+    ack = TRUE;
+
+EXIT:
+    g_free(path);
+    g_free(dir);
+    g_clear_error(&err);
+    g_byte_array_free(out, TRUE);
+
+    return ack;
+}
+
+/* ========================================================================= *
+ * External API
+ * ========================================================================= */
+
+/** Start startup configuration loading
+ *
+ * Until usb_moded_snapshot_close() is called, the data is either
+ * served from a valid snapshot or collected for saving a new one.
+ *
+ * @param diag whether diagnostic mode configuration is used
+ */
+void usb_moded_snapshot_open(int diag)
+{
+    usb_moded_snapshot_close();
+
+    snapshot_input_stamp = snapshot_stamp(diag);
+
+    if( snapshot_map(snapshot_input_stamp) )
+        log_debug("%s: using snapshot", SNAPSHOT_FILE_PATH);
+    else
+        snapshot_build_begin();
+}
+
+/** Finish startup configuration loading
+ *
+ * If the data was parsed from ini-files, a new snapshot is written.
+ */
+void usb_moded_snapshot_close(void)
+{
+    if( snapshot_building ) {
+        if( (snapshot_added & snapshot_required) == snapshot_required )
+            snapshot_save();
+        else
+            log_debug("incomplete data; snapshot not saved");
+    }
+
+    snapshot_build_end();
+    snapshot_unmap();
+
+    g_free(snapshot_input_stamp), snapshot_input_stamp = 0;
+}
+
+/** Fill settings from snapshot
+ *
+ * @return TRUE if data was available, FALSE otherwise
+ */
+gboolean usb_moded_snapshot_get_settings(GKeyFile *ini)
+{
+    static const snapshot_layout_t layout = { .nstr = 3 };
+
+    const snapshot_header_t *hdr = (const snapshot_header_t *)snapshot_data;
+    const uint32_t *rec = snapshot_records(SNAPSHOT_SETTINGS, &layout);
+
+    if( !rec )
+        return FALSE;
+
+    for( uint32_t i = 0; i < hdr->section[SNAPSHOT_SETTINGS].count; ++i, rec += 3 ) {
+        const char *grp = snapshot_string(rec[0]);
+        const char *key = snapshot_string(rec[1]);
+        const char *val = snapshot_string(rec[2]);
+
+        if( grp && key && val )
+            g_key_file_set_value(ini, grp, key, val);
+    }
+    return TRUE;
+}
+
+/** Store settings parsed from ini-file to snapshot
+ */
+void usb_moded_snapshot_add_settings(GKeyFile *ini)
+{
+    gchar **grp;
+
+    if( !snapshot_building )
+        return;
+
+    /* Settings may be reloaded; only the latest copy is kept */
+    g_byte_array_set_size(snapshot_sect[SNAPSHOT_SETTINGS], 0);
+    snapshot_count[SNAPSHOT_SETTINGS] = 0;
+
+    if( (grp = g_key_file_get_groups(ini, 0)) ) {
+        for( size_t i = 0; grp[i]; ++i ) {
+            gchar **key = g_key_file_get_keys(ini, grp[i], 0, 0);
+
+            for( size_t k = 0; key && key[k]; ++k ) {
+                gchar *val = g_key_file_get_value(ini, grp[i], key[k], 0);
+                if( val ) {
+                    snapshot_put32(snapshot_sect[SNAPSHOT_SETTINGS], snapshot_intern(grp[i]));
+                    snapshot_put32(snapshot_sect[SNAPSHOT_SETTINGS], snapshot_intern(key[k]));
+                    snapshot_put32(snapshot_sect[SNAPSHOT_SETTINGS], snapshot_intern(val));
+                    snapshot_count[SNAPSHOT_SETTINGS]++;
+                }
+                g_free(val);
+            }
+            g_strfreev(key);
+        }
+        g_strfreev(grp);
+    }
+
+    snapshot_added |= 1u << SNAPSHOT_SETTINGS;
+}
+
+/** Get dynamic mode list from snapshot
+ *
+ * @return TRUE if data was available, FALSE otherwise
+ */
+gboolean usb_moded_snapshot_get_modes(GList **modelist)
+{
+    if( !snapshot_records(SNAPSHOT_MODES, &snapshot_mode_layout) )
+        return FALSE;
+
+    *modelist = snapshot_get_list(SNAPSHOT_MODES, &snapshot_mode_layout);
+    log_debug("%u modes from snapshot", g_list_length(*modelist));
+    return TRUE;
+}
+
+/** Store dynamic mode list parsed from ini-files to snapshot
+ */
+void usb_moded_snapshot_add_modes(GList *modelist)
+{
+    snapshot_add_list(SNAPSHOT_MODES, &snapshot_mode_layout, modelist);
+}
+
+#ifdef APP_SYNC
+/** Get appsync list from snapshot
+ *
+ * @return TRUE if data was available, FALSE otherwise
+ */
+gboolean usb_moded_snapshot_get_appsync(GList **synclist)
+{
+    if( !snapshot_records(SNAPSHOT_APPSYNC, &snapshot_app_layout) )
+        return FALSE;
+
+    *synclist = snapshot_get_list(SNAPSHOT_APPSYNC, &snapshot_app_layout);
+    log_debug("%u appsync entries from snapshot", g_list_length(*synclist));
+    return TRUE;
+}
+
+/** Store appsync list parsed from ini-files to snapshot
+ */
+void usb_moded_snapshot_add_appsync(GList *synclist)
+{
+    snapshot_add_list(SNAPSHOT_APPSYNC, &snapshot_app_layout, synclist);
+}
+#endif
@@ -0,0 +1,45 @@
+/**
+  @file usb_moded-snapshot.h
+
+  Copyright (C) 2016 Jolla. All rights reserved.
+
+  @author: Philippe De Swert <philippe.deswert@jollamobile.com>
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the Lesser GNU General Public License 
+  version 2 as published by the Free Software Foundation. 
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  General Public License for more details.
+ 
+  You should have received a copy of the Lesser GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+  02110-1301 USA
+*/
+
+#ifndef USB_MODED_SNAPSHOT_H_
+#define USB_MODED_SNAPSHOT_H_
+
+#include <glib.h>
+
+#define SNAPSHOT_DIR_PATH	"/var/cache/usb-moded"
+#define SNAPSHOT_FILE_PATH	SNAPSHOT_DIR_PATH"/config.snapshot"
+
+void usb_moded_snapshot_open(int diag);
+void usb_moded_snapshot_close(void);
+
+gboolean usb_moded_snapshot_get_settings(GKeyFile *ini);
+void usb_moded_snapshot_add_settings(GKeyFile *ini);
+
+gboolean usb_moded_snapshot_get_modes(GList **modelist);
+void usb_moded_snapshot_add_modes(GList *modelist);
+
+#ifdef APP_SYNC
+gboolean usb_moded_snapshot_get_appsync(GList **synclist);
+void usb_moded_snapshot_add_appsync(GList *synclist);
+#endif
+
+#endif /* USB_MODED_SNAPSHOT_H_ */
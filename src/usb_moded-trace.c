@@ -0,0 +1,242 @@
+/**
+  @file usb_moded-trace.c
+
+  Copyright (C) 2016 Jolla. All rights reserved.
+
+  @author: Philippe De Swert <philippe.deswert@jollamobile.com>
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the Lesser GNU General Public License
+  version 2 as published by the Free Software Foundation.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  General Public License for more details.
+
+  You should have received a copy of the Lesser GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+  02110-1301 USA
+*/
+
+/*
+ * Transition latency tracing
+ *
+ * Every phase of a mode transition is recorded with a monotonic
+ * timestamp relative to the event that started the transition. Phases
+ * that take time (sysfs writes, external commands, sleeps) are recorded
+ * as spans with a duration, the rest as instantaneous marks.
+ *
+ * Only the latest transition is kept; beginning a new one discards the
+ * previous breakdown. The buffer has a fixed size so that a runaway
+ * transition can not eat memory, entries that do not fit are counted.
+ */
+
+#include <stdarg.h>
+#include <glib.h>
+
+#include "usb_moded-trace.h"
+#include "usb_moded-log.h"
+
+/* ========================================================================= *
+ * State data
+ * ========================================================================= */
+
+/** Maximum number of entries recorded per transition */
+#define TRACE_MAX_ENTRIES 128
+
+/** Human readable phase names */
+static const char * const trace_phase_names[TRACE_PHASE_COUNT] =
+{
+    [TRACE_UDEV_EVENT]    = "udev_event",
+    [TRACE_CABLE_DELAY]   = "cable_delay",
+    [TRACE_MODE_DECIDED]  = "mode_decided",
+    [TRACE_MODULE_LOADED] = "module_loaded",
+    [TRACE_MODULE_UNLOAD] = "module_unload",
+    [TRACE_SYSFS_WRITE]   = "sysfs_write",
+    [TRACE_SYSFS_STATS]   = "sysfs_stats",
+    [TRACE_APPSYNC_PRE]   = "appsync_pre",
+    [TRACE_ENUMERATION]   = "enumeration",
+    [TRACE_NETWORK_UP]    = "network_up",
+    [TRACE_DHCPD]         = "dhcpd",
+    [TRACE_NAT]           = "nat",
+    [TRACE_POSTSYNC]      = "postsync",
+    [TRACE_EXEC]          = "exec",
+    [TRACE_SLEEP]         = "sleep",
+    [TRACE_STEP]          = "step",
+    [TRACE_MODE_SET]      = "mode_set",
+};
+
+/** Single recorded phase */
+typedef struct trace_entry_t
+{
+    trace_phase_t phase;
+    gint64        begin;    /* usec since start of transition */
+    gint64        duration; /* usec, or -1 for instantaneous marks */
+    gchar        *detail;
+} trace_entry_t;
+
+/** What started the traced transition */
+static gchar *trace_reason = 0;
+
+/** Monotonic time when the traced transition started */
+static gint64 trace_start = 0;
+
+/** Recorded phases */
+static trace_entry_t trace_entries[TRACE_MAX_ENTRIES];
+static int           trace_count = 0;
+
+/** Number of phases that did not fit in the buffer */
+static unsigned trace_dropped = 0;
+
+/* ========================================================================= *
+ * Internal helpers
+ * ========================================================================= */
+
+static void trace_clear(void)
+{
+    for( int i = 0; i < trace_count; ++i )
+        g_free(trace_entries[i].detail), trace_entries[i].detail = 0;
+
+    trace_count = 0;
+    trace_dropped = 0;
+
+    g_free(trace_reason), trace_reason = 0;
+}
+
+static void trace_add(trace_phase_t phase, gint64 begin, gint64 end,
+                      const char *fmt, va_list va)
+{
+    trace_entry_t *entry;
+
+    /* anything before the first transition goes to startup trace */
+    if( !trace_reason ) {
+        trace_reason = g_strdup("startup");
+        trace_start  = begin;
+    }
+
+    if( trace_count >= TRACE_MAX_ENTRIES ) {
+        ++trace_dropped;
+        return;
+    }
+
+    /* spans started before the transition are cut at its start, so
+     * that offsets stay non-negative */
+    if( begin < trace_start )
+        begin = trace_start;
+
+    entry = &trace_entries[trace_count++];
+    entry->phase    = phase;
+    entry->begin    = begin - trace_start;
+    entry->duration = (end < 0) ? -1 : end - begin;
+    entry->detail   = fmt ? g_strdup_vprintf(fmt, va) : 0;
+}
+
+/* ========================================================================= *
+ * External API
+ * ========================================================================= */
+
+/** Start tracing a new transition, discarding the previous one
+ *
+ * @param reason what triggered the transition
+ */
+void usb_moded_trace_begin(const char *reason)
+{
+    trace_clear();
+    trace_reason = g_strdup(reason ?: "unknown");
+    trace_start  = g_get_monotonic_time();
+}
+
+/** Get timestamp for starting a span
+ *
+ * @return monotonic time in usec
+ */
+gint64 usb_moded_trace_now(void)
+{
+    return g_get_monotonic_time();
+}
+
+/** Record an instantaneous phase
+ *
+ * @param phase phase identification
+ * @param fmt   printf style detail string, or NULL
+ */
+void usb_moded_trace_mark(trace_phase_t phase, const char *fmt, ...)
+{
+    va_list va;
+
+    va_start(va, fmt);
+    trace_add(phase, g_get_monotonic_time(), -1, fmt, va);
+    va_end(va);
+}
+
+/** Record a phase that started at given time and ends now
+ *
+ * @param phase phase identification
+ * @param start value from usb_moded_trace_now() taken when phase started
+ * @param fmt   printf style detail string, or NULL
+ */
+void usb_moded_trace_span(trace_phase_t phase, gint64 start,
+                          const char *fmt, ...)
+{
+    va_list va;
+
+    va_start(va, fmt);
+    trace_add(phase, start, g_get_monotonic_time(), fmt, va);
+    va_end(va);
+}
+
+/** Format breakdown of the latest transition
+ *
+ * One line per phase: offset from start of transition, phase name,
+ * duration for spans and detail string. Times are in milliseconds,
+ * the total is the time until the last phase ended.
+ *
+ * @return human readable report, to be released with g_free()
+ */
+gchar *usb_moded_trace_report(void)
+{
+    GString *str = g_string_new(0);
+    gint64   total = 0;
+
+    /* spans are recorded when they end, so the last entry is not
+     * necessarily the one ending last */
+    for( int i = 0; i < trace_count; ++i ) {
+        const trace_entry_t *entry = &trace_entries[i];
+        gint64 end = entry->begin + (entry->duration > 0 ? entry->duration : 0);
+        if( total < end )
+            total = end;
+    }
+
+    g_string_append_printf(str, "transition: %s, %d phases, %" G_GINT64_FORMAT
+                           ".%03d ms\n", trace_reason ?: "none", trace_count,
+                           total / 1000, (int)(total % 1000));
+
+    for( int i = 0; i < trace_count; ++i ) {
+        const trace_entry_t *entry = &trace_entries[i];
+
+        g_string_append_printf(str, "%+8" G_GINT64_FORMAT ".%03d %-13s",
+                               entry->begin / 1000, (int)(entry->begin % 1000),
+                               trace_phase_names[entry->phase]);
+        if( entry->duration >= 0 )
+            g_string_append_printf(str, " %6" G_GINT64_FORMAT ".%03d ms",
+                                   entry->duration / 1000,
+                                   (int)(entry->duration % 1000));
+        if( entry->detail )
+            g_string_append_printf(str, " %s", entry->detail);
+        g_string_append_c(str, '\n');
+    }
+
+    if( trace_dropped )
+        g_string_append_printf(str, "%u phases dropped\n", trace_dropped);
+
+    return g_string_free(str, FALSE);
+}
+
+/** Release trace data on exit
+ */
+void usb_moded_trace_quit(void)
+{
+    trace_clear();
+}
@@ -0,0 +1,61 @@
+/**
+  @file usb_moded-trace.h
+
+  Copyright (C) 2016 Jolla. All rights reserved.
+
+  @author: Philippe De Swert <philippe.deswert@jollamobile.com>
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the Lesser GNU General Public License 
+  version 2 as published by the Free Software Foundation. 
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  General Public License for more details.
+ 
+  You should have received a copy of the Lesser GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+  02110-1301 USA
+*/
+
+#ifndef USB_MODED_TRACE_H_
+#define USB_MODED_TRACE_H_
+
+#include <glib.h>
+
+/** Phases of a mode transition that get timestamped */
+typedef enum trace_phase_t
+{
+    TRACE_UDEV_EVENT,     /* udev event changing cable state received */
+    TRACE_CABLE_DELAY,    /* cable connection delay expired */
+    TRACE_MODE_DECIDED,   /* mode to activate has been decided */
+    TRACE_MODULE_LOADED,  /* gadget module loaded */
+    TRACE_MODULE_UNLOAD,  /* wait for a busy gadget module to unload */
+    TRACE_SYSFS_WRITE,    /* single sysfs / procfs write */
+    TRACE_SYSFS_STATS,    /* sysfs handle cache statistics */
+    TRACE_APPSYNC_PRE,    /* pre-enumeration applications started */
+    TRACE_ENUMERATION,    /* gadget enabled for enumeration */
+    TRACE_NETWORK_UP,     /* usb network interface configured */
+    TRACE_DHCPD,          /* dhcp server configured */
+    TRACE_NAT,            /* nat rules installed */
+    TRACE_POSTSYNC,       /* post-enumeration applications started */
+    TRACE_EXEC,           /* external command executed */
+    TRACE_SLEEP,          /* blocking sleep */
+    TRACE_STEP,           /* timer driven transition step executed */
+    TRACE_MODE_SET,       /* mode activation finished */
+    TRACE_PHASE_COUNT
+} trace_phase_t;
+
+void   usb_moded_trace_begin(const char *reason);
+gint64 usb_moded_trace_now(void);
+void   usb_moded_trace_mark(trace_phase_t phase, const char *fmt, ...)
+       __attribute__((format(printf, 2, 3)));
+void   usb_moded_trace_span(trace_phase_t phase, gint64 start,
+                            const char *fmt, ...)
+       __attribute__((format(printf, 3, 4)));
+gchar *usb_moded_trace_report(void);
+void   usb_moded_trace_quit(void);
+
+#endif /* USB_MODED_TRACE_H_ */
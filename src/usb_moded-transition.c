@@ -0,0 +1,253 @@
+/**
+  @file usb_moded-transition.c
+
+  Copyright (C) 2016 Jolla. All rights reserved.
+
+  @author: Philippe De Swert <philippe.deswert@jollamobile.com>
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the Lesser GNU General Public License
+  version 2 as published by the Free Software Foundation.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  General Public License for more details.
+
+  You should have received a copy of the Lesser GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+  02110-1301 USA
+*/
+
+/*
+ * Mode transitions as timer driven steps
+ *
+ * Mode transitions used to sleep in the mainloop while waiting for usb
+ * enumeration, umount and module unload retries and so on. Instead the
+ * waiting parts are now steps: the transition schedules the step and
+ * returns, and the step function continues from a timer callback.
+ *
+ * Each kind of step has a slot of its own, so that for example a cable
+ * disconnect does not abandon a module unload that is being waited for.
+ * Scheduling a step replaces only a pending step of the same kind, which
+ * is what a sequence rescheduling itself, or a new transition replacing
+ * a stale one, should do. Steps that are dropped without running release
+ * their context through the destructor given when scheduling them.
+ */
+
+#include <glib.h>
+
+#include "usb_moded-transition.h"
+#include "usb_moded-log.h"
+#include "usb_moded-trace.h"
+
+/* ========================================================================= *
+ * State data
+ * ========================================================================= */
+
+/** Human readable step names, for debugging */
+static const char * const transition_step_names[TRANSITION_STEP_COUNT] =
+{
+    [TRANSITION_IDLE]                = "idle",
+    [TRANSITION_DISCONNECT_SETTLE]   = "disconnect_settle",
+    [TRANSITION_MODULE_UNLOAD_RETRY] = "module_unload_retry",
+    [TRANSITION_UMOUNT_RETRY]        = "umount_retry",
+    [TRANSITION_LUN_SETTLE]          = "lun_settle",
+    [TRANSITION_CELLULAR_WAIT]       = "cellular_wait",
+    [TRANSITION_POSTSYNC_SETTLE]     = "postsync_settle",
+    [TRANSITION_NETWORK_UPDATE_WAIT] = "network_update_wait",
+};
+
+/** Pending step of one kind */
+typedef struct transition_slot_t
+{
+    /** Timer for executing the step, or 0 if nothing is pending */
+    guint          timer_id;
+
+    /** Function, context and context destructor of the step */
+    transition_fn  func;
+    gpointer       ctx;
+    GDestroyNotify ctx_free;
+} transition_slot_t;
+
+/** Slots indexed by transition_step_t; TRANSITION_IDLE is not used */
+static transition_slot_t transition_slots[TRANSITION_STEP_COUNT];
+
+/** Steps belonging to activating a mode */
+static const transition_step_t transition_mode_steps[] =
+{
+    TRANSITION_UMOUNT_RETRY,
+    TRANSITION_LUN_SETTLE,
+    TRANSITION_CELLULAR_WAIT,
+    TRANSITION_POSTSYNC_SETTLE,
+    TRANSITION_NETWORK_UPDATE_WAIT,
+};
+
+/* ========================================================================= *
+ * Internal helpers
+ * ========================================================================= */
+
+static gboolean transition_valid(transition_step_t step)
+{
+    return step > TRANSITION_IDLE && step < TRANSITION_STEP_COUNT;
+}
+
+/** Forget pending step, releasing its context */
+static void transition_clear(transition_step_t step)
+{
+    transition_slot_t *slot = &transition_slots[step];
+
+    if( slot->timer_id )
+        g_source_remove(slot->timer_id), slot->timer_id = 0;
+
+    if( slot->ctx && slot->ctx_free )
+        slot->ctx_free(slot->ctx);
+
+    slot->func = 0;
+    slot->ctx = 0;
+    slot->ctx_free = 0;
+}
+
+/** Execute pending step */
+static void transition_run(transition_step_t step)
+{
+    transition_slot_t *slot = &transition_slots[step];
+    transition_fn      func = slot->func;
+    gpointer           ctx  = slot->ctx;
+
+    /* ownership of ctx passes to the step function */
+    slot->ctx = 0;
+    transition_clear(step);
+
+    log_debug("transition: %s", usb_moded_transition_step_name(step));
+    usb_moded_trace_mark(TRACE_STEP, "%s",
+                         usb_moded_transition_step_name(step));
+    func(ctx);
+}
+
+static gboolean transition_timer_cb(gpointer aptr)
+{
+    transition_step_t step = GPOINTER_TO_INT(aptr);
+
+    transition_slots[step].timer_id = 0;
+    transition_run(step);
+
+    return FALSE;
+}
+
+/* ========================================================================= *
+ * External API
+ * ========================================================================= */
+
+/** Schedule a transition step
+ *
+ * A pending step of the same kind is dropped, steps of other kinds
+ * are not affected.
+ *
+ * @param step      step identification
+ * @param delay_ms  how long to wait before executing the step
+ * @param fn        function executing the step
+ * @param ctx       context passed to fn
+ * @param ctx_free  used for releasing ctx if the step is not executed
+ */
+void usb_moded_transition_schedule(transition_step_t step, guint delay_ms,
+                                   transition_fn fn, gpointer ctx,
+                                   GDestroyNotify ctx_free)
+{
+    transition_slot_t *slot;
+
+    if( !transition_valid(step) ) {
+        log_err("transition: invalid step %d", step);
+        if( ctx && ctx_free )
+            ctx_free(ctx);
+        return;
+    }
+
+    slot = &transition_slots[step];
+    if( slot->timer_id ) {
+        log_debug("transition: %s replaced",
+                  usb_moded_transition_step_name(step));
+        transition_clear(step);
+    }
+
+    log_debug("transition: %s in %u ms",
+              usb_moded_transition_step_name(step), delay_ms);
+
+    slot->func     = fn;
+    slot->ctx      = ctx;
+    slot->ctx_free = ctx_free;
+    slot->timer_id = g_timeout_add(delay_ms, transition_timer_cb,
+                                   GINT_TO_POINTER(step));
+}
+
+/** Drop a pending transition step without executing it
+ *
+ * @param step step identification
+ */
+void usb_moded_transition_cancel(transition_step_t step)
+{
+    if( !usb_moded_transition_pending(step) )
+        return;
+
+    log_debug("transition: %s cancelled",
+              usb_moded_transition_step_name(step));
+    transition_clear(step);
+}
+
+/** Drop pending steps of a mode activation
+ *
+ * Disconnect and module unload steps are left alone, they outlive
+ * the mode that is being cleaned up.
+ */
+void usb_moded_transition_cancel_mode(void)
+{
+    for( size_t i = 0; i < G_N_ELEMENTS(transition_mode_steps); ++i )
+        usb_moded_transition_cancel(transition_mode_steps[i]);
+}
+
+/** Execute a pending transition step immediately
+ *
+ * @param step step identification
+ */
+void usb_moded_transition_flush(transition_step_t step)
+{
+    if( !usb_moded_transition_pending(step) )
+        return;
+
+    log_debug("transition: %s flushed", usb_moded_transition_step_name(step));
+    transition_run(step);
+}
+
+/** Release pending transition steps on exit
+ */
+void usb_moded_transition_quit(void)
+{
+    for( int step = TRANSITION_IDLE + 1; step < TRANSITION_STEP_COUNT; ++step )
+        transition_clear(step);
+}
+
+/** Check whether a transition step is pending
+ *
+ * @param step step identification
+ *
+ * @return TRUE if the step is waiting to be executed
+ */
+gboolean usb_moded_transition_pending(transition_step_t step)
+{
+    return transition_valid(step) && transition_slots[step].timer_id != 0;
+}
+
+/** Get name of a transition step
+ *
+ * @param step step identification
+ *
+ * @return human readable name
+ */
+const char *usb_moded_transition_step_name(transition_step_t step)
+{
+    if( (unsigned)step >= TRANSITION_STEP_COUNT )
+        return "unknown";
+
+    return transition_step_names[step];
+}
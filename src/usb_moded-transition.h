@@ -0,0 +1,65 @@
+/**
+  @file usb_moded-transition.h
+
+  Copyright (C) 2016 Jolla. All rights reserved.
+
+  @author: Philippe De Swert <philippe.deswert@jollamobile.com>
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the Lesser GNU General Public License 
+  version 2 as published by the Free Software Foundation. 
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  General Public License for more details.
+ 
+  You should have received a copy of the Lesser GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+  02110-1301 USA
+*/
+
+#ifndef USB_MODED_TRANSITION_H_
+#define USB_MODED_TRANSITION_H_
+
+#include <glib.h>
+
+/** Steps of a mode transition that wait for time to pass
+ *
+ * Everything else in a transition is done synchronously, these are
+ * the points where the transition yields back to the mainloop. Steps
+ * of different kinds can be pending at the same time.
+ */
+typedef enum transition_step_t
+{
+    TRANSITION_IDLE,
+    TRANSITION_DISCONNECT_SETTLE,   /* let usb settle before disconnect cleanup */
+    TRANSITION_MODULE_UNLOAD_RETRY, /* wait before retrying module unload */
+    TRANSITION_UMOUNT_RETRY,        /* wait before retrying mass storage umount */
+    TRANSITION_LUN_SETTLE,          /* wait for enumeration before exporting luns */
+    TRANSITION_CELLULAR_WAIT,       /* wait for cellular data before nat setup */
+    TRANSITION_POSTSYNC_SETTLE,     /* let interfaces settle before post sync */
+    TRANSITION_NETWORK_UPDATE_WAIT, /* wait for cellular data before nat update */
+    TRANSITION_STEP_COUNT
+} transition_step_t;
+
+/** Function executing a transition step
+ *
+ * The function takes over ownership of ctx. It can schedule the next
+ * step, or the same step again, before returning.
+ */
+typedef void (*transition_fn)(gpointer ctx);
+
+void usb_moded_transition_schedule(transition_step_t step, guint delay_ms,
+                                   transition_fn fn, gpointer ctx,
+                                   GDestroyNotify ctx_free);
+void usb_moded_transition_cancel(transition_step_t step);
+void usb_moded_transition_cancel_mode(void);
+void usb_moded_transition_flush(transition_step_t step);
+void usb_moded_transition_quit(void);
+
+gboolean usb_moded_transition_pending(transition_step_t step);
+const char *usb_moded_transition_step_name(transition_step_t step);
+
+#endif /* USB_MODED_TRANSITION_H_ */
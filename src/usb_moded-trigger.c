@@ -38,6 +38,7 @@
 #include "usb_moded-hw-ab.h"
 #include "usb_moded-modesetting.h"
 #include "usb_moded-trigger.h"
+#include "usb_moded-trace.h"
 #if defined MEEGOLOCK
 #include "usb_moded-lock.h"
 #endif /* MEEGOLOCK */
@@ -53,6 +54,7 @@ static const char *dev_name;
 static gboolean monitor_udev(GIOChannel *iochannel G_GNUC_UNUSED, GIOCondition cond,
                              gpointer data G_GNUC_UNUSED);
 static void udev_parse(struct udev_device *dev);
+static mode_id_t trigger_mode_id(void);
 
 static void notify_issue (gpointer data)
 {
@@ -189,6 +191,16 @@ void trigger_stop(void)
   dev_name = 0;
 }
 
+/* map the configured trigger mode to a mode id */
+static mode_id_t trigger_mode_id(void)
+{
+  char *mode = get_trigger_mode();
+  mode_id_t id = mode_registry_lookup(mode);
+
+  free(mode);
+  return id;
+}
+
 static void udev_parse(struct udev_device *dev)
 {
   const char *tmp = 0;
@@ -213,10 +225,10 @@ static void udev_parse(struct udev_device *dev)
 #if defined MEEGOLOCK
 	 if(usb_moded_get_export_permission())
 #endif /* MEEGOLOCK */
-	   if(strcmp(get_trigger_mode(), get_usb_mode()) != 0)
+	   if(trigger_mode_id() != get_usb_mode_id())
 	   {
-		usb_moded_mode_cleanup(get_usb_module());
-      	   	set_usb_mode(get_trigger_mode());
+		usb_moded_trace_begin("trigger");
+		switch_usb_mode_id(trigger_mode_id());
 	   }
 	   free(trigger);
 	}
@@ -232,10 +244,10 @@ static void udev_parse(struct udev_device *dev)
 #if defined MEEGOLOCK
      if(usb_moded_get_export_permission())
 #endif /* MEEGOLOCK */
-       if(strcmp(get_trigger_mode(), get_usb_mode()) != 0)
+       if(trigger_mode_id() != get_usb_mode_id())
 	{
-	    usb_moded_mode_cleanup(get_usb_module());
-       	    set_usb_mode(get_trigger_mode());
+	    usb_moded_trace_begin("trigger");
+	    switch_usb_mode_id(trigger_mode_id());
 	}
     }
     return;
@@ -28,6 +28,7 @@
 #include <unistd.h>
 
 #include <poll.h>
+#include <sys/inotify.h>
 
 #include <libudev.h>
 
@@ -38,6 +39,8 @@
 #include "usb_moded-hw-ab.h"
 #include "usb_moded.h"
 #include "usb_moded-modes.h"
+#include "usb_moded-trace.h"
+#include "usb_moded-root.h"
 
 /* global variables */
 static struct udev *udev;
@@ -50,6 +53,11 @@ static int cleanup = 0;
 static int cable = 0, charger = 0;
 static guint cable_connection_timeout_id = 0;
 
+/* fixture power supply, used instead of udev under an alternate root */
+#define FIXTURE_POWER_SUPPLY "/sys/class/power_supply/usb"
+static int fixture_fd = -1;
+static guint fixture_id = 0;
+
 /** Bookkeeping data for power supply locating heuristics */
 typedef struct power_device {
         /** Device path used by udev */
@@ -62,6 +70,10 @@ typedef struct power_device {
 static gboolean monitor_udev(GIOChannel *iochannel G_GNUC_UNUSED, GIOCondition cond,
                              gpointer data G_GNUC_UNUSED);
 static void udev_parse(struct udev_device *dev, bool initial);
+static void power_supply_parse(const char *present, const char *online,
+			       const char *type, bool initial);
+static gboolean fixture_init(void);
+static void fixture_cleanup(void);
 static void setup_cable_connection(void);
 static void setup_charger_connection(void);
 static void cancel_cable_connection_timeout(void);
@@ -131,6 +143,10 @@ gboolean hwal_init(void)
   int ret = 0;
 
   cleanup = 0;
+
+  /* udev can not be redirected, follow the fixture tree instead */
+  if(usb_moded_root_stubbed())
+	return fixture_init();
 	
   /* Create the udev object */
   udev = udev_new();
@@ -282,6 +298,12 @@ void hwal_cleanup(void)
 
   log_debug("HWhal cleanup\n");
 
+  if(usb_moded_root_stubbed())
+  {
+    fixture_cleanup();
+    return;
+  }
+
   if(watch_id != 0)
   {
     g_source_remove(watch_id);
@@ -337,6 +359,7 @@ static gboolean cable_connection_timeout_cb(gpointer data)
 {
 	log_debug("connect delay: timeout");
 	cable_connection_timeout_id = 0;
+	usb_moded_trace_mark(TRACE_CABLE_DELAY, "%d ms", cable_connection_delay);
 
 	setup_cable_connection();
 
@@ -379,7 +402,17 @@ static void schedule_cable_connection_timeout(void)
 
 static void udev_parse(struct udev_device *dev, bool initial)
 {
-	/* udev properties we are interested in */
+	power_supply_parse(udev_device_get_property_value(dev, "POWER_SUPPLY_PRESENT"),
+			   udev_device_get_property_value(dev, "POWER_SUPPLY_ONLINE"),
+			   udev_device_get_property_value(dev, "POWER_SUPPLY_TYPE"),
+			   initial);
+}
+
+/* act on power supply state, the values are NULL when not available */
+static void power_supply_parse(const char *present, const char *online,
+			       const char *type, bool initial)
+{
+	/* power supply properties we are interested in */
 	const char *power_supply_present = 0;
 	const char *power_supply_online  = 0;
 	const char *power_supply_type    = 0;
@@ -399,10 +432,10 @@ static void udev_parse(struct udev_device *dev, bool initial)
 	 * Check for present first as some drivers use online for when charging
 	 * is enabled
 	 */
-	power_supply_present = udev_device_get_property_value(dev, "POWER_SUPPLY_PRESENT");
+	power_supply_present = present;
 	if (!power_supply_present) {
 		power_supply_present =
-		power_supply_online = udev_device_get_property_value(dev, "POWER_SUPPLY_ONLINE");
+		power_supply_online = online;
 	}
 
 	if (power_supply_present && !strcmp(power_supply_present, "1"))
@@ -415,6 +448,12 @@ static void udev_parse(struct udev_device *dev, bool initial)
 		warnings = true;
 		/* Block suspend briefly */
 		delay_suspend();
+		/* Start timing the transition, unless the event just
+		 * repeats the one we are already delaying */
+		if (!cable_connection_timeout_id)
+			usb_moded_trace_begin(connected ? "cable connected" : "cable disconnected");
+		usb_moded_trace_mark(TRACE_UDEV_EVENT, "present=%s",
+				     power_supply_present ?: "?");
 	}
 
 	/* disconnect */
@@ -443,7 +482,7 @@ static void udev_parse(struct udev_device *dev, bool initial)
 		if (warnings && power_supply_online)
 			log_warning("Using online property\n");
 
-		power_supply_type = udev_device_get_property_value(dev, "POWER_SUPPLY_TYPE");
+		power_supply_type = type;
 		/*
 		 * Power supply type might not exist also :(
 		 * Send connected event but this will not be able
@@ -483,3 +522,105 @@ static void udev_parse(struct udev_device *dev, bool initial)
 cleanup:
 	return;
 }
+
+/* read a power supply attribute from the fixture tree */
+static gchar *fixture_read(const char *dir, const char *name)
+{
+	gchar *path = g_strconcat(dir, "/", name, NULL);
+	gchar *text = 0;
+
+	if (g_file_get_contents(path, &text, 0, 0))
+		g_strstrip(text);
+
+	g_free(path);
+	return text;
+}
+
+static void fixture_parse(bool initial)
+{
+	gchar *dir     = usb_moded_root_path(FIXTURE_POWER_SUPPLY);
+	gchar *present = fixture_read(dir, "present");
+	gchar *online  = fixture_read(dir, "online");
+	gchar *type    = fixture_read(dir, "type");
+
+	power_supply_parse(present, online, type, initial);
+
+	g_free(type);
+	g_free(online);
+	g_free(present);
+	g_free(dir);
+}
+
+static gboolean fixture_watch_cb(GIOChannel *chn G_GNUC_UNUSED, GIOCondition cond,
+				 gpointer data G_GNUC_UNUSED)
+{
+	char buf[1024];
+
+	if (cond & (G_IO_ERR | G_IO_HUP | G_IO_NVAL)) {
+		log_crit("fixture power supply watch disabled");
+		fixture_id = 0;
+		return FALSE;
+	}
+
+	/* the events themselves do not matter, just re-read the state */
+	while (read(fixture_fd, buf, sizeof buf) > 0)
+		;
+
+	acquire_wakelock(USB_MODED_WAKELOCK_PROCESS_INPUT);
+	fixture_parse(false);
+	release_wakelock(USB_MODED_WAKELOCK_PROCESS_INPUT);
+
+	return TRUE;
+}
+
+/* follow power supply attribute files written by a test harness
+ *
+ * The fixture directory holds present, online and type files with the
+ * values udev would report as POWER_SUPPLY_* properties. Writing them
+ * stands in for a power_supply change event.
+ */
+static gboolean fixture_init(void)
+{
+	gchar *dir = usb_moded_root_path(FIXTURE_POWER_SUPPLY);
+	GIOChannel *chn = 0;
+
+	if ((fixture_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) == -1) {
+		log_err("fixture: inotify_init: %m");
+		goto EXIT;
+	}
+
+	if (inotify_add_watch(fixture_fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO) == -1) {
+		log_err("%s: inotify_add_watch: %m", dir);
+		goto EXIT;
+	}
+
+	if ((chn = g_io_channel_unix_new(fixture_fd)) == 0)
+		goto EXIT;
+
+	fixture_id = g_io_add_watch(chn, G_IO_IN | G_IO_ERR | G_IO_HUP | G_IO_NVAL,
+				    fixture_watch_cb, 0);
+	log_debug("fixture power supply: %s", dir);
+
+	/* check if we are already connected */
+	fixture_parse(true);
+
+EXIT:
+	if (chn)
+		g_io_channel_unref(chn);
+	if (!fixture_id)
+		fixture_cleanup();
+	g_free(dir);
+
+	return fixture_id != 0;
+}
+
+static void fixture_cleanup(void)
+{
+	if (fixture_id)
+		g_source_remove(fixture_id), fixture_id = 0;
+
+	if (fixture_fd != -1)
+		close(fixture_fd), fixture_fd = -1;
+
+	cancel_cable_connection_timeout();
+}
@@ -132,6 +132,54 @@ static int unset_rescue (void)
 	return 1;
 }
 
+static int sync_config (void)
+{
+  DBusMessage *req = NULL, *reply = NULL;
+  int ret = 0;
+
+  if ((req = dbus_message_new_method_call(USB_MODE_SERVICE, USB_MODE_OBJECT, USB_MODE_INTERFACE, USB_MODE_CONFIG_SYNC)) != NULL)
+  {
+        if ((reply = dbus_connection_send_with_reply_and_block(conn, req, -1, NULL)) != NULL)
+        {
+		ret = 1;
+		dbus_message_unref(reply);
+        }
+        dbus_message_unref(req);
+  }
+
+  if(ret)
+  {
+	printf("Configuration written to disk\n");
+	return 0;
+  }
+  else
+	return 1;
+}
+
+static int get_transition_trace (void)
+{
+  DBusMessage *req = NULL, *reply = NULL;
+  char *ret = 0;
+
+  if ((req = dbus_message_new_method_call(USB_MODE_SERVICE, USB_MODE_OBJECT, USB_MODE_INTERFACE, USB_MODE_TRANSITION_TRACE)) != NULL)
+  {
+        if ((reply = dbus_connection_send_with_reply_and_block(conn, req, -1, NULL)) != NULL)
+        {
+            dbus_message_get_args(reply, NULL, DBUS_TYPE_STRING, &ret, DBUS_TYPE_INVALID);
+            if(ret)
+              printf("%s", ret);
+            dbus_message_unref(reply);
+        }
+        dbus_message_unref(req);
+  }
+
+  if(ret)
+    return 0;
+
+  /* not everything went as planned, return error */
+  return 1;
+}
+
 static int set_mode (char *mode)
 {
   DBusMessage *req = NULL, *reply = NULL;
@@ -340,7 +388,7 @@ int main (int argc, char *argv[])
 {
   int query = 0, network = 0, setmode = 0, config = 0;
   int modelist = 0, mode_configured = 0, hide = 0, unhide = 0, hiddenlist = 0;
-  int res = 1, opt, rescue = 0;
+  int res = 1, opt, rescue = 0, sync = 0, trace = 0;
   char *option = 0;
 
   if(argc == 1)
@@ -349,7 +397,7 @@ int main (int argc, char *argv[])
     exit(1);
   }
 
-  while ((opt = getopt(argc, argv, "c:dhi:mn:qrs:u:v")) != -1)
+  while ((opt = getopt(argc, argv, "c:dhi:mn:qrs:tu:vy")) != -1)
   {
 	switch (opt) {
 		case 'c':
@@ -380,6 +428,9 @@ int main (int argc, char *argv[])
 			setmode = 1;
 			option = optarg;
 			break;
+		case 't':
+			trace = 1;
+			break;
 		case 'u':
 			unhide = 1;
 			option = optarg;
@@ -387,6 +438,9 @@ int main (int argc, char *argv[])
                 case 'v':
                         hiddenlist = 1;
                         break;
+		case 'y':
+			sync = 1;
+			break;
 		case 'h':
                 default:
                    fprintf(stderr, "\nUsage: %s -<option> <args>\n\n \
@@ -400,8 +454,10 @@ int main (int argc, char *argv[])
                    \t-q to query the current mode,\n \
 		   \t-r turn rescue mode off,\n \
                    \t-s to set/activate a mode,\n \
+                   \t-t to get the timing breakdown of the last mode transition,\n \
                    \t-u unhide a mode,\n \
-                   \t-v to get the list of hidden modes\n",
+                   \t-v to get the list of hidden modes,\n \
+                   \t-y to write pending configuration changes to disk\n",
                    argv[0]); 
                    exit(1);
                }
@@ -438,6 +494,10 @@ int main (int argc, char *argv[])
 	res = set_unhide_mode_config(option);
   else if (hiddenlist)
         res = get_hiddenlist();
+  else if (sync)
+	res = sync_config();
+  else if (trace)
+	res = get_transition_trace();
 
   /* subfunctions will return 1 if an error occured, print message */
   if(res)
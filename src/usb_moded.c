@@ -39,6 +39,12 @@
 
 #include "usb_moded.h"
 #include "usb_moded-modes.h"
+#include "usb_moded-modeid.h"
+#include "usb_moded-transition.h"
+#include "usb_moded-trace.h"
+#include "usb_moded-root.h"
+#include "usb_moded-mount.h"
+#include "usb_moded-configfs.h"
 #include "usb_moded-dbus.h"
 #include "usb_moded-dbus-private.h"
 #include "usb_moded-hw-ab.h"
@@ -51,7 +57,10 @@
 #include "usb_moded-trigger.h"
 #include "usb_moded-config.h"
 #include "usb_moded-config-private.h"
+#include "usb_moded-bootparam.h"
+#include "usb_moded-snapshot.h"
 #include "usb_moded-network.h"
+#include "usb_moded-dhcpd.h"
 #include "usb_moded-mac.h"
 #include "usb_moded-android.h"
 #include "usb_moded-systemd.h"
@@ -60,6 +69,14 @@
 #include "usb_moded-dsme.h"
 #endif
 
+#ifdef CONNMAN
+#include "usb_moded-connman.h"
+#endif
+
+#ifdef OFONO
+#include "usb_moded-ofono.h"
+#endif
+
 /* Wakelogging is noisy, do not log it by default */
 #ifndef  VERBOSE_WAKELOCKING
 # define VERBOSE_WAKELOCKING 0
@@ -125,7 +142,9 @@ guint charging_timeout = 0;
 static GList *modelist;
 
 /* static helper functions */
-static gboolean set_disconnected(gpointer data);
+static void set_disconnected(gpointer data);
+static void finish_disconnect(void);
+static void set_usb_mode_planned(mode_id_t id, const mode_plan_t *plan);
 static gboolean set_disconnected_silent(gpointer data);
 static void usb_moded_init(void);
 static gboolean charging_fallback(gpointer data);
@@ -150,6 +169,8 @@ void set_usb_connected(gboolean connected)
 	if(current_mode.connected == connected)
 		return;
 
+	finish_disconnect();
+
 	if(charging_timeout)
 	{
 		g_source_remove(charging_timeout);
@@ -170,13 +191,9 @@ void set_usb_connected(gboolean connected)
 		return;
 	}
 	current_mode.connected = FALSE;
-	set_disconnected(NULL);
-	/* Some android kernels check for an active gadget to enable charging and
-	 * cable detection, meaning USB is completely dead unless we keep the gadget
-	 * active
-	 */
-	if(current_mode.android_usb_broken)
-		set_android_charging_mode();
+	/* let usb settle */
+	usb_moded_transition_schedule(TRANSITION_DISCONNECT_SETTLE, 1000,
+				      set_disconnected, NULL, NULL);
 	if (android_ignore_udev_events) {
 		android_ignore_next_udev_disconnect_event = TRUE;
 	}
@@ -184,10 +201,8 @@ void set_usb_connected(gboolean connected)
 
 }
 
-static gboolean set_disconnected(gpointer data)
+static void set_disconnected(gpointer data)
 {
-  /* let usb settle */
-  usb_moded_sleep(1);
   /* only disconnect for real if we are actually still disconnected */
   if(!get_usb_connection_state())
 	{
@@ -195,15 +210,30 @@ static gboolean set_disconnected(gpointer data)
   		/* signal usb disconnected */
 		usb_moded_send_signal(USB_DISCONNECTED);
 		/* unload modules and general cleanup if not charging */
-		if(strcmp(get_usb_mode(), MODE_CHARGING) ||
-		   strcmp(get_usb_mode(), MODE_CHARGING_FALLBACK))
+		if(get_usb_mode_id() != MODE_ID_CHARGING ||
+		   get_usb_mode_id() != MODE_ID_CHARGING_FALLBACK)
 			usb_moded_mode_cleanup(get_usb_module());
 		/* Nothing else as we do not need to do anything for cleaning up charging mode */
 		usb_moded_module_cleanup(get_usb_module());
-		set_usb_mode(MODE_UNDEFINED);
+		set_usb_mode_id(MODE_ID_UNDEFINED);
 	
 	}
-  return FALSE;
+  /* Some android kernels check for an active gadget to enable charging and
+   * cable detection, meaning USB is completely dead unless we keep the gadget
+   * active
+   */
+  if(current_mode.android_usb_broken)
+	set_android_charging_mode();
+}
+
+/* complete disconnect related transition steps without waiting */
+static void finish_disconnect(void)
+{
+  usb_moded_transition_flush(TRANSITION_DISCONNECT_SETTLE);
+
+  /* a busy module gets one more unload attempt, no more waiting */
+  usb_moded_module_unload_expire();
+  usb_moded_transition_flush(TRANSITION_MODULE_UNLOAD_RETRY);
 }
 
 /* set disconnected without sending signals. */
@@ -213,12 +243,12 @@ if(!get_usb_connection_state())
         {
                 log_debug("Resetting connection data after HUP\n");
                 /* unload modules and general cleanup if not charging */
-                if(strcmp(get_usb_mode(), MODE_CHARGING) ||
-		   strcmp(get_usb_mode(), MODE_CHARGING_FALLBACK))
+                if(get_usb_mode_id() != MODE_ID_CHARGING ||
+		   get_usb_mode_id() != MODE_ID_CHARGING_FALLBACK)
                         usb_moded_mode_cleanup(get_usb_module());
                 /* Nothing else as we do not need to do anything for cleaning up charging mode */
                 usb_moded_module_cleanup(get_usb_module());
-                set_usb_mode(MODE_UNDEFINED);
+                set_usb_mode_id(MODE_ID_UNDEFINED);
         }
   return FALSE;
 
@@ -237,14 +267,14 @@ void set_charger_connected(gboolean state)
   if(state)
   {
     usb_moded_send_signal(CHARGER_CONNECTED);
-    set_usb_mode(MODE_CHARGER);
+    set_usb_mode_id(MODE_ID_CHARGER);
     current_mode.connected = TRUE;
   }
   else
   {
     current_mode.connected = FALSE;
     usb_moded_send_signal(CHARGER_DISCONNECTED);
-    set_usb_mode(MODE_UNDEFINED);
+    set_usb_mode_id(MODE_ID_UNDEFINED);
     current_mode.connected = FALSE;
   }
 }
@@ -253,6 +283,7 @@ void set_charger_connected(gboolean state)
 void
 rethink_usb_charging_fallback(void)
 {
+    mode_id_t usb_mode_id = MODE_ID_INVALID;
     const char *usb_mode = NULL;
 
 
@@ -262,10 +293,11 @@ rethink_usb_charging_fallback(void)
     if( !get_usb_connection_state() )
         goto EXIT;
 
-    usb_mode = get_usb_mode();
+    usb_mode_id = get_usb_mode_id();
+    usb_mode = mode_registry_name(usb_mode_id);
 
-    if( strcmp(usb_mode, MODE_UNDEFINED) &&
-        strcmp(usb_mode, MODE_CHARGING_FALLBACK) )
+    if( usb_mode_id != MODE_ID_UNDEFINED &&
+        usb_mode_id != MODE_ID_CHARGING_FALLBACK )
         goto EXIT;
 
     /* If device locking is supported, the device must be in
@@ -300,11 +332,12 @@ EXIT:
 void set_usb_connected_state(void)
 {	
   char *mode_to_set;
+  mode_id_t mode_id_to_set;
 
   if(rescue_mode)
   {
 	log_debug("Entering rescue mode!\n");
-	set_usb_mode(MODE_DEVELOPER);
+	set_usb_mode_id(MODE_ID_DEVELOPER);
 	return;
   }
   else if(diag_mode)
@@ -314,7 +347,7 @@ void set_usb_connected_state(void)
 	{
 		GList *iter = modelist;
 		struct mode_list_elem *data = iter->data;
-		set_usb_mode(data->mode_name);
+		set_usb_mode_id(data->mode_id);
 	}
 	return;
   }
@@ -334,23 +367,22 @@ void set_usb_connected_state(void)
 	/* This is safe to do here as the starting condition is
 	MODE_UNDEFINED, and having a devicelock being activated when
 	a mode is set will not interrupt it */
-	if(!strcmp(mode_to_set, current_mode.mode))
+	mode_id_to_set = mode_registry_lookup(mode_to_set);
+
+	if(mode_id_to_set == current_mode.mode_id)
 		goto end;
 
-	if (!strcmp(MODE_ASK, mode_to_set))
+	if (mode_id_to_set == MODE_ID_ASK)
 	{
 		/*! If charging mode is the only available selection, don't ask
  		 just select it */
 		gchar *available_modes = get_mode_list(AVAILABLE_MODES_LIST);
-		if (!strcmp(MODE_CHARGING, available_modes)) {
-			gchar *temp = mode_to_set;
-			mode_to_set = available_modes;
-			available_modes = temp;
-		}
+		if (!strcmp(MODE_CHARGING, available_modes))
+			mode_id_to_set = MODE_ID_CHARGING;
 		g_free(available_modes);
 	}
 
-	if(!strcmp(MODE_ASK, mode_to_set))
+	if(mode_id_to_set == MODE_ID_ASK)
 	{
 		/* send signal, mode will be set when the dialog service calls
 	  	 the set_mode method call.
@@ -362,10 +394,10 @@ void set_usb_connected_state(void)
 		charging_timeout = g_timeout_add_seconds(3, charging_fallback, NULL);
 		/* in case there was nobody listening for the UI, they will know 
 		   that the UI is needed by requesting the current mode */
-		set_usb_mode(MODE_ASK);
+		set_usb_mode_id(MODE_ID_ASK);
 	}
 	else
-		set_usb_mode(mode_to_set);
+		set_usb_mode_id(mode_id_to_set);
   }
   else
   {
@@ -373,33 +405,83 @@ void set_usb_connected_state(void)
 	   We also fall back here in case the device is locked and we do not 
 	   export the system contents. Or if we are in acting dead mode.
 	*/
-	set_usb_mode(MODE_CHARGING_FALLBACK);
+	set_usb_mode_id(MODE_ID_CHARGING_FALLBACK);
   }
 end:
   free(mode_to_set);
 }
 
-/** set the usb mode 
+/** set the usb mode by name
+ *
+ * Unknown mode names end up in MODE_UNDEFINED.
  *
  * @param mode The requested USB mode
  * 
  */
 void set_usb_mode(const char *mode)
+{
+  mode_id_t id = mode_registry_lookup(mode);
+
+  if(id == MODE_ID_INVALID)
+	log_debug("Unknown mode %s requested\n", mode);
+  set_usb_mode_id(id);
+}
+
+/** set the usb mode 
+ *
+ * @param id The requested USB mode id
+ * 
+ */
+void set_usb_mode_id(mode_id_t id)
+{
+  set_usb_mode_planned(id, NULL);
+}
+
+/** switch directly from the current mode to another one
+ *
+ * Between dynamic modes that use the same module only the parts that
+ * differ are torn down and set up again, otherwise the current mode
+ * is cleaned up completely before setting the new one.
+ *
+ * @param id The requested USB mode id
+ *
+ */
+void switch_usb_mode_id(mode_id_t id)
+{
+  mode_plan_t plan;
+
+  if(!usb_moded_mode_plan(get_usb_mode_data(), mode_registry_data(id), &plan))
+  {
+	usb_moded_mode_cleanup(get_usb_module());
+	set_usb_mode_id(id);
+	return;
+  }
+
+  usb_moded_mode_cleanup_plan(&plan);
+  set_usb_mode_planned(id, &plan);
+}
+
+/* set the usb mode, skipping the parts kept by the plan, if any */
+static void set_usb_mode_planned(mode_id_t id, const mode_plan_t *plan)
 {
   /* set return to 1 to be sure to error out if no matching mode is found either */
   int ret=1, net=0;
+  struct mode_list_elem *data;
 
-  log_debug("Setting %s\n", mode);
+  log_debug("Setting %s\n", mode_registry_name(id));
+  usb_moded_trace_mark(TRACE_MODE_DECIDED, "%s%s", mode_registry_name(id),
+		       plan ? " (planned)" : "");
 
   /* CHARGING AND FALLBACK CHARGING are always ok to set, so this can be done
      before the optional second device lock check */
-  if(!strcmp(mode, MODE_CHARGING) || !strcmp(mode, MODE_CHARGING_FALLBACK))
+  if(id == MODE_ID_CHARGING || id == MODE_ID_CHARGING_FALLBACK)
   {
 	check_module_state(MODULE_MASS_STORAGE);
 	/* for charging we use a fake file_storage (blame USB certification for this insanity */
 	set_usb_module(MODULE_MASS_STORAGE);
 	/* MODULE_CHARGING has all the parameters defined, so it will not match the g_file_storage rule in usb_moded_load_module */
 	ret = usb_moded_load_module(MODULE_CHARGING);
+	usb_moded_trace_mark(TRACE_MODULE_LOADED, "%s: %d", MODULE_CHARGING, ret);
 	/* if charging mode setting did not succeed we might be dealing with android */
 	if(ret)
 	{
@@ -413,7 +495,7 @@ void set_usb_mode(const char *mode)
   }
 
   /* Dedicated charger mode needs nothing to be done and no user interaction */
-  if(!strcmp(mode, MODE_CHARGER))
+  if(id == MODE_ID_CHARGER)
   {
 	ret = 0;
 	goto end;
@@ -436,26 +518,29 @@ void set_usb_mode(const char *mode)
 
   /* nothing needs to be done for this mode but signalling.
      Handled here to avoid issues with ask menu and devicelock */
-  if(!strcmp(mode, MODE_ASK))
+  if(id == MODE_ID_ASK)
   {
 	ret = 0;
 	goto end;
   }
 
-  /* go through all the dynamic modes if the modelist exists*/
-  if(modelist)
+  /* look up the dynamic mode, if any */
+  data = mode_registry_data(id);
+  if(data)
   {
-    GList *iter;
-
-    for( iter = modelist; iter; iter = g_list_next(iter) )
-    {
-      struct mode_list_elem *data = iter->data;
-      if(!strcmp(mode, data->mode_name))
-      {
-	log_debug("Matching mode %s found.\n", mode);
-  	check_module_state(data->mode_module);
-	set_usb_module(data->mode_module);
-	ret = usb_moded_load_module(data->mode_module);
+	log_debug("Matching mode %s found.\n", data->mode_name);
+	if(plan)
+	{
+		/* the module stays loaded when switching by plan */
+		ret = 0;
+	}
+	else
+	{
+		check_module_state(data->mode_module);
+		set_usb_module(data->mode_module);
+		ret = usb_moded_load_module(data->mode_module);
+		usb_moded_trace_mark(TRACE_MODULE_LOADED, "%s: %d", data->mode_module, ret);
+	}
 	/* set data before calling any of the dynamic mode functions
 	   as they will use the get_usb_mode_data function */
 	set_usb_mode_data(data);
@@ -464,10 +549,8 @@ void set_usb_mode(const char *mode)
 		if (android_ignore_udev_events) {
 		  android_ignore_next_udev_disconnect_event = TRUE;
 		}
-		ret = set_dynamic_mode();
+		ret = set_dynamic_mode(plan);
 	}
-      }
-    }
   }
 
 end:
@@ -476,35 +559,119 @@ end:
   if(ret)
   {
 	  set_usb_module(MODULE_NONE);
-	  mode = MODE_UNDEFINED;
 	  set_usb_mode_data(NULL);
-	  log_debug("mode setting failed or device disconnected, mode to set was = %s\n", mode);
+	  log_debug("mode setting failed or device disconnected, mode to set was = %s\n", mode_registry_name(id));
+	  id = MODE_ID_UNDEFINED;
   }
   if(net)
     log_debug("Network setting failed!\n");
-  free(current_mode.mode);
-  current_mode.mode = strdup(mode);
+  current_mode.mode_id = id;
+  usb_moded_trace_mark(TRACE_MODE_SET, "%s", mode_registry_name(id));
+  usb_moded_mode_sysfs_stats();
   /* CHARGING_FALLBACK is an internal mode not to be broadcasted outside */
-  if(!strcmp(mode, MODE_CHARGING_FALLBACK))
+  if(id == MODE_ID_CHARGING_FALLBACK)
     usb_moded_send_signal(MODE_CHARGING);
   else
     usb_moded_send_signal(get_usb_mode());
 }
 
-/* check if a mode is in a list */
-static bool mode_in_list(const char *mode, char * const *modes)
+/* whether hidden/whitelist flags need to be reloaded from config */
+static gboolean mode_lists_stale = TRUE;
+/* whether a mode whitelist is configured at all */
+static gboolean mode_whitelist_active = FALSE;
+/* mode list strings, indexed by mode_list_type_t */
+static gchar *mode_list_cache[AVAILABLE_MODES_LIST + 1];
+
+/* drop cached mode list strings */
+static void mode_lists_flush(void)
+{
+  size_t i;
+
+  for(i = 0; i < G_N_ELEMENTS(mode_list_cache); i++)
+  {
+    g_free(mode_list_cache[i]);
+    mode_list_cache[i] = 0;
+  }
+}
+
+/* set flag for all modes in a comma separated list, clear it from the rest */
+static void mode_flags_from_list(unsigned flag, const char *list)
 {
+  gchar **split;
   int i;
 
-  if (!modes)
-    return false;
+  mode_registry_clear_flags(flag);
 
-  for(i = 0; modes[i] != NULL; i++)
+  if(!list)
+    return;
+
+  split = g_strsplit(list, ",", 0);
+  for(i = 0; split[i] != NULL; i++)
+    mode_registry_set_flags(mode_registry_lookup(split[i]), flag, TRUE);
+  g_strfreev(split);
+}
+
+/* reload hidden and whitelist flags from config if needed */
+static void mode_lists_refresh(void)
+{
+  char *list;
+
+  if(!mode_lists_stale)
+    return;
+
+  list = get_hidden_modes();
+  mode_flags_from_list(MODE_FLAG_HIDDEN, list);
+  g_free(list);
+
+  list = get_mode_whitelist();
+  mode_whitelist_active = (list != NULL);
+  mode_flags_from_list(MODE_FLAG_WHITELISTED, list);
+  g_free(list);
+
+  mode_lists_stale = FALSE;
+}
+
+/** Forget hidden/whitelist state and cached mode lists
+ *
+ * Used when the configuration or the mode list has been reloaded.
+ */
+void mode_lists_invalidate(void)
+{
+  mode_lists_stale = TRUE;
+  mode_lists_flush();
+}
+
+/** Update hidden state of a mode after the hide setting changed
+ *
+ * @param mode The mode name
+ * @param hidden TRUE if the mode was hidden, FALSE if unhidden
+ */
+void mode_lists_set_hidden(const char *mode, gboolean hidden)
+{
+  if(!mode_lists_stale)
+    mode_registry_set_flags(mode_registry_lookup(mode), MODE_FLAG_HIDDEN, hidden);
+  mode_lists_flush();
+}
+
+/** Update whitelisted state of modes after the whitelist changed
+ *
+ * @param whitelist The new comma separated whitelist, or NULL
+ */
+void mode_lists_set_whitelist(const char *whitelist)
+{
+  if(!mode_lists_stale)
   {
-    if(!strcmp(modes[i], mode))
-      return true;
+    mode_whitelist_active = (whitelist != NULL);
+    mode_flags_from_list(MODE_FLAG_WHITELISTED, whitelist);
   }
-  return false;
+  mode_lists_flush();
+}
+
+/* check if a mode passes the whitelist */
+static bool mode_is_whitelisted(mode_id_t id)
+{
+  return !mode_whitelist_active ||
+    (mode_registry_get_flags(id) & MODE_FLAG_WHITELISTED);
 }
 
 /** check if a given usb_mode exists
@@ -514,54 +681,37 @@ static bool mode_in_list(const char *mode, char * const *modes)
  *
  */
 int valid_mode(const char *mode)
+{
+  return valid_mode_id(mode_registry_lookup(mode));
+}
+
+/** check if a given usb_mode id exists
+ *
+ * @param id The mode id to look for
+ * @return 0 if mode exists, 1 if it does not exist
+ *
+ */
+int valid_mode_id(mode_id_t id)
 {
   int valid = 1;
+
   /* MODE_ASK, MODE_CHARGER and MODE_CHARGING_FALLBACK are not modes that are settable seen their special 'internal' status 
      so we only check the modes that are announed outside. Only exception is the built in MODE_CHARGING */
-  if(!strcmp(MODE_CHARGING, mode))
+  if(id == MODE_ID_CHARGING)
         valid = 0;
-  else
+  /* check dynamic modes */
+  else if(mode_registry_data(id))
   {
-    char *whitelist;
-    gchar **whitelist_split = NULL;
-
-    whitelist = get_mode_whitelist();
-    if (whitelist)
-    {
-      whitelist_split = g_strsplit(whitelist, ",", 0);
-      g_free(whitelist);
-    }
-
-    /* check dynamic modes */
-    if(modelist)
-    {
-      GList *iter;
-
-      for( iter = modelist; iter; iter = g_list_next(iter) )
-      {
-        struct mode_list_elem *data = iter->data;
-        if(!strcmp(mode, data->mode_name))
-        {
-          if (!whitelist_split || mode_in_list(data->mode_name, whitelist_split))
-            valid = 0;
-          break;
-        }
-      }
-
-      g_strfreev(whitelist_split);
-    }
+    mode_lists_refresh();
+    if (mode_is_whitelisted(id))
+      valid = 0;
   }
   return valid;
 
 }
 
-/** make a list of all available usb modes
- *
- * @param type The type of list to return. Supported or available.
- * @return a comma-separated list of modes (MODE_ASK not included as it is not a real mode)
- *
- */
-gchar *get_mode_list(mode_list_type_t type)
+/* build a list of usb modes, see get_mode_list() */
+static gchar *mode_list_build(mode_list_type_t type)
 {
   GString *modelist_str;
 
@@ -573,44 +723,22 @@ gchar *get_mode_list(mode_list_type_t type)
     if(modelist)
     {
       GList *iter;
-      char *hidden_modes_list, *whitelist;
-      gchar **hidden_mode_split = NULL, **whitelist_split = NULL;
-
-      hidden_modes_list = get_hidden_modes();
-      if(hidden_modes_list)
-      {
-        hidden_mode_split = g_strsplit(hidden_modes_list, ",", 0);
-        g_free(hidden_modes_list);
-      }
-
-      if (type == AVAILABLE_MODES_LIST)
-      {
-        whitelist = get_mode_whitelist();
-        if (whitelist)
-        {
-          whitelist_split = g_strsplit(whitelist, ",", 0);
-          g_free(whitelist);
-        }
-      }
 
       for( iter = modelist; iter; iter = g_list_next(iter) )
       {
         struct mode_list_elem *data = iter->data;
 
         /* skip items in the hidden list */
-        if (mode_in_list(data->mode_name, hidden_mode_split))
+        if (mode_registry_get_flags(data->mode_id) & MODE_FLAG_HIDDEN)
           continue;
 
         /* if there is a whitelist skip items not in the list */
-        if (whitelist_split && !mode_in_list(data->mode_name, whitelist_split))
+        if (type == AVAILABLE_MODES_LIST && !mode_is_whitelisted(data->mode_id))
           continue;
 
 	modelist_str = g_string_append(modelist_str, data->mode_name);
 	modelist_str = g_string_append(modelist_str, ", ");
       }
-
-      g_strfreev(hidden_mode_split);
-      g_strfreev(whitelist_split);
     }
 
     /* end with charging mode */
@@ -625,6 +753,25 @@ gchar *get_mode_list(mode_list_type_t type)
   }
 }
 
+/** make a list of all available usb modes
+ *
+ * The list is built once and reused until hidden modes, the whitelist
+ * or the mode list change.
+ *
+ * @param type The type of list to return. Supported or available.
+ * @return a comma-separated list of modes (MODE_ASK not included as it is not a real mode)
+ *
+ */
+gchar *get_mode_list(mode_list_type_t type)
+{
+  mode_lists_refresh();
+
+  if(!mode_list_cache[type])
+    mode_list_cache[type] = mode_list_build(type);
+
+  return(g_strdup(mode_list_cache[type]));
+}
+
 /** get the usb mode 
  *
  * @return the currently set mode
@@ -632,7 +779,17 @@ gchar *get_mode_list(mode_list_type_t type)
  */
 inline const char * get_usb_mode(void)
 {
-  return(current_mode.mode);
+  return(mode_registry_name(current_mode.mode_id));
+}
+
+/** get the usb mode id
+ *
+ * @return the currently set mode id
+ *
+ */
+mode_id_t get_usb_mode_id(void)
+{
+  return(current_mode.mode_id);
 }
 
 /** set the loaded module 
@@ -701,14 +858,19 @@ inline struct mode_list_elem * get_usb_mode_data(void)
 /* set default values for usb_moded */
 static void usb_moded_init(void)
 {
+  gchar *path;
+
   current_mode.connected = FALSE;
   current_mode.mounted = FALSE;
-  current_mode.mode = strdup(MODE_UNDEFINED);
+  current_mode.mode_id = MODE_ID_UNDEFINED;
   current_mode.module = strdup(MODULE_NONE);
 
   if(android_broken_usb)
 	current_mode.android_usb_broken = TRUE;
 
+  /* parse kernel command line once, before anything needs it */
+  usb_moded_bootparam_init();
+
   /* check config, merge or create if outdated */
   if(conf_file_merge() != 0)
   {
@@ -716,21 +878,34 @@ static void usb_moded_init(void)
     exit(1);
   }
 
+  /* use binary snapshot of config, modes and appsync data if valid */
+  usb_moded_snapshot_open(diag_mode);
+
+  /* keep parsed config in memory, reload only on changes */
+  usb_moded_config_init();
+
 #ifdef APP_SYNC
   readlist(diag_mode);
 #endif
 
   /* always read dyn modes even if appsync is not used */
   modelist = read_mode_list(diag_mode);
+  mode_registry_add_modelist(modelist);
 
+  /* make sure settings are loaded before the snapshot is closed */
   if(check_trigger())
 	trigger_init();
 
+  /* save new snapshot if ini-files had to be parsed */
+  usb_moded_snapshot_close();
+
   /* Set-up mac address before kmod */
-  if(access("/etc/modprobe.d/g_ether.conf", F_OK) != 0)
+  path = usb_moded_root_path("/etc/modprobe.d/g_ether.conf");
+  if(access(path, F_OK) != 0)
   {
     generate_random_mac();  	
   }
+  g_free(path);
 
   /* kmod init */
   usb_moded_module_ctx_init();
@@ -738,6 +913,9 @@ static void usb_moded_init(void)
   /* Android specific stuff */
   if(android_settings())
   	android_init_values();
+
+  /* create configfs gadget functions used by dynamic modes */
+  usb_moded_configfs_init(modelist);
   /* TODO: add more start-up clean-up and init here if needed */
 }	
 
@@ -745,15 +923,37 @@ static void usb_moded_init(void)
  */
 static void usb_moded_cleanup(void)
 {
+    /* Drop pending transition step */
+    usb_moded_transition_quit();
+
+    /* Stop mount table watch and holder scan */
+    usb_moded_mount_quit();
+
+    /* Stop built-in dhcp server */
+    usb_moded_dhcpd_stop();
+
+    /* Release latency trace */
+    usb_moded_trace_quit();
+
     /* Undo usb_moded_module_ctx_init() */
     usb_moded_module_ctx_cleanup();
 
     /* Undo trigger_init() */
     trigger_stop();
 
+    /* Undo usb_moded_configfs_init() */
+    usb_moded_configfs_quit();
+
     /* Undo read_mode_list() */
+    mode_registry_forget_modelist();
     free_mode_list(modelist);
 
+    /* Undo usb_moded_config_init() */
+    usb_moded_config_quit();
+
+    /* Undo usb_moded_bootparam_init() */
+    usb_moded_bootparam_quit();
+
 #ifdef APP_SYNC
     /* Undo readlist() */
     free_appsync_list();
@@ -763,8 +963,11 @@ static void usb_moded_cleanup(void)
     free(current_mode.module),
         current_mode.module = 0;
 
-    free(current_mode.mode),
-        current_mode.mode = 0;
+    /* Undo get_mode_list() */
+    mode_lists_invalidate();
+
+    /* Undo mode_registry_add_modelist() */
+    mode_registry_quit();
 }
 
 /* charging fallback handler */
@@ -773,15 +976,14 @@ static gboolean charging_fallback(gpointer data)
   /* if a mode has been set we don't want it changed to charging
    * after 5 seconds. We set it to ask, so anything different 
    * means a mode has been set */
-  if(strcmp(get_usb_mode(), MODE_ASK) != 0)
+  if(get_usb_mode_id() != MODE_ID_ASK)
 		  return FALSE;
 
-  set_usb_mode(MODE_CHARGING_FALLBACK);
+  set_usb_mode_id(MODE_ID_CHARGING_FALLBACK);
   /* since this is the fallback, we keep an indication
      for the UI, as we are not really in charging mode.
   */
-  free(current_mode.mode);
-  current_mode.mode = strdup(MODE_ASK);
+  current_mode.mode_id = MODE_ID_ASK;
   current_mode.data = NULL;
   charging_timeout = 0;
   log_info("Falling back on charging mode.\n");
@@ -808,9 +1010,12 @@ static void sigint_handler(int signum)
         /* clear existing data to be sure */
         set_usb_mode_data(NULL);
         /* free and read in modelist again */
+        mode_registry_forget_modelist();
         free_mode_list(modelist);
 
         modelist = read_mode_list(diag_mode);
+        mode_registry_add_modelist(modelist);
+        mode_lists_invalidate();
 
         send_supported_modes_signal();
         send_available_modes_signal();
@@ -843,6 +1048,8 @@ static void usage(void)
 #endif
                   "  -v,  --version       \t\toutput version information and exit\n"
                   "  -m,  --max-cable-delay=<ms>\tmaximum delay before accepting cable connection\n"
+                  "  -R,  --root=<dir>    \t\tuse dir as root for sysfs, proc and config files,\n"
+                  "                       \t\tstub module loading and external commands\n"
                   "\n");
 }
 
@@ -1046,11 +1253,13 @@ EXIT:
 static void write_to_sysfs_file(const char *path, const char *text)
 {
 	int fd = -1;
+	gchar *real = 0;
 
 	if (!path || !text)
 		goto EXIT;
 
-	if ((fd = open(path, O_WRONLY)) == -1) {
+	real = usb_moded_root_path(path);
+	if ((fd = open(real, O_WRONLY)) == -1) {
 		if (errno != ENOENT) {
 			log_warning("%s: open for writing failed: %m", path);
 		}
@@ -1064,6 +1273,7 @@ static void write_to_sysfs_file(const char *path, const char *text)
 EXIT:
 	if (fd != -1)
 		close(fd);
+	g_free(real);
 }
 
 /** Acquire wakelock via sysfs
@@ -1174,7 +1384,11 @@ void delay_suspend(void)
  */
 static bool init_done_p(void)
 {
-	return access("/run/systemd/boot-status/init-done", F_OK) == 0;
+	gchar *path = usb_moded_root_path("/run/systemd/boot-status/init-done");
+	bool   done = access(path, F_OK) == 0;
+
+	g_free(path);
+	return done;
 }
 
 /** Request orderly exit from mainloop
@@ -1205,11 +1419,16 @@ usb_moded_system_(const char *file, int line, const char *func,
 		  const char *command)
 {
 	int rc = 1;
+	gint64 start = usb_moded_trace_now();
 
 	log_debug("EXEC %s; from %s:%d: %s()",
 		  command, file, line, func);
 
-	rc = system(command);
+	if( usb_moded_root_stubbed() )
+		rc = 0;
+	else
+		rc = system(command);
+	usb_moded_trace_span(TRACE_EXEC, start, "%s", command);
 
 	if( rc != 0 )
 		log_warning("EXEC %s; exit code is %d", command, rc);
@@ -1226,6 +1445,11 @@ usb_moded_popen_(const char *file, int line, const char *func,
 	log_debug("EXEC %s; from %s:%d: %s()",
 		  command, file, line, func);
 
+	/* stubbed commands succeed without producing any output,
+	 * and swallow their input */
+	if( usb_moded_root_stubbed() )
+		return popen(*type == 'w' ? "cat >/dev/null" : "true", type);
+
 	return popen(command, type);
 }
 
@@ -1241,6 +1465,7 @@ usb_moded_usleep_(const char *file, int line, const char *func,
 	};
 
 	long ms = (ts.tv_nsec + 1000000 - 1) / 1000000;
+	gint64 start = usb_moded_trace_now();
 
 	if( !ms ) {
 		log_debug("SLEEP %ld seconds; from %s:%d: %s()",
@@ -1256,6 +1481,7 @@ usb_moded_usleep_(const char *file, int line, const char *func,
 	}
 
 	do { } while( nanosleep(&ts, &ts) == -1 && errno != EINTR );
+	usb_moded_trace_span(TRACE_SLEEP, start, "%s()", func);
 }
 
 int main(int argc, char* argv[])
@@ -1276,6 +1502,7 @@ int main(int argc, char* argv[])
 		{ "systemd", no_argument, 0, 'n' },
                 { "version", no_argument, 0, 'v' },
                 { "max-cable-delay", required_argument, 0, 'm' },
+                { "root", required_argument, 0, 'R' },
                 { 0, 0, 0, 0 }
         };
 
@@ -1287,7 +1514,7 @@ int main(int argc, char* argv[])
 	 * - - - - - - - - - - - - - - - - - - - */
 
 	 /* Parse the command-line options */
-        while ((opt = getopt_long(argc, argv, "aifsTlDdhrnvm:", options, &opt_idx)) != -1)
+        while ((opt = getopt_long(argc, argv, "aifsTlDdhrnvm:R:", options, &opt_idx)) != -1)
 	{
                 switch (opt) 
 		{
@@ -1341,6 +1568,10 @@ int main(int argc, char* argv[])
 				set_cable_connection_delay(strtol(optarg, 0, 0));
 				break;
 
+			case 'R':
+				usb_moded_root_set(optarg);
+				break;
+
 	                default:
         	                usage();
 				exit(0);
@@ -1411,6 +1642,21 @@ int main(int argc, char* argv[])
 		goto EXIT;
 	}
 #endif
+	/* Connman tracker keeps cellular data and technology state
+	 * cached for usb tethering. */
+#ifdef CONNMAN
+	if( !usb_moded_connman_start() ) {
+		log_crit("connman tracking could not be started");
+		goto EXIT;
+	}
+#endif
+	/* Ofono tracker keeps roaming state cached for usb tethering. */
+#ifdef OFONO
+	if( !usb_moded_ofono_start() ) {
+		log_crit("ofono tracking could not be started");
+		goto EXIT;
+	}
+#endif
 
 	/* Set daemon config/state data to sane state */
 	usb_moded_mode_init();
@@ -1522,6 +1768,14 @@ EXIT:
 #ifdef MEEGOLOCK
 	dsme_listener_stop();
 #endif
+	/* Stop tracking connman state */
+#ifdef CONNMAN
+	usb_moded_connman_stop();
+#endif
+	/* Stop tracking ofono state */
+#ifdef OFONO
+	usb_moded_ofono_stop();
+#endif
 
 	/* Stop udev listener */
 	hwal_cleanup();
@@ -1543,6 +1797,9 @@ EXIT:
 	 * are taken and left behind on exit path */
 	allow_suspend();
 
+	/* Forget alternate root, no more file system access after this */
+	usb_moded_root_quit();
+
 	log_debug("usb-moded return from main, with exit code %d",
 		  usb_moded_exitcode);
 	return usb_moded_exitcode;
@@ -39,6 +39,7 @@
 #include <glib-object.h>
 
 #include "usb_moded-dyn-config.h"
+#include "usb_moded-modeid.h"
 
 #define USB_MODED_LOCKFILE	"/var/run/usb_moded.pid"
 #define MAX_READ_BUF 512
@@ -52,7 +53,7 @@ typedef struct usb_mode
   gboolean connected; 		/* connection status, 1 for connected */
   gboolean mounted;  		/* mount status, 1 for mounted -UNUSED atm- */
   gboolean android_usb_broken;  /* Used to keep an active gadget for broken Android kernels */
-  char *mode;  			/* the mode name */
+  mode_id_t mode_id;		/* the mode registry id */
   char *module; 		/* the module name for the specific mode */
   struct mode_list_elem *data;  /* contains the mode data */
   /*@}*/
@@ -66,8 +67,11 @@ typedef enum mode_list_type_t {
 void set_usb_connected(gboolean connected);
 void set_usb_connected_state(void);
 void set_usb_mode(const char *mode);
+void set_usb_mode_id(mode_id_t id);
+void switch_usb_mode_id(mode_id_t id);
 void rethink_usb_charging_fallback(void);
 const char * get_usb_mode(void);
+mode_id_t get_usb_mode_id(void);
 void set_usb_module(const char *module);
 const char * get_usb_module(void);
 void set_usb_mode_data(struct mode_list_elem *data);
@@ -76,8 +80,12 @@ gboolean get_usb_connection_state(void);
 void set_usb_connection_state(gboolean state);
 void set_charger_connected(gboolean state);
 gchar *get_mode_list(mode_list_type_t type);
+void mode_lists_invalidate(void);
+void mode_lists_set_hidden(const char *mode, gboolean hidden);
+void mode_lists_set_whitelist(const char *whitelist);
 gchar *get_available_mode_list(void);
 int valid_mode(const char *mode);
+int valid_mode_id(mode_id_t id);
 
 /** Name of the wakelock usb_moded uses for temporary suspend delay */
 #define USB_MODED_WAKELOCK_STATE_CHANGE        "usb_moded_state"
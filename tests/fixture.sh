@@ -0,0 +1,241 @@
+# Fixture tree for running usb_moded off-device
+#
+# Sourced by the check and bench scripts. Builds a tmpfs backed root
+# directory with just enough of sysfs, configfs, procfs and
+# /etc/usb-moded for usb_moded --root to run against, starts a private
+# dbus daemon standing in for the system bus, and simulates power
+# supply changes by writing the fixture power_supply attributes that
+# usb_moded follows in place of udev events.
+#
+# Copyright (C) 2016 Jolla. All rights reserved.
+#
+# This program is free software; you can redistribute it and/or
+# modify it under the terms of the Lesser GNU General Public License
+# version 2 as published by the Free Software Foundation.
+
+: ${USB_MODED:=../src/usb_moded}
+: ${USB_MODED_UTIL:=../src/usb_moded_util}
+: ${FIXTURE_MODE:=fixture_mode}
+
+FIXTURE_ROOT=
+FIXTURE_MOUNTED=
+FIXTURE_LOG=
+FIXTURE_PID=
+FIXTURE_BUS_PID=
+
+# milliseconds from the monotonic-ish wall clock, good enough for latency
+fixture_now()
+{
+    echo $(( $(date +%s%N) / 1000000 ))
+}
+
+fixture_fail()
+{
+    echo "FAIL: $*" >&2
+    [ -n "$FIXTURE_LOG" ] && tail -n 40 "$FIXTURE_LOG" >&2
+    exit 1
+}
+
+fixture_create()
+{
+    local base=/dev/shm
+    [ -d "$base" ] && [ -w "$base" ] || base=${TMPDIR:-/tmp}
+
+    FIXTURE_ROOT=$(mktemp -d "$base/usb-moded-fixture.XXXXXX") ||
+        fixture_fail "can't create fixture directory"
+
+    # a private tmpfs when possible, otherwise whatever $base is on
+    if [ "$(id -u)" = 0 ] &&
+       mount -t tmpfs -o size=16m,mode=0755 usb-moded-fixture "$FIXTURE_ROOT" 2> /dev/null; then
+        FIXTURE_MOUNTED=1
+    fi
+
+    local r=$FIXTURE_ROOT
+
+    # power supply, see FIXTURE_POWER_SUPPLY in usb_moded-udev.c
+    mkdir -p $r/sys/class/power_supply/usb
+    echo 0   > $r/sys/class/power_supply/usb/present
+    echo 0   > $r/sys/class/power_supply/usb/online
+    echo USB > $r/sys/class/power_supply/usb/type
+
+    # android gadget
+    mkdir -p $r/sys/class/android_usb/android0
+    echo 0    > $r/sys/class/android_usb/android0/enable
+    echo none > $r/sys/class/android_usb/android0/functions
+    echo 0000 > $r/sys/class/android_usb/android0/idProduct
+
+    # configfs gadget and an udc to bind it to
+    mkdir -p $r/sys/kernel/config/usb_gadget
+    mkdir -p $r/sys/class/udc/fixture-udc
+
+    # procfs bits that are read
+    mkdir -p $r/proc
+    : > $r/proc/modules
+    echo "console=ttyS0" > $r/proc/cmdline
+    mkdir -p $r/proc/self
+    : > $r/proc/self/mountinfo
+
+    # configuration
+    mkdir -p $r/etc/usb-moded/dyn-modes $r/etc/usb-moded/run
+    mkdir -p $r/etc/modprobe.d $r/var/cache/usb-moded
+    mkdir -p $r/run/systemd/boot-status
+    touch $r/run/systemd/boot-status/init-done
+
+    cat > $r/etc/usb-moded/fixture.ini <<EOT
+[usbmode]
+mode = $FIXTURE_MODE
+EOT
+
+    cat > $r/etc/usb-moded/dyn-modes/$FIXTURE_MODE.ini <<EOT
+[mode]
+name = $FIXTURE_MODE
+module = none
+
+[options]
+sysfs_path = /sys/class/android_usb/android0/functions
+sysfs_value = acm
+sysfs_reset_value = none
+softconnect_path = /sys/class/android_usb/android0/enable
+softconnect = 1
+softconnect_disconnect = 0
+idProduct = 0A02
+EOT
+
+    FIXTURE_LOG=$r/usb_moded.log
+}
+
+# value of a key in an ini file, without surrounding whitespace
+fixture_ini_value()
+{
+    sed -n "s/^[[:space:]]*$2[[:space:]]*=[[:space:]]*//p" "$1" |
+        sed -n '1s/[[:space:]]*$//p'
+}
+
+# what a mode file needs that the fixture can not provide, empty if
+# the mode can be run against the fixture
+fixture_mode_missing()
+{
+    local ini=$1 iface
+
+    if [ "$(fixture_ini_value "$ini" mass_storage)" = 1 ] ||
+       [ "$(fixture_ini_value "$ini" module)" = g_file_storage ]; then
+        echo "block devices to export"
+    elif [ -n "$(fixture_ini_value "$ini" connman_tethering)" ]; then
+        echo "connman"
+    elif [ "$(fixture_ini_value "$ini" network)" = 1 ]; then
+        iface=$(fixture_ini_value "$ini" network_interface)
+        [ -e "/sys/class/net/${iface:-usb0}" ] ||
+            echo "network interface ${iface:-usb0}"
+    fi
+}
+
+# make a mode file the only dynamic mode and the configured mode, and
+# create the sysfs attributes it writes; sets FIXTURE_MODE to its name
+fixture_use_mode()
+{
+    local r=$FIXTURE_ROOT ini=$1 path
+
+    FIXTURE_MODE=$(fixture_ini_value "$ini" name)
+
+    rm -f $r/etc/usb-moded/dyn-modes/*.ini $r/var/cache/usb-moded/*
+    cp "$ini" $r/etc/usb-moded/dyn-modes/
+    cat > $r/etc/usb-moded/fixture.ini <<EOT
+[usbmode]
+mode = $FIXTURE_MODE
+EOT
+
+    for path in $(sed -n 's/^[a-z_]*_path[0-9]*[[:space:]]*=[[:space:]]*//p' "$ini"); do
+        case "$path" in /sys/*) ;; *) continue ;; esac
+        [ -e "$r$path" ] && continue
+        mkdir -p "$(dirname "$r$path")"
+        : > "$r$path"
+    done
+}
+
+fixture_destroy()
+{
+    fixture_daemon_stop
+    fixture_bus_stop
+
+    if [ -n "$FIXTURE_ROOT" ]; then
+        [ -n "$FIXTURE_MOUNTED" ] && umount "$FIXTURE_ROOT"
+        rm -rf "$FIXTURE_ROOT"
+    fi
+    FIXTURE_ROOT=
+}
+
+# simulate a power supply change: pc | charger | none
+fixture_cable()
+{
+    local ps=$FIXTURE_ROOT/sys/class/power_supply/usb
+
+    case "$1" in
+    pc)      echo USB     > $ps/type; echo 1 > $ps/online; echo 1 > $ps/present ;;
+    charger) echo USB_DCP > $ps/type; echo 1 > $ps/online; echo 1 > $ps/present ;;
+    none)    echo 0 > $ps/online; echo 0 > $ps/present ;;
+    *)       fixture_fail "unknown cable $1" ;;
+    esac
+}
+
+# value of a fixture file, without surrounding whitespace
+fixture_value()
+{
+    tr -d ' \n' < "$FIXTURE_ROOT$1"
+}
+
+fixture_bus_start()
+{
+    local out
+
+    out=$(dbus-daemon --session --fork --print-address --print-pid) ||
+        fixture_fail "can't start dbus-daemon"
+
+    DBUS_SYSTEM_BUS_ADDRESS=$(echo "$out" | sed -n 1p)
+    DBUS_SESSION_BUS_ADDRESS=$DBUS_SYSTEM_BUS_ADDRESS
+    FIXTURE_BUS_PID=$(echo "$out" | sed -n 2p)
+    export DBUS_SYSTEM_BUS_ADDRESS DBUS_SESSION_BUS_ADDRESS
+}
+
+fixture_bus_stop()
+{
+    [ -n "$FIXTURE_BUS_PID" ] && kill "$FIXTURE_BUS_PID" 2> /dev/null
+    FIXTURE_BUS_PID=
+}
+
+fixture_daemon_start()
+{
+    "$USB_MODED" --root="$FIXTURE_ROOT" -T -D "$@" > "$FIXTURE_LOG" 2>&1 &
+    FIXTURE_PID=$!
+}
+
+fixture_daemon_stop()
+{
+    if [ -n "$FIXTURE_PID" ]; then
+        kill "$FIXTURE_PID" 2> /dev/null
+        wait "$FIXTURE_PID" 2> /dev/null
+    fi
+    FIXTURE_PID=
+}
+
+# current mode as reported over dbus, empty if usb_moded is not there
+fixture_mode()
+{
+    "$USB_MODED_UTIL" -q 2> /dev/null | sed -n 's/^mode = //p'
+}
+
+# wait until usb_moded reports given mode, or any mode when empty
+fixture_wait_mode()
+{
+    local want=$1 timeout=${2:-5000} start mode
+
+    start=$(fixture_now)
+    while :; do
+        mode=$(fixture_mode)
+        if [ -n "$mode" ] && { [ -z "$want" ] || [ "$mode" = "$want" ]; }; then
+            return 0
+        fi
+        kill -0 "$FIXTURE_PID" 2> /dev/null || fixture_fail "usb_moded exited"
+        [ $(( $(fixture_now) - start )) -lt "$timeout" ] || return 1
+        sleep 0.01
+    done
+}
@@ -0,0 +1,96 @@
+#!/bin/sh
+#
+# Off-device latency benchmark
+#
+# For every mode in config/dyn-modes (BENCH_MODES), reports over a
+# number of runs against the fixture tree:
+#  - cold start: usb_moded started until it answers on dbus
+#  - connect to mode ready: simulated cable connect until the mode is
+#    reported, both as seen from outside and as the total of the
+#    transition trace recorded by usb_moded
+# The transition trace of the last connect is printed as a breakdown.
+# Modes that need hardware the fixture does not have are skipped, and
+# reported as such.
+#
+# Copyright (C) 2016 Jolla. All rights reserved.
+#
+# This program is free software; you can redistribute it and/or
+# modify it under the terms of the Lesser GNU General Public License
+# version 2 as published by the Free Software Foundation.
+
+. "${srcdir:-.}/fixture.sh"
+
+: ${BENCH_RUNS:=10}
+: ${BENCH_MODES:=${srcdir:-.}/../config/dyn-modes/*.ini}
+
+command -v dbus-daemon > /dev/null || fixture_fail "dbus-daemon is needed"
+[ -x "$USB_MODED" ] || fixture_fail "$USB_MODED not built"
+
+trap fixture_destroy EXIT
+
+# min / median / max of the numbers on stdin
+bench_stats()
+{
+    sort -n | awk '{ v[NR] = $1 }
+        END { if( NR ) printf "min %s, median %s, max %s (%d runs)\n",
+                              v[1], v[int((NR + 1) / 2)], v[NR], NR }'
+}
+
+# runs of one mode, the mode file is installed in the fixture already
+bench_mode()
+{
+    local cold= connect= traced= trace= run=0 start
+
+    while [ $run -lt "$BENCH_RUNS" ]; do
+        run=$((run + 1))
+
+        # the first run also builds the config snapshot
+        start=$(fixture_now)
+        fixture_daemon_start
+        fixture_wait_mode "" 10000 || fixture_fail "usb_moded did not come up"
+        cold="$cold $(( $(fixture_now) - start ))"
+
+        start=$(fixture_now)
+        fixture_cable pc
+        fixture_wait_mode "$FIXTURE_MODE" || fixture_fail "$FIXTURE_MODE not set"
+        connect="$connect $(( $(fixture_now) - start ))"
+
+        trace=$("$USB_MODED_UTIL" -t)
+        traced="$traced $(echo "$trace" | sed -n '1s/.*, \([0-9.]*\) ms$/\1/p')"
+
+        fixture_cable none
+        fixture_wait_mode undefined || fixture_fail "mode not reset"
+        fixture_daemon_stop
+    done
+
+    echo "  cold start (ms):            $(echo $cold | tr ' ' '\n' | bench_stats)"
+    echo "  connect to mode ready (ms): $(echo $connect | tr ' ' '\n' | bench_stats)"
+    echo "    traced in usb_moded (ms): $(echo $traced | tr ' ' '\n' | bench_stats)"
+    echo "  last connect:"
+    echo "$trace" | sed 's/^/    /'
+}
+
+fixture_create
+fixture_bus_start
+
+benched=0
+skipped=0
+for ini in $BENCH_MODES; do
+    [ -f "$ini" ] || fixture_fail "no mode files in $BENCH_MODES"
+
+    missing=$(fixture_mode_missing "$ini")
+    if [ -n "$missing" ]; then
+        echo "$(basename "$ini"): skipped, needs $missing"
+        echo
+        skipped=$((skipped + 1))
+        continue
+    fi
+
+    fixture_use_mode "$ini"
+    echo "$(basename "$ini"): $FIXTURE_MODE"
+    bench_mode
+    echo
+    benched=$((benched + 1))
+done
+
+echo "$benched modes benchmarked, $skipped skipped"
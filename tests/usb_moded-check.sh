@@ -0,0 +1,45 @@
+#!/bin/sh
+#
+# Off-device functional check: cable connect selects the configured
+# mode and writes its sysfs values, disconnect resets them again.
+#
+# Copyright (C) 2016 Jolla. All rights reserved.
+#
+# This program is free software; you can redistribute it and/or
+# modify it under the terms of the Lesser GNU General Public License
+# version 2 as published by the Free Software Foundation.
+
+. "${srcdir:-.}/fixture.sh"
+
+# automake: exit status 77 skips the test
+command -v dbus-daemon > /dev/null || exit 77
+[ -x "$USB_MODED" ] || exit 77
+
+trap fixture_destroy EXIT
+
+fixture_create
+fixture_bus_start
+fixture_daemon_start
+
+fixture_wait_mode "" || fixture_fail "usb_moded did not come up"
+[ "$(fixture_mode)" = "undefined" ] ||
+    fixture_fail "mode $(fixture_mode) without cable"
+
+fixture_cable pc
+fixture_wait_mode "$FIXTURE_MODE" || fixture_fail "$FIXTURE_MODE not set on connect"
+[ "$(fixture_value /sys/class/android_usb/android0/functions)" = "acm" ] ||
+    fixture_fail "functions not written"
+[ "$(fixture_value /sys/class/android_usb/android0/enable)" = "1" ] ||
+    fixture_fail "gadget not enabled"
+
+fixture_cable none
+fixture_wait_mode undefined || fixture_fail "mode not reset on disconnect"
+[ "$(fixture_value /sys/class/android_usb/android0/functions)" = "none" ] ||
+    fixture_fail "functions not reset"
+
+fixture_cable charger
+fixture_wait_mode dedicated_charger || fixture_fail "charger not detected"
+fixture_cable none
+fixture_wait_mode undefined || fixture_fail "mode not reset after charger"
+
+echo "PASS"
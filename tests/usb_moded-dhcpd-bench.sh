@@ -0,0 +1,115 @@
+#!/bin/sh
+#
+# Off-device time-to-lease benchmark for the built-in dhcp server
+#
+# A veth pair stands in for the usb network: usb_moded serves one end
+# with builtin_dhcp = 1, and a dhcp client in a network namespace of
+# its own asks for a lease on the other end. Reports, over a number of
+# runs:
+#  - connect to lease: simulated cable connect until the client has
+#    its address, as seen from outside
+#  - dhcpd start to lease: the dhcpd phase recorded by usb_moded
+#
+# Needs root for the namespace and the dhcp port, ip(8), and busybox
+# udhcpc or dhclient.
+#
+# Copyright (C) 2016 Jolla. All rights reserved.
+#
+# This program is free software; you can redistribute it and/or
+# modify it under the terms of the Lesser GNU General Public License
+# version 2 as published by the Free Software Foundation.
+
+. "${srcdir:-.}/fixture.sh"
+
+: ${BENCH_RUNS:=10}
+
+BENCH_NS=usb-moded-bench
+BENCH_IF=usbmdbench0
+BENCH_PEER=usbmdbench1
+BENCH_IP=192.168.2.15
+
+[ "$(id -u)" = 0 ] || fixture_fail "needs to be run as root"
+command -v dbus-daemon > /dev/null || fixture_fail "dbus-daemon is needed"
+command -v ip > /dev/null || fixture_fail "ip is needed"
+[ -x "$USB_MODED" ] || fixture_fail "$USB_MODED not built"
+
+# one shot lease request on the peer end, exits once it has an address
+if command -v udhcpc > /dev/null; then
+    BENCH_CLIENT="udhcpc -i $BENCH_PEER -n -q -f -T 1 -t 30 -s /bin/true"
+elif command -v busybox > /dev/null; then
+    BENCH_CLIENT="busybox udhcpc -i $BENCH_PEER -n -q -f -T 1 -t 30 -s /bin/true"
+elif command -v dhclient > /dev/null; then
+    BENCH_CLIENT="dhclient -1 -sf /bin/true -pf /dev/null -lf /dev/null $BENCH_PEER"
+else
+    fixture_fail "udhcpc or dhclient is needed"
+fi
+
+bench_destroy()
+{
+    fixture_destroy
+    ip link del $BENCH_IF 2> /dev/null
+    ip netns del $BENCH_NS 2> /dev/null
+}
+
+trap bench_destroy EXIT
+
+# min / median / max of the numbers on stdin
+bench_stats()
+{
+    sort -n | awk '{ v[NR] = $1 }
+        END { if( NR ) printf "min %s, median %s, max %s (%d runs)\n",
+                              v[1], v[int((NR + 1) / 2)], v[NR], NR }'
+}
+
+fixture_create
+
+# network commands are stubbed off-device, so the device end of the
+# pair is configured here instead of by usb_moded
+ip netns add $BENCH_NS || fixture_fail "can't create network namespace"
+ip link add $BENCH_IF type veth peer name $BENCH_PEER netns $BENCH_NS ||
+    fixture_fail "can't create veth pair"
+ip addr add $BENCH_IP/24 dev $BENCH_IF
+ip link set $BENCH_IF up
+ip netns exec $BENCH_NS ip link set $BENCH_PEER up
+
+cat >> $FIXTURE_ROOT/etc/usb-moded/fixture.ini <<EOT
+
+[network]
+ip = $BENCH_IP
+netmask = 255.255.255.0
+interface = $BENCH_IF
+builtin_dhcp = 1
+EOT
+
+sed -i -e "/^module = /a network = 1\\nnetwork_interface = $BENCH_IF" \
+       -e "/^\\[options\\]/a dhcp_server = 1" \
+    $FIXTURE_ROOT/etc/usb-moded/dyn-modes/$FIXTURE_MODE.ini
+
+fixture_bus_start
+
+lease=
+traced=
+
+run=0
+while [ $run -lt "$BENCH_RUNS" ]; do
+    run=$((run + 1))
+
+    fixture_daemon_start
+    fixture_wait_mode "" 10000 || fixture_fail "usb_moded did not come up"
+
+    start=$(fixture_now)
+    fixture_cable pc
+    ip netns exec $BENCH_NS $BENCH_CLIENT > /dev/null 2>&1 ||
+        fixture_fail "no lease"
+    lease="$lease $(( $(fixture_now) - start ))"
+
+    traced="$traced $("$USB_MODED_UTIL" -t |
+        awk '$2 == "dhcpd" { for( i = 3; i < NF; ++i ) if( $(i + 1) == "ms" ) print $i }')"
+
+    fixture_cable none
+    fixture_wait_mode undefined || fixture_fail "mode not reset"
+    fixture_daemon_stop
+done
+
+echo "connect to lease (ms):      $(echo $lease | tr ' ' '\n' | bench_stats)"
+echo "  dhcpd start to lease (ms): $(echo $traced | tr ' ' '\n' | bench_stats)"